@@ -0,0 +1,249 @@
+#define _GNU_SOURCE
+
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define BENCH_IO_SIZE (64 * 1024)
+
+static uint8_t g_benchPattern[BENCH_IO_SIZE];
+static uint8_t g_benchScratch[BENCH_IO_SIZE];
+
+uint64_t BenchNowMicros(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000;
+}
+
+int BenchListenUnix(const char* path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Socket path %s is too long\n", path);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Error creating socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, strlen(path) + 1);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        printf("Error listening on %s: %s (errno=%d)\n", path, strerror(errno), errno);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+bool BenchServersStart(BENCH_SERVERS* servers, const char* address) {
+    int i;
+    int k;
+
+    for (i = 0; i < BENCH_IO_SIZE; i++) {
+        g_benchPattern[i] = (uint8_t)i;
+    }
+    for (i = 0; i < BENCH_SERVER_MAX_CONNS; i++) {
+        servers->conns[i].socket = -1;
+    }
+    servers->sinkBytes = 0;
+
+    for (k = 0; k < BENCH_SERVER_KINDS; k++) {
+        struct sockaddr_in addr;
+        socklen_t addrLen = sizeof(addr);
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+        if (fd < 0) {
+            perror("Error creating server socket");
+            return false;
+        }
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        if (inet_pton(AF_INET, address, &addr.sin_addr) != 1) {
+            printf("Invalid server address %s\n", address);
+            close(fd);
+            return false;
+        }
+        if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, SOMAXCONN) < 0 ||
+            getsockname(fd, (struct sockaddr*)&addr, &addrLen) < 0) {
+            perror("Error starting server");
+            close(fd);
+            return false;
+        }
+
+        servers->listeners[k] = fd;
+        servers->ports[k] = ntohs(addr.sin_port);
+    }
+    return true;
+}
+
+static void AcceptConns(BENCH_SERVERS* servers, BENCH_SERVER_KIND kind) {
+    int next = 0;
+    int fd;
+
+    while ((fd = accept4(servers->listeners[kind], NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        while (next < BENCH_SERVER_MAX_CONNS && servers->conns[next].socket != -1) {
+            next++;
+        }
+        if (next == BENCH_SERVER_MAX_CONNS) {
+            printf("Too many server connections\n");
+            close(fd);
+            continue;
+        }
+        servers->conns[next].socket = fd;
+        servers->conns[next].kind = kind;
+        servers->conns[next].received = 0;
+        servers->conns[next].owed = 0;
+    }
+}
+
+static void CloseConn(BENCH_SERVER_CONN* conn) {
+    close(conn->socket);
+    conn->socket = -1;
+}
+
+static void ServeConn(BENCH_SERVERS* servers, BENCH_SERVER_CONN* conn, short revents) {
+    ssize_t n;
+
+    if ((revents & (POLLERR | POLLNVAL)) || ((revents & POLLHUP) && !(revents & POLLIN))) {
+        CloseConn(conn);
+        return;
+    }
+
+    // Only read while nothing is owed, so a peer that does not read its
+    // answers is slowed down instead of piling them up
+    if ((revents & POLLIN) && (conn->owed == 0 || conn->kind == BENCH_SINK || conn->kind == BENCH_SOURCE)) {
+        n = recv(conn->socket, g_benchScratch, sizeof(g_benchScratch), 0);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+            CloseConn(conn);
+            return;
+        }
+        if (n > 0) {
+            switch (conn->kind) {
+                case BENCH_ECHO:
+                    conn->owed += (uint64_t)n;
+                    break;
+                case BENCH_SINK:
+                    servers->sinkBytes += (uint64_t)n;
+                    break;
+                case BENCH_RESPONDER:
+                    conn->received += (uint64_t)n;
+                    while (servers->requestSize > 0 && conn->received >= servers->requestSize) {
+                        conn->received -= servers->requestSize;
+                        conn->owed += servers->responseSize;
+                    }
+                    break;
+                default:
+                    break;
+            }
+        }
+    }
+
+    if (conn->kind == BENCH_SOURCE) {
+        conn->owed = sizeof(g_benchPattern);
+    }
+    if (conn->owed > 0) {
+        size_t chunk = conn->owed < sizeof(g_benchPattern) ? (size_t)conn->owed : sizeof(g_benchPattern);
+
+        n = send(conn->socket, g_benchPattern, chunk, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                CloseConn(conn);
+            }
+            return;
+        }
+        conn->owed -= (uint64_t)n;
+    }
+}
+
+int BenchServersPollSetup(BENCH_SERVERS* servers, struct pollfd* fds) {
+    int count = 0;
+    int i;
+
+    for (i = 0; i < BENCH_SERVER_KINDS; i++) {
+        fds[count].fd = servers->listeners[i];
+        fds[count].events = POLLIN;
+        fds[count].revents = 0;
+        count++;
+    }
+    for (i = 0; i < BENCH_SERVER_MAX_CONNS; i++) {
+        BENCH_SERVER_CONN* conn = &servers->conns[i];
+
+        if (conn->socket == -1) {
+            continue;
+        }
+        servers->pollConn[count - BENCH_SERVER_KINDS] = i;
+        fds[count].fd = conn->socket;
+        fds[count].events = conn->kind == BENCH_SOURCE ? POLLIN | POLLOUT :
+                            conn->owed > 0 ? POLLOUT : POLLIN;
+        fds[count].revents = 0;
+        count++;
+    }
+    return count;
+}
+
+void BenchServersPollEvents(BENCH_SERVERS* servers, const struct pollfd* fds, int count) {
+    int i;
+
+    for (i = BENCH_SERVER_KINDS; i < count; i++) {
+        if (fds[i].revents != 0) {
+            ServeConn(servers, &servers->conns[servers->pollConn[i - BENCH_SERVER_KINDS]], fds[i].revents);
+        }
+    }
+    for (i = 0; i < BENCH_SERVER_KINDS; i++) {
+        if (fds[i].revents & POLLIN) {
+            AcceptConns(servers, (BENCH_SERVER_KIND)i);
+        }
+    }
+}
+
+void BenchLatencyAdd(BENCH_LATENCY* latency, uint64_t us) {
+    if (latency->count < BENCH_MAX_SAMPLES) {
+        latency->samplesUs[latency->count++] = us > UINT32_MAX ? UINT32_MAX : (uint32_t)us;
+    }
+}
+
+static int CompareSamples(const void* a, const void* b) {
+    uint32_t x = *(const uint32_t*)a;
+    uint32_t y = *(const uint32_t*)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static uint32_t Percentile(const BENCH_LATENCY* latency, double fraction) {
+    if (latency->count == 0) {
+        return 0;
+    }
+    return latency->samplesUs[(uint32_t)(fraction * (latency->count - 1) + 0.5)];
+}
+
+void BenchLatencyReport(BENCH_LATENCY* latency, const char* name) {
+    qsort(latency->samplesUs, latency->count, sizeof(latency->samplesUs[0]), CompareSamples);
+
+    printf("%s_samples=%u\n", name, latency->count);
+    printf("%s_min_us=%u\n", name, Percentile(latency, 0.0));
+    printf("%s_p50_us=%u\n", name, Percentile(latency, 0.50));
+    printf("%s_p90_us=%u\n", name, Percentile(latency, 0.90));
+    printf("%s_p99_us=%u\n", name, Percentile(latency, 0.99));
+    printf("%s_p999_us=%u\n", name, Percentile(latency, 0.999));
+    printf("%s_max_us=%u\n", name, Percentile(latency, 1.0));
+}
@@ -0,0 +1,68 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// Pieces shared by the benchmark tools (fake_guest, socks_load,
+// trace_replay): the local servers streams are pointed at, the channel
+// socket a tool listens on in place of a VM, and latency statistics printed
+// as key=value report lines. Linux only.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <poll.h>
+
+#define BENCH_SERVER_MAX_CONNS 2048
+#define BENCH_MAX_SAMPLES (1 << 20)
+
+// Echo answers every byte with one, sink counts and discards, source sends
+// until the peer closes, and the responder answers every requestSize
+// bytes received with responseSize bytes. Payload bytes are a fixed pattern.
+typedef enum {
+    BENCH_ECHO,
+    BENCH_SINK,
+    BENCH_SOURCE,
+    BENCH_RESPONDER,
+    BENCH_SERVER_KINDS
+} BENCH_SERVER_KIND;
+
+typedef struct {
+    int socket;                 // -1 if unused
+    BENCH_SERVER_KIND kind;
+    uint64_t received;          // Responder: bytes of the current request
+    uint64_t owed;              // Bytes to send back
+} BENCH_SERVER_CONN;
+
+typedef struct {
+    int listeners[BENCH_SERVER_KINDS];
+    uint16_t ports[BENCH_SERVER_KINDS];
+    uint32_t requestSize;
+    uint32_t responseSize;
+    uint64_t sinkBytes;         // Received by the sink server
+    int pollConn[BENCH_SERVER_MAX_CONNS];
+    BENCH_SERVER_CONN conns[BENCH_SERVER_MAX_CONNS];
+} BENCH_SERVERS;
+
+// Poll entries BenchServersPollSetup may use
+#define BENCH_SERVER_POLL_FDS (BENCH_SERVER_KINDS + BENCH_SERVER_MAX_CONNS)
+
+typedef struct {
+    uint32_t count;
+    uint32_t samplesUs[BENCH_MAX_SAMPLES];
+} BENCH_LATENCY;
+
+uint64_t BenchNowMicros(void);
+
+// Listens on a Unix socket at path, replacing a stale one; -1 on error
+int BenchListenUnix(const char* path);
+
+// Starts every server on an ephemeral port of the IPv4 address
+bool BenchServersStart(BENCH_SERVERS* servers, const char* address);
+int BenchServersPollSetup(BENCH_SERVERS* servers, struct pollfd* fds);
+void BenchServersPollEvents(BENCH_SERVERS* servers, const struct pollfd* fds, int count);
+
+// Samples beyond BENCH_MAX_SAMPLES are dropped
+void BenchLatencyAdd(BENCH_LATENCY* latency, uint64_t us);
+
+// Prints NAME_samples, NAME_min_us, NAME_p50_us ... NAME_max_us
+void BenchLatencyReport(BENCH_LATENCY* latency, const char* name);
+
+#endif // BENCH_H
@@ -8,7 +8,7 @@ if ! command -v gcc &> /dev/null; then
 fi
 
 # Compile the host proxy
-gcc -Wall -Wextra -O2 host_proxy.c -o host_proxy
+gcc -Wall -Wextra -O2 host_proxy.c mux_sched.c mux_frame.c token_bucket.c timer_wheel.c transport.c shm_ring.c dns_cache.c handoff.c conn_pool.c connect_breaker.c channel_emu.c trace.c -o host_proxy
 
 # Check if compilation was successful
 if [ $? -ne 0 ]; then
@@ -16,8 +16,57 @@ if [ $? -ne 0 ]; then
     exit 1
 fi
 
+# Compile the shared-memory ring server used with --channel shm:PATH
+gcc -Wall -Wextra -O2 shm_bridge.c shm_ring.c transport.c channel_emu.c token_bucket.c -o shm_bridge
+
+if [ $? -ne 0 ]; then
+    echo "Build failed."
+    exit 1
+fi
+
+# Compile the Linux build of the guest SOCKS server, for Linux guests and
+# for running the whole pipeline on one machine
+gcc -Wall -Wextra -O2 socks_server_linux.c socks_proto.c mux_sched.c mux_frame.c mux_rx.c timer_wheel.c transport.c shm_ring.c channel_emu.c token_bucket.c -o socks_server
+
+if [ $? -ne 0 ]; then
+    echo "Build failed."
+    exit 1
+fi
+
+# Compile the benchmark guest that stands in for a VM on the channel socket
+gcc -Wall -Wextra -O2 fake_guest.c bench.c transport.c shm_ring.c channel_emu.c token_bucket.c -o fake_guest
+
+if [ $? -ne 0 ]; then
+    echo "Build failed."
+    exit 1
+fi
+
+# Compile the SOCKS5 load generator that drives the guest frontend
+gcc -Wall -Wextra -O2 socks_load.c bench.c -o socks_load
+
+if [ $? -ne 0 ]; then
+    echo "Build failed."
+    exit 1
+fi
+
+# Compile the tool that replays channel traces recorded with --capture
+gcc -Wall -Wextra -O2 trace_replay.c trace.c bench.c transport.c shm_ring.c channel_emu.c token_bucket.c -o trace_replay
+
+if [ $? -ne 0 ]; then
+    echo "Build failed."
+    exit 1
+fi
+
+# Compile the microbenchmarks of the per-frame path
+gcc -Wall -Wextra -O2 microbench.c mux_frame.c mux_sched.c -o microbench
+
+if [ $? -ne 0 ]; then
+    echo "Build failed."
+    exit 1
+fi
+
 # Set executable permissions
-chmod +x host_proxy
+chmod +x host_proxy shm_bridge socks_server fake_guest socks_load trace_replay microbench
 chmod +x test_proxy.sh
 
 echo ""
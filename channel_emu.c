@@ -0,0 +1,285 @@
+#include "channel_emu.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A rate-limited pipe takes bytes again once this many tokens are back, so
+// a saturated link moves data in pieces of useful size rather than byte by
+// byte. Also the least bucket depth; the default is 10ms worth of traffic.
+#define EMU_MIN_TOKENS 512
+
+static uint32_t NextRandom(CHANNEL_EMU* emu) {
+    // xorshift32: cheap, and the same seed gives the same run
+    uint32_t x = emu->random;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    emu->random = x;
+    return x;
+}
+
+// Parses a number with an optional K, M or G suffix (powers of 1024)
+static bool ParseBytes(const char* text, const char** end, uint64_t* value) {
+    char* stop;
+    unsigned long long count = strtoull(text, &stop, 10);
+
+    if (stop == text) {
+        return false;
+    }
+    switch (*stop) {
+        case 'k': case 'K': count <<= 10; stop++; break;
+        case 'm': case 'M': count <<= 20; stop++; break;
+        case 'g': case 'G': count <<= 30; stop++; break;
+        default: break;
+    }
+    *end = stop;
+    *value = count;
+    return true;
+}
+
+// Parses a time with a us, ms or s suffix (ms if none) into microseconds
+static bool ParseTime(const char* text, const char** end, uint64_t* valueUs) {
+    char* stop;
+    unsigned long long count = strtoull(text, &stop, 10);
+
+    if (stop == text || count > 3600ULL * 1000 * 1000) {
+        return false;
+    }
+    if (strncmp(stop, "us", 2) == 0) {
+        stop += 2;
+    } else if (strncmp(stop, "ms", 2) == 0) {
+        count *= 1000;
+        stop += 2;
+    } else if (*stop == 's') {
+        count *= 1000000;
+        stop++;
+    } else {
+        count *= 1000;
+    }
+    *end = stop;
+    *valueUs = count;
+    return true;
+}
+
+bool ChannelEmuParse(CHANNEL_EMU_CONFIG* config, const char* spec) {
+    const char* p = spec;
+
+    memset(config, 0, sizeof(*config));
+    config->buffer = CHANNEL_EMU_BUFFER;
+    config->seed = 1;
+
+    while (*p != '\0') {
+        const char* equals = strchr(p, '=');
+        const char* end = p;
+        uint64_t value = 0;
+        uint64_t high = 0;
+        size_t keyLen;
+        bool ok;
+
+        if (equals == NULL) {
+            printf("Invalid channel emulation '%s': expected KEY=VALUE\n", spec);
+            return false;
+        }
+        keyLen = equals - p;
+
+        if (keyLen == 7 && strncmp(p, "latency", 7) == 0) {
+            ok = ParseTime(equals + 1, &end, &config->latencyUs);
+        } else if (keyLen == 6 && strncmp(p, "jitter", 6) == 0) {
+            ok = ParseTime(equals + 1, &end, &config->jitterUs);
+        } else if (keyLen == 4 && strncmp(p, "rate", 4) == 0) {
+            ok = ParseBytes(equals + 1, &end, &config->rate);
+        } else if (keyLen == 6 && strncmp(p, "buffer", 6) == 0) {
+            ok = ParseBytes(equals + 1, &end, &value) && value > 0 && value <= CHANNEL_EMU_BUFFER;
+            config->buffer = (uint32_t)value;
+        } else if (keyLen == 4 && strncmp(p, "seed", 4) == 0) {
+            ok = ParseBytes(equals + 1, &end, &value) && value <= UINT32_MAX;
+            config->seed = (uint32_t)value;
+        } else if (keyLen == 5 && strncmp(p, "chunk", 5) == 0) {
+            ok = ParseBytes(equals + 1, &end, &value);
+            high = value;
+            if (ok && *end == '-') {
+                ok = ParseBytes(end + 1, &end, &high);
+            }
+            ok = ok && value > 0 && value <= high && high <= CHANNEL_EMU_BUFFER;
+            config->chunkMin = (uint32_t)value;
+            config->chunkMax = (uint32_t)high;
+        } else {
+            printf("Invalid channel emulation '%s': unknown key '%.*s'\n", spec, (int)keyLen, p);
+            return false;
+        }
+
+        if (!ok || (*end != ',' && *end != '\0')) {
+            printf("Invalid channel emulation '%s': bad value for '%.*s'\n", spec, (int)keyLen, p);
+            return false;
+        }
+        p = *end == ',' ? end + 1 : end;
+    }
+
+    // xorshift never leaves zero
+    if (config->seed == 0) {
+        config->seed = 1;
+    }
+    return true;
+}
+
+static void PipeInit(CHANNEL_EMU_PIPE* pipe, uint64_t rate, uint64_t now) {
+    uint64_t burst = rate / 100 > EMU_MIN_TOKENS ? rate / 100 : EMU_MIN_TOKENS;
+
+    pipe->head = 0;
+    pipe->used = 0;
+    pipe->firstSegment = 0;
+    pipe->segmentCount = 0;
+    pipe->lastArrivalUs = 0;
+    TokenBucketInit(&pipe->bucket, rate, burst, now);
+}
+
+void ChannelEmuInit(CHANNEL_EMU* emu, const CHANNEL_EMU_CONFIG* config, uint64_t now) {
+    if (config != &emu->config) {
+        emu->config = *config;
+    }
+    emu->random = config->seed;
+    emu->inEof = false;
+    emu->inError = 0;
+    emu->outError = 0;
+    emu->wakeUs = CHANNEL_EMU_NEVER;
+    PipeInit(&emu->in, config->rate, now);
+    PipeInit(&emu->out, config->rate, now);
+}
+
+size_t ChannelEmuRoom(CHANNEL_EMU* emu, CHANNEL_EMU_PIPE* pipe, uint64_t now) {
+    uint64_t tokens = TokenBucketAvailable(&pipe->bucket, now);
+    size_t room = pipe->used < emu->config.buffer ? emu->config.buffer - pipe->used : 0;
+
+    if (pipe->segmentCount == CHANNEL_EMU_SEGMENTS || tokens < EMU_MIN_TOKENS) {
+        return 0;
+    }
+    return tokens < room ? (size_t)tokens : room;
+}
+
+size_t ChannelEmuChunk(CHANNEL_EMU* emu, size_t length) {
+    uint32_t span = emu->config.chunkMax - emu->config.chunkMin + 1;
+    size_t chunk;
+
+    if (emu->config.chunkMin == 0) {
+        return length;
+    }
+    chunk = emu->config.chunkMin + NextRandom(emu) % span;
+    return chunk < length ? chunk : length;
+}
+
+void ChannelEmuPush(CHANNEL_EMU* emu, CHANNEL_EMU_PIPE* pipe, const struct iovec* iov, int iovcnt,
+                    size_t length, uint64_t now) {
+    CHANNEL_EMU_SEGMENT* segment;
+    uint64_t arrival = now + emu->config.latencyUs;
+    size_t copied = 0;
+    int i;
+
+    if (length == 0) {
+        return;
+    }
+    if (emu->config.jitterUs > 0) {
+        arrival += NextRandom(emu) % (emu->config.jitterUs + 1);
+    }
+    if (arrival < pipe->lastArrivalUs) {
+        arrival = pipe->lastArrivalUs;
+    }
+    pipe->lastArrivalUs = arrival;
+
+    for (i = 0; i < iovcnt && copied < length; i++) {
+        const uint8_t* src = iov[i].iov_base;
+        size_t n = iov[i].iov_len < length - copied ? iov[i].iov_len : length - copied;
+
+        while (n > 0) {
+            uint32_t tail = (pipe->head + pipe->used) % CHANNEL_EMU_BUFFER;
+            size_t span = CHANNEL_EMU_BUFFER - tail < n ? CHANNEL_EMU_BUFFER - tail : n;
+
+            memcpy(pipe->data + tail, src, span);
+            pipe->used += (uint32_t)span;
+            src += span;
+            n -= span;
+            copied += span;
+        }
+    }
+
+    segment = &pipe->segments[(pipe->firstSegment + pipe->segmentCount) % CHANNEL_EMU_SEGMENTS];
+    segment->length = (uint32_t)copied;
+    segment->arrivalUs = arrival;
+    pipe->segmentCount++;
+    TokenBucketConsume(&pipe->bucket, copied);
+}
+
+size_t ChannelEmuArrived(CHANNEL_EMU_PIPE* pipe, uint64_t now, struct iovec* iov, int* iovcnt) {
+    size_t arrived = 0;
+    uint32_t i;
+
+    for (i = 0; i < pipe->segmentCount; i++) {
+        const CHANNEL_EMU_SEGMENT* segment = &pipe->segments[(pipe->firstSegment + i) % CHANNEL_EMU_SEGMENTS];
+
+        if (segment->arrivalUs > now) {
+            break;
+        }
+        arrived += segment->length;
+    }
+
+    *iovcnt = 0;
+    if (arrived == 0) {
+        return 0;
+    }
+    iov[0].iov_base = pipe->data + pipe->head;
+    iov[0].iov_len = CHANNEL_EMU_BUFFER - pipe->head < arrived ? CHANNEL_EMU_BUFFER - pipe->head : arrived;
+    *iovcnt = 1;
+    if (iov[0].iov_len < arrived) {
+        iov[1].iov_base = pipe->data;
+        iov[1].iov_len = arrived - iov[0].iov_len;
+        *iovcnt = 2;
+    }
+    return arrived;
+}
+
+void ChannelEmuPop(CHANNEL_EMU_PIPE* pipe, size_t length) {
+    pipe->head = (uint32_t)((pipe->head + length) % CHANNEL_EMU_BUFFER);
+    pipe->used -= (uint32_t)length;
+
+    while (length > 0) {
+        CHANNEL_EMU_SEGMENT* segment = &pipe->segments[pipe->firstSegment];
+
+        if (segment->length > length) {
+            segment->length -= (uint32_t)length;
+            break;
+        }
+        length -= segment->length;
+        pipe->firstSegment = (pipe->firstSegment + 1) % CHANNEL_EMU_SEGMENTS;
+        pipe->segmentCount--;
+    }
+}
+
+static uint64_t PipeNextEvent(CHANNEL_EMU_PIPE* pipe, uint64_t now) {
+    uint64_t next = CHANNEL_EMU_NEVER;
+    uint32_t i;
+
+    // The first segment still on its way; earlier ones are waiting for the
+    // reader, which is not a matter of time
+    for (i = 0; i < pipe->segmentCount; i++) {
+        const CHANNEL_EMU_SEGMENT* segment = &pipe->segments[(pipe->firstSegment + i) % CHANNEL_EMU_SEGMENTS];
+
+        if (segment->arrivalUs > now) {
+            next = segment->arrivalUs - now;
+            break;
+        }
+    }
+    if (TokenBucketAvailable(&pipe->bucket, now) < EMU_MIN_TOKENS) {
+        uint64_t refill = TokenBucketDelay(&pipe->bucket, EMU_MIN_TOKENS);
+
+        next = refill < next ? refill : next;
+    }
+    return next;
+}
+
+uint64_t ChannelEmuNextEvent(CHANNEL_EMU* emu, uint64_t now) {
+    uint64_t in = PipeNextEvent(&emu->in, now);
+    uint64_t out = PipeNextEvent(&emu->out, now);
+
+    return in < out ? in : out;
+}
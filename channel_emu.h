@@ -0,0 +1,95 @@
+#ifndef CHANNEL_EMU_H
+#define CHANNEL_EMU_H
+
+// Channel emulator for benchmarks. Bytes written to a channel and bytes read
+// from it pass through a pipe per direction that models a slow serial link:
+// they enter at a limited rate, arrive after a fixed latency plus random
+// jitter, and are handed on in chunks of random size, the way a virtio-serial
+// chardev splits and merges writes. Arrival order is kept. Time is passed in
+// by the caller in microseconds.
+//
+// Configured from a spec of comma separated KEY=VALUE pairs:
+//
+//   rate=BYTES         Bytes per second each way (K/M/G suffixes), 0 = unlimited
+//   latency=TIME       One-way delay (us, ms or s suffix; ms if none)
+//   jitter=TIME        Extra delay, uniform between 0 and TIME
+//   chunk=MIN[-MAX]    Every read and write moves MIN to MAX bytes
+//   buffer=BYTES       Bytes in flight per direction (default and limit: 64K)
+//   seed=N             Seed of the random numbers, for repeatable runs
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include "token_bucket.h"
+
+#define CHANNEL_EMU_BUFFER (64 * 1024)
+#define CHANNEL_EMU_SEGMENTS 512
+#define CHANNEL_EMU_NEVER UINT64_MAX
+
+typedef struct {
+    uint64_t rate;
+    uint64_t latencyUs;
+    uint64_t jitterUs;
+    uint32_t chunkMin;          // 0: no chunking
+    uint32_t chunkMax;
+    uint32_t buffer;
+    uint32_t seed;
+} CHANNEL_EMU_CONFIG;
+
+// Bytes that entered the pipe together and arrive together
+typedef struct {
+    uint32_t length;
+    uint64_t arrivalUs;
+} CHANNEL_EMU_SEGMENT;
+
+typedef struct {
+    uint8_t data[CHANNEL_EMU_BUFFER];
+    uint32_t head;              // Offset of the oldest byte
+    uint32_t used;
+    CHANNEL_EMU_SEGMENT segments[CHANNEL_EMU_SEGMENTS];
+    uint32_t firstSegment;
+    uint32_t segmentCount;
+    uint64_t lastArrivalUs;     // Jitter never reorders bytes
+    TOKEN_BUCKET bucket;
+} CHANNEL_EMU_PIPE;
+
+typedef struct CHANNEL_EMU {
+    CHANNEL_EMU_CONFIG config;
+    CHANNEL_EMU_PIPE in;        // Peer to us
+    CHANNEL_EMU_PIPE out;       // Us to peer
+    uint32_t random;
+    bool inEof;                 // The peer closed; deliver what is in flight first
+    int inError;                // errno of a failed read, reported the same way
+    int outError;               // errno of a failed delivery, reported on the next write
+    uint64_t wakeUs;            // Next arrival or refill as of the last poll setup
+} CHANNEL_EMU;
+
+// Parses a spec into config; see above
+bool ChannelEmuParse(CHANNEL_EMU_CONFIG* config, const char* spec);
+
+// Empties both pipes, e.g. for a newly opened channel
+void ChannelEmuInit(CHANNEL_EMU* emu, const CHANNEL_EMU_CONFIG* config, uint64_t now);
+
+// Bytes the pipe takes now, as free space and tokens permit
+size_t ChannelEmuRoom(CHANNEL_EMU* emu, CHANNEL_EMU_PIPE* pipe, uint64_t now);
+
+// Cuts a read or write of length bytes to one random chunk, if chunking is on
+size_t ChannelEmuChunk(CHANNEL_EMU* emu, size_t length);
+
+// Adds length bytes from iov (at most ChannelEmuRoom) to the pipe
+void ChannelEmuPush(CHANNEL_EMU* emu, CHANNEL_EMU_PIPE* pipe, const struct iovec* iov, int iovcnt,
+                    size_t length, uint64_t now);
+
+// Bytes that have arrived, as up to two spans of the pipe's buffer
+size_t ChannelEmuArrived(CHANNEL_EMU_PIPE* pipe, uint64_t now, struct iovec* iov, int* iovcnt);
+
+// Removes length arrived bytes from the front of the pipe
+void ChannelEmuPop(CHANNEL_EMU_PIPE* pipe, size_t length);
+
+// Microseconds until bytes arrive or tokens are back, CHANNEL_EMU_NEVER if
+// the pipes wait for nothing
+uint64_t ChannelEmuNextEvent(CHANNEL_EMU* emu, uint64_t now);
+
+#endif // CHANNEL_EMU_H
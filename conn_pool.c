@@ -0,0 +1,221 @@
+#define _GNU_SOURCE
+
+#include "conn_pool.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+static POOL_DESTINATION* FindEntry(CONN_POOL* pool, const char* host, uint16_t port) {
+    int i;
+
+    for (i = 0; i < CONN_POOL_DESTINATIONS; i++) {
+        POOL_DESTINATION* entry = &pool->entries[i];
+
+        if (entry->host[0] != '\0' && entry->port == port && strcmp(entry->host, host) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void DropSocket(POOL_DESTINATION* entry, int index) {
+    close(entry->sockets[index].socket);
+    entry->sockets[index] = entry->sockets[--entry->count];
+}
+
+static void DropAll(POOL_DESTINATION* entry) {
+    while (entry->count > 0) {
+        DropSocket(entry, entry->count - 1);
+    }
+}
+
+// An idle socket is usable while its connect is pending or has succeeded and
+// the server has not closed it. Bytes the server sent first (a banner) stay
+// queued for the stream that takes the socket.
+static bool SocketUsable(int fd, bool* connecting) {
+    struct pollfd pfd;
+    int error = 0;
+    socklen_t errorLen = sizeof(error);
+    ssize_t peeked;
+    char byte;
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, 0) < 0) {
+        return false;
+    }
+    if (!(pfd.revents & (POLLOUT | POLLERR | POLLHUP))) {
+        *connecting = true;
+        return true;
+    }
+    if ((pfd.revents & POLLHUP) || getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &errorLen) < 0 || error != 0) {
+        return false;
+    }
+
+    *connecting = false;
+    peeked = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return peeked > 0 || (peeked < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+// Connects idle sockets up to the configured count. Addresses are only used
+// for as long as the sockets themselves would be kept, so a destination that
+// moved is picked up by the next open that misses the pool.
+static void TopUp(CONN_POOL* pool, POOL_DESTINATION* entry, uint64_t nowMs) {
+    while (entry->count < pool->perDestination && nowMs - entry->resolved < pool->ttlMs) {
+        const DNS_ADDRESS* address = &entry->address;
+        int fd = socket(address->family, address->socktype | SOCK_NONBLOCK, address->protocol);
+
+        if (fd < 0) {
+            return;
+        }
+        if (connect(fd, (const struct sockaddr*)&address->addr, address->addrLen) < 0 && errno != EINPROGRESS) {
+            close(fd);
+            return;
+        }
+
+        entry->sockets[entry->count].socket = fd;
+        entry->sockets[entry->count].since = nowMs;
+        entry->count++;
+    }
+}
+
+void ConnPoolInit(CONN_POOL* pool, int perDestination, uint64_t ttlMs, uint64_t nowMs) {
+    memset(pool, 0, sizeof(*pool));
+    pool->perDestination = perDestination < CONN_POOL_MAX_SOCKETS ? perDestination : CONN_POOL_MAX_SOCKETS;
+    pool->ttlMs = ttlMs;
+    pool->lastDecay = nowMs;
+}
+
+void ConnPoolRecord(CONN_POOL* pool, const char* host, uint16_t port, const DNS_ADDRESS* address, uint64_t nowMs) {
+    POOL_DESTINATION* entry;
+    int i;
+
+    if (pool->perDestination == 0 || strlen(host) >= DNS_HOST_MAX) {
+        return;
+    }
+
+    entry = FindEntry(pool, host, port);
+    if (entry == NULL) {
+        if (address == NULL) {
+            return;
+        }
+
+        // Replace a free entry, otherwise the least used one
+        for (i = 0; i < CONN_POOL_DESTINATIONS; i++) {
+            POOL_DESTINATION* candidate = &pool->entries[i];
+
+            if (candidate->host[0] == '\0') {
+                entry = candidate;
+                break;
+            }
+            if (entry == NULL || candidate->opens < entry->opens) {
+                entry = candidate;
+            }
+        }
+
+        DropAll(entry);
+        memset(entry, 0, sizeof(*entry));
+        snprintf(entry->host, sizeof(entry->host), "%s", host);
+        entry->port = port;
+    }
+
+    if (address != NULL) {
+        entry->address = *address;
+        entry->resolved = nowMs;
+    }
+    entry->opens++;
+}
+
+int ConnPoolTake(CONN_POOL* pool, const char* host, uint16_t port, uint64_t nowMs, bool* connecting) {
+    POOL_DESTINATION* entry;
+
+    if (pool->perDestination == 0) {
+        return -1;
+    }
+
+    entry = FindEntry(pool, host, port);
+    while (entry != NULL && entry->count > 0) {
+        POOLED_SOCKET pooled = entry->sockets[--entry->count];
+
+        if (nowMs - pooled.since < pool->ttlMs && SocketUsable(pooled.socket, connecting)) {
+            pool->hits++;
+            TopUp(pool, entry, nowMs);
+            return pooled.socket;
+        }
+        close(pooled.socket);
+    }
+
+    pool->misses++;
+    return -1;
+}
+
+void ConnPoolMaintain(CONN_POOL* pool, uint64_t nowMs) {
+    bool connecting;
+    int i;
+    int k;
+
+    if (pool->perDestination == 0) {
+        return;
+    }
+
+    if (nowMs - pool->lastDecay >= CONN_POOL_DECAY_MS) {
+        pool->lastDecay = nowMs;
+        for (i = 0; i < CONN_POOL_DESTINATIONS; i++) {
+            POOL_DESTINATION* entry = &pool->entries[i];
+
+            entry->opens /= 2;
+            if (entry->host[0] != '\0' && entry->opens == 0) {
+                DropAll(entry);
+                entry->host[0] = '\0';
+            }
+        }
+    }
+
+    // Hot destinations: the busiest few with enough recent opens
+    for (i = 0; i < CONN_POOL_DESTINATIONS; i++) {
+        pool->entries[i].hot = false;
+    }
+    for (k = 0; k < CONN_POOL_HOT; k++) {
+        POOL_DESTINATION* best = NULL;
+
+        for (i = 0; i < CONN_POOL_DESTINATIONS; i++) {
+            POOL_DESTINATION* entry = &pool->entries[i];
+
+            if (entry->host[0] != '\0' && !entry->hot && entry->opens >= CONN_POOL_HOT_OPENS &&
+                (best == NULL || entry->opens > best->opens)) {
+                best = entry;
+            }
+        }
+        if (best == NULL) {
+            break;
+        }
+        best->hot = true;
+    }
+
+    for (i = 0; i < CONN_POOL_DESTINATIONS; i++) {
+        POOL_DESTINATION* entry = &pool->entries[i];
+
+        for (k = entry->count - 1; k >= 0; k--) {
+            if (!entry->hot || nowMs - entry->sockets[k].since >= pool->ttlMs ||
+                !SocketUsable(entry->sockets[k].socket, &connecting)) {
+                DropSocket(entry, k);
+            }
+        }
+        if (entry->hot) {
+            TopUp(pool, entry, nowMs);
+        }
+    }
+}
+
+void ConnPoolClose(CONN_POOL* pool) {
+    int i;
+
+    for (i = 0; i < CONN_POOL_DESTINATIONS; i++) {
+        DropAll(&pool->entries[i]);
+    }
+}
@@ -0,0 +1,64 @@
+#ifndef CONN_POOL_H
+#define CONN_POOL_H
+
+// Pre-connected upstream sockets for frequently used destinations. Every
+// stream open is counted per host and port; the counts halve every
+// CONN_POOL_DECAY_MS so they follow the recent mix. The busiest destinations
+// (up to CONN_POOL_HOT, each with at least CONN_POOL_HOT_OPENS recent opens)
+// keep a few idle sockets connected, so an open to them skips the resolver
+// and the TCP handshake. Idle sockets are closed after a TTL, or as soon as
+// the server closes them. Time is in milliseconds and supplied by the caller.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dns_cache.h"
+
+#define CONN_POOL_DESTINATIONS 64
+#define CONN_POOL_HOT 8
+#define CONN_POOL_MAX_SOCKETS 4     // Per destination
+#define CONN_POOL_HOT_OPENS 2
+#define CONN_POOL_DECAY_MS 30000
+
+typedef struct {
+    int socket;
+    uint64_t since;                 // When the connect was started
+} POOLED_SOCKET;
+
+typedef struct {
+    char host[DNS_HOST_MAX];        // Empty if the entry is unused
+    uint16_t port;
+    uint32_t opens;                 // Recent opens, decayed
+    bool hot;
+    DNS_ADDRESS address;            // Address of the latest resolve
+    uint64_t resolved;              // When it was resolved
+    int count;
+    POOLED_SOCKET sockets[CONN_POOL_MAX_SOCKETS];
+} POOL_DESTINATION;
+
+typedef struct {
+    POOL_DESTINATION entries[CONN_POOL_DESTINATIONS];
+    int perDestination;             // Idle sockets per hot destination, 0 disables the pool
+    uint64_t ttlMs;
+    uint64_t lastDecay;
+    uint64_t hits;
+    uint64_t misses;
+} CONN_POOL;
+
+void ConnPoolInit(CONN_POOL* pool, int perDestination, uint64_t ttlMs, uint64_t nowMs);
+
+// Counts an open to host:port. address is what the name resolved to, or
+// NULL when the open was served from the pool.
+void ConnPoolRecord(CONN_POOL* pool, const char* host, uint16_t port, const DNS_ADDRESS* address, uint64_t nowMs);
+
+// Hands out an idle socket to host:port, -1 if there is none. The socket is
+// non-blocking; *connecting is set if its connect has not completed yet.
+int ConnPoolTake(CONN_POOL* pool, const char* host, uint16_t port, uint64_t nowMs, bool* connecting);
+
+// Periodic upkeep: ages the counts, picks the hot destinations, drops expired
+// and dead sockets and connects new ones
+void ConnPoolMaintain(CONN_POOL* pool, uint64_t nowMs);
+
+void ConnPoolClose(CONN_POOL* pool);
+
+#endif // CONN_POOL_H
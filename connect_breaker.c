@@ -0,0 +1,98 @@
+#include "connect_breaker.h"
+
+#include <stdio.h>
+#include <string.h>
+
+void ConnectBreakerInit(CONNECT_BREAKER* breaker, uint64_t maxWindowMs, uint64_t probeTimeoutMs) {
+    memset(breaker, 0, sizeof(*breaker));
+    breaker->maxWindowMs = maxWindowMs;
+    breaker->probeTimeoutMs = probeTimeoutMs;
+}
+
+bool ConnectBreakerAllow(CONNECT_BREAKER* breaker, const char* host, uint16_t port, uint64_t nowMs,
+                         int* slot, int* error) {
+    CONNECT_BREAKER_ENTRY* victim = NULL;
+    int i;
+
+    *slot = -1;
+    if (breaker->maxWindowMs == 0 || strlen(host) >= CONNECT_BREAKER_HOST_MAX) {
+        return true;
+    }
+
+    for (i = 0; i < CONNECT_BREAKER_ENTRIES; i++) {
+        CONNECT_BREAKER_ENTRY* entry = &breaker->entries[i];
+
+        if (entry->host[0] != '\0' && entry->port == port && strcmp(entry->host, host) == 0) {
+            if (nowMs < entry->blockedUntil) {
+                *error = entry->lastError;
+                breaker->rejected++;
+                return false;
+            }
+
+            // Tripped: this open is the probe, the others wait for its outcome
+            if (entry->failures >= CONNECT_BREAKER_TRIP) {
+                entry->blockedUntil = nowMs + breaker->probeTimeoutMs;
+            }
+            entry->pending++;
+            entry->lastUsed = nowMs;
+            *slot = i;
+            return true;
+        }
+
+        // Entries with opens in flight stay put; otherwise prefer a free
+        // entry, then a healthy one, then the least recently used
+        if (entry->pending > 0) {
+            continue;
+        }
+        if (entry->host[0] == '\0') {
+            if (victim == NULL || victim->host[0] != '\0') {
+                victim = entry;
+            }
+        } else if (victim == NULL ||
+                   (victim->host[0] != '\0' &&
+                    ((entry->failures == 0 && victim->failures != 0) ||
+                     ((entry->failures == 0) == (victim->failures == 0) && entry->lastUsed < victim->lastUsed)))) {
+            victim = entry;
+        }
+    }
+
+    if (victim != NULL) {
+        memset(victim, 0, sizeof(*victim));
+        snprintf(victim->host, sizeof(victim->host), "%s", host);
+        victim->port = port;
+        victim->pending = 1;
+        victim->lastUsed = nowMs;
+        *slot = (int)(victim - breaker->entries);
+    }
+    return true;
+}
+
+uint64_t ConnectBreakerReport(CONNECT_BREAKER* breaker, int slot, int outcome, int error, uint64_t nowMs) {
+    CONNECT_BREAKER_ENTRY* entry;
+    uint64_t window;
+
+    if (slot < 0 || slot >= CONNECT_BREAKER_ENTRIES) {
+        return 0;
+    }
+
+    entry = &breaker->entries[slot];
+    entry->pending--;
+
+    if (outcome == CONNECT_SUCCEEDED) {
+        entry->failures = 0;
+        entry->blockedUntil = 0;
+        return 0;
+    }
+    if (outcome != CONNECT_FAILED) {
+        return 0;
+    }
+
+    entry->failures++;
+    entry->lastError = error;
+    window = entry->failures > 16 ? breaker->maxWindowMs : (uint64_t)CONNECT_BREAKER_BASE_MS << (entry->failures - 1);
+    if (window > breaker->maxWindowMs) {
+        window = breaker->maxWindowMs;
+    }
+    entry->blockedUntil = nowMs + window;
+    return window;
+}
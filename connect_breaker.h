@@ -0,0 +1,56 @@
+#ifndef CONNECT_BREAKER_H
+#define CONNECT_BREAKER_H
+
+// Fail-fast memory of unreachable upstream destinations (host and port).
+// Every failed resolve or connect blocks further opens to the destination
+// for a window that starts at CONNECT_BREAKER_BASE_MS and doubles with each
+// consecutive failure, up to a configured maximum; a success clears it.
+// After CONNECT_BREAKER_TRIP consecutive failures the breaker is tripped:
+// once the window is over, a single open goes ahead as a probe while the
+// rest keep failing, until the probe's outcome is known or the probe
+// timeout passes. Time is in milliseconds and supplied by the caller.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define CONNECT_BREAKER_ENTRIES 256
+#define CONNECT_BREAKER_HOST_MAX 256
+#define CONNECT_BREAKER_BASE_MS 1000
+#define CONNECT_BREAKER_TRIP 3
+
+// Outcome of an open that was let through
+#define CONNECT_SUCCEEDED 0
+#define CONNECT_FAILED 1
+#define CONNECT_ABANDONED 2     // Closed before the connect finished either way
+
+typedef struct {
+    char host[CONNECT_BREAKER_HOST_MAX];    // Empty if the entry is unused
+    uint16_t port;
+    uint32_t failures;          // Consecutive
+    int lastError;              // errno of the latest failure
+    uint64_t blockedUntil;
+    uint64_t lastUsed;
+    int pending;                // Opens whose outcome is outstanding
+} CONNECT_BREAKER_ENTRY;
+
+typedef struct {
+    CONNECT_BREAKER_ENTRY entries[CONNECT_BREAKER_ENTRIES];
+    uint64_t maxWindowMs;       // 0 disables the breaker
+    uint64_t probeTimeoutMs;
+    uint64_t rejected;
+} CONNECT_BREAKER;
+
+void ConnectBreakerInit(CONNECT_BREAKER* breaker, uint64_t maxWindowMs, uint64_t probeTimeoutMs);
+
+// Returns false if opens to host:port are failing fast, with *error set to
+// the errno of the failure that is remembered. Otherwise *slot is the entry
+// to report the outcome to (-1 if there is none) with ConnectBreakerReport,
+// exactly once.
+bool ConnectBreakerAllow(CONNECT_BREAKER* breaker, const char* host, uint16_t port, uint64_t nowMs,
+                         int* slot, int* error);
+
+// Records the outcome of an open; error is the errno of a failed one.
+// Returns how long the destination now fails fast, 0 if it does not.
+uint64_t ConnectBreakerReport(CONNECT_BREAKER* breaker, int slot, int outcome, int error, uint64_t nowMs);
+
+#endif // CONNECT_BREAKER_H
@@ -0,0 +1,133 @@
+#define _GNU_SOURCE
+
+#include "dns_cache.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static void SetPort(DNS_ADDRESS* address, uint16_t port) {
+    if (address->family == AF_INET) {
+        ((struct sockaddr_in*)&address->addr)->sin_port = htons(port);
+    } else if (address->family == AF_INET6) {
+        ((struct sockaddr_in6*)&address->addr)->sin6_port = htons(port);
+    }
+}
+
+static int CopyAddresses(const DNS_ADDRESS* source, int count, uint16_t port, DNS_ADDRESS* out, int max) {
+    int i;
+
+    if (count > max) {
+        count = max;
+    }
+    for (i = 0; i < count; i++) {
+        out[i] = source[i];
+        SetPort(&out[i], port);
+    }
+    return count;
+}
+
+// Runs the system resolver; ports are filled in per request
+static int Lookup(const char* host, int flags, DNS_ADDRESS* out, int max) {
+    struct addrinfo hints, *res, *ai;
+    int count = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = flags;
+
+    if (getaddrinfo(host, NULL, &hints, &res) != 0) {
+        return 0;
+    }
+
+    for (ai = res; ai != NULL && count < max; ai = ai->ai_next) {
+        if (ai->ai_addrlen > sizeof(out[count].addr)) {
+            continue;
+        }
+        memset(&out[count], 0, sizeof(out[count]));
+        out[count].family = ai->ai_family;
+        out[count].socktype = ai->ai_socktype;
+        out[count].protocol = ai->ai_protocol;
+        out[count].addrLen = ai->ai_addrlen;
+        memcpy(&out[count].addr, ai->ai_addr, ai->ai_addrlen);
+        count++;
+    }
+
+    freeaddrinfo(res);
+    return count;
+}
+
+void DnsCacheInit(DNS_CACHE* cache, uint64_t ttlMs) {
+    memset(cache, 0, sizeof(*cache));
+    cache->ttlMs = ttlMs;
+}
+
+int DnsCacheResolve(DNS_CACHE* cache, const char* host, uint16_t port, uint64_t nowMs,
+                    DNS_ADDRESS* out, int max) {
+    DNS_ADDRESS found[DNS_MAX_ADDRESSES];
+    DNS_ENTRY* victim = NULL;
+    int count;
+    int i;
+
+    // Literal addresses need no lookup and would only crowd out names
+    count = Lookup(host, AI_NUMERICHOST, found, DNS_MAX_ADDRESSES);
+    if (count > 0) {
+        return CopyAddresses(found, count, port, out, max);
+    }
+
+    if (cache->ttlMs != 0 && strlen(host) < DNS_HOST_MAX) {
+        for (i = 0; i < DNS_CACHE_ENTRIES; i++) {
+            DNS_ENTRY* entry = &cache->entries[i];
+            bool entryExpired;
+            bool victimExpired;
+
+            if (entry->host[0] == '\0') {
+                if (victim == NULL || victim->host[0] != '\0') {
+                    victim = entry;
+                }
+                continue;
+            }
+
+            if (strcmp(entry->host, host) == 0) {
+                if (nowMs < entry->expires) {
+                    entry->lastUsed = nowMs;
+                    cache->hits++;
+                    return CopyAddresses(entry->addrs, entry->count, port, out, max);
+                }
+                victim = entry;
+                break;
+            }
+
+            // Prefer a free slot, then an expired one, then the least recently used
+            if (victim == NULL) {
+                victim = entry;
+            } else if (victim->host[0] != '\0') {
+                entryExpired = nowMs >= entry->expires;
+                victimExpired = nowMs >= victim->expires;
+                if ((entryExpired && !victimExpired) ||
+                    (entryExpired == victimExpired && entry->lastUsed < victim->lastUsed)) {
+                    victim = entry;
+                }
+            }
+        }
+    }
+
+    cache->misses++;
+    count = Lookup(host, 0, found, DNS_MAX_ADDRESSES);
+    if (count == 0) {
+        return 0;
+    }
+
+    if (victim != NULL) {
+        snprintf(victim->host, sizeof(victim->host), "%s", host);
+        memcpy(victim->addrs, found, sizeof(found[0]) * count);
+        victim->count = count;
+        victim->expires = nowMs + cache->ttlMs;
+        victim->lastUsed = nowMs;
+    }
+
+    return CopyAddresses(found, count, port, out, max);
+}
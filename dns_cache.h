@@ -0,0 +1,47 @@
+#ifndef DNS_CACHE_H
+#define DNS_CACHE_H
+
+// Cache of resolved upstream host names. Entries live for a fixed TTL (the
+// system resolver does not report record TTLs) and the least recently used
+// entry is replaced when the table is full. Numeric addresses bypass the
+// cache. Time is in milliseconds and supplied by the caller.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define DNS_CACHE_ENTRIES 256
+#define DNS_MAX_ADDRESSES 4
+#define DNS_HOST_MAX 256
+
+typedef struct {
+    int family;
+    int socktype;
+    int protocol;
+    socklen_t addrLen;
+    struct sockaddr_storage addr;
+} DNS_ADDRESS;
+
+typedef struct {
+    char host[DNS_HOST_MAX];        // Empty if the entry is unused
+    uint64_t expires;
+    uint64_t lastUsed;
+    int count;
+    DNS_ADDRESS addrs[DNS_MAX_ADDRESSES];
+} DNS_ENTRY;
+
+typedef struct {
+    DNS_ENTRY entries[DNS_CACHE_ENTRIES];
+    uint64_t ttlMs;                 // 0 disables caching
+    uint64_t hits;
+    uint64_t misses;
+} DNS_CACHE;
+
+void DnsCacheInit(DNS_CACHE* cache, uint64_t ttlMs);
+
+// Resolves host for a stream connection to port. Fills up to max addresses
+// and returns how many, 0 if the name does not resolve.
+int DnsCacheResolve(DNS_CACHE* cache, const char* host, uint16_t port, uint64_t nowMs,
+                    DNS_ADDRESS* out, int max);
+
+#endif // DNS_CACHE_H
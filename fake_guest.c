@@ -0,0 +1,611 @@
+// Benchmark guest. Listens on the channel socket in place of a VM, speaks
+// the mux protocol to a host proxy and drives streams through it to echo,
+// sink and source servers that it runs itself on the loopback interface.
+// The report lists throughput, the request or connection rate and latency
+// percentiles as key=value lines in a fixed order, so runs can be compared
+// with diff or collected by a script.
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sys/socket.h>
+
+#include "mux_protocol.h"
+#include "transport.h"
+#include "bench.h"
+
+#define REPORT_VERSION 1
+#define DEFAULT_CHANNEL "/tmp/vserial"
+
+// The host proxy accepts stream IDs 0..MAX_STREAMS-1 per guest
+#define BENCH_MAX_STREAMS 64
+#define BENCH_MAX_SIZE (64 * 1024)
+
+// Channel buffers. Uploads keep the outgoing one filled up to OUT_LOW_WATER.
+#define IN_BUFFER_SIZE (256 * 1024)
+#define OUT_BUFFER_SIZE (1024 * 1024)
+#define OUT_LOW_WATER (256 * 1024)
+
+#define SOCKS_ATYP_IPV4 0x01
+
+typedef enum {
+    MODE_RR,            // Request/response on long-lived streams (echo)
+    MODE_CONNECT,       // One request per stream, then close and reopen (echo)
+    MODE_DOWNLOAD,      // Bulk data from the host side (source)
+    MODE_UPLOAD,        // Bulk data toward the host side (sink)
+    MODE_COUNT
+} BENCH_MODE;
+
+static const char* g_modeNames[MODE_COUNT] = {"rr", "connect", "download", "upload"};
+
+typedef struct {
+    bool open;                  // Request sent, our CLOSE not sent yet
+    bool closing;               // Our CLOSE sent
+    uint64_t openedUs;          // When the request was sent
+    uint64_t sentUs;            // When the outstanding echo request was sent
+    uint32_t expected;          // Echo bytes still to come back
+} BENCH_STREAM;
+
+typedef struct {
+    uint64_t startUs;
+    uint64_t bytesUp;           // Guest to upstream server
+    uint64_t bytesDown;         // Upstream server to guest
+    uint64_t ops;               // Requests (rr) or connections (connect) completed
+    uint64_t errors;            // Streams the host failed or closed on its own
+    uint64_t sinkBase;          // Sink server count when measuring started
+} BENCH_STATS;
+
+typedef struct {
+    BENCH_MODE mode;
+    int streams;
+    uint32_t size;
+    uint64_t durationUs;
+    uint64_t warmupUs;
+} BENCH_CONFIG;
+
+static BENCH_CONFIG g_config = {MODE_RR, 16, 64, 10000000ULL, 1000000ULL};
+static BENCH_STATS g_stats;
+static BENCH_LATENCY g_latency;
+static BENCH_STREAM g_streams[BENCH_MAX_STREAMS];
+static BENCH_SERVERS g_servers;
+static MUX_CHANNEL g_channel;
+static bool g_measuring = false;
+static bool g_stopping = false;
+
+static TRANSPORT g_transport;
+static CHANNEL_EMU g_emu;
+static CHANNEL_EMU_CONFIG g_emuConfig;
+static bool g_emulate = false;
+static uint8_t g_in[IN_BUFFER_SIZE];
+static size_t g_inLen = 0;
+static uint8_t g_out[OUT_BUFFER_SIZE];
+static size_t g_outStart = 0;
+static size_t g_outEnd = 0;
+static uint8_t g_pattern[MUX_MAX_PAYLOAD];
+
+static void PrintUsage(const char* prog) {
+    printf("Usage: %s [options] [SOCKET]\n", prog);
+    printf("Acts as the guest on the channel socket SOCKET (default: %s) and benchmarks\n", DEFAULT_CHANNEL);
+    printf("the host proxy that connects to it\n");
+    printf("  -m, --mode MODE         rr, connect, download or upload (default: rr)\n");
+    printf("  -n, --streams N         Concurrent streams, at most %d (default: 16)\n", BENCH_MAX_STREAMS);
+    printf("  -s, --size BYTES        Request size for rr and connect (default: 64)\n");
+    printf("  -d, --duration SEC      Measured time (default: 10)\n");
+    printf("  -w, --warmup SEC        Unmeasured time before it (default: 1)\n");
+    printf("  -e, --channel-emu SPEC  Emulate a slow channel, e.g. rate=1M,latency=2ms,chunk=1-512\n");
+    printf("  -h, --help              Show this help\n");
+}
+
+static size_t OutRoom(void) {
+    if (g_outStart > 0 && g_outEnd + MUX_MAX_PAYLOAD + sizeof(VIRTIO_MSG_HEADER) > sizeof(g_out)) {
+        memmove(g_out, g_out + g_outStart, g_outEnd - g_outStart);
+        g_outEnd -= g_outStart;
+        g_outStart = 0;
+    }
+    return sizeof(g_out) - g_outEnd;
+}
+
+static bool QueueFrame(uint16_t connId, const void* payload, uint16_t length) {
+    VIRTIO_MSG_HEADER header;
+
+    if (OutRoom() < sizeof(header) + length) {
+        return false;
+    }
+
+    header.connId = connId;
+    header.length = length;
+    memcpy(g_out + g_outEnd, &header, sizeof(header));
+    memcpy(g_out + g_outEnd + sizeof(header), payload, length);
+    g_outEnd += sizeof(header) + length;
+    return true;
+}
+
+static bool QueueControl(uint8_t type, uint16_t connId) {
+    MUX_CTRL_STREAM msg;
+
+    msg.type = type;
+    msg.connId = connId;
+    return QueueFrame(MUX_CONTROL_CONNID, &msg, sizeof(msg));
+}
+
+// Queues size bytes of stream data, split into frames the channel accepts
+static bool QueueData(uint16_t connId, uint32_t size) {
+    while (size > 0) {
+        uint16_t chunk = size < g_channel.maxPayload ? (uint16_t)size : g_channel.maxPayload;
+
+        if (!QueueFrame(connId, g_pattern, chunk)) {
+            return false;
+        }
+        // Uploads are counted by the sink, once they made it through
+        if (g_measuring && g_config.mode != MODE_UPLOAD) {
+            g_stats.bytesUp += chunk;
+        }
+        size -= chunk;
+    }
+    return true;
+}
+
+static bool FlushChannel(void) {
+    while (g_outStart < g_outEnd) {
+        struct iovec iov = {g_out + g_outStart, g_outEnd - g_outStart};
+        ssize_t n = TransportWritev(&g_transport, &iov, 1);
+
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return true;
+            }
+            perror("Error writing to host proxy");
+            return false;
+        }
+        g_outStart += (size_t)n;
+    }
+    g_outStart = 0;
+    g_outEnd = 0;
+    return true;
+}
+
+static void RecordLatency(uint64_t startUs) {
+    if (!g_measuring) {
+        return;
+    }
+    g_stats.ops++;
+    BenchLatencyAdd(&g_latency, BenchNowMicros() - startUs);
+}
+
+// Opens stream id to the server the mode uses. Echo streams send their
+// first request right behind the open, as a pipelining client would.
+static void OpenStream(int id) {
+    static const BENCH_SERVER_KIND servers[MODE_COUNT] = {BENCH_ECHO, BENCH_ECHO, BENCH_SOURCE, BENCH_SINK};
+    BENCH_STREAM* stream = &g_streams[id];
+    uint16_t port = g_servers.ports[servers[g_config.mode]];
+    uint8_t request[7] = {SOCKS_ATYP_IPV4, 127, 0, 0, 1, (uint8_t)(port >> 8), (uint8_t)port};
+
+    if (!QueueFrame((uint16_t)id, request, sizeof(request))) {
+        return;
+    }
+
+    memset(stream, 0, sizeof(*stream));
+    stream->open = true;
+    stream->openedUs = BenchNowMicros();
+    if (g_config.mode == MODE_RR || g_config.mode == MODE_CONNECT) {
+        stream->sentUs = stream->openedUs;
+        stream->expected = g_config.size;
+        QueueData((uint16_t)id, g_config.size);
+    }
+}
+
+static void CloseStream(int id) {
+    g_streams[id].open = false;
+    g_streams[id].closing = true;
+    QueueControl(MUX_CTRL_CLOSE, (uint16_t)id);
+}
+
+// Both CLOSEs are through; the ID may be opened again
+static void FinishStream(int id) {
+    memset(&g_streams[id], 0, sizeof(g_streams[id]));
+    if (!g_stopping) {
+        OpenStream(id);
+    }
+}
+
+static void HandleStreamData(uint16_t connId, uint16_t length) {
+    BENCH_STREAM* stream;
+
+    if (connId >= BENCH_MAX_STREAMS || !g_streams[connId].open) {
+        return;
+    }
+
+    stream = &g_streams[connId];
+    if (g_measuring) {
+        g_stats.bytesDown += length;
+    }
+    if (g_config.mode != MODE_RR && g_config.mode != MODE_CONNECT) {
+        return;
+    }
+
+    stream->expected = length < stream->expected ? stream->expected - length : 0;
+    if (stream->expected > 0) {
+        return;
+    }
+
+    if (g_config.mode == MODE_RR) {
+        RecordLatency(stream->sentUs);
+        if (!g_stopping) {
+            stream->sentUs = BenchNowMicros();
+            stream->expected = g_config.size;
+            QueueData(connId, g_config.size);
+        }
+    } else {
+        RecordLatency(stream->openedUs);
+        CloseStream(connId);
+    }
+}
+
+static void HandleHello(const MUX_HELLO* hello) {
+    MUX_HELLO ack;
+
+    if (hello->version != MUX_PROTOCOL_VERSION) {
+        printf("Host speaks protocol version %u, this tool speaks %d\n", hello->version, MUX_PROTOCOL_VERSION);
+        return;
+    }
+
+    // A HELLO means the host started over; so do the streams
+    memset(g_streams, 0, sizeof(g_streams));
+    g_channel.version = hello->version;
+    g_channel.maxPayload = hello->maxPayload < MUX_MAX_PAYLOAD ? hello->maxPayload : MUX_MAX_PAYLOAD;
+    g_channel.capabilities = hello->capabilities & MUX_CAPABILITIES;
+
+    ack.type = MUX_CTRL_HELLO_ACK;
+    ack.version = MUX_PROTOCOL_VERSION;
+    ack.maxPayload = MUX_MAX_PAYLOAD;
+    ack.capabilities = MUX_CAPABILITIES;
+    QueueFrame(MUX_CONTROL_CONNID, &ack, sizeof(ack));
+
+    if (!g_channel.ready) {
+        printf("Channel ready: protocol %u, max payload %u, capabilities 0x%08X\n",
+               g_channel.version, g_channel.maxPayload, g_channel.capabilities);
+    }
+    g_channel.ready = true;
+}
+
+static void HandleControl(const uint8_t* data, uint16_t length) {
+    MUX_CTRL_STREAM msg;
+    MUX_HELLO hello;
+    MUX_HEARTBEAT heartbeat;
+    MUX_OPEN_RESULT result;
+
+    if (length < 1) {
+        return;
+    }
+
+    switch (data[0]) {
+        case MUX_CTRL_HELLO:
+            if (length >= sizeof(hello)) {
+                memcpy(&hello, data, sizeof(hello));
+                HandleHello(&hello);
+            }
+            break;
+        case MUX_CTRL_PING:
+            if (length >= sizeof(heartbeat)) {
+                memcpy(&heartbeat, data, sizeof(heartbeat));
+                heartbeat.type = MUX_CTRL_PONG;
+                QueueFrame(MUX_CONTROL_CONNID, &heartbeat, sizeof(heartbeat));
+            }
+            break;
+        case MUX_CTRL_CLOSE:
+            if (length < sizeof(msg)) {
+                break;
+            }
+            memcpy(&msg, data, sizeof(msg));
+            if (msg.connId >= BENCH_MAX_STREAMS) {
+                break;
+            }
+            if (g_streams[msg.connId].open) {
+                // The host gave up on a stream that was still in use
+                if (g_measuring) {
+                    g_stats.errors++;
+                }
+                CloseStream(msg.connId);
+            }
+            if (g_streams[msg.connId].closing) {
+                FinishStream(msg.connId);
+            }
+            break;
+        case MUX_CTRL_OPEN_FAIL:
+            if (length >= sizeof(result)) {
+                memcpy(&result, data, sizeof(result));
+                printf("Host failed to open stream %u (SOCKS reply %u)\n", result.connId, result.reply);
+            }
+            break;
+        default:
+            // HELLO_ACK, EOF, OPEN_ACK: nothing to do
+            break;
+    }
+}
+
+static bool ReadChannel(void) {
+    size_t offset = 0;
+    ssize_t n = TransportRead(&g_transport, g_in + g_inLen, sizeof(g_in) - g_inLen);
+
+    if (n == 0) {
+        printf("Host proxy disconnected\n");
+        return false;
+    }
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return true;
+        }
+        perror("Error reading from host proxy");
+        return false;
+    }
+    g_inLen += (size_t)n;
+
+    while (g_inLen - offset >= sizeof(VIRTIO_MSG_HEADER)) {
+        VIRTIO_MSG_HEADER header;
+
+        memcpy(&header, g_in + offset, sizeof(header));
+        if (g_inLen - offset < sizeof(header) + header.length) {
+            break;
+        }
+        if (header.connId == MUX_CONTROL_CONNID) {
+            HandleControl(g_in + offset + sizeof(header), header.length);
+        } else {
+            HandleStreamData(header.connId, header.length);
+        }
+        offset += sizeof(header) + header.length;
+    }
+
+    memmove(g_in, g_in + offset, g_inLen - offset);
+    g_inLen -= offset;
+    return true;
+}
+
+// Keeps the channel busy with upload data, round robin over the streams
+static void FillUploads(void) {
+    static int next = 0;
+    int idle = 0;
+
+    while (g_outEnd - g_outStart < OUT_LOW_WATER && idle < g_config.streams) {
+        int id = next;
+
+        next = (next + 1) % g_config.streams;
+        if (!g_streams[id].open) {
+            idle++;
+            continue;
+        }
+        idle = 0;
+        if (!QueueData((uint16_t)id, g_channel.maxPayload)) {
+            break;
+        }
+    }
+}
+
+static void PrintReport(uint64_t endUs) {
+    double seconds = (double)(endUs - g_stats.startUs) / 1e6;
+
+    if (g_config.mode == MODE_UPLOAD) {
+        g_stats.bytesUp = g_servers.sinkBytes - g_stats.sinkBase;
+    }
+
+    printf("report_version=%d\n", REPORT_VERSION);
+    printf("mode=%s\n", g_modeNames[g_config.mode]);
+    printf("streams=%d\n", g_config.streams);
+    printf("size=%u\n", g_config.size);
+    printf("max_payload=%u\n", g_channel.maxPayload);
+    printf("capabilities=0x%08X\n", g_channel.capabilities);
+    printf("duration_s=%.3f\n", seconds);
+    printf("bytes_up=%llu\n", (unsigned long long)g_stats.bytesUp);
+    printf("bytes_down=%llu\n", (unsigned long long)g_stats.bytesDown);
+    printf("mbit_up=%.2f\n", g_stats.bytesUp * 8 / seconds / 1e6);
+    printf("mbit_down=%.2f\n", g_stats.bytesDown * 8 / seconds / 1e6);
+    printf("ops=%llu\n", (unsigned long long)g_stats.ops);
+    printf("ops_per_s=%.1f\n", g_stats.ops / seconds);
+    printf("errors=%llu\n", (unsigned long long)g_stats.errors);
+    BenchLatencyReport(&g_latency, "latency");
+}
+
+// Runs the benchmark on an accepted host proxy connection
+static bool Run(void) {
+    struct pollfd fds[TRANSPORT_POLL_FDS + BENCH_SERVER_POLL_FDS];
+    uint64_t startUs = 0;
+    uint64_t endUs = 0;
+    int nfds;
+    int i;
+
+    while (1) {
+        uint64_t now = BenchNowMicros();
+        int timeoutMs = -1;
+        int channelTimeoutMs;
+        short events;
+
+        // Phases: wait for HELLO, warm up, measure, then report
+        if (g_channel.ready && startUs == 0) {
+            startUs = now;
+            for (i = 0; i < g_config.streams; i++) {
+                OpenStream(i);
+            }
+        }
+        if (startUs != 0 && !g_measuring && endUs == 0 && now - startUs >= g_config.warmupUs) {
+            memset(&g_stats, 0, sizeof(g_stats));
+            g_latency.count = 0;
+            g_stats.startUs = now;
+            g_stats.sinkBase = g_servers.sinkBytes;
+            g_measuring = true;
+            endUs = now + g_config.durationUs;
+        }
+        if (g_measuring && now >= endUs) {
+            g_measuring = false;
+            g_stopping = true;
+            PrintReport(now);
+            return true;
+        }
+        if (startUs != 0) {
+            uint64_t due = g_measuring ? endUs : startUs + g_config.warmupUs;
+
+            timeoutMs = due > now ? (int)((due - now + 999) / 1000) : 0;
+        }
+
+        if (g_config.mode == MODE_UPLOAD) {
+            FillUploads();
+        }
+        if (!FlushChannel()) {
+            return false;
+        }
+
+        if (TransportPollSetup(&g_transport, fds, true, g_outStart < g_outEnd)) {
+            timeoutMs = 0;
+        }
+        channelTimeoutMs = TransportPollTimeout(&g_transport);
+        if (channelTimeoutMs >= 0 && (timeoutMs < 0 || channelTimeoutMs < timeoutMs)) {
+            timeoutMs = channelTimeoutMs;
+        }
+        nfds = TRANSPORT_POLL_FDS + BenchServersPollSetup(&g_servers, fds + TRANSPORT_POLL_FDS);
+
+        if (poll(fds, nfds, timeoutMs) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll error");
+            return false;
+        }
+
+        BenchServersPollEvents(&g_servers, fds + TRANSPORT_POLL_FDS, nfds - TRANSPORT_POLL_FDS);
+        events = TransportPollEvents(&g_transport, fds);
+        if ((events & POLLOUT) && !FlushChannel()) {
+            return false;
+        }
+        if ((events & (POLLIN | POLLHUP | POLLERR)) && !ReadChannel()) {
+            return false;
+        }
+    }
+}
+
+static bool ParseCount(const char* text, unsigned long max, unsigned long* value) {
+    char* end;
+
+    *value = strtoul(text, &end, 10);
+    return end != text && *end == '\0' && *value <= max;
+}
+
+int main(int argc, char* argv[]) {
+    static const struct option longOptions[] = {
+        {"mode", required_argument, NULL, 'm'},
+        {"streams", required_argument, NULL, 'n'},
+        {"size", required_argument, NULL, 's'},
+        {"duration", required_argument, NULL, 'd'},
+        {"warmup", required_argument, NULL, 'w'},
+        {"channel-emu", required_argument, NULL, 'e'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    const char* path = DEFAULT_CHANNEL;
+    char spec[TRANSPORT_SPEC_MAX];
+    int fd;
+    unsigned long value;
+    int listener;
+    int opt;
+    int i;
+
+    while ((opt = getopt_long(argc, argv, "m:n:s:d:w:e:h", longOptions, NULL)) != -1) {
+        switch (opt) {
+            case 'm':
+                for (i = 0; i < MODE_COUNT && strcmp(optarg, g_modeNames[i]) != 0; i++) {
+                }
+                if (i == MODE_COUNT) {
+                    printf("Unknown mode '%s'\n", optarg);
+                    return 1;
+                }
+                g_config.mode = (BENCH_MODE)i;
+                break;
+            case 'n':
+                if (!ParseCount(optarg, BENCH_MAX_STREAMS, &value) || value == 0) {
+                    printf("Invalid stream count '%s' (1 to %d)\n", optarg, BENCH_MAX_STREAMS);
+                    return 1;
+                }
+                g_config.streams = (int)value;
+                break;
+            case 's':
+                if (!ParseCount(optarg, BENCH_MAX_SIZE, &value) || value == 0) {
+                    printf("Invalid size '%s' (1 to %d)\n", optarg, BENCH_MAX_SIZE);
+                    return 1;
+                }
+                g_config.size = (uint32_t)value;
+                break;
+            case 'd':
+            case 'w':
+                if (!ParseCount(optarg, 86400, &value) || (opt == 'd' && value == 0)) {
+                    printf("Invalid time '%s'\n", optarg);
+                    return 1;
+                }
+                *(opt == 'd' ? &g_config.durationUs : &g_config.warmupUs) = value * 1000000ULL;
+                break;
+            case 'e':
+                if (!ChannelEmuParse(&g_emuConfig, optarg)) {
+                    return 1;
+                }
+                g_emulate = true;
+                break;
+            case 'h':
+                PrintUsage(argv[0]);
+                return 0;
+            default:
+                PrintUsage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind > 1) {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+    if (optind < argc) {
+        path = argv[optind];
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    for (i = 0; i < (int)sizeof(g_pattern); i++) {
+        g_pattern[i] = (uint8_t)i;
+    }
+    if (!BenchServersStart(&g_servers, "127.0.0.1")) {
+        return 1;
+    }
+
+    listener = BenchListenUnix(path);
+    if (listener < 0) {
+        return 1;
+    }
+    printf("Waiting for a host proxy on %s (%s, %d streams)\n", path, g_modeNames[g_config.mode], g_config.streams);
+
+    fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+        perror("accept error");
+        close(listener);
+        return 1;
+    }
+    close(listener);
+    unlink(path);
+
+    // The accepted socket becomes a transport so it can be emulated
+    snprintf(spec, sizeof(spec), "unix:%s", path);
+    if (!TransportParse(&g_transport, spec)) {
+        close(fd);
+        return 1;
+    }
+    if (g_emulate) {
+        TransportEmulate(&g_transport, &g_emu, &g_emuConfig);
+    }
+    if (!TransportAdopt(&g_transport, "unix", &fd, 1)) {
+        return 1;
+    }
+
+    if (!Run()) {
+        return 1;
+    }
+    TransportClose(&g_transport);
+    return 0;
+}
@@ -0,0 +1,190 @@
+#define _GNU_SOURCE
+
+#include "handoff.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+static bool FillAddress(struct sockaddr_un* addr, const char* path) {
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        printf("Socket path %s is too long\n", path);
+        return false;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    memcpy(addr->sun_path, path, strlen(path) + 1);
+    return true;
+}
+
+static void SetReceiveTimeout(int fd, uint64_t timeoutMs) {
+    struct timeval timeout;
+
+    timeout.tv_sec = timeoutMs / 1000;
+    timeout.tv_usec = (timeoutMs % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+int HandoffListen(const char* path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (!FillAddress(&addr, path)) {
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Error creating handoff socket");
+        return -1;
+    }
+
+    // A previous generation's socket is replaced; whoever connects gets
+    // every stream, so only the owner may
+    unlink(path);
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || chmod(path, 0600) < 0 || listen(fd, 1) < 0) {
+        printf("Error listening on %s: %s (errno=%d)\n", path, strerror(errno), errno);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int HandoffAccept(int listener, uint64_t timeoutMs) {
+    int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+
+    if (fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("Error accepting takeover");
+        }
+        return -1;
+    }
+
+    SetReceiveTimeout(fd, timeoutMs);
+    return fd;
+}
+
+int HandoffConnect(const char* path, uint64_t timeoutMs) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (!FillAddress(&addr, path)) {
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Error creating handoff socket");
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        printf("Error connecting to %s: %s (errno=%d)\n", path, strerror(errno), errno);
+        close(fd);
+        return -1;
+    }
+
+    SetReceiveTimeout(fd, timeoutMs);
+    return fd;
+}
+
+bool HandoffSend(int socket, const void* record, size_t length, const int* fds, int fdCount) {
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+    struct iovec iov;
+    ssize_t sent;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = (void*)record;
+    iov.iov_len = length;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (fdCount > 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * fdCount);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fdCount);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * fdCount);
+    }
+
+    do {
+        sent = sendmsg(socket, &msg, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+
+    if (sent != (ssize_t)length) {
+        perror("Error sending handoff record");
+        return false;
+    }
+    return true;
+}
+
+ssize_t HandoffReceive(int socket, HANDOFF_RECORD* record, int* fds, int* fdCount) {
+    char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+    struct iovec iov;
+    ssize_t received;
+    int i;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = record;
+    iov.iov_len = sizeof(*record);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    *fdCount = 0;
+
+    do {
+        received = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+    } while (received < 0 && errno == EINTR);
+
+    if (received < 0) {
+        perror("Error receiving handoff record");
+        return -1;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+
+            for (i = 0; i < count; i++) {
+                int fd;
+
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                if (*fdCount < HANDOFF_MAX_FDS) {
+                    fds[(*fdCount)++] = fd;
+                } else {
+                    close(fd);
+                }
+            }
+        }
+    }
+
+    if (received < (ssize_t)sizeof(record->type) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        if (received == 0) {
+            printf("Handoff peer went away\n");
+        } else {
+            printf("Malformed handoff record (%zd bytes)\n", received);
+        }
+        for (i = 0; i < *fdCount; i++) {
+            close(fds[i]);
+        }
+        *fdCount = 0;
+        return -1;
+    }
+
+    return received;
+}
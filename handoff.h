@@ -0,0 +1,110 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+// Hot restart of the host proxy. A running proxy started with --handoff PATH
+// listens on a Unix SOCK_SEQPACKET socket; a new proxy started with
+// --takeover PATH connects to it. The old process writes out its queued
+// virtio egress, then sends one record per message:
+//
+//   BEGIN                  Format version and record counts
+//   VM                     Per VM: channel spec, negotiated parameters and
+//                          unprocessed ingress bytes, with the channel's
+//                          descriptors attached (see TransportExport)
+//   STREAM                 Per open stream: state flags and guest data not
+//                          yet written upstream, with the upstream socket
+//   END
+//
+// The new process answers ACK once it owns everything, and the old process
+// exits without closing any stream. Without an ACK the old process keeps
+// serving. Both processes must speak the same HANDOFF_VERSION.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "transport.h"
+
+#define HANDOFF_MAGIC 0x464F4448U     // "HDOF"
+#define HANDOFF_VERSION 1
+#define HANDOFF_MAX_FDS TRANSPORT_MAX_FDS
+#define HANDOFF_INGRESS_MAX (64 * 1024)
+#define HANDOFF_PENDING_MAX 4096
+#define HANDOFF_HOST_MAX 256
+#define HANDOFF_BACKEND_MAX 8
+
+// Record types
+#define HANDOFF_BEGIN 1
+#define HANDOFF_VM 2
+#define HANDOFF_STREAM 3
+#define HANDOFF_END 4
+#define HANDOFF_ACK 5
+
+// Stream state flags
+#define HANDOFF_STREAM_CLOSING 0x01
+#define HANDOFF_STREAM_CONNECTING 0x02
+#define HANDOFF_STREAM_UPSTREAM_EOF 0x04
+#define HANDOFF_STREAM_GUEST_EOF 0x08
+#define HANDOFF_STREAM_OPEN_PENDING 0x10    // Guest still waits for OPEN_ACK/OPEN_FAIL
+
+typedef struct {
+    uint32_t type;
+    uint32_t magic;
+    uint32_t version;
+    uint32_t vmCount;
+    uint32_t streamCount;
+} HANDOFF_BEGIN_RECORD;
+
+typedef struct {
+    uint32_t type;
+    uint8_t discovered;                 // Found in --channel-dir
+    uint8_t open;                       // Channel descriptors are attached
+    uint8_t ready;                      // HELLO exchange completed
+    uint8_t version;
+    uint16_t maxPayload;
+    uint32_t capabilities;
+    uint32_t pingSeq;
+    uint32_t reconnects;
+    uint64_t srttUs;
+    uint64_t minRttUs;
+    char spec[TRANSPORT_SPEC_MAX];
+    char backend[HANDOFF_BACKEND_MAX];  // Backend of the open descriptors
+    uint32_t ingressUsed;
+    uint8_t ingress[HANDOFF_INGRESS_MAX];   // Only ingressUsed bytes are sent
+} HANDOFF_VM_RECORD;
+
+typedef struct {
+    uint32_t type;
+    uint16_t vm;                        // Position of the VM record, from 0
+    uint16_t connId;
+    uint8_t flags;                      // HANDOFF_STREAM_*
+    uint8_t priority;                   // Egress priority class
+    uint16_t pendingLen;
+    uint64_t idleMs;                    // Time since the last data
+    char host[HANDOFF_HOST_MAX];        // Destination rate limit entry, empty if none
+    uint8_t pending[HANDOFF_PENDING_MAX];   // Only pendingLen bytes are sent
+} HANDOFF_STREAM_RECORD;
+
+typedef union {
+    uint32_t type;
+    HANDOFF_BEGIN_RECORD begin;
+    HANDOFF_VM_RECORD vm;
+    HANDOFF_STREAM_RECORD stream;
+} HANDOFF_RECORD;
+
+// Socket the running proxy accepts takeovers on: non-blocking, owner-only
+int HandoffListen(const char* path);
+
+// Accepts a takeover and connects to a running proxy. Both return a blocking
+// socket whose receives time out after timeoutMs, or -1.
+int HandoffAccept(int listener, uint64_t timeoutMs);
+int HandoffConnect(const char* path, uint64_t timeoutMs);
+
+// Sends one record with up to HANDOFF_MAX_FDS descriptors attached
+bool HandoffSend(int socket, const void* record, size_t length, const int* fds, int fdCount);
+
+// Receives one record and the descriptors attached to it. Returns the record
+// length, or -1 on errors and truncated records (closing any descriptors).
+ssize_t HandoffReceive(int socket, HANDOFF_RECORD* record, int* fds, int* fdCount);
+
+#endif // HANDOFF_H
@@ -9,454 +9,2435 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <sys/socket.h>
-#include <sys/un.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <poll.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <getopt.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <signal.h>
+#include <dirent.h>
 #include <sys/stat.h>
-#include <sys/select.h>
 
-#define MAX_CONNECTIONS 64
+#include "mux_sched.h"
+#include "token_bucket.h"
+#include "timer_wheel.h"
+#include "transport.h"
+#include "dns_cache.h"
+#include "handoff.h"
+#include "connect_breaker.h"
+#include "conn_pool.h"
+#include "trace.h"
+#include "mux_frame.h"
+
+// Guest VMs served by one process, and upstream connections shared by all of
+// them. Each VM numbers its streams 0..MAX_STREAMS-1 like the guest does; a
+// stream takes a slot from the shared pool only while it is open. Every slot
+// is a descriptor, so RLIMIT_NOFILE has to leave room for them.
+#define MAX_VMS 64
+#define MAX_STREAMS 64
+#define MAX_CONNECTIONS 1024
 #define BUFFER_SIZE 4096
-#define VIRTIO_DEVICE "/tmp/vserial"  // Adjust for your setup
+#define VIRTIO_DEVICE "/tmp/vserial"  // Default channel, see --channel
+#define VM_NAME_MAX 64
+// Poll entries reserved for each VM's channel transport
+#define CHANNEL_POLL_FDS TRANSPORT_POLL_FDS
+// How often --channel-dir is rescanned for VMs that came or went
+#define CHANNEL_SCAN_INTERVAL_MS 1000
+
+// Egress buffering toward each virtio channel. Frames wait in per-stream
+// queues and are picked by the VM's DRR scheduler. A VM's upstream reads are
+// paused once its backlog passes the high-water mark and resumed below the
+// low-water mark; a single stream is also paused once its own queue passes
+// EGRESS_STREAM_LIMIT. The frames themselves come from one pool shared by
+// all VMs, so idle VMs hold no buffers.
+#define EGRESS_POOL_FRAMES 2048
+#define EGRESS_HIGH_WATER (192 * 1024)
+#define EGRESS_LOW_WATER (64 * 1024)
+#define EGRESS_STREAM_LIMIT (64 * 1024)
+// Frames kept free for control messages and one read per stream of a VM
+#define EGRESS_FRAME_RESERVE (MAX_STREAMS + 16)
+// No upstream socket is read while the pool is down to this many frames
+#define EGRESS_CONTROL_RESERVE 16
+// Frames handed to a single writev
+#define EGRESS_BATCH_FRAMES 16
+
+// Flow used for channel-level control frames (stream flows are 0..MAX_STREAMS-1)
+#define CONTROL_FLOW MAX_STREAMS
+
+// Bandwidth shaping: a throttled stream resumes reading once its buckets
+// hold at least this many bytes (or a full bucket, if smaller)
+#define RATE_LIMIT_MIN_CHUNK 1024
+
+// How long to wait for the guest to answer HELLO, in seconds
+#define DEFAULT_HELLO_TIMEOUT 3
+
+// Heartbeats: a PING every interval; the channel is considered dead after
+// DEFAULT_HEARTBEAT_TIMEOUT seconds without any bytes from the guest
+#define DEFAULT_HEARTBEAT_INTERVAL 5
+#define DEFAULT_HEARTBEAT_TIMEOUT 15
+
+// Reconnect backoff: starts at RECONNECT_MIN_DELAY_MS and doubles up to the
+// configured maximum (seconds)
+#define RECONNECT_MIN_DELAY_MS 100
+#define DEFAULT_RECONNECT_MAX 10
+
+// Default stream timeouts in seconds (0 disables the idle timeout)
+#define DEFAULT_CONNECT_TIMEOUT 10
+#define DEFAULT_IDLE_TIMEOUT 300
+#define DEFAULT_LINGER_TIMEOUT 30
+
+// Lifetime of resolved upstream host names in seconds (0 disables the cache)
+#define DEFAULT_DNS_TTL 60
+
+// Pre-connected sockets: how long an idle one is kept (seconds), and how
+// often the pool is aged and topped up
+#define DEFAULT_PRECONNECT_TTL 30
+#define CONN_POOL_INTERVAL_MS 1000
+
+// Longest time an unreachable destination fails fast, in seconds (0 disables)
+#define DEFAULT_FAIL_FAST_MAX 60
+
+// How often a channel capture is written out to its file
+#define TRACE_FLUSH_INTERVAL_MS 1000
+
+// Ingress reassembly buffer for frames read from the virtio channel
+#define INGRESS_BUFFER_SIZE (64 * 1024)
+
+// Hot restart: how long the old process may take to write out its egress
+// queues, and how long either side waits for the other's next record
+#define HANDOFF_DRAIN_MS 2000
+#define HANDOFF_TIMEOUT_MS 5000
+
+#if INGRESS_BUFFER_SIZE > HANDOFF_INGRESS_MAX || BUFFER_SIZE > HANDOFF_PENDING_MAX
+#error "Stream state does not fit the handoff records"
+#endif
 
 // SOCKS protocol constants
-#define SOCKS_ATYP_IPV4 0x01
-#define SOCKS_ATYP_DOMAIN 0x03
-#define SOCKS_ATYP_IPV6 0x04
+#define SOCKS_REPLY_SUCCESS 0x00
+#define SOCKS_REPLY_GENERAL_FAILURE 0x01
+#define SOCKS_REPLY_NETWORK_UNREACHABLE 0x03
+#define SOCKS_REPLY_HOST_UNREACHABLE 0x04
+#define SOCKS_REPLY_CONNECTION_REFUSED 0x05
+#define SOCKS_REPLY_ADDRESS_NOT_SUPPORTED 0x08
 
-// Virtio message header for multiplexing
-typedef struct {
-    uint16_t connId;
-    uint16_t length;
-} __attribute__((packed)) VIRTIO_MSG_HEADER;
+struct VM_CONTEXT;
+struct CONNECTION_DATA;
 
-// Connection state
-typedef struct {
+// Connection state that the event loop reads for every slot on every pass,
+// one cache line per slot. Buffers and rarely used fields live in the
+// slot's CONNECTION_DATA.
+typedef struct MUX_CACHE_ALIGNED {
     int socket;
     bool inUse;
-    uint16_t connId;
+    bool closing;                     // CLOSE sent, waiting for the guest's CLOSE
+    bool throttled;                   // Reads paused until the buckets refill
+    bool connecting;                  // Non-blocking connect still in progress
+    bool connectDeferred;             // Connect waits for early data (TCP Fast Open)
+    bool openPending;                 // Guest not yet told the connect's result (OPEN_ACK/OPEN_FAIL)
+    bool upstreamEof;                 // Upstream sent FIN; EOF forwarded to the guest
+    bool guestEof;                    // Guest sent EOF; upstream write side shut down once drained
+    uint16_t connId;                  // Stream ID within that guest
+    uint16_t pendingLen;              // Guest data not yet accepted by the upstream socket
+    struct VM_CONTEXT* vm;            // Guest that owns the stream
+    struct CONNECTION_DATA* data;
+    int destLimit;                    // Index into g_destLimits, -1 if not limited
+    int breaker;                      // g_breaker entry awaiting the connect's outcome, -1 if none
+    int connectError;                 // errno of a failed open, reported in OPEN_FAIL
+    uint32_t generation;              // Bumped each time the slot is taken for a stream
+    uint64_t lastActivity;            // Wheel time of the last data in either direction
 } CONNECTION_INFO;
 
+_Static_assert(sizeof(CONNECTION_INFO) == MUX_CACHE_LINE, "CONNECTION_INFO must fill one cache line");
+
+// The rest of a connection slot
+typedef struct CONNECTION_DATA {
+    uint8_t pending[BUFFER_SIZE];     // Guest data for the upstream socket (pendingLen bytes)
+    TOKEN_BUCKET bucket;              // Per-stream rate limit for upstream reads
+    DNS_ADDRESS address;              // Destination of a deferred connect
+    TIMER timer;                      // Connect, idle or linger timeout
+    TIMER rateTimer;                  // Wakes a throttled stream
+} CONNECTION_DATA;
+
+// Stream timeouts configured at startup (milliseconds)
+typedef struct {
+    uint64_t connectMs;
+    uint64_t idleMs;
+    uint64_t lingerMs;
+} TIMEOUT_CONFIG;
+
+// Rate limits configured at startup (bytes per second, 0 = unlimited)
+typedef struct {
+    uint64_t streamRate;
+    uint64_t streamBurst;
+    uint64_t destRate;
+    uint64_t destBurst;
+} RATE_LIMIT_CONFIG;
+
+// Token bucket shared by all streams to one destination host. Entries are
+// kept after the last stream closes so reconnecting does not refill them.
+typedef struct {
+    char host[256];
+    int refCount;
+    TOKEN_BUCKET bucket;
+} DEST_LIMIT;
+
+// Channel handshake, heartbeat and reconnect settings (milliseconds)
+typedef struct {
+    uint64_t helloTimeoutMs;
+    uint64_t heartbeatIntervalMs;   // Between PINGs, 0 disables heartbeats
+    uint64_t heartbeatTimeoutMs;    // Silence after which the guest is assumed gone
+    uint64_t reconnectMaxMs;
+} CHANNEL_CONFIG;
+
+// Liveness of a virtio channel and reconnect state
+typedef struct {
+    uint64_t lastReceiveMs;     // Wheel time of the last bytes from the guest
+    uint32_t pingSeq;
+    uint64_t srttUs;            // Smoothed heartbeat round trip
+    uint64_t minRttUs;
+    uint64_t reconnectDelayMs;  // Next reconnect backoff
+    uint32_t reconnects;
+    TIMER heartbeatTimer;
+    TIMER reconnectTimer;       // Next reconnect attempt, or HELLO wait after one
+} CHANNEL_MONITOR;
+
+// Frames dequeued from the scheduler and being written to the channel
+typedef struct {
+    MUX_FRAME* head;
+    MUX_FRAME* tail;
+    size_t offset;  // Bytes of the head frame already written
+    size_t bytes;   // Bytes in the batch, including the written part of the head
+    bool paused;    // Upstream reads paused until the backlog drains
+} EGRESS_BUFFER;
+
+// Bytes read from the virtio channel that do not form a complete frame yet
+typedef struct {
+    uint8_t data[INGRESS_BUFFER_SIZE];
+    size_t used;
+    bool stalled;   // A frame is waiting for an upstream socket to drain
+    bool resume;    // The stall was cleared; process the buffer again
+    int stalledSlot;            // Stream ID whose socket is behind
+} INGRESS_BUFFER;
+
+// One guest VM: its channel, the mux state on it and its stream namespace
+typedef struct VM_CONTEXT {
+    bool inUse;
+    bool discovered;            // Found in --channel-dir, removed with its socket
+    bool seen;                  // Still present in the latest directory scan
+    char name[VM_NAME_MAX];
+    TRANSPORT transport;
+    MUX_CHANNEL channel;
+    CHANNEL_MONITOR monitor;
+    EGRESS_BUFFER egress;
+    INGRESS_BUFFER ingress;
+    MUX_FLOW flows[MAX_STREAMS + 1];
+    MUX_SCHEDULER sched;
+    int16_t streams[MAX_STREAMS];   // Slot in g_connections per stream ID, -1 if none
+} VM_CONTEXT;
+
 // Global data
+VM_CONTEXT g_vms[MAX_VMS];
+char g_channelDir[TRANSPORT_ADDRESS_MAX];
+TIMER g_scanTimer;
+
+// Upstream connections, shared by all VMs
 CONNECTION_INFO g_connections[MAX_CONNECTIONS] = {0};
-int g_virtioFd = -1;
+CONNECTION_DATA g_connectionData[MAX_CONNECTIONS];
+int g_freeConnections[MAX_CONNECTIONS];
+int g_freeConnectionCount;
+
+MUX_FRAME g_egressFrames[EGRESS_POOL_FRAMES];
+MUX_FRAME_POOL g_egressPool;
+MUX_FLOW g_templateFlows[1];
+MUX_SCHEDULER g_schedTemplate;  // Port rules and quanta applied to every VM
+
+RATE_LIMIT_CONFIG g_rateConfig = {0};
+DEST_LIMIT g_destLimits[MAX_CONNECTIONS];
+DNS_CACHE g_dnsCache;
+bool g_fastOpen = false;        // Send early guest data in the SYN (--fast-open)
+CONN_POOL g_connPool;
+TIMER g_connPoolTimer;
+CONNECT_BREAKER g_breaker;      // Destinations that recently failed to connect
+bool g_emulateChannel = false;  // Pass channels through an emulated slow link (--channel-emu)
+CHANNEL_EMU_CONFIG g_channelEmuConfig;
+CHANNEL_EMU g_channelEmus[MAX_VMS];
+TRACE_WRITER g_trace;           // Frames crossing the channels (--capture)
+TIMER g_traceTimer;
+
+CHANNEL_CONFIG g_channelConfig = {
+    DEFAULT_HELLO_TIMEOUT * 1000ULL,
+    DEFAULT_HEARTBEAT_INTERVAL * 1000ULL,
+    DEFAULT_HEARTBEAT_TIMEOUT * 1000ULL,
+    DEFAULT_RECONNECT_MAX * 1000ULL
+};
+
+TIMER_WHEEL g_timers;
+int g_handoffListener = -1;     // --handoff socket, -1 if hot restart is off
+TIMEOUT_CONFIG g_timeouts = {
+    DEFAULT_CONNECT_TIMEOUT * 1000ULL,
+    DEFAULT_IDLE_TIMEOUT * 1000ULL,
+    DEFAULT_LINGER_TIMEOUT * 1000ULL
+};
 
 // Function prototypes
-bool InitializeVirtio(void);
+VM_CONTEXT* AddVm(const char* spec, bool discovered);
+VM_CONTEXT* FindVm(const char* spec);
+void RemoveVm(VM_CONTEXT* vm);
+void ScanChannelDir(TIMER* timer, void* context);
+void ConnPoolTimeout(TIMER* timer, void* context);
+void TraceFlushTimeout(TIMER* timer, void* context);
+void CaptureFrame(VM_CONTEXT* vm, uint8_t direction, const uint8_t* frame);
+void ServiceChannel(VM_CONTEXT* vm, const struct pollfd* fds);
+bool InitializeVirtio(VM_CONTEXT* vm);
 void CleanupVirtio(void);
-bool HandleConnectionRequest(uint16_t connId, uint8_t* data, uint16_t length);
-bool SendToVirtio(uint16_t connId, const uint8_t* data, uint16_t length);
+void HandOver(void);
+bool DrainEgress(void);
+bool SendHandoffState(int sock);
+bool TakeOver(const char* path);
+VM_CONTEXT* AdoptVm(const HANDOFF_VM_RECORD* record, const int* fds, int fdCount);
+bool AdoptStream(VM_CONTEXT* vm, const HANDOFF_STREAM_RECORD* record, const int* fds, int fdCount);
+bool OpenVirtio(VM_CONTEXT* vm);
+void ChannelLost(VM_CONTEXT* vm);
+void DropChannelState(VM_CONTEXT* vm);
+void ReconnectTimeout(TIMER* timer, void* context);
+void HeartbeatTimeout(TIMER* timer, void* context);
+void HandlePong(VM_CONTEXT* vm, const MUX_HEARTBEAT* msg);
+bool SendHello(VM_CONTEXT* vm, uint8_t type);
+bool ExchangeHello(VM_CONTEXT* vm);
+bool NegotiateChannel(VM_CONTEXT* vm, const MUX_HELLO* peer);
+void ResetStreams(VM_CONTEXT* vm);
+CONNECTION_INFO* FindStream(VM_CONTEXT* vm, uint16_t connId);
+CONNECTION_INFO* AllocConnection(VM_CONTEXT* vm, uint16_t connId);
+void ReleaseConnection(CONNECTION_INFO* conn);
+bool HandleConnectionRequest(CONNECTION_INFO* conn, uint8_t* data, uint16_t length);
+bool SendToVirtio(VM_CONTEXT* vm, uint16_t connId, const uint8_t* data, uint16_t length);
+bool SendControlToVirtio(VM_CONTEXT* vm, uint16_t flowId, uint8_t type, uint16_t connId);
+bool FlushVirtio(VM_CONTEXT* vm);
+size_t EgressBacklog(VM_CONTEXT* vm);
+void UpdateEgressPause(VM_CONTEXT* vm);
+bool HandleControlFrame(VM_CONTEXT* vm, const uint8_t* data, uint16_t length);
+void HandleGuestClose(VM_CONTEXT* vm, uint16_t connId);
+void HandleGuestEof(VM_CONTEXT* vm, uint16_t connId);
+void HandleUpstreamEof(CONNECTION_INFO* conn);
+bool CompleteConnect(CONNECTION_INFO* conn);
+void ReportConnect(CONNECTION_INFO* conn, int outcome);
+bool SendOpenResult(CONNECTION_INFO* conn, uint8_t type);
+bool ConnectUpstream(CONNECTION_INFO* conn);
+void StartDeferredConnects(VM_CONTEXT* vm);
+void UpdateHalfClose(CONNECTION_INFO* conn);
+void ArmConnectionTimer(CONNECTION_INFO* conn);
+void ConnectionTimeout(TIMER* timer, void* context);
+void RateLimitWake(TIMER* timer, void* context);
+uint64_t NowMicros(void);
+uint64_t NowMillis(void);
+void RateLimitOpen(CONNECTION_INFO* conn, const char* host);
+void RateLimitClose(CONNECTION_INFO* conn);
+size_t RateLimitAllowance(CONNECTION_INFO* conn, uint64_t now);
+bool RateLimitReady(CONNECTION_INFO* conn, uint64_t now);
+void RateLimitConsume(CONNECTION_INFO* conn, size_t bytes);
+uint64_t RateLimitDelay(CONNECTION_INFO* conn);
+bool ProcessVirtioIngress(VM_CONTEXT* vm);
+bool SendToUpstream(CONNECTION_INFO* conn, const uint8_t* data, uint16_t length);
+bool FlushUpstream(CONNECTION_INFO* conn);
 void CloseConnection(CONNECTION_INFO* conn);
 
-int main(void) {
-    struct pollfd fds[MAX_CONNECTIONS + 1];
+static void PrintUsage(const char* prog) {
+    printf("Usage: %s [options]\n", prog);
+    printf("  -C, --channel SPEC                Channel to a guest, repeat for more VMs (default: %s)\n", VIRTIO_DEVICE);
+    printf("  -D, --channel-dir DIR             Serve every socket or device in DIR, following changes\n");
+    printf("  -p, --priority PORT[-PORT]=CLASS  Egress priority class for a destination port range\n");
+    printf("  -q, --quantum CLASS=BYTES         Per-stream DRR quantum for a priority class\n");
+    printf("  -r, --stream-rate BYTES           Per-stream download limit in bytes/s (K/M/G suffixes)\n");
+    printf("  -R, --dest-rate BYTES             Per-destination-host download limit in bytes/s\n");
+    printf("      --stream-burst BYTES          Per-stream bucket depth (default: 100ms at the rate)\n");
+    printf("      --dest-burst BYTES            Per-destination bucket depth (default: 100ms at the rate)\n");
+    printf("      --connect-timeout SEC         Upstream connect timeout (default: %d)\n", DEFAULT_CONNECT_TIMEOUT);
+    printf("      --idle-timeout SEC            Close streams idle this long, 0 to disable (default: %d)\n", DEFAULT_IDLE_TIMEOUT);
+    printf("      --linger-timeout SEC          Limit for half-closed and closing streams (default: %d)\n", DEFAULT_LINGER_TIMEOUT);
+    printf("      --hello-timeout SEC           Wait this long for the guest's HELLO-ACK (default: %d)\n", DEFAULT_HELLO_TIMEOUT);
+    printf("      --heartbeat-interval SEC      Channel heartbeat period, 0 to disable (default: %d)\n", DEFAULT_HEARTBEAT_INTERVAL);
+    printf("      --heartbeat-timeout SEC       Reconnect after this long without traffic (default: %d)\n", DEFAULT_HEARTBEAT_TIMEOUT);
+    printf("      --reconnect-max SEC           Longest delay between reconnect attempts (default: %d)\n", DEFAULT_RECONNECT_MAX);
+    printf("      --dns-ttl SEC                 Cache resolved host names, 0 to disable (default: %d)\n", DEFAULT_DNS_TTL);
+    printf("      --fast-open                   Send the first guest data in the SYN (TCP Fast Open)\n");
+    printf("      --fail-fast-max SEC           Longest fail-fast window for unreachable destinations, 0 to disable (default: %d)\n", DEFAULT_FAIL_FAST_MAX);
+    printf("      --preconnect N                Keep N idle sockets to each busy destination, 0 to disable (default: 0)\n");
+    printf("      --preconnect-ttl SEC          Close idle pre-connected sockets after this long (default: %d)\n", DEFAULT_PRECONNECT_TTL);
+    printf("      --handoff PATH                Hand channels and streams to a new process that connects here\n");
+    printf("      --takeover PATH               Take over from the proxy listening on PATH (see --handoff)\n");
+    printf("      --channel-emu SPEC            Emulate a slow channel for benchmarks, e.g. rate=1M,latency=2ms,chunk=1-512\n");
+    printf("                                    (keys: rate, latency, jitter, chunk, buffer, seed)\n");
+    printf("      --capture PATH                Record every channel frame to a trace file for trace_replay\n");
+    printf("      --capture-payload             Include stream data in the trace, not just frame sizes\n");
+    printf("Classes: control (0), interactive (1), default (2), bulk (3)\n");
+    printf("Channels: unix:PATH, tcp:HOST:PORT, dev:PATH, dev:IN_FIFO,OUT_FIFO, shm:PATH,\n");
+    printf("          or a bare path (socket or device, detected when opened)\n");
+}
+
+// Parses a byte count with an optional K, M or G suffix (powers of 1024)
+static bool ParseByteCount(const char* text, uint64_t* value) {
+    char* end;
+    unsigned long long count = strtoull(text, &end, 10);
+    
+    if (end == text) {
+        return false;
+    }
+    switch (*end) {
+        case 'k': case 'K': count <<= 10; end++; break;
+        case 'm': case 'M': count <<= 20; end++; break;
+        case 'g': case 'G': count <<= 30; end++; break;
+        default: break;
+    }
+    if (*end != '\0') {
+        return false;
+    }
+    
+    *value = count;
+    return true;
+}
+
+// Parses a timeout in whole seconds into milliseconds
+static bool ParseSeconds(const char* text, uint64_t* valueMs) {
+    char* end;
+    unsigned long seconds = strtoul(text, &end, 10);
+    
+    if (end == text || *end != '\0' || seconds > TIMER_WHEEL_MAX_DELAY / 1000) {
+        return false;
+    }
+    
+    *valueMs = (uint64_t)seconds * 1000;
+    return true;
+}
+
+// Default bucket depth: 100ms worth of traffic, but at least one full frame
+static uint64_t DefaultBurst(uint64_t rate) {
+    return rate / 10 > BUFFER_SIZE ? rate / 10 : BUFFER_SIZE;
+}
+
+// Shortens a poll() timeout to when an emulated channel needs attention
+static int ChannelPollTimeout(VM_CONTEXT* vm, int timeout) {
+    int channelTimeout = TransportPollTimeout(&vm->transport);
+    
+    return channelTimeout >= 0 && (timeout < 0 || channelTimeout < timeout) ? channelTimeout : timeout;
+}
+
+int main(int argc, char* argv[]) {
+    static const struct option longOptions[] = {
+        {"channel", required_argument, NULL, 'C'},
+        {"channel-dir", required_argument, NULL, 'D'},
+        {"priority", required_argument, NULL, 'p'},
+        {"quantum", required_argument, NULL, 'q'},
+        {"stream-rate", required_argument, NULL, 'r'},
+        {"dest-rate", required_argument, NULL, 'R'},
+        {"stream-burst", required_argument, NULL, 'b'},
+        {"dest-burst", required_argument, NULL, 'B'},
+        {"connect-timeout", required_argument, NULL, 'c'},
+        {"idle-timeout", required_argument, NULL, 'i'},
+        {"linger-timeout", required_argument, NULL, 'l'},
+        {"hello-timeout", required_argument, NULL, 'H'},
+        {"heartbeat-interval", required_argument, NULL, 'k'},
+        {"heartbeat-timeout", required_argument, NULL, 'K'},
+        {"reconnect-max", required_argument, NULL, 'm'},
+        {"dns-ttl", required_argument, NULL, 'd'},
+        {"fast-open", no_argument, NULL, 'F'},
+        {"fail-fast-max", required_argument, NULL, 'f'},
+        {"preconnect", required_argument, NULL, 'P'},
+        {"preconnect-ttl", required_argument, NULL, 't'},
+        {"handoff", required_argument, NULL, 'O'},
+        {"takeover", required_argument, NULL, 'T'},
+        {"channel-emu", required_argument, NULL, 'E'},
+        {"capture", required_argument, NULL, 'W'},
+        {"capture-payload", no_argument, NULL, 'Y'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    struct pollfd fds[MAX_CONNECTIONS + MAX_VMS * CHANNEL_POLL_FDS + 1];
+    int pollSlot[MAX_CONNECTIONS + MAX_VMS * CHANNEL_POLL_FDS + 1];
+    uint32_t pollGen[MAX_CONNECTIONS + MAX_VMS * CHANNEL_POLL_FDS + 1]; // Stream the slot was polled for
+    int vmPoll[MAX_VMS];        // First poll entry of each VM's channel, -1 if none
+    int vmFd[MAX_VMS];          // Channel descriptor the entries were set up for
+    const char* channels[MAX_VMS];
+    int channelCount = 0;
+    const char* handoffPath = NULL;
+    const char* takeoverPath = NULL;
+    const char* capturePath = NULL;
+    bool capturePayload = false;
+    bool tookOver = false;
+    int handoffPoll;
+    uint64_t dnsTtlMs = DEFAULT_DNS_TTL * 1000ULL;
+    uint64_t preconnectTtlMs = DEFAULT_PRECONNECT_TTL * 1000ULL;
+    uint64_t failFastMaxMs = DEFAULT_FAIL_FAST_MAX * 1000ULL;
+    unsigned long preconnect = 0;
     int nfds;
     int i;
+    int v;
+    int opt;
     uint8_t buffer[BUFFER_SIZE + sizeof(VIRTIO_MSG_HEADER)];
     
-    // Initialize virtio connection
-    if (!InitializeVirtio()) {
-        return 1;
+    // Scheduler settings are collected in a template and copied to every
+    // VM. Control frames go first, and latency sensitive ports (SSH, DNS)
+    // are served ahead of ordinary streams.
+    MuxPoolInit(&g_egressPool, g_egressFrames, EGRESS_POOL_FRAMES);
+    MuxSchedInit(&g_schedTemplate, g_templateFlows, 1, &g_egressPool);
+    
+    while ((opt = getopt_long(argc, argv, "C:D:p:q:r:R:h", longOptions, NULL)) != -1) {
+        switch (opt) {
+            case 'C':
+                if (channelCount == MAX_VMS) {
+                    printf("At most %d channels are supported\n", MAX_VMS);
+                    return 1;
+                }
+                channels[channelCount++] = optarg;
+                break;
+            case 'D':
+                if (strlen(optarg) >= sizeof(g_channelDir)) {
+                    printf("Directory name %s is too long\n", optarg);
+                    return 1;
+                }
+                strcpy(g_channelDir, optarg);
+                break;
+            case 'p':
+                if (!MuxSchedAddPortRule(&g_schedTemplate, optarg)) {
+                    return 1;
+                }
+                break;
+            case 'q':
+                if (!MuxSchedSetQuantum(&g_schedTemplate, optarg)) {
+                    return 1;
+                }
+                break;
+            case 'r':
+            case 'R':
+            case 'b':
+            case 'B': {
+                uint64_t* target = opt == 'r' ? &g_rateConfig.streamRate :
+                                   opt == 'R' ? &g_rateConfig.destRate :
+                                   opt == 'b' ? &g_rateConfig.streamBurst : &g_rateConfig.destBurst;
+                if (!ParseByteCount(optarg, target)) {
+                    printf("Invalid byte count '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            }
+            case 'c':
+            case 'i':
+            case 'l':
+            case 'H':
+            case 'k':
+            case 'K':
+            case 'm':
+            case 'd':
+            case 't':
+            case 'f': {
+                uint64_t* target = opt == 'c' ? &g_timeouts.connectMs :
+                                   opt == 'i' ? &g_timeouts.idleMs :
+                                   opt == 'l' ? &g_timeouts.lingerMs :
+                                   opt == 'H' ? &g_channelConfig.helloTimeoutMs :
+                                   opt == 'k' ? &g_channelConfig.heartbeatIntervalMs :
+                                   opt == 'K' ? &g_channelConfig.heartbeatTimeoutMs :
+                                   opt == 'm' ? &g_channelConfig.reconnectMaxMs :
+                                   opt == 'd' ? &dnsTtlMs :
+                                   opt == 't' ? &preconnectTtlMs : &failFastMaxMs;
+                if (!ParseSeconds(optarg, target) ||
+                    (opt != 'i' && opt != 'k' && opt != 'd' && opt != 'f' && *target == 0)) {
+                    printf("Invalid timeout '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            }
+            case 'P': {
+                char* end;
+                
+                preconnect = strtoul(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || preconnect > CONN_POOL_MAX_SOCKETS) {
+                    printf("Invalid socket count '%s' (at most %d)\n", optarg, CONN_POOL_MAX_SOCKETS);
+                    return 1;
+                }
+                break;
+            }
+            case 'F':
+                g_fastOpen = true;
+                break;
+            case 'O':
+                handoffPath = optarg;
+                break;
+            case 'T':
+                takeoverPath = optarg;
+                break;
+            case 'E':
+                if (!ChannelEmuParse(&g_channelEmuConfig, optarg)) {
+                    return 1;
+                }
+                g_emulateChannel = true;
+                break;
+            case 'W':
+                capturePath = optarg;
+                break;
+            case 'Y':
+                capturePayload = true;
+                break;
+            case 'h':
+                PrintUsage(argv[0]);
+                return 0;
+            default:
+                PrintUsage(argv[0]);
+                return 1;
+        }
+    }
+    MuxSchedAddPortRule(&g_schedTemplate, "22=interactive");
+    MuxSchedAddPortRule(&g_schedTemplate, "53=interactive");
+    
+    if (g_rateConfig.streamRate != 0 && g_rateConfig.streamBurst == 0) {
+        g_rateConfig.streamBurst = DefaultBurst(g_rateConfig.streamRate);
+    }
+    if (g_rateConfig.destRate != 0 && g_rateConfig.destBurst == 0) {
+        g_rateConfig.destBurst = DefaultBurst(g_rateConfig.destRate);
+    }
+    if (g_rateConfig.streamRate != 0 || g_rateConfig.destRate != 0) {
+        printf("Rate limits: stream %llu B/s (burst %llu), destination %llu B/s (burst %llu)\n",
+               (unsigned long long)g_rateConfig.streamRate, (unsigned long long)g_rateConfig.streamBurst,
+               (unsigned long long)g_rateConfig.destRate, (unsigned long long)g_rateConfig.destBurst);
+    }
+    
+    // Writes to a device or FIFO whose reader went away must fail with
+    // EPIPE instead of killing the process
+    signal(SIGPIPE, SIG_IGN);
+    
+    TimerWheelInit(&g_timers, NowMillis());
+    DnsCacheInit(&g_dnsCache, dnsTtlMs);
+    ConnPoolInit(&g_connPool, (int)preconnect, preconnectTtlMs, g_timers.current);
+    if (preconnect != 0) {
+        TimerInit(&g_connPoolTimer, ConnPoolTimeout, NULL);
+        TimerSchedule(&g_timers, &g_connPoolTimer, CONN_POOL_INTERVAL_MS);
+    }
+    ConnectBreakerInit(&g_breaker, failFastMaxMs, g_timeouts.connectMs);
+    if (capturePath != NULL) {
+        if (!TraceWriterOpen(&g_trace, capturePath, capturePayload, NowMicros())) {
+            return 1;
+        }
+        printf("Capturing channel frames%s to %s\n", capturePayload ? " with payload" : "", capturePath);
+        TimerInit(&g_traceTimer, TraceFlushTimeout, NULL);
+        TimerSchedule(&g_timers, &g_traceTimer, TRACE_FLUSH_INTERVAL_MS);
+    }
+    if (g_channelConfig.reconnectMaxMs < RECONNECT_MIN_DELAY_MS) {
+        g_channelConfig.reconnectMaxMs = RECONNECT_MIN_DELAY_MS;
     }
     
-    // Initialize all connections
+    // Initialize the shared connection pool. This has to happen before the
+    // handshake: frames that arrive behind the HELLO_ACK may already open streams.
     for (i = 0; i < MAX_CONNECTIONS; i++) {
         g_connections[i].socket = -1;
         g_connections[i].inUse = false;
-        g_connections[i].connId = i;
+        g_connections[i].closing = false;
+        g_connections[i].pendingLen = 0;
+        g_connections[i].destLimit = -1;
+        g_connections[i].breaker = -1;
+        g_connections[i].throttled = false;
+        g_connections[i].data = &g_connectionData[i];
+        TimerInit(&g_connectionData[i].timer, ConnectionTimeout, &g_connections[i]);
+        TimerInit(&g_connectionData[i].rateTimer, RateLimitWake, &g_connections[i]);
+        g_freeConnections[i] = MAX_CONNECTIONS - 1 - i;
+    }
+    g_freeConnectionCount = MAX_CONNECTIONS;
+    
+    // A takeover brings the old process's channels and streams along.
+    // Once it has succeeded, the old process is gone and a missing
+    // --handoff socket is no reason to drop them.
+    if (takeoverPath != NULL) {
+        if (!TakeOver(takeoverPath)) {
+            return 1;
+        }
+        tookOver = true;
+    }
+    if (handoffPath != NULL) {
+        g_handoffListener = HandoffListen(handoffPath);
+        if (g_handoffListener < 0 && !tookOver) {
+            return 1;
+        }
+        if (g_handoffListener >= 0) {
+            printf("Accepting takeovers on %s\n", handoffPath);
+        }
+    }
+    
+    if (channelCount == 0 && g_channelDir[0] == '\0' && !tookOver) {
+        channels[channelCount++] = VIRTIO_DEVICE;
+    }
+    for (i = 0; i < channelCount; i++) {
+        VM_CONTEXT* vm;
+        
+        if (tookOver && FindVm(channels[i]) != NULL) {
+            continue;
+        }
+        vm = AddVm(channels[i], false);
+        if (vm == NULL) {
+            return 1;
+        }
+        
+        if (channelCount == 1 && g_channelDir[0] == '\0' && !tookOver) {
+            // A single guest: fail fast if it is not there
+            if (!InitializeVirtio(vm)) {
+                return 1;
+            }
+        } else {
+            // Many guests: none of them may hold up the others, so each one
+            // connects and shakes hands from the event loop
+            TimerSchedule(&g_timers, &vm->monitor.reconnectTimer, 0);
+        }
+    }
+    if (g_channelDir[0] != '\0') {
+        TimerInit(&g_scanTimer, ScanChannelDir, NULL);
+        ScanChannelDir(&g_scanTimer, NULL);
+    }
+    
+    printf("Host proxy started. Waiting for connections...\n");
+    
+    while (1) {
+        uint64_t now;
+        bool channelReady = false;
+        int timeout;
+        int ready;
+        
+        // Add the channels to poll. Stop reading while a frame is stalled
+        // on a slow upstream socket, and wait for POLLOUT while egress is queued.
+        // Shared-memory rings may already have data, so poll must not sleep.
+        nfds = 0;
+        timeout = (int)TimerWheelTimeout(&g_timers, NowMillis());
+        for (v = 0; v < MAX_VMS; v++) {
+            VM_CONTEXT* vm = &g_vms[v];
+            
+            vmPoll[v] = -1;
+            if (!vm->inUse || !TransportIsOpen(&vm->transport)) {
+                continue;
+            }
+            if (TransportPollSetup(&vm->transport, fds + nfds, !vm->ingress.stalled, EgressBacklog(vm) > 0)) {
+                channelReady = true;
+            }
+            timeout = ChannelPollTimeout(vm, timeout);
+            vmPoll[v] = nfds;
+            vmFd[v] = vm->transport.readFd;
+            for (i = 0; i < CHANNEL_POLL_FDS; i++) {
+                pollSlot[nfds++] = -1;
+            }
+        }
+        
+        handoffPoll = -1;
+        if (g_handoffListener != -1) {
+            fds[nfds].fd = g_handoffListener;
+            fds[nfds].events = POLLIN;
+            fds[nfds].revents = 0;
+            handoffPoll = nfds;
+            pollSlot[nfds++] = -1;
+        }
+        
+        // Add active connections to poll. Reads are paused while the VM's
+        // channel or the stream's own queue is saturated, while the stream is
+        // throttled and after upstream EOF; sockets with pending guest data
+        // or a connect in progress wait for POLLOUT.
+        for (i = 0; i < MAX_CONNECTIONS; i++) {
+            CONNECTION_INFO* conn = &g_connections[i];
+            
+            if (conn->inUse && !conn->closing && conn->socket != -1) {
+                bool canRead = !conn->vm->egress.paused && !conn->throttled &&
+                               !conn->connecting && !conn->upstreamEof &&
+                               conn->vm->flows[conn->connId].queuedBytes < EGRESS_STREAM_LIMIT;
+                short events = (canRead ? POLLIN : 0) |
+                               (conn->pendingLen > 0 || conn->connecting ? POLLOUT : 0);
+                if (events == 0) {
+                    continue;
+                }
+                fds[nfds].fd = conn->socket;
+                fds[nfds].events = events;
+                fds[nfds].revents = 0;
+                pollSlot[nfds] = i;
+                pollGen[nfds] = conn->generation;
+                nfds++;
+            }
+        }
+        
+        // Wait for events, or until the next timer is due
+        ready = poll(fds, nfds, channelReady ? 0 : timeout);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll error");
+            break;
+        }
+        
+        // Timeouts, throttle wakeups, idle checks, heartbeats, reconnects and
+        // directory scans. Channels they lost, reopened or removed have stale
+        // poll results.
+        TimerWheelAdvance(&g_timers, NowMillis());
+        if (ready == 0 && !channelReady) {
+            continue;
+        }
+        
+        for (v = 0; v < MAX_VMS; v++) {
+            if (vmPoll[v] != -1 && g_vms[v].inUse && g_vms[v].transport.readFd == vmFd[v]) {
+                ServiceChannel(&g_vms[v], fds + vmPoll[v]);
+            }
+        }
+        
+        // Check connections for data
+        for (int p = 0; p < nfds; p++) {
+            CONNECTION_INFO* conn;
+            VM_CONTEXT* vm;
+            
+            i = pollSlot[p];
+            if (i < 0) {
+                continue;
+            }
+            conn = &g_connections[i];
+            vm = conn->vm;
+            if (!conn->inUse || conn->closing || fds[p].revents == 0) {
+                continue;
+            }
+            
+            // The guest closed the stream and opened another in the same slot
+            // while servicing its channel; the result belongs to the old socket
+            if (conn->generation != pollGen[p]) {
+                continue;
+            }
+            
+            // A non-blocking connect has finished, one way or the other
+            if (conn->connecting) {
+                if (!CompleteConnect(conn)) {
+                    CloseConnection(conn);
+                }
+                continue;
+            }
+            
+            // Deliver guest data that the socket could not take earlier
+            if (fds[p].revents & POLLOUT) {
+                if (!FlushUpstream(conn)) {
+                    printf("[%s] Send failed for connection %d\n", vm->name, conn->connId);
+                    CloseConnection(conn);
+                    continue;
+                }
+                if (conn->pendingLen == 0 && vm->ingress.stalledSlot == conn->connId) {
+                    vm->ingress.stalled = false;
+                    vm->ingress.stalledSlot = -1;
+                    vm->ingress.resume = true;
+                }
+                UpdateHalfClose(conn);
+                if (!conn->inUse || conn->closing) {
+                    continue;
+                }
+            }
+            
+            // The channel or the shared pool may have filled up while
+            // handling earlier slots
+            if (vm->egress.paused || vm->flows[conn->connId].queuedBytes >= EGRESS_STREAM_LIMIT ||
+                g_egressPool.freeCount <= EGRESS_CONTROL_RESERVE ||
+                conn->upstreamEof || !(fds[p].revents & (POLLIN | POLLERR | POLLHUP))) {
+                continue;
+            }
+            
+            // Read no more than the stream's rate limits allow; a timer wakes
+            // the stream once its buckets hold a chunk again
+            now = NowMicros();
+            if (!RateLimitReady(conn, now)) {
+                conn->throttled = true;
+                TimerSchedule(&g_timers, &conn->data->rateTimer, (RateLimitDelay(conn) + 999) / 1000);
+                continue;
+            }
+            
+            ssize_t bytesRead = recv(conn->socket, 
+                                   buffer + sizeof(VIRTIO_MSG_HEADER), 
+                                   RateLimitAllowance(conn, now), 0);
+            if (bytesRead > 0) {
+                RateLimitConsume(conn, bytesRead);
+                conn->lastActivity = g_timers.current;
+                
+                // Forward data to virtio
+                if (!SendToVirtio(vm, conn->connId, buffer + sizeof(VIRTIO_MSG_HEADER), bytesRead)) {
+                    printf("[%s] Failed to send data to virtio for connection %d\n", vm->name, conn->connId);
+                    CloseConnection(conn);
+                }
+            } else if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                continue;
+            } else if (bytesRead == 0) {
+                // Upstream finished sending; the guest may still have more to say
+                HandleUpstreamEof(conn);
+            } else {
+                printf("[%s] Receive failed for connection %d: %s\n", vm->name, conn->connId, strerror(errno));
+                CloseConnection(conn);
+            }
+        }
+        
+        for (v = 0; v < MAX_VMS; v++) {
+            VM_CONTEXT* vm = &g_vms[v];
+            
+            if (!vm->inUse || !TransportIsOpen(&vm->transport)) {
+                continue;
+            }
+            
+            // Frames held back by a slow or closed upstream socket can proceed
+            if (vm->ingress.resume) {
+                vm->ingress.resume = false;
+                if (!ProcessVirtioIngress(vm)) {
+                    ChannelLost(vm);
+                    continue;
+                }
+            }
+            
+            // Other VMs may have returned frames to the shared pool
+            if (vm->egress.paused) {
+                UpdateEgressPause(vm);
+            }
+        }
+        
+        // A new process wants to take over; only returns if it did not
+        if (handoffPoll != -1 && (fds[handoffPoll].revents & POLLIN)) {
+            HandOver();
+        }
+    }
+    
+    CleanupVirtio();
+    ConnPoolClose(&g_connPool);
+    TraceWriterClose(&g_trace);
+    return 0;
+}
+
+// Derives a log name for a VM from the last component of its channel path
+static void VmNameFromSpec(char* name, size_t size, const char* spec) {
+    const char* base = strrchr(spec, '/');
+    
+    snprintf(name, size, "%s", base != NULL && base[1] != '\0' ? base + 1 : spec);
+}
+
+VM_CONTEXT* AddVm(const char* spec, bool discovered) {
+    VM_CONTEXT* vm = NULL;
+    int v;
+    int i;
+    
+    for (v = 0; v < MAX_VMS; v++) {
+        if (!g_vms[v].inUse) {
+            vm = &g_vms[v];
+            break;
+        }
+    }
+    if (vm == NULL) {
+        printf("Cannot add channel %s: already serving %d VMs\n", spec, MAX_VMS);
+        return NULL;
+    }
+    
+    memset(vm, 0, sizeof(*vm));
+    if (!TransportParse(&vm->transport, spec)) {
+        return NULL;
+    }
+    if (g_emulateChannel) {
+        TransportEmulate(&vm->transport, &g_channelEmus[vm - g_vms], &g_channelEmuConfig);
+    }
+    
+    vm->inUse = true;
+    vm->discovered = discovered;
+    vm->seen = true;
+    VmNameFromSpec(vm->name, sizeof(vm->name), vm->transport.address);
+    vm->ingress.stalledSlot = -1;
+    for (i = 0; i < MAX_STREAMS; i++) {
+        vm->streams[i] = -1;
+    }
+    
+    MuxSchedInit(&vm->sched, vm->flows, MAX_STREAMS + 1, &g_egressPool);
+    MuxSchedCopyConfig(&vm->sched, &g_schedTemplate);
+    MuxSchedSetPriority(&vm->sched, CONTROL_FLOW, MUX_PRIO_CONTROL);
+    
+    vm->monitor.reconnectDelayMs = RECONNECT_MIN_DELAY_MS;
+    TimerInit(&vm->monitor.heartbeatTimer, HeartbeatTimeout, vm);
+    TimerInit(&vm->monitor.reconnectTimer, ReconnectTimeout, vm);
+    
+    printf("[%s] Added VM on channel %s (%s)\n", vm->name, vm->transport.address, TransportName(&vm->transport));
+    return vm;
+}
+
+// VM served on the channel a spec names, NULL if none
+VM_CONTEXT* FindVm(const char* spec) {
+    TRANSPORT transport;
+    int v;
+    
+    if (!TransportParse(&transport, spec)) {
+        return NULL;
+    }
+    for (v = 0; v < MAX_VMS; v++) {
+        if (g_vms[v].inUse && strcmp(g_vms[v].transport.address, transport.address) == 0) {
+            return &g_vms[v];
+        }
+    }
+    return NULL;
+}
+
+// Drops a VM for good, without telling a guest that is most likely gone
+void RemoveVm(VM_CONTEXT* vm) {
+    printf("[%s] Removing VM\n", vm->name);
+    
+    TransportClose(&vm->transport);
+    DropChannelState(vm);
+    TimerCancel(&g_timers, &vm->monitor.reconnectTimer);
+    vm->inUse = false;
+}
+
+// Adds a VM for every socket or device that appeared in --channel-dir and
+// removes the ones whose node is gone
+void ScanChannelDir(TIMER* timer, void* context) {
+    DIR* dir;
+    struct dirent* entry;
+    int v;
+    
+    (void)context;
+    
+    for (v = 0; v < MAX_VMS; v++) {
+        g_vms[v].seen = false;
     }
     
-    printf("Host proxy started. Waiting for connections...\n");
+    dir = opendir(g_channelDir);
+    if (dir == NULL) {
+        printf("Cannot read channel directory %s: %s\n", g_channelDir, strerror(errno));
+    } else {
+        while ((entry = readdir(dir)) != NULL) {
+            char path[TRANSPORT_ADDRESS_MAX];
+            struct stat statbuf;
+            bool known = false;
+            VM_CONTEXT* vm;
+            
+            if (entry->d_name[0] == '.' ||
+                snprintf(path, sizeof(path), "%s/%s", g_channelDir, entry->d_name) >= (int)sizeof(path) ||
+                stat(path, &statbuf) == -1 || !(S_ISSOCK(statbuf.st_mode) || S_ISCHR(statbuf.st_mode))) {
+                continue;
+            }
+            
+            for (v = 0; v < MAX_VMS; v++) {
+                if (g_vms[v].inUse && strcmp(g_vms[v].transport.address, path) == 0) {
+                    g_vms[v].seen = true;
+                    known = true;
+                    break;
+                }
+            }
+            
+            if (!known && (vm = AddVm(path, true)) != NULL) {
+                TimerSchedule(&g_timers, &vm->monitor.reconnectTimer, 0);
+            }
+        }
+        closedir(dir);
+    }
+    
+    for (v = 0; v < MAX_VMS; v++) {
+        if (g_vms[v].inUse && g_vms[v].discovered && !g_vms[v].seen) {
+            RemoveVm(&g_vms[v]);
+        }
+    }
+    
+    TimerSchedule(&g_timers, timer, CHANNEL_SCAN_INTERVAL_MS);
+}
+
+// Writes out the capture, so a trace taken up to a crash is still useful
+void TraceFlushTimeout(TIMER* timer, void* context) {
+    (void)context;
+    
+    TraceWriterFlush(&g_trace);
+    TimerSchedule(&g_timers, timer, TRACE_FLUSH_INTERVAL_MS);
+}
+
+// Ages the pre-connected socket pool and tops up the busy destinations
+void ConnPoolTimeout(TIMER* timer, void* context) {
+    (void)context;
+    
+    ConnPoolMaintain(&g_connPool, g_timers.current);
+    TimerSchedule(&g_timers, timer, CONN_POOL_INTERVAL_MS);
+}
+
+// Handles poll results for one VM's channel
+void ServiceChannel(VM_CONTEXT* vm, const struct pollfd* fds) {
+    short channelEvents = TransportPollEvents(&vm->transport, fds);
+    
+    // Drain queued egress first so upstream reads can resume
+    if (channelEvents & (POLLOUT | POLLERR | POLLHUP)) {
+        if (!FlushVirtio(vm)) {
+            ChannelLost(vm);
+            return;
+        }
+    }
+    
+    // Check the channel for data
+    if (channelEvents & (POLLIN | POLLHUP)) {
+        ssize_t bytesRead = TransportRead(&vm->transport, vm->ingress.data + vm->ingress.used,
+                                          sizeof(vm->ingress.data) - vm->ingress.used);
+        if (bytesRead > 0) {
+            printf("[%s] Received %zd bytes from virtio device\n", vm->name, bytesRead);
+            vm->ingress.used += bytesRead;
+            vm->monitor.lastReceiveMs = g_timers.current;
+            if (!ProcessVirtioIngress(vm)) {
+                ChannelLost(vm);
+            }
+        } else if (bytesRead < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                printf("[%s] Error reading from virtio: %s\n", vm->name, strerror(errno));
+                ChannelLost(vm);
+            }
+        } else {
+            // Keep the process and its upstream state; only the channel restarts
+            printf("[%s] Virtio connection closed\n", vm->name);
+            ChannelLost(vm);
+        }
+    }
+}
+
+bool InitializeVirtio(VM_CONTEXT* vm) {
+    if (!OpenVirtio(vm)) {
+        return false;
+    }
+    
+    // Agree on protocol parameters before any stream traffic
+    if (!ExchangeHello(vm)) {
+        TransportClose(&vm->transport);
+        return false;
+    }
+    
+    printf("[%s] VirtIO channel setup complete and ready for connections\n", vm->name);
+    return true;
+}
+
+bool OpenVirtio(VM_CONTEXT* vm) {
+    printf("[%s] Attempting to open virtio channel %s (%s)\n", vm->name, vm->transport.address,
+           TransportName(&vm->transport));
+    
+    if (!TransportOpen(&vm->transport)) {
+        return false;
+    }
+    
+    printf("[%s] Channel open over %s, fd=%d\n", vm->name, TransportName(&vm->transport), vm->transport.readFd);
+    return true;
+}
+
+// Forgets the streams, queues and heartbeat of a channel that went away
+void DropChannelState(VM_CONTEXT* vm) {
+    MUX_FRAME* frame;
+    
+    vm->channel.ready = false;
+    
+    // Streams cannot survive: the guest starts over after a new HELLO
+    ResetStreams(vm);
+    MuxSchedDropFlow(&vm->sched, CONTROL_FLOW);
+    while ((frame = vm->egress.head) != NULL) {
+        vm->egress.head = frame->next;
+        MuxPoolFree(&g_egressPool, frame);
+    }
+    vm->egress.tail = NULL;
+    vm->egress.offset = 0;
+    vm->egress.bytes = 0;
+    vm->egress.paused = false;
+    vm->ingress.used = 0;
+    vm->ingress.resume = false;
+    
+    TimerCancel(&g_timers, &vm->monitor.heartbeatTimer);
+}
+
+// The channel is gone: drop everything tied to it and start reconnecting.
+// Upstream state that does not depend on the guest (rate limit buckets,
+// caches) is kept.
+void ChannelLost(VM_CONTEXT* vm) {
+    printf("[%s] %s, reconnecting in %llu ms\n", vm->name,
+           TransportIsOpen(&vm->transport) ? "Virtio channel lost" : "Reconnect failed",
+           (unsigned long long)vm->monitor.reconnectDelayMs);
+    
+    TransportClose(&vm->transport);
+    DropChannelState(vm);
+    
+    TimerSchedule(&g_timers, &vm->monitor.reconnectTimer, vm->monitor.reconnectDelayMs);
+    vm->monitor.reconnectDelayMs *= 2;
+    if (vm->monitor.reconnectDelayMs > g_channelConfig.reconnectMaxMs) {
+        vm->monitor.reconnectDelayMs = g_channelConfig.reconnectMaxMs;
+    }
+}
+
+// Connect (or reconnect) attempt, or the end of the HELLO wait that followed one
+void ReconnectTimeout(TIMER* timer, void* context) {
+    VM_CONTEXT* vm = (VM_CONTEXT*)context;
+    
+    (void)timer;
+    
+    if (TransportIsOpen(&vm->transport)) {
+        printf("[%s] No HELLO-ACK from the guest within %llu ms\n", vm->name,
+               (unsigned long long)g_channelConfig.helloTimeoutMs);
+        ChannelLost(vm);
+        return;
+    }
+    
+    vm->monitor.reconnects++;
+    if (!OpenVirtio(vm)) {
+        ChannelLost(vm);
+        return;
+    }
+    
+    // The main loop completes the handshake; give up if it takes too long
+    printf("[%s] Connected (attempt %u), sending HELLO\n", vm->name, vm->monitor.reconnects);
+    TimerSchedule(&g_timers, &vm->monitor.reconnectTimer, g_channelConfig.helloTimeoutMs);
+    if (!SendHello(vm, MUX_CTRL_HELLO)) {
+        ChannelLost(vm);
+    }
+}
+
+// Sends a PING and checks that the guest has been heard from recently
+void HeartbeatTimeout(TIMER* timer, void* context) {
+    VM_CONTEXT* vm = (VM_CONTEXT*)context;
+    MUX_HEARTBEAT msg;
+    
+    (void)timer;
+    
+    if (!vm->channel.ready || !(vm->channel.capabilities & MUX_CAP_HEARTBEAT)) {
+        return;
+    }
+    
+    if (g_timers.current - vm->monitor.lastReceiveMs >= g_channelConfig.heartbeatTimeoutMs) {
+        printf("[%s] Nothing from the guest for %llu ms, assuming it is gone\n", vm->name,
+               (unsigned long long)(g_timers.current - vm->monitor.lastReceiveMs));
+        ChannelLost(vm);
+        return;
+    }
+    
+    msg.type = MUX_CTRL_PING;
+    msg.seq = ++vm->monitor.pingSeq;
+    msg.timestamp = NowMicros();
+    if (MuxSchedEnqueue(&vm->sched, CONTROL_FLOW, MUX_CONTROL_CONNID, (const uint8_t*)&msg, sizeof(msg))) {
+        FlushVirtio(vm);
+    }
+    
+    TimerSchedule(&g_timers, &vm->monitor.heartbeatTimer, g_channelConfig.heartbeatIntervalMs);
+}
+
+// Folds a PONG into the RTT estimate (smoothed like TCP's SRTT, gain 1/8)
+void HandlePong(VM_CONTEXT* vm, const MUX_HEARTBEAT* msg) {
+    CHANNEL_MONITOR* monitor = &vm->monitor;
+    uint64_t now = NowMicros();
+    uint64_t rtt;
+    
+    if (msg->timestamp > now) {
+        return;
+    }
+    
+    rtt = now - msg->timestamp;
+    if (monitor->srttUs == 0) {
+        monitor->srttUs = rtt;
+    } else {
+        monitor->srttUs = (monitor->srttUs * 7 + rtt) / 8;
+    }
+    if (monitor->minRttUs == 0 || rtt < monitor->minRttUs) {
+        monitor->minRttUs = rtt;
+    }
+    
+    printf("[%s] Heartbeat %u: RTT %.2f ms (smoothed %.2f ms, min %.2f ms)\n", vm->name, msg->seq,
+           rtt / 1000.0, monitor->srttUs / 1000.0, monitor->minRttUs / 1000.0);
+}
+
+bool SendHello(VM_CONTEXT* vm, uint8_t type) {
+    MUX_HELLO msg;
+    
+    msg.type = type;
+    msg.version = MUX_PROTOCOL_VERSION;
+    msg.maxPayload = BUFFER_SIZE;
+    msg.capabilities = MUX_CAPABILITIES;
+    
+    if (!MuxSchedEnqueue(&vm->sched, CONTROL_FLOW, MUX_CONTROL_CONNID, (const uint8_t*)&msg, sizeof(msg))) {
+        printf("[%s] Virtio egress queue full, dropping HELLO\n", vm->name);
+        return false;
+    }
+    
+    return FlushVirtio(vm);
+}
+
+// Sends HELLO and waits for the guest's answer. A HELLO from a guest that
+// started after us completes the exchange as well.
+bool ExchangeHello(VM_CONTEXT* vm) {
+    uint64_t deadline = NowMillis() + g_channelConfig.helloTimeoutMs;
+    
+    vm->channel.ready = false;
+    printf("[%s] Sending HELLO (protocol %d, max payload %d, capabilities 0x%08X)\n", vm->name,
+           MUX_PROTOCOL_VERSION, BUFFER_SIZE, MUX_CAPABILITIES);
+    if (!SendHello(vm, MUX_CTRL_HELLO)) {
+        return false;
+    }
+    
+    while (!vm->channel.ready) {
+        struct pollfd pfd[CHANNEL_POLL_FDS];
+        short events;
+        uint64_t now = NowMillis();
+        ssize_t bytesRead;
+        bool channelReady;
+        int ready;
+        
+        if (now >= deadline) {
+            printf("Error: no HELLO-ACK from the guest within %llu ms. Is the SOCKS server running?\n",
+                   (unsigned long long)g_channelConfig.helloTimeoutMs);
+            return false;
+        }
+        
+        channelReady = TransportPollSetup(&vm->transport, pfd, true, EgressBacklog(vm) > 0);
+        ready = poll(pfd, CHANNEL_POLL_FDS, channelReady ? 0 : ChannelPollTimeout(vm, (int)(deadline - now)));
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll error during handshake");
+            return false;
+        }
+        if (ready == 0 && !channelReady) {
+            continue;
+        }
+        
+        events = TransportPollEvents(&vm->transport, pfd);
+        if ((events & POLLOUT) && !FlushVirtio(vm)) {
+            return false;
+        }
+        if (!(events & (POLLIN | POLLERR | POLLHUP))) {
+            continue;
+        }
+        
+        bytesRead = TransportRead(&vm->transport, vm->ingress.data + vm->ingress.used,
+                                  sizeof(vm->ingress.data) - vm->ingress.used);
+        if (bytesRead == 0) {
+            printf("Error: virtio channel closed during handshake\n");
+            return false;
+        }
+        if (bytesRead < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                continue;
+            }
+            perror("Error reading from virtio during handshake");
+            return false;
+        }
+        
+        vm->ingress.used += bytesRead;
+        if (!ProcessVirtioIngress(vm)) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+// Applies the peer's HELLO parameters; false if the channel cannot be used
+bool NegotiateChannel(VM_CONTEXT* vm, const MUX_HELLO* peer) {
+    MUX_CHANNEL* channel = &vm->channel;
+    
+    if (peer->version != MUX_PROTOCOL_VERSION) {
+        printf("[%s] Error: guest speaks protocol version %u, this proxy speaks %d\n", vm->name,
+               peer->version, MUX_PROTOCOL_VERSION);
+        return false;
+    }
+    if (peer->maxPayload < MUX_MIN_PAYLOAD) {
+        printf("[%s] Error: guest frame payload limit %u is below the minimum of %d\n", vm->name,
+               peer->maxPayload, MUX_MIN_PAYLOAD);
+        return false;
+    }
+    
+    channel->version = peer->version;
+    channel->maxPayload = peer->maxPayload < BUFFER_SIZE ? peer->maxPayload : BUFFER_SIZE;
+    channel->capabilities = peer->capabilities & MUX_CAPABILITIES;
+    channel->ready = true;
+    printf("[%s] Channel ready: protocol %u, max payload %u, capabilities 0x%08X\n", vm->name,
+           channel->version, channel->maxPayload, channel->capabilities);
+    
+    // Healthy again: reset the backoff and start watching the guest
+    TimerCancel(&g_timers, &vm->monitor.reconnectTimer);
+    vm->monitor.reconnectDelayMs = RECONNECT_MIN_DELAY_MS;
+    vm->monitor.lastReceiveMs = g_timers.current;
+    if (g_channelConfig.heartbeatIntervalMs != 0 && (channel->capabilities & MUX_CAP_HEARTBEAT)) {
+        TimerSchedule(&g_timers, &vm->monitor.heartbeatTimer, g_channelConfig.heartbeatIntervalMs);
+    }
+    return true;
+}
+
+// Forgets every stream of the VM without CLOSE frames; the guest has started over
+void ResetStreams(VM_CONTEXT* vm) {
+    for (int id = 0; id < MAX_STREAMS; id++) {
+        CONNECTION_INFO* conn = FindStream(vm, id);
+        
+        if (conn == NULL) {
+            continue;
+        }
+        if (conn->socket != -1) {
+            close(conn->socket);
+            conn->socket = -1;
+        }
+        conn->pendingLen = 0;
+        conn->connecting = false;
+        conn->upstreamEof = false;
+        conn->guestEof = false;
+        ReportConnect(conn, CONNECT_ABANDONED);
+        RateLimitClose(conn);
+        TimerCancel(&g_timers, &conn->data->timer);
+        TimerCancel(&g_timers, &conn->data->rateTimer);
+        MuxSchedDropFlow(&vm->sched, conn->connId);
+        ReleaseConnection(conn);
+    }
+    
+    vm->ingress.stalled = false;
+    vm->ingress.stalledSlot = -1;
+}
+
+void CleanupVirtio(void) {
+    // Close all connections and channels
+    for (int v = 0; v < MAX_VMS; v++) {
+        if (g_vms[v].inUse) {
+            ResetStreams(&g_vms[v]);
+            TransportClose(&g_vms[v].transport);
+        }
+    }
+}
+
+static void CloseDescriptors(const int* fds, int count) {
+    for (int i = 0; i < count; i++) {
+        close(fds[i]);
+    }
+}
+
+// Serves --handoff: gives every channel and stream to the process that
+// connected and exits once it has them. Returns if the takeover failed, with
+// this process still in charge.
+void HandOver(void) {
+    HANDOFF_RECORD ack;
+    int fds[HANDOFF_MAX_FDS];
+    int fdCount;
+    int sock = HandoffAccept(g_handoffListener, HANDOFF_TIMEOUT_MS);
+    
+    if (sock < 0) {
+        return;
+    }
+    
+    // Queued frames are the one thing that cannot be handed over halfway
+    printf("Takeover requested, writing out queued virtio egress\n");
+    if (!DrainEgress()) {
+        printf("Virtio egress did not drain within %d ms, refusing the takeover\n", HANDOFF_DRAIN_MS);
+        close(sock);
+        return;
+    }
+    
+    if (SendHandoffState(sock) && HandoffReceive(sock, &ack, fds, &fdCount) >= (ssize_t)sizeof(ack.type)) {
+        CloseDescriptors(fds, fdCount);
+        if (ack.type == HANDOFF_ACK) {
+            // The new process holds its own references to every descriptor,
+            // so exiting closes nothing the guests or upstream hosts can see
+            printf("Handed over to the new process, exiting\n");
+            exit(0);
+        }
+    }
+    
+    printf("Takeover failed, carrying on\n");
+    close(sock);
+}
+
+// Writes out every VM's queued egress; false if a channel could not take it
+// all within HANDOFF_DRAIN_MS. Channels are not read meanwhile, so guest
+// frames wait in the transport for whichever process reads next.
+bool DrainEgress(void) {
+    uint64_t deadline = NowMillis() + HANDOFF_DRAIN_MS;
+    
+    while (1) {
+        struct pollfd pfd[MAX_VMS * CHANNEL_POLL_FDS];
+        int draining[MAX_VMS];
+        int count = 0;
+        int timeout = -1;
+        bool channelReady = false;
+        uint64_t now;
+        int v;
+        
+        for (v = 0; v < MAX_VMS; v++) {
+            VM_CONTEXT* vm = &g_vms[v];
+            
+            if (!vm->inUse || !TransportIsOpen(&vm->transport) || EgressBacklog(vm) == 0) {
+                continue;
+            }
+            if (TransportPollSetup(&vm->transport, pfd + count * CHANNEL_POLL_FDS, false, true)) {
+                channelReady = true;
+            }
+            timeout = ChannelPollTimeout(vm, timeout);
+            draining[count++] = v;
+        }
+        
+        if (count == 0) {
+            return true;
+        }
+        now = NowMillis();
+        if (now >= deadline) {
+            return false;
+        }
+        
+        if (timeout < 0 || timeout > (int)(deadline - now)) {
+            timeout = (int)(deadline - now);
+        }
+        if (poll(pfd, count * CHANNEL_POLL_FDS, channelReady ? 0 : timeout) < 0 && errno != EINTR) {
+            perror("poll error while draining");
+            return false;
+        }
+        
+        for (int k = 0; k < count; k++) {
+            VM_CONTEXT* vm = &g_vms[draining[k]];
+            short events = TransportPollEvents(&vm->transport, pfd + k * CHANNEL_POLL_FDS);
+            
+            if ((events & (POLLOUT | POLLERR | POLLHUP)) && !FlushVirtio(vm)) {
+                ChannelLost(vm);
+            }
+        }
+    }
+}
+
+// Sends the handoff records for every VM and stream; see handoff.h
+bool SendHandoffState(int sock) {
+    static HANDOFF_RECORD record;
+    int fds[HANDOFF_MAX_FDS];
+    uint32_t vmCount = 0;
+    uint32_t streamCount = 0;
+    uint16_t sent = 0;
+    int v;
+    int id;
+    
+    for (v = 0; v < MAX_VMS; v++) {
+        if (!g_vms[v].inUse) {
+            continue;
+        }
+        vmCount++;
+        for (id = 0; id < MAX_STREAMS; id++) {
+            if (FindStream(&g_vms[v], id) != NULL) {
+                streamCount++;
+            }
+        }
+    }
+    
+    memset(&record.begin, 0, sizeof(record.begin));
+    record.begin.type = HANDOFF_BEGIN;
+    record.begin.magic = HANDOFF_MAGIC;
+    record.begin.version = HANDOFF_VERSION;
+    record.begin.vmCount = vmCount;
+    record.begin.streamCount = streamCount;
+    if (!HandoffSend(sock, &record, sizeof(record.begin), NULL, 0)) {
+        return false;
+    }
+    
+    for (v = 0; v < MAX_VMS; v++) {
+        VM_CONTEXT* vm = &g_vms[v];
+        HANDOFF_VM_RECORD* vmRecord = &record.vm;
+        
+        if (!vm->inUse) {
+            continue;
+        }
+        
+        memset(vmRecord, 0, offsetof(HANDOFF_VM_RECORD, ingress));
+        vmRecord->type = HANDOFF_VM;
+        vmRecord->discovered = vm->discovered;
+        vmRecord->open = TransportIsOpen(&vm->transport);
+        vmRecord->ready = vm->channel.ready;
+        vmRecord->version = vm->channel.version;
+        vmRecord->maxPayload = vm->channel.maxPayload;
+        vmRecord->capabilities = vm->channel.capabilities;
+        vmRecord->pingSeq = vm->monitor.pingSeq;
+        vmRecord->reconnects = vm->monitor.reconnects;
+        vmRecord->srttUs = vm->monitor.srttUs;
+        vmRecord->minRttUs = vm->monitor.minRttUs;
+        TransportSpec(&vm->transport, vmRecord->spec, sizeof(vmRecord->spec));
+        snprintf(vmRecord->backend, sizeof(vmRecord->backend), "%s", TransportName(&vm->transport));
+        vmRecord->ingressUsed = vm->ingress.used;
+        memcpy(vmRecord->ingress, vm->ingress.data, vm->ingress.used);
+        if (!HandoffSend(sock, vmRecord, offsetof(HANDOFF_VM_RECORD, ingress) + vm->ingress.used,
+                         fds, TransportExport(&vm->transport, fds))) {
+            return false;
+        }
+        
+        for (id = 0; id < MAX_STREAMS; id++) {
+            CONNECTION_INFO* conn = FindStream(vm, id);
+            HANDOFF_STREAM_RECORD* streamRecord = &record.stream;
+            
+            if (conn == NULL) {
+                continue;
+            }
+            
+            memset(streamRecord, 0, offsetof(HANDOFF_STREAM_RECORD, pending));
+            streamRecord->type = HANDOFF_STREAM;
+            streamRecord->vm = sent;
+            streamRecord->connId = conn->connId;
+            streamRecord->flags = (conn->closing ? HANDOFF_STREAM_CLOSING : 0) |
+                                  (conn->connecting ? HANDOFF_STREAM_CONNECTING : 0) |
+                                  (conn->upstreamEof ? HANDOFF_STREAM_UPSTREAM_EOF : 0) |
+                                  (conn->guestEof ? HANDOFF_STREAM_GUEST_EOF : 0) |
+                                  (conn->openPending ? HANDOFF_STREAM_OPEN_PENDING : 0);
+            streamRecord->priority = vm->flows[id].priority;
+            streamRecord->pendingLen = conn->pendingLen;
+            streamRecord->idleMs = g_timers.current - conn->lastActivity;
+            if (conn->destLimit >= 0) {
+                snprintf(streamRecord->host, sizeof(streamRecord->host), "%s", g_destLimits[conn->destLimit].host);
+            }
+            memcpy(streamRecord->pending, conn->data->pending, conn->pendingLen);
+            if (!HandoffSend(sock, streamRecord, offsetof(HANDOFF_STREAM_RECORD, pending) + conn->pendingLen,
+                             &conn->socket, conn->socket != -1 ? 1 : 0)) {
+                return false;
+            }
+        }
+        sent++;
+    }
+    
+    record.type = HANDOFF_END;
+    return HandoffSend(sock, &record, sizeof(record.type), NULL, 0);
+}
+
+// Serves --takeover: receives every channel and stream from the running
+// proxy. Nothing is read or written on them until the old process has sent
+// everything and been told to exit, so a failed takeover leaves it in charge.
+bool TakeOver(const char* path) {
+    static HANDOFF_RECORD record;
+    VM_CONTEXT* adopted[MAX_VMS];
+    int fds[HANDOFF_MAX_FDS];
+    int fdCount;
+    uint32_t vmCount = 0;
+    uint32_t streamCount = 0;
+    uint32_t expectedVms;
+    uint32_t expectedStreams;
+    bool complete = false;
+    ssize_t length;
+    int sock;
+    
+    printf("Taking over from the proxy at %s\n", path);
+    sock = HandoffConnect(path, HANDOFF_DRAIN_MS + HANDOFF_TIMEOUT_MS);
+    if (sock < 0) {
+        return false;
+    }
+    
+    length = HandoffReceive(sock, &record, fds, &fdCount);
+    CloseDescriptors(fds, fdCount);
+    if (length != (ssize_t)sizeof(record.begin) || record.type != HANDOFF_BEGIN ||
+        record.begin.magic != HANDOFF_MAGIC || record.begin.version != HANDOFF_VERSION) {
+        printf("The running proxy did not start a version %d handoff\n", HANDOFF_VERSION);
+        close(sock);
+        return false;
+    }
+    expectedVms = record.begin.vmCount;
+    expectedStreams = record.begin.streamCount;
+    
+    while ((length = HandoffReceive(sock, &record, fds, &fdCount)) > 0) {
+        if (record.type == HANDOFF_END) {
+            complete = vmCount == expectedVms && streamCount == expectedStreams;
+            break;
+        }
+        
+        if (record.type == HANDOFF_VM && vmCount < MAX_VMS &&
+            length >= (ssize_t)offsetof(HANDOFF_VM_RECORD, ingress) &&
+            record.vm.ingressUsed <= INGRESS_BUFFER_SIZE &&
+            (size_t)length == offsetof(HANDOFF_VM_RECORD, ingress) + record.vm.ingressUsed) {
+            adopted[vmCount] = AdoptVm(&record.vm, fds, fdCount);
+            if (adopted[vmCount] == NULL) {
+                break;
+            }
+            vmCount++;
+        } else if (record.type == HANDOFF_STREAM &&
+                   length >= (ssize_t)offsetof(HANDOFF_STREAM_RECORD, pending) &&
+                   record.stream.vm < vmCount && record.stream.pendingLen <= BUFFER_SIZE &&
+                   (size_t)length == offsetof(HANDOFF_STREAM_RECORD, pending) + record.stream.pendingLen) {
+            if (!AdoptStream(adopted[record.stream.vm], &record.stream, fds, fdCount)) {
+                break;
+            }
+            streamCount++;
+        } else {
+            printf("Unexpected handoff record (type %u, %zd bytes)\n", record.type, length);
+            CloseDescriptors(fds, fdCount);
+            break;
+        }
+    }
+    
+    record.type = HANDOFF_ACK;
+    if (!complete || !HandoffSend(sock, &record, sizeof(record.type), NULL, 0)) {
+        printf("Takeover failed after %u of %u VMs and %u of %u streams\n",
+               vmCount, expectedVms, streamCount, expectedStreams);
+        close(sock);
+        return false;
+    }
+    
+    close(sock);
+    printf("Took over %u VMs and %u streams\n", vmCount, streamCount);
+    return true;
+}
+
+// Rebuilds a VM from its handoff record and takes ownership of the channel
+// descriptors. Returns NULL if the VM cannot be set up.
+VM_CONTEXT* AdoptVm(const HANDOFF_VM_RECORD* record, const int* fds, int fdCount) {
+    char spec[TRANSPORT_SPEC_MAX];
+    char backend[HANDOFF_BACKEND_MAX];
+    VM_CONTEXT* vm;
+    
+    snprintf(spec, sizeof(spec), "%.*s", (int)sizeof(record->spec) - 1, record->spec);
+    snprintf(backend, sizeof(backend), "%.*s", (int)sizeof(record->backend) - 1, record->backend);
+    
+    vm = AddVm(spec, record->discovered);
+    if (vm == NULL) {
+        CloseDescriptors(fds, fdCount);
+        return NULL;
+    }
+    if (record->open) {
+        if (!TransportAdopt(&vm->transport, backend, fds, fdCount)) {
+            return NULL;
+        }
+    } else {
+        CloseDescriptors(fds, fdCount);
+    }
+    
+    vm->channel.ready = record->ready;
+    vm->channel.version = record->version;
+    vm->channel.maxPayload = record->maxPayload;
+    vm->channel.capabilities = record->capabilities;
+    vm->monitor.pingSeq = record->pingSeq;
+    vm->monitor.reconnects = record->reconnects;
+    vm->monitor.srttUs = record->srttUs;
+    vm->monitor.minRttUs = record->minRttUs;
+    vm->monitor.lastReceiveMs = g_timers.current;
+    
+    // Frames the old process had not processed yet, including one that was
+    // stalled on a slow upstream socket, are parsed again from the start
+    memcpy(vm->ingress.data, record->ingress, record->ingressUsed);
+    vm->ingress.used = record->ingressUsed;
+    vm->ingress.resume = vm->ingress.used > 0;
+    
+    if (!TransportIsOpen(&vm->transport)) {
+        TimerSchedule(&g_timers, &vm->monitor.reconnectTimer, 0);
+    } else if (!vm->channel.ready) {
+        // The HELLO exchange was under way; its answer arrives here
+        TimerSchedule(&g_timers, &vm->monitor.reconnectTimer, g_channelConfig.helloTimeoutMs);
+    } else if (g_channelConfig.heartbeatIntervalMs != 0 && (vm->channel.capabilities & MUX_CAP_HEARTBEAT)) {
+        TimerSchedule(&g_timers, &vm->monitor.heartbeatTimer, g_channelConfig.heartbeatIntervalMs);
+    }
+    
+    printf("[%s] Took over %s channel (%s, %u bytes of ingress)\n", vm->name, TransportName(&vm->transport),
+           vm->channel.ready ? "ready" : TransportIsOpen(&vm->transport) ? "handshaking" : "reconnecting",
+           record->ingressUsed);
+    return vm;
+}
+
+// Rebuilds a stream from its handoff record and takes ownership of its
+// upstream socket. Rate limit buckets start out full.
+bool AdoptStream(VM_CONTEXT* vm, const HANDOFF_STREAM_RECORD* record, const int* fds, int fdCount) {
+    char host[HANDOFF_HOST_MAX];
+    CONNECTION_INFO* conn = NULL;
+    
+    if (record->connId < MAX_STREAMS && FindStream(vm, record->connId) == NULL &&
+        fdCount == ((record->flags & HANDOFF_STREAM_CLOSING) ? 0 : 1)) {
+        conn = AllocConnection(vm, record->connId);
+    }
+    if (conn == NULL) {
+        printf("[%s] Cannot take over stream %u\n", vm->name, record->connId);
+        CloseDescriptors(fds, fdCount);
+        return false;
+    }
+    
+    conn->socket = fdCount > 0 ? fds[0] : -1;
+    conn->closing = (record->flags & HANDOFF_STREAM_CLOSING) != 0;
+    conn->connecting = (record->flags & HANDOFF_STREAM_CONNECTING) != 0;
+    conn->upstreamEof = (record->flags & HANDOFF_STREAM_UPSTREAM_EOF) != 0;
+    conn->guestEof = (record->flags & HANDOFF_STREAM_GUEST_EOF) != 0;
+    conn->openPending = (record->flags & HANDOFF_STREAM_OPEN_PENDING) != 0;
+    conn->pendingLen = record->pendingLen;
+    memcpy(conn->data->pending, record->pending, record->pendingLen);
+    conn->lastActivity = record->idleMs < g_timers.current ? g_timers.current - record->idleMs : 0;
+    MuxSchedSetPriority(&vm->sched, conn->connId, record->priority);
+    if (!conn->closing) {
+        snprintf(host, sizeof(host), "%.*s", (int)sizeof(record->host) - 1, record->host);
+        RateLimitOpen(conn, host);
+    }
+    ArmConnectionTimer(conn);
+    return true;
+}
+
+// Connection slot of a stream, NULL if the VM has no such stream
+CONNECTION_INFO* FindStream(VM_CONTEXT* vm, uint16_t connId) {
+    if (connId >= MAX_STREAMS || vm->streams[connId] < 0) {
+        return NULL;
+    }
+    return &g_connections[vm->streams[connId]];
+}
+
+// Takes a slot from the shared pool for a new stream
+CONNECTION_INFO* AllocConnection(VM_CONTEXT* vm, uint16_t connId) {
+    CONNECTION_INFO* conn;
+    int slot;
+    
+    if (connId >= MAX_STREAMS || g_freeConnectionCount == 0) {
+        return NULL;
+    }
+    
+    slot = g_freeConnections[--g_freeConnectionCount];
+    conn = &g_connections[slot];
+    conn->socket = -1;
+    conn->inUse = true;
+    conn->generation++;
+    conn->closing = false;
+    conn->vm = vm;
+    conn->connId = connId;
+    conn->pendingLen = 0;
+    conn->connecting = false;
+    conn->connectDeferred = false;
+    conn->breaker = -1;
+    conn->openPending = true;
+    conn->connectError = 0;
+    conn->upstreamEof = false;
+    conn->guestEof = false;
+    conn->destLimit = -1;
+    conn->throttled = false;
+    vm->streams[connId] = (int16_t)slot;
+    return conn;
+}
+
+// Returns a finished stream's slot to the pool
+void ReleaseConnection(CONNECTION_INFO* conn) {
+    TimerCancel(&g_timers, &conn->data->timer);
+    conn->closing = false;
+    conn->inUse = false;
+    conn->vm->streams[conn->connId] = -1;
+    g_freeConnections[g_freeConnectionCount++] = (int)(conn - g_connections);
+}
+
+bool HandleConnectionRequest(CONNECTION_INFO* conn, uint8_t* data, uint16_t length) {
+    VM_CONTEXT* vm = conn->vm;
+    MUX_OPEN_REQUEST request;
+    const char* host = request.host;
+    uint16_t port;
+    DNS_ADDRESS address;
+    bool inProgress = false;
+    int sockfd;
+    
+    // Parse connection request
+    if (!MuxParseOpenRequest(data, length, &request, &conn->connectError)) {
+        if (conn->connectError == EAFNOSUPPORT) {
+            printf("[%s] Unsupported address type %d for connection %d\n", vm->name, request.atyp, conn->connId);
+        } else {
+            printf("[%s] Invalid connection request for connection %d\n", vm->name, conn->connId);
+        }
+        return false;
+    }
+    port = request.port;
+    
+    printf("[%s] Connection request: %s:%d (ID: %d)\n", vm->name, host, port, conn->connId);
+    
+    // Refuse at once while the destination keeps failing, instead of tying
+    // up the stream until the connect times out again
+    if (!ConnectBreakerAllow(&g_breaker, host, port, g_timers.current, &conn->breaker, &conn->connectError)) {
+        printf("[%s] %s:%d failed recently, refusing connection %d\n", vm->name, host, port, conn->connId);
+        return false;
+    }
+    
+    // A busy destination may have a socket connected already
+    sockfd = ConnPoolTake(&g_connPool, host, port, g_timers.current, &inProgress);
+    if (sockfd >= 0) {
+        ConnPoolRecord(&g_connPool, host, port, NULL, g_timers.current);
+        printf("[%s] Connection %d uses a pre-connected socket\n", vm->name, conn->connId);
+    } else {
+        // Resolve through the cache shared by all VMs
+        if (DnsCacheResolve(&g_dnsCache, host, port, g_timers.current, &address, 1) == 0) {
+            printf("[%s] Cannot resolve %s\n", vm->name, host);
+            conn->connectError = EHOSTUNREACH;
+            ReportConnect(conn, CONNECT_FAILED);
+            return false;
+        }
+        ConnPoolRecord(&g_connPool, host, port, &address, g_timers.current);
+        
+        sockfd = socket(address.family, address.socktype | SOCK_NONBLOCK, address.protocol);
+        if (sockfd < 0) {
+            perror("socket failed");
+            conn->connectError = errno;
+            ReportConnect(conn, CONNECT_ABANDONED);
+            return false;
+        }
+        
+        // Connect without blocking the loop; the poll loop finishes the
+        // handshake, and the connect timer gives up on unresponsive hosts.
+        // With Fast Open the connect waits for the rest of the ingress pass,
+        // so data the guest sent right behind the request can ride in the
+        // SYN (see StartDeferredConnects).
+        if (g_fastOpen && address.socktype == SOCK_STREAM) {
+            conn->connectDeferred = true;
+            conn->data->address = address;
+            inProgress = true;
+        } else if (connect(sockfd, (struct sockaddr*)&address.addr, address.addrLen) < 0) {
+            if (errno != EINPROGRESS) {
+                perror("connect failed");
+                conn->connectError = errno;
+                close(sockfd);
+                ReportConnect(conn, CONNECT_FAILED);
+                return false;
+            }
+            inProgress = true;
+        }
+    }
+    
+    // Store connection info
+    conn->socket = sockfd;
+    conn->connecting = inProgress;
+    conn->lastActivity = g_timers.current;
+    MuxSchedSetPriority(&vm->sched, conn->connId, MuxSchedPortPriority(&vm->sched, port));
+    RateLimitOpen(conn, host);
+    ArmConnectionTimer(conn);
+    
+    if (conn->connectDeferred) {
+        printf("[%s] Connection %d waiting for early data\n", vm->name, conn->connId);
+    } else if (inProgress) {
+        printf("[%s] Connection %d connecting\n", vm->name, conn->connId);
+    } else {
+        ReportConnect(conn, CONNECT_SUCCEEDED);
+        SendOpenResult(conn, MUX_CTRL_OPEN_ACK);
+        printf("[%s] Connection %d established\n", vm->name, conn->connId);
+    }
+    return true;
+}
+
+bool CompleteConnect(CONNECTION_INFO* conn) {
+    int error = 0;
+    socklen_t errorLen = sizeof(error);
+    
+    if (getsockopt(conn->socket, SOL_SOCKET, SO_ERROR, &error, &errorLen) < 0) {
+        error = errno;
+    }
+    if (error != 0) {
+        printf("[%s] Connect failed for connection %d: %s\n", conn->vm->name, conn->connId, strerror(error));
+        conn->connectError = error;
+        ReportConnect(conn, CONNECT_FAILED);
+        return false;
+    }
+    
+    conn->connecting = false;
+    ReportConnect(conn, CONNECT_SUCCEEDED);
+    SendOpenResult(conn, MUX_CTRL_OPEN_ACK);
+    ArmConnectionTimer(conn);
+    printf("[%s] Connection %d established\n", conn->vm->name, conn->connId);
+    
+    // Deliver whatever the guest sent while the connect was in flight
+    if (!FlushUpstream(conn)) {
+        printf("[%s] Send failed for connection %d\n", conn->vm->name, conn->connId);
+        return false;
+    }
+    if (conn->pendingLen == 0 && conn->vm->ingress.stalledSlot == conn->connId) {
+        conn->vm->ingress.stalled = false;
+        conn->vm->ingress.stalledSlot = -1;
+        conn->vm->ingress.resume = true;
+    }
+    UpdateHalfClose(conn);
+    return true;
+}
+
+// Starts the connect of a stream that waited for early data. Buffered guest
+// data goes out in the SYN if the kernel holds a Fast Open cookie for the
+// destination; without one, a normal handshake starts that also asks for a
+// cookie, and the data follows once it completes.
+bool ConnectUpstream(CONNECTION_INFO* conn) {
+    const struct sockaddr* addr = (const struct sockaddr*)&conn->data->address.addr;
+    ssize_t bytesSent;
+    
+    conn->connectDeferred = false;
     
-    while (1) {
-        // Set up polling
-        nfds = 0;
-        
-        // Add virtio device to poll
-        fds[nfds].fd = g_virtioFd;
-        fds[nfds].events = POLLIN;
-        nfds++;
-        
-        // Add active connections to poll
-        for (i = 0; i < MAX_CONNECTIONS; i++) {
-            if (g_connections[i].inUse) {
-                fds[nfds].fd = g_connections[i].socket;
-                fds[nfds].events = POLLIN;
-                nfds++;
-            }
+    if (conn->pendingLen > 0) {
+        bytesSent = sendto(conn->socket, conn->data->pending, conn->pendingLen, MSG_FASTOPEN | MSG_NOSIGNAL,
+                           addr, conn->data->address.addrLen);
+        if (bytesSent >= 0) {
+            printf("[%s] Connection %d connecting, %zd bytes sent with the SYN\n", conn->vm->name,
+                   conn->connId, bytesSent);
+            memmove(conn->data->pending, conn->data->pending + bytesSent, conn->pendingLen - bytesSent);
+            conn->pendingLen -= bytesSent;
+            return true;
         }
-        
-        // Wait for events
-        if (poll(fds, nfds, -1) <= 0) {
-            perror("poll error");
-            break;
+        if (errno == EINPROGRESS) {
+            printf("[%s] Connection %d connecting, no Fast Open cookie yet\n", conn->vm->name, conn->connId);
+            return true;
         }
-        
-        // Check virtio device for data
-        if (fds[0].revents & POLLIN) {
-            ssize_t bytesRead = read(g_virtioFd, buffer, sizeof(buffer));
-            if (bytesRead > 0) {
-                printf("Received %zd bytes from virtio device\n", bytesRead);
-                
-                // Debug: Display the first few bytes
-                printf("First 16 bytes of data: ");
-                for (int i = 0; i < (bytesRead < 16 ? bytesRead : 16); i++) {
-                    printf("%02X ", buffer[i]);
-                }
-                printf("\n");
-                
-                if (bytesRead >= (ssize_t)sizeof(VIRTIO_MSG_HEADER)) {
-                    VIRTIO_MSG_HEADER* header = (VIRTIO_MSG_HEADER*)buffer;
-                    uint16_t connId = header->connId;
-                    uint16_t length = header->length;
-                    
-                    printf("Virtio message: connId=%u, length=%u\n", connId, length);
-                    
-                    if (bytesRead >= (ssize_t)(sizeof(VIRTIO_MSG_HEADER) + length)) {
-                        // Check if this is a new connection or data for an existing one
-                        if (connId < MAX_CONNECTIONS) {
-                            if (!g_connections[connId].inUse) {
-                                // New connection request
-                                HandleConnectionRequest(connId, buffer + sizeof(VIRTIO_MSG_HEADER), length);
-                            } else {
-                                // Data for existing connection
-                                if (g_connections[connId].socket != -1) {
-                                    ssize_t bytesSent = send(g_connections[connId].socket, 
-                                                         buffer + sizeof(VIRTIO_MSG_HEADER), 
-                                                         length, 0);
-                                    if (bytesSent <= 0) {
-                                        printf("Send failed for connection %d\n", connId);
-                                        CloseConnection(&g_connections[connId]);
-                                    }
-                                }
-                            }
-                        }
-                    }
-                }
-            } else if (bytesRead < 0) {
-                perror("Error reading from virtio");
-                break;
-            } else {
-                printf("Virtio connection closed\n");
-                break;
-            }
+        if (errno != EOPNOTSUPP) {
+            perror("connect failed");
+            conn->connectError = errno;
+            ReportConnect(conn, CONNECT_FAILED);
+            return false;
         }
+        // Fast Open is disabled for clients on this host (net.ipv4.tcp_fastopen)
+    }
+    
+    if (connect(conn->socket, addr, conn->data->address.addrLen) < 0 && errno != EINPROGRESS) {
+        perror("connect failed");
+        conn->connectError = errno;
+        ReportConnect(conn, CONNECT_FAILED);
+        return false;
+    }
+    printf("[%s] Connection %d connecting\n", conn->vm->name, conn->connId);
+    return true;
+}
+
+// Starts the connects that ProcessVirtioIngress held back, now that the
+// frames which arrived with the requests have been buffered
+void StartDeferredConnects(VM_CONTEXT* vm) {
+    for (int id = 0; id < MAX_STREAMS; id++) {
+        CONNECTION_INFO* conn = FindStream(vm, id);
         
-        // Check connections for data
-        for (i = 0; i < MAX_CONNECTIONS; i++) {
-            if (g_connections[i].inUse) {
-                int pollIndex = 1;  // Start after virtio
-                
-                for (int j = 0; j < i; j++) {
-                    if (g_connections[j].inUse) {
-                        pollIndex++;
-                    }
-                }
-                
-                if (pollIndex < nfds && fds[pollIndex].revents & POLLIN) {
-                    ssize_t bytesRead = recv(g_connections[i].socket, 
-                                           buffer + sizeof(VIRTIO_MSG_HEADER), 
-                                           BUFFER_SIZE, 0);
-                    if (bytesRead > 0) {
-                        // Forward data to virtio
-                        if (!SendToVirtio(i, buffer + sizeof(VIRTIO_MSG_HEADER), bytesRead)) {
-                            printf("Failed to send data to virtio for connection %d\n", i);
-                            CloseConnection(&g_connections[i]);
-                        }
-                    } else {
-                        // Connection closed or error
-                        printf("Connection %d closed\n", i);
-                        CloseConnection(&g_connections[i]);
-                    }
-                }
-            }
+        if (conn != NULL && conn->connectDeferred && !conn->closing && !ConnectUpstream(conn)) {
+            CloseConnection(conn);
         }
     }
+}
+
+// Tells the circuit breaker how the stream's upstream connect ended
+void ReportConnect(CONNECTION_INFO* conn, int outcome) {
+    const CONNECT_BREAKER_ENTRY* entry;
+    uint64_t windowMs;
+    
+    if (conn->breaker < 0) {
+        return;
+    }
     
-    CleanupVirtio();
-    return 0;
+    entry = &g_breaker.entries[conn->breaker];
+    windowMs = ConnectBreakerReport(&g_breaker, conn->breaker, outcome, conn->connectError, g_timers.current);
+    conn->breaker = -1;
+    if (windowMs != 0) {
+        printf("[%s] %s:%d failed %u time(s) in a row, failing fast for %llums%s\n", conn->vm->name,
+               entry->host, entry->port, entry->failures, (unsigned long long)windowMs,
+               entry->failures >= CONNECT_BREAKER_TRIP ? " (circuit open)" : "");
+    }
 }
 
-bool InitializeVirtio(void) {
-    printf("Attempting to connect to virtio socket at: %s\n", VIRTIO_DEVICE);
+bool SendToVirtio(VM_CONTEXT* vm, uint16_t connId, const uint8_t* data, uint16_t length) {
+    if (length > vm->channel.maxPayload) {
+        printf("Data too large for virtio buffer\n");
+        return false;
+    }
     
-    // Get file info about the socket
-    struct stat statbuf;
-    if (stat(VIRTIO_DEVICE, &statbuf) == -1) {
-        printf("Error: Cannot stat virtio socket: %s (errno=%d)\n", strerror(errno), errno);
-        printf("Make sure the QEMU VM is running with the virtio-serial device properly configured.\n");
+    // Queue the frame on the stream's flow; the scheduler decides when it goes out
+    if (!MuxSchedEnqueue(&vm->sched, connId, connId, data, length)) {
+        printf("[%s] Virtio egress queue full (%zu bytes queued)\n", vm->name, EgressBacklog(vm));
         return false;
     }
     
-    printf("Socket exists. Type: %s\n", S_ISSOCK(statbuf.st_mode) ? "socket" : 
-                                        S_ISCHR(statbuf.st_mode) ? "character device" : "other");
-    printf("Permissions: %o, Size: %ld\n", statbuf.st_mode & 0777, (long)statbuf.st_size);
+    UpdateEgressPause(vm);
+    
+    // Try to push it out right away; whatever the channel does not take
+    // stays queued until the next POLLOUT
+    return FlushVirtio(vm);
+}
+
+bool SendControlToVirtio(VM_CONTEXT* vm, uint16_t flowId, uint8_t type, uint16_t connId) {
+    MUX_CTRL_STREAM msg;
+    
+    msg.type = type;
+    msg.connId = connId;
     
-    // Create a socket
-    g_virtioFd = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (g_virtioFd < 0) {
-        printf("Error creating socket: %s (errno=%d)\n", strerror(errno), errno);
-        perror("Failed to create socket");
+    // Stream control frames share the stream's flow so they stay behind its data
+    if (!MuxSchedEnqueue(&vm->sched, flowId, MUX_CONTROL_CONNID, (const uint8_t*)&msg, sizeof(msg))) {
+        printf("[%s] Virtio egress queue full, dropping control frame %u for connection %u\n",
+               vm->name, type, connId);
         return false;
     }
     
-    // Set up the address
-    struct sockaddr_un addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path, VIRTIO_DEVICE, sizeof(addr.sun_path) - 1);
+    return FlushVirtio(vm);
+}
+
+// Maps a connect error to the SOCKS5 reply code the guest passes on
+static uint8_t SocksReplyForError(int error) {
+    switch (error) {
+        case ENETUNREACH:
+        case ENETDOWN:
+            return SOCKS_REPLY_NETWORK_UNREACHABLE;
+        case EHOSTUNREACH:
+        case EHOSTDOWN:
+        case ETIMEDOUT:
+            return SOCKS_REPLY_HOST_UNREACHABLE;
+        case ECONNREFUSED:
+            return SOCKS_REPLY_CONNECTION_REFUSED;
+        case EAFNOSUPPORT:
+            return SOCKS_REPLY_ADDRESS_NOT_SUPPORTED;
+        default:
+            return SOCKS_REPLY_GENERAL_FAILURE;
+    }
+}
+
+// Tells the guest how the stream's connect ended, so its SOCKS reply can
+// carry the bound address or the reason for the failure. Sent once per
+// stream, on the stream's flow.
+bool SendOpenResult(CONNECTION_INFO* conn, uint8_t type) {
+    MUX_OPEN_RESULT msg;
+    struct sockaddr_storage bound;
+    socklen_t boundLen = sizeof(bound);
+    
+    conn->openPending = false;
+    if (!(conn->vm->channel.capabilities & MUX_CAP_OPEN_RESULT)) {
+        return true;
+    }
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.type = type;
+    msg.connId = conn->connId;
+    msg.reply = type == MUX_CTRL_OPEN_ACK ? SOCKS_REPLY_SUCCESS : SocksReplyForError(conn->connectError);
+    msg.atyp = MUX_ATYP_IPV4;
+    if (type == MUX_CTRL_OPEN_ACK && getsockname(conn->socket, (struct sockaddr*)&bound, &boundLen) == 0) {
+        if (bound.ss_family == AF_INET6) {
+            const struct sockaddr_in6* in6 = (const struct sockaddr_in6*)&bound;
+    
+            msg.atyp = MUX_ATYP_IPV6;
+            memcpy(msg.addr, &in6->sin6_addr, 16);
+            msg.port = in6->sin6_port;
+        } else if (bound.ss_family == AF_INET) {
+            const struct sockaddr_in* in4 = (const struct sockaddr_in*)&bound;
     
-    // Connect to the socket
-    printf("Connecting to socket...\n");
-    if (connect(g_virtioFd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-        printf("Error connecting to socket: %s (errno=%d)\n", strerror(errno), errno);
-        perror("Failed to connect to virtio socket");
-        close(g_virtioFd);
-        g_virtioFd = -1;
+            memcpy(msg.addr, &in4->sin_addr, 4);
+            msg.port = in4->sin_port;
+        }
+    }
+    
+    if (!MuxSchedEnqueue(&conn->vm->sched, conn->connId, MUX_CONTROL_CONNID, (const uint8_t*)&msg, sizeof(msg))) {
+        printf("[%s] Virtio egress queue full, dropping open result for connection %u\n",
+               conn->vm->name, conn->connId);
         return false;
     }
     
-    printf("Successfully connected to virtio socket, fd=%d\n", g_virtioFd);
+    return FlushVirtio(conn->vm);
+}
+
+size_t EgressBacklog(VM_CONTEXT* vm) {
+    return vm->sched.queuedBytes + vm->egress.bytes - vm->egress.offset;
+}
+
+void UpdateEgressPause(VM_CONTEXT* vm) {
+    size_t backlog = EgressBacklog(vm);
     
-    // Send a test message to verify the connection
-    printf("Sending test messages to VirtIO device...\n");
+    if (!vm->egress.paused &&
+        (backlog >= EGRESS_HIGH_WATER || g_egressPool.freeCount < EGRESS_FRAME_RESERVE)) {
+        printf("[%s] Virtio channel saturated (%zu bytes queued), pausing upstream reads\n", vm->name, backlog);
+        vm->egress.paused = true;
+    } else if (vm->egress.paused && backlog <= EGRESS_LOW_WATER &&
+               g_egressPool.freeCount >= 2 * EGRESS_FRAME_RESERVE) {
+        printf("[%s] Virtio channel drained (%zu bytes queued), resuming upstream reads\n", vm->name, backlog);
+        vm->egress.paused = false;
+    }
+}
+
+bool FlushVirtio(VM_CONTEXT* vm) {
+    // Nothing can be written while reconnecting; the queues were dropped
+    if (!TransportIsOpen(&vm->transport)) {
+        return true;
+    }
     
-    for (int i = 0; i < 5; i++) {  // Try sending 5 times with different patterns
-        uint8_t testBuffer[sizeof(VIRTIO_MSG_HEADER) + 32];
-        VIRTIO_MSG_HEADER* header = (VIRTIO_MSG_HEADER*)testBuffer;
-        header->connId = 0xFFFF;  // Special test connection ID
-        header->length = 16;      // Length of test message
+    while (1) {
+        struct iovec iov[EGRESS_BATCH_FRAMES];
+        int iovcnt = 0;
+        int batchFrames = 0;
+        MUX_FRAME* frame;
+        ssize_t bytesSent;
+        
+        // Top up the write batch in scheduler order
+        for (frame = vm->egress.head; frame != NULL; frame = frame->next) {
+            batchFrames++;
+        }
+        while (batchFrames < EGRESS_BATCH_FRAMES && (frame = MuxSchedDequeue(&vm->sched)) != NULL) {
+            if (vm->egress.tail != NULL) {
+                vm->egress.tail->next = frame;
+            } else {
+                vm->egress.head = frame;
+            }
+            vm->egress.tail = frame;
+            vm->egress.bytes += frame->size;
+            batchFrames++;
+        }
         
-        // Prepare a test pattern that's easy to recognize
-        uint8_t* payload = testBuffer + sizeof(VIRTIO_MSG_HEADER);
-        for (int j = 0; j < 16; j++) {
-            payload[j] = (i * 16) + j;  // Create a recognizable pattern
+        if (vm->egress.head == NULL) {
+            break;
         }
         
-        // Print the exact bytes we're sending for debugging
-        printf("Sending test message %d, %zu bytes: ", i+1, sizeof(VIRTIO_MSG_HEADER) + 16);
-        for (size_t j = 0; j < sizeof(VIRTIO_MSG_HEADER) + 16; j++) {
-            printf("%02X ", testBuffer[j]);
+        for (frame = vm->egress.head; frame != NULL; frame = frame->next) {
+            size_t skip = frame == vm->egress.head ? vm->egress.offset : 0;
+            iov[iovcnt].iov_base = frame->data + skip;
+            iov[iovcnt].iov_len = frame->size - skip;
+            iovcnt++;
         }
-        printf("\n");
         
-        // Send the message
-        ssize_t bytesSent = write(g_virtioFd, testBuffer, sizeof(VIRTIO_MSG_HEADER) + 16);
-        if (bytesSent == sizeof(VIRTIO_MSG_HEADER) + 16) {
-            printf("Test message %d sent successfully: %zd bytes\n", i+1, bytesSent);
-        } else {
-            if (bytesSent < 0) {
-                perror("Failed to send test message");
-            } else {
-                printf("Incomplete test message sent: %zd/%zu bytes\n", 
-                      bytesSent, sizeof(VIRTIO_MSG_HEADER) + 16);
+        bytesSent = TransportWritev(&vm->transport, iov, iovcnt);
+        if (bytesSent < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("[%s] Write to virtio failed: %s\n", vm->name, strerror(errno));
+            return false;
+        }
+        
+        // Release fully written frames
+        vm->egress.offset += bytesSent;
+        while (vm->egress.head != NULL && vm->egress.offset >= vm->egress.head->size) {
+            frame = vm->egress.head;
+            vm->egress.head = frame->next;
+            if (vm->egress.head == NULL) {
+                vm->egress.tail = NULL;
             }
+            vm->egress.offset -= frame->size;
+            vm->egress.bytes -= frame->size;
+            CaptureFrame(vm, TRACE_TO_GUEST, frame->data);
+            MuxPoolFree(&g_egressPool, frame);
         }
+    }
+    
+    UpdateEgressPause(vm);
+    return true;
+}
+
+bool ProcessVirtioIngress(VM_CONTEXT* vm) {
+    INGRESS_BUFFER* ingress = &vm->ingress;
+    size_t offset = 0;
+    
+    while (1) {
+        VIRTIO_MSG_HEADER header;
+        uint8_t* payload;
+        int split = MuxFrameSplit(ingress->data + offset, ingress->used - offset, BUFFER_SIZE, &header);
         
-        // Try to read a response immediately
-        fd_set readfds;
-        struct timeval tv;
+        if (split == MUX_FRAME_INVALID) {
+            printf("[%s] Invalid virtio frame length %u for connection %u\n", vm->name, header.length, header.connId);
+            return false;
+        }
         
-        FD_ZERO(&readfds);
-        FD_SET(g_virtioFd, &readfds);
+        // Wait for the rest of the frame
+        if (split == MUX_FRAME_PARTIAL) {
+            break;
+        }
+        payload = ingress->data + offset + sizeof(VIRTIO_MSG_HEADER);
         
-        // Set a short timeout for response
-        tv.tv_sec = 1;
-        tv.tv_usec = 0;
+        printf("[%s] Virtio message: connId=%u, length=%u\n", vm->name, header.connId, header.length);
         
-        int ret = select(g_virtioFd + 1, &readfds, NULL, NULL, &tv);
-        if (ret > 0) {
-            // Data is available to read
-            uint8_t respBuffer[1024];
-            ssize_t bytesRead = read(g_virtioFd, respBuffer, sizeof(respBuffer));
-            if (bytesRead > 0) {
-                printf("Received response: %zd bytes\n", bytesRead);
-                printf("Response data: ");
-                for (int j = 0; j < (bytesRead < 32 ? bytesRead : 32); j++) {
-                    printf("%02X ", respBuffer[j]);
+        // Check if this is a new connection or data for an existing one
+        if (header.connId == MUX_CONTROL_CONNID) {
+            if (!HandleControlFrame(vm, payload, header.length)) {
+                return false;
+            }
+        } else if (!vm->channel.ready) {
+            printf("[%s] Discarding frame for connection %u received before the handshake\n", vm->name, header.connId);
+        } else if (header.connId < MAX_STREAMS) {
+            CONNECTION_INFO* conn = FindStream(vm, header.connId);
+            
+            if (conn == NULL) {
+                // New connection request; tell the guest if it cannot be served
+                conn = AllocConnection(vm, header.connId);
+                if (conn == NULL) {
+                    printf("[%s] No free connection slots for connection %u\n", vm->name, header.connId);
+                    SendControlToVirtio(vm, header.connId, MUX_CTRL_CLOSE, header.connId);
+                } else if (!HandleConnectionRequest(conn, payload, header.length)) {
+                    CloseConnection(conn);
                 }
-                printf("\n");
-            } else if (bytesRead == 0) {
-                printf("Connection closed by peer\n");
-            } else {
-                perror("Error reading response");
+            } else if (conn->closing) {
+                // Data that crossed our CLOSE; the guest will close its side
+            } else if (conn->pendingLen + header.length > BUFFER_SIZE) {
+                // The upstream socket is still behind; keep this frame until it drains
+                ingress->stalled = true;
+                ingress->stalledSlot = header.connId;
+                break;
+            } else if (!SendToUpstream(conn, payload, header.length)) {
+                printf("[%s] Send failed for connection %d\n", vm->name, header.connId);
+                CloseConnection(conn);
             }
-        } else if (ret == 0) {
-            printf("No response received within timeout\n");
-        } else {
-            perror("Select error");
         }
         
-        // Small delay between sends
-        usleep(200000);  // 200ms
-    }
-    
-    // Set non-blocking mode
-    int flags = fcntl(g_virtioFd, F_GETFL, 0);
-    if (flags == -1) {
-        perror("Failed to get flags for virtio device");
-        close(g_virtioFd);
-        g_virtioFd = -1;
-        return false;
+        CaptureFrame(vm, TRACE_TO_HOST, ingress->data + offset);
+        offset += sizeof(VIRTIO_MSG_HEADER) + header.length;
     }
     
-    if (fcntl(g_virtioFd, F_SETFL, flags | O_NONBLOCK) == -1) {
-        perror("Failed to set non-blocking mode for virtio device");
-        close(g_virtioFd);
-        g_virtioFd = -1;
-        return false;
+    // Keep the partial frame at the start of the buffer
+    if (offset > 0) {
+        memmove(ingress->data, ingress->data + offset, ingress->used - offset);
+        ingress->used -= offset;
     }
     
-    printf("VirtIO socket setup complete and ready for connections\n");
+    StartDeferredConnects(vm);
     return true;
 }
 
-void CleanupVirtio(void) {
-    // Close all connections
-    for (int i = 0; i < MAX_CONNECTIONS; i++) {
-        if (g_connections[i].inUse) {
-            CloseConnection(&g_connections[i]);
-        }
-    }
+// Adds a frame (header and payload) that was written to or handled from the
+// channel to the capture, if one is running
+void CaptureFrame(VM_CONTEXT* vm, uint8_t direction, const uint8_t* frame) {
+    VIRTIO_MSG_HEADER header;
     
-    // Close virtio device
-    if (g_virtioFd != -1) {
-        close(g_virtioFd);
-        g_virtioFd = -1;
+    if (g_trace.file == NULL) {
+        return;
     }
+    memcpy(&header, frame, sizeof(header));
+    TraceWriteFrame(&g_trace, direction, (uint8_t)(vm - g_vms), &header, frame + sizeof(header), NowMicros());
 }
 
-bool HandleConnectionRequest(uint16_t connId, uint8_t* data, uint16_t length) {
-    if (connId >= MAX_CONNECTIONS || g_connections[connId].inUse) {
-        printf("Invalid connection ID in request: %d\n", connId);
-        return false;
-    }
+bool HandleControlFrame(VM_CONTEXT* vm, const uint8_t* data, uint16_t length) {
+    MUX_CTRL_STREAM msg;
+    MUX_HELLO hello;
+    MUX_HEARTBEAT heartbeat;
     
-    uint8_t atyp = data[0];
-    uint16_t port;
-    char host[256];
-    int hostLen;
-    struct addrinfo hints, *res;
-    int sockfd;
+    if (length < 1) {
+        return true;
+    }
     
-    // Parse connection request
-    switch (atyp) {
-        case SOCKS_ATYP_IPV4:
-            if (length < 1 + 4 + 2) {
-                printf("Invalid IPv4 connection request\n");
+    switch (data[0]) {
+        case MUX_CTRL_HELLO:
+        case MUX_CTRL_HELLO_ACK:
+            if (length < sizeof(hello)) {
+                printf("[%s] Invalid HELLO control frame\n", vm->name);
                 return false;
             }
-            
-            sprintf(host, "%d.%d.%d.%d", data[1], data[2], data[3], data[4]);
-            port = (data[5] << 8) | data[6];
+            memcpy(&hello, data, sizeof(hello));
+            if (data[0] == MUX_CTRL_HELLO) {
+                // The guest (re)started: nothing it knew about survives
+                printf("[%s] HELLO from guest\n", vm->name);
+                ResetStreams(vm);
+                if (!SendHello(vm, MUX_CTRL_HELLO_ACK)) {
+                    return false;
+                }
+            }
+            return NegotiateChannel(vm, &hello);
+        case MUX_CTRL_PING:
+        case MUX_CTRL_PONG:
+            if (length < sizeof(heartbeat)) {
+                printf("Invalid heartbeat control frame\n");
+                return true;
+            }
+            memcpy(&heartbeat, data, sizeof(heartbeat));
+            if (data[0] == MUX_CTRL_PONG) {
+                HandlePong(vm, &heartbeat);
+            } else if (vm->channel.ready) {
+                heartbeat.type = MUX_CTRL_PONG;
+                if (MuxSchedEnqueue(&vm->sched, CONTROL_FLOW, MUX_CONTROL_CONNID,
+                                    (const uint8_t*)&heartbeat, sizeof(heartbeat))) {
+                    FlushVirtio(vm);
+                }
+            }
             break;
-            
-        case SOCKS_ATYP_DOMAIN:
-            if (length < 2) {
-                printf("Invalid domain connection request\n");
-                return false;
+        case MUX_CTRL_CLOSE:
+            if (length < sizeof(msg)) {
+                printf("Invalid CLOSE control frame\n");
+                return true;
             }
-            
-            hostLen = data[1];
-            if (length < 2 + hostLen + 2) {
-                printf("Invalid domain connection request (domain truncated)\n");
-                return false;
+            memcpy(&msg, data, sizeof(msg));
+            HandleGuestClose(vm, msg.connId);
+            break;
+        case MUX_CTRL_EOF:
+            if (length < sizeof(msg)) {
+                printf("Invalid EOF control frame\n");
+                return true;
             }
-            
-            memcpy(host, &data[2], hostLen);
-            host[hostLen] = '\0';
-            port = (data[2 + hostLen] << 8) | data[2 + hostLen + 1];
+            memcpy(&msg, data, sizeof(msg));
+            HandleGuestEof(vm, msg.connId);
             break;
-            
         default:
-            printf("Unsupported address type: %d\n", atyp);
-            return false;
+            printf("Ignoring unknown control frame type %u\n", data[0]);
+            break;
     }
     
-    printf("Connection request: %s:%d (ID: %d)\n", host, port, connId);
-    
-    // Connect to the target server
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_STREAM;
-    
-    char portStr[8];
-    sprintf(portStr, "%d", port);
+    return true;
+}
+
+void HandleGuestClose(VM_CONTEXT* vm, uint16_t connId) {
+    CONNECTION_INFO* conn = FindStream(vm, connId);
     
-    if (getaddrinfo(host, portStr, &hints, &res) != 0) {
-        perror("getaddrinfo failed");
-        return false;
+    if (conn == NULL) {
+        return;
     }
     
-    sockfd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-    if (sockfd < 0) {
-        perror("socket failed");
-        freeaddrinfo(res);
-        return false;
+    if (conn->closing) {
+        // Both sides have now closed; the slot can be reused
+        ReleaseConnection(conn);
+        printf("[%s] Connection %d released\n", vm->name, connId);
+        return;
     }
     
-    if (connect(sockfd, res->ai_addr, res->ai_addrlen) < 0) {
-        perror("connect failed");
-        close(sockfd);
-        freeaddrinfo(res);
-        return false;
+    // The guest no longer wants anything queued for this stream, nor the
+    // result of its connect
+    MuxSchedDropFlow(&vm->sched, connId);
+    conn->openPending = false;
+    CloseConnection(conn);
+    ReleaseConnection(conn);
+}
+
+void HandleGuestEof(VM_CONTEXT* vm, uint16_t connId) {
+    CONNECTION_INFO* conn = FindStream(vm, connId);
+    
+    if (conn == NULL || conn->closing || conn->guestEof) {
+        return;
     }
     
-    freeaddrinfo(res);
+    conn->guestEof = true;
+    printf("[%s] Guest finished sending on connection %d\n", vm->name, connId);
+    
+    ArmConnectionTimer(conn);
+    UpdateHalfClose(conn);
+}
+
+void HandleUpstreamEof(CONNECTION_INFO* conn) {
+    VM_CONTEXT* vm = conn->vm;
     
-    // Set socket to non-blocking
-    int flags = fcntl(sockfd, F_GETFL, 0);
-    if (flags != -1) {
-        fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+    // A guest without half-close support only understands a full close
+    if (!(vm->channel.capabilities & MUX_CAP_HALF_CLOSE)) {
+        printf("[%s] Connection %d closed by upstream\n", vm->name, conn->connId);
+        CloseConnection(conn);
+        return;
     }
     
-    // Store connection info
-    g_connections[connId].socket = sockfd;
-    g_connections[connId].inUse = true;
-    g_connections[connId].connId = connId;
+    conn->upstreamEof = true;
+    printf("[%s] Upstream finished sending on connection %d\n", vm->name, conn->connId);
     
-    printf("Connection %d established\n", connId);
-    return true;
+    // Queued behind the stream's data so the guest sees all of it first
+    SendControlToVirtio(vm, conn->connId, MUX_CTRL_EOF, conn->connId);
+    
+    ArmConnectionTimer(conn);
+    UpdateHalfClose(conn);
 }
 
-bool SendToVirtio(uint16_t connId, const uint8_t* data, uint16_t length) {
-    uint8_t buffer[BUFFER_SIZE + sizeof(VIRTIO_MSG_HEADER)];
-    VIRTIO_MSG_HEADER* header = (VIRTIO_MSG_HEADER*)buffer;
-    ssize_t bytesSent;
+// Passes the guest's EOF on once its data has been delivered, and closes
+// the stream when both directions are finished
+void UpdateHalfClose(CONNECTION_INFO* conn) {
+    if (!conn->guestEof || conn->connecting || conn->pendingLen > 0) {
+        return;
+    }
     
-    if (length > BUFFER_SIZE) {
-        printf("Data too large for virtio buffer\n");
-        return false;
+    if (conn->upstreamEof) {
+        CloseConnection(conn);
+        return;
     }
     
-    // Prepare header
-    header->connId = connId;
-    header->length = length;
+    shutdown(conn->socket, SHUT_WR);
+}
+
+bool SendToUpstream(CONNECTION_INFO* conn, const uint8_t* data, uint16_t length) {
+    ssize_t bytesSent = 0;
     
-    // Copy data
-    memcpy(buffer + sizeof(VIRTIO_MSG_HEADER), data, length);
+    conn->lastActivity = g_timers.current;
     
-    // Send to virtio
-    bytesSent = write(g_virtioFd, buffer, sizeof(VIRTIO_MSG_HEADER) + length);
-    if (bytesSent != (ssize_t)(sizeof(VIRTIO_MSG_HEADER) + length)) {
+    // Preserve ordering behind data that is already waiting, and hold
+    // everything until the connect completes
+    if (conn->pendingLen == 0 && !conn->connecting) {
+        bytesSent = send(conn->socket, data, length, MSG_NOSIGNAL);
         if (bytesSent < 0) {
-            perror("write to virtio failed");
-        } else {
-            printf("Incomplete write to virtio: %zd/%zu bytes\n", 
-                  bytesSent, sizeof(VIRTIO_MSG_HEADER) + length);
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                return false;
+            }
+            bytesSent = 0;
         }
-        return false;
     }
     
+    memcpy(conn->data->pending + conn->pendingLen, data + bytesSent, length - bytesSent);
+    conn->pendingLen += length - bytesSent;
+    return true;
+}
+
+bool FlushUpstream(CONNECTION_INFO* conn) {
+    ssize_t bytesSent;
+    
+    if (conn->pendingLen == 0 || conn->connecting) {
+        return true;
+    }
+    
+    bytesSent = send(conn->socket, conn->data->pending, conn->pendingLen, MSG_NOSIGNAL);
+    if (bytesSent < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    
+    memmove(conn->data->pending, conn->data->pending + bytesSent, conn->pendingLen - bytesSent);
+    conn->pendingLen -= bytesSent;
     return true;
 }
 
 void CloseConnection(CONNECTION_INFO* conn) {
-    if (!conn->inUse) {
+    if (!conn->inUse || conn->closing) {
         return;
     }
     
@@ -465,6 +2446,195 @@ void CloseConnection(CONNECTION_INFO* conn) {
         conn->socket = -1;
     }
     
-    conn->inUse = false;
-    printf("Connection %d closed\n", conn->connId);
-} 
\ No newline at end of file
+    conn->pendingLen = 0;
+    conn->connecting = false;
+    conn->upstreamEof = false;
+    conn->guestEof = false;
+    ReportConnect(conn, CONNECT_ABANDONED);
+    RateLimitClose(conn);
+    TimerCancel(&g_timers, &conn->data->rateTimer);
+    if (conn->vm->ingress.stalledSlot == conn->connId) {
+        conn->vm->ingress.stalled = false;
+        conn->vm->ingress.stalledSlot = -1;
+        conn->vm->ingress.resume = true;
+    }
+    
+    // Tell the guest, after any data still queued for it. The slot stays
+    // reserved until the guest's CLOSE arrives. A stream that never
+    // connected first reports why, so the client gets a SOCKS error.
+    conn->closing = true;
+    ArmConnectionTimer(conn);
+    if (conn->openPending) {
+        SendOpenResult(conn, MUX_CTRL_OPEN_FAIL);
+    }
+    SendControlToVirtio(conn->vm, conn->connId, MUX_CTRL_CLOSE, conn->connId);
+    printf("[%s] Connection %d closed\n", conn->vm->name, conn->connId);
+}
+
+// Schedules the timeout that applies to the stream's current state
+void ArmConnectionTimer(CONNECTION_INFO* conn) {
+    uint64_t delayMs;
+    
+    if (conn->connecting) {
+        delayMs = g_timeouts.connectMs;
+    } else if (conn->closing || conn->upstreamEof || conn->guestEof) {
+        delayMs = g_timeouts.lingerMs;
+    } else if (g_timeouts.idleMs != 0) {
+        delayMs = g_timeouts.idleMs;
+    } else {
+        TimerCancel(&g_timers, &conn->data->timer);
+        return;
+    }
+    
+    TimerSchedule(&g_timers, &conn->data->timer, delayMs);
+}
+
+void ConnectionTimeout(TIMER* timer, void* context) {
+    CONNECTION_INFO* conn = (CONNECTION_INFO*)context;
+    
+    (void)timer;
+    
+    if (conn->closing) {
+        // The guest never confirmed the close; reclaim the slot anyway
+        printf("[%s] Connection %d: no CLOSE from guest, releasing\n", conn->vm->name, conn->connId);
+        MuxSchedDropFlow(&conn->vm->sched, conn->connId);
+        ReleaseConnection(conn);
+    } else if (conn->connecting) {
+        printf("[%s] Connection %d: connect timed out\n", conn->vm->name, conn->connId);
+        conn->connectError = ETIMEDOUT;
+        ReportConnect(conn, CONNECT_FAILED);
+        CloseConnection(conn);
+    } else if (conn->upstreamEof || conn->guestEof) {
+        printf("[%s] Connection %d: half-closed for too long\n", conn->vm->name, conn->connId);
+        CloseConnection(conn);
+    } else if (g_timers.current - conn->lastActivity >= g_timeouts.idleMs) {
+        printf("[%s] Connection %d: idle timeout\n", conn->vm->name, conn->connId);
+        CloseConnection(conn);
+    } else {
+        // Traffic since the timer was armed; only wait out the remainder
+        TimerSchedule(&g_timers, &conn->data->timer,
+                      conn->lastActivity + g_timeouts.idleMs - g_timers.current);
+    }
+}
+
+uint64_t NowMicros(void) {
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+uint64_t NowMillis(void) {
+    return NowMicros() / 1000;
+}
+
+void RateLimitOpen(CONNECTION_INFO* conn, const char* host) {
+    uint64_t now = NowMicros();
+    int slot = -1;
+    int i;
+    
+    TokenBucketInit(&conn->data->bucket, g_rateConfig.streamRate, g_rateConfig.streamBurst, now);
+    conn->throttled = false;
+    conn->destLimit = -1;
+    
+    // Streams taken over without a destination entry stay without one
+    if (g_rateConfig.destRate == 0 || host[0] == '\0') {
+        return;
+    }
+    
+    // Share the bucket of an existing entry for this host, otherwise take
+    // over an unused entry (preferring one that was never assigned)
+    for (i = 0; i < MAX_CONNECTIONS; i++) {
+        if (g_destLimits[i].host[0] != '\0' && strcmp(g_destLimits[i].host, host) == 0) {
+            slot = i;
+            break;
+        }
+        if (g_destLimits[i].refCount == 0 &&
+            (slot == -1 || (g_destLimits[slot].host[0] != '\0' && g_destLimits[i].host[0] == '\0'))) {
+            slot = i;
+        }
+    }
+    
+    if (slot == -1) {
+        return;
+    }
+    
+    if (strcmp(g_destLimits[slot].host, host) != 0) {
+        snprintf(g_destLimits[slot].host, sizeof(g_destLimits[slot].host), "%s", host);
+        TokenBucketInit(&g_destLimits[slot].bucket, g_rateConfig.destRate, g_rateConfig.destBurst, now);
+    }
+    g_destLimits[slot].refCount++;
+    conn->destLimit = slot;
+}
+
+void RateLimitWake(TIMER* timer, void* context) {
+    CONNECTION_INFO* conn = (CONNECTION_INFO*)context;
+    
+    (void)timer;
+    conn->throttled = false;
+}
+
+void RateLimitClose(CONNECTION_INFO* conn) {
+    if (conn->destLimit >= 0) {
+        g_destLimits[conn->destLimit].refCount--;
+        conn->destLimit = -1;
+    }
+    conn->throttled = false;
+}
+
+// Bytes the stream may read now, capped at one frame
+size_t RateLimitAllowance(CONNECTION_INFO* conn, uint64_t now) {
+    uint64_t allowance = TokenBucketAvailable(&conn->data->bucket, now);
+    
+    if (conn->destLimit >= 0) {
+        uint64_t dest = TokenBucketAvailable(&g_destLimits[conn->destLimit].bucket, now);
+        if (dest < allowance) {
+            allowance = dest;
+        }
+    }
+    
+    return allowance < conn->vm->channel.maxPayload ? (size_t)allowance : conn->vm->channel.maxPayload;
+}
+
+// A throttled stream waits for a reasonable chunk rather than reading dribbles
+static uint64_t RateLimitChunk(const TOKEN_BUCKET* bucket) {
+    return bucket->burst < RATE_LIMIT_MIN_CHUNK ? bucket->burst : RATE_LIMIT_MIN_CHUNK;
+}
+
+bool RateLimitReady(CONNECTION_INFO* conn, uint64_t now) {
+    if (TokenBucketEnabled(&conn->data->bucket) &&
+        TokenBucketAvailable(&conn->data->bucket, now) < RateLimitChunk(&conn->data->bucket)) {
+        return false;
+    }
+    
+    if (conn->destLimit >= 0) {
+        TOKEN_BUCKET* dest = &g_destLimits[conn->destLimit].bucket;
+        if (TokenBucketAvailable(dest, now) < RateLimitChunk(dest)) {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+void RateLimitConsume(CONNECTION_INFO* conn, size_t bytes) {
+    TokenBucketConsume(&conn->data->bucket, bytes);
+    if (conn->destLimit >= 0) {
+        TokenBucketConsume(&g_destLimits[conn->destLimit].bucket, bytes);
+    }
+}
+
+// Microseconds until both buckets hold a chunk again
+uint64_t RateLimitDelay(CONNECTION_INFO* conn) {
+    uint64_t delay = TokenBucketDelay(&conn->data->bucket, RateLimitChunk(&conn->data->bucket));
+    
+    if (conn->destLimit >= 0) {
+        TOKEN_BUCKET* dest = &g_destLimits[conn->destLimit].bucket;
+        uint64_t destDelay = TokenBucketDelay(dest, RateLimitChunk(dest));
+        if (destDelay > delay) {
+            delay = destDelay;
+        }
+    }
+    
+    return delay;
+}
@@ -4,26 +4,110 @@
 HANDLE g_iocp = NULL;
 HANDLE g_virtioHandle = NULL;
 CONNECTION_CONTEXT g_connections[MAX_CONNECTIONS] = {0};
+CONNECTION_IO g_connectionIo[MAX_CONNECTIONS];
 SOCKET g_listenSocket = INVALID_SOCKET;
 LPFN_ACCEPTEX lpfnAcceptEx = NULL;
 
-// Acceptance information for AcceptEx
-SOCKET g_acceptSocket = INVALID_SOCKET;
-char g_acceptBuffer[2 * (sizeof(SOCKADDR_IN) + 16)];
-OVERLAPPED g_acceptOverlap = {0};
+// Egress scheduler: per-stream queues toward the virtio channel
+MUX_FRAME g_egressFrames[EGRESS_POOL_FRAMES];
+MUX_FRAME_POOL g_egressPool;
+MUX_FLOW g_egressFlows[MAX_CONNECTIONS + 1];
+MUX_SCHEDULER g_egressSched;
+bool g_readsBlocked = false;    // Some client has readBlocked set
 
-// Virtio read buffer and overlapped structure
-uint8_t g_virtioReadBuffer[BUFFER_SIZE + sizeof(VIRTIO_MSG_HEADER)];
-OVERLAPPED g_virtioReadOverlap = {0};
+// Virtio writes in flight
+VIRTIO_WRITE g_virtioWrites[VIRTIO_WRITES];
 
-int main(void) {
+// The channel lost data and waits to be opened again
+bool g_virtioFailed = false;
+TIMER g_reopenTimer;
+
+// Channel parameters agreed with the host
+MUX_CHANNEL g_channel = {0};
+
+// Handshake, idle and linger timeouts for client streams
+TIMER_WHEEL g_timers;
+uint64_t g_idleTimeoutMs = DEFAULT_IDLE_TIMEOUT_MS;
+
+// Answer SOCKS requests before the host has connected (--optimistic)
+bool g_optimisticOpen = false;
+
+// Accepts kept posted, and whether they wait for the client's first bytes
+ACCEPT_OP g_accepts[MAX_ACCEPTS];
+int g_acceptCount = DEFAULT_ACCEPTS;
+bool g_acceptData = false;
+TIMER g_acceptTimer;
+
+// Virtio receive buffers, one overlapped read per buffer
+MUX_RX_BUFFER g_virtioReadBuffers[VIRTIO_READ_BUFFERS];
+OVERLAPPED g_virtioReadOverlaps[VIRTIO_READ_BUFFERS];
+MUX_RX g_virtioRx;
+int g_virtioReadsPosted = 0;
+bool g_ingressStalled = false;  // A host frame waits for room in a client's send queue
+
+int main(int argc, char* argv[]) {
     WSADATA wsaData;
     DWORD bytesTransferred;
     ULONG_PTR completionKey;
     OVERLAPPED* pOverlapped;
     CONNECTION_CONTEXT* ctx;
+    VIRTIO_WRITE* write;
+    MUX_RX_BUFFER* readBuffer;
+    ACCEPT_OP* accept;
+    CLIENT_OP* op;
+    BOOL completed;
     int i;
 
+    // Set up the egress scheduler. Control frames go first, and latency
+    // sensitive ports (SSH, DNS) are served ahead of ordinary streams.
+    MuxPoolInit(&g_egressPool, g_egressFrames, EGRESS_POOL_FRAMES);
+    MuxSchedInit(&g_egressSched, g_egressFlows, MAX_CONNECTIONS + 1, &g_egressPool);
+    MuxSchedSetPriority(&g_egressSched, CONTROL_FLOW, MUX_PRIO_CONTROL);
+
+    // Receive buffers for the virtio channel
+    MuxRxInit(&g_virtioRx, g_virtioReadBuffers, VIRTIO_READ_BUFFERS);
+
+    // Command line: --priority PORT[-PORT]=CLASS, --quantum CLASS=BYTES,
+    // --idle-timeout SECONDS (0 disables), --optimistic, --accepts N,
+    // --accept-data
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--priority") == 0 && i + 1 < argc) {
+            if (!MuxSchedAddPortRule(&g_egressSched, argv[++i])) {
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--quantum") == 0 && i + 1 < argc) {
+            if (!MuxSchedSetQuantum(&g_egressSched, argv[++i])) {
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--idle-timeout") == 0 && i + 1 < argc) {
+            char* end;
+            unsigned long seconds = strtoul(argv[++i], &end, 10);
+
+            if (end == argv[i] || *end != '\0' || seconds > TIMER_WHEEL_MAX_DELAY / 1000) {
+                printf("Invalid timeout '%s'\n", argv[i]);
+                return 1;
+            }
+            g_idleTimeoutMs = (uint64_t)seconds * 1000;
+        } else if (strcmp(argv[i], "--optimistic") == 0) {
+            g_optimisticOpen = true;
+        } else if (strcmp(argv[i], "--accepts") == 0 && i + 1 < argc) {
+            g_acceptCount = atoi(argv[++i]);
+            if (g_acceptCount < 1 || g_acceptCount > MAX_ACCEPTS) {
+                printf("Invalid accept count '%s' (1-%d)\n", argv[i], MAX_ACCEPTS);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--accept-data") == 0) {
+            g_acceptData = true;
+        } else {
+            printf("Usage: %s [--priority PORT[-PORT]=CLASS] [--quantum CLASS=BYTES] [--idle-timeout SECONDS]"
+                   " [--optimistic] [--accepts N] [--accept-data]\n", argv[0]);
+            printf("Classes: control (0), interactive (1), default (2), bulk (3)\n");
+            return 1;
+        }
+    }
+    MuxSchedAddPortRule(&g_egressSched, "22=interactive");
+    MuxSchedAddPortRule(&g_egressSched, "53=interactive");
+
     // Initialize Winsock
     if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
         printf("WSAStartup failed: %d\n", WSAGetLastError());
@@ -44,129 +128,134 @@ int main(void) {
     }
 
     // Initialize connection contexts
+    TimerWheelInit(&g_timers, GetTickCount64());
+    TimerInit(&g_reopenTimer, ReopenVirtio, NULL);
     for (i = 0; i < MAX_CONNECTIONS; i++) {
         g_connections[i].socket = INVALID_SOCKET;
         g_connections[i].inUse = false;
         g_connections[i].connId = i;
+        g_connections[i].io = &g_connectionIo[i];
+        g_connectionIo[i].recvOp.type = OP_READ;
+        g_connectionIo[i].recvOp.ctx = &g_connections[i];
+        g_connectionIo[i].sendOp.type = OP_WRITE;
+        g_connectionIo[i].sendOp.ctx = &g_connections[i];
+        MuxRxQueueInit(&g_connectionIo[i].sendQueue);
+        TimerInit(&g_connectionIo[i].timer, ConnectionTimeout, &g_connections[i]);
+    }
+
+    // Keep several accepts posted so a burst of clients is taken at once
+    for (i = 0; i < MAX_ACCEPTS; i++) {
+        g_accepts[i].socket = INVALID_SOCKET;
+    }
+    TimerInit(&g_acceptTimer, CheckAccepts, NULL);
+    for (i = 0; i < g_acceptCount; i++) {
+        PostAccept(&g_accepts[i]);
+    }
+    if (g_acceptData) {
+        TimerSchedule(&g_timers, &g_acceptTimer, ACCEPT_CHECK_MS);
     }
 
-    // Post an initial accept
-    PostAccept();
+    // Post the initial virtio reads
+    PostVirtioReads();
 
-    // Post an initial virtio read
-    PostVirtioRead();
+    // Announce ourselves; streams are refused until the host answers.
+    // A host that starts later sends its own HELLO instead.
+    SendHello(MUX_CTRL_HELLO);
 
     printf("SOCKS server started. Listening on port %d\n", SOCKS_PORT);
 
     // Main event loop
     while (true) {
-        if (!GetQueuedCompletionStatus(g_iocp, &bytesTransferred, &completionKey, &pOverlapped, INFINITE)) {
+        uint64_t now = GetTickCount64();
+        int64_t timeout;
+
+        // Run due timers, then wait no longer than the next one
+        TimerWheelAdvance(&g_timers, now);
+        timeout = TimerWheelTimeout(&g_timers, now);
+
+        completed = GetQueuedCompletionStatus(g_iocp, &bytesTransferred, &completionKey, &pOverlapped,
+                                              timeout < 0 ? INFINITE : (DWORD)timeout);
+        if (!completed) {
             if (pOverlapped == NULL) {
+                if (GetLastError() == WAIT_TIMEOUT) {
+                    continue;
+                }
                 // IOCP error
                 printf("IOCP error: %d\n", GetLastError());
                 break;
             }
         }
 
-        if (pOverlapped == &g_acceptOverlap) {
+        if ((accept = FindAccept(pOverlapped)) != NULL) {
             // New connection accepted
-            SOCKET clientSocket = g_acceptSocket;
-            g_acceptSocket = INVALID_SOCKET;
-
-            // Create a new socket for the next accept
-            PostAccept();
-
-            // Handle the new connection
-            if (!HandleNewConnection(clientSocket)) {
-                closesocket(clientSocket);
-            }
+            CompleteAccept(accept, completed, bytesTransferred);
+        }
+        else if ((write = FindVirtioWrite(pOverlapped)) != NULL) {
+            // A virtio write finished; its buffer takes the next frames
+            CompleteVirtioWrite(write, completed, bytesTransferred);
         }
-        else if (pOverlapped == &g_virtioReadOverlap) {
+        else if ((readBuffer = FindVirtioRead(pOverlapped)) != NULL) {
             // Data received from virtio-serial
-            printf("Received %d bytes from virtio device\n", bytesTransferred);
-            
-            // Debug: Display the first few bytes
-            printf("First 16 bytes of data: ");
-            for (int i = 0; i < (bytesTransferred < 16 ? bytesTransferred : 16); i++) {
-                printf("%02X ", g_virtioReadBuffer[i]);
-            }
-            printf("\n");
-            
-            if (bytesTransferred >= sizeof(VIRTIO_MSG_HEADER)) {
-                VIRTIO_MSG_HEADER* header = (VIRTIO_MSG_HEADER*)g_virtioReadBuffer;
-                uint16_t connId = header->connId;
-                uint16_t length = header->length;
-                
-                printf("Virtio message: connId=%u, length=%u\n", connId, length);
-                
-                if (connId < MAX_CONNECTIONS && g_connections[connId].inUse && 
-                    bytesTransferred >= sizeof(VIRTIO_MSG_HEADER) + length) {
-                    // Send data to the client
-                    ctx = &g_connections[connId];
-                    ctx->wsaBuf.buf = (char*)(g_virtioReadBuffer + sizeof(VIRTIO_MSG_HEADER));
-                    ctx->wsaBuf.len = length;
-                    ctx->pendingOp = OP_WRITE;
-
-                    if (WSASend(ctx->socket, &ctx->wsaBuf, 1, NULL, 0, &ctx->overlap, NULL) == SOCKET_ERROR) {
-                        if (WSAGetLastError() != WSA_IO_PENDING) {
-                            CloseConnection(ctx);
-                        }
-                    }
-                }
-            }
-
-            // Post another virtio read
-            PostVirtioRead();
+            CompleteVirtioRead(readBuffer, completed, bytesTransferred);
         }
         else {
             // Client socket operation completed
-            ctx = CONTAINING_RECORD(pOverlapped, CONNECTION_CONTEXT, overlap);
+            op = CONTAINING_RECORD(pOverlapped, CLIENT_OP, overlap);
+            ctx = op->ctx;
 
-            if (bytesTransferred == 0 && (ctx->pendingOp == OP_READ || ctx->pendingOp == OP_WRITE)) {
-                // Connection closed by client
-                CloseConnection(ctx);
+            if (op->type == OP_WRITE) {
+                // Host data reached the client; send what queued up meanwhile
+                CompleteClientSend(ctx, completed, bytesTransferred);
                 continue;
             }
 
-            ctx->bytesTransferred = bytesTransferred;
-
-            switch (ctx->pendingOp) {
-                case OP_READ:
-                    switch (ctx->state) {
-                        case STATE_INIT:
-                            if (ProcessSocksAuth(ctx)) {
-                                ctx->state = STATE_AUTH;
-                                PostClientRead(ctx);
-                            } else {
-                                CloseConnection(ctx);
-                            }
-                            break;
-                        case STATE_AUTH:
-                            if (ProcessSocksRequest(ctx)) {
-                                ctx->state = STATE_CONNECTED;
-                                PostClientRead(ctx);
-                            } else {
-                                CloseConnection(ctx);
-                            }
-                            break;
-                        case STATE_CONNECTED:
-                            // Forward data to virtio
-                            if (!SendToVirtio(ctx, ctx->buffer, (uint16_t)bytesTransferred)) {
-                                CloseConnection(ctx);
-                            } else {
-                                PostClientRead(ctx);
-                            }
-                            break;
-                        default:
-                            CloseConnection(ctx);
-                            break;
+            ctx->recvPending = false;
+            if (ctx->socket == INVALID_SOCKET) {
+                // Completion of a read on a connection closed since
+                continue;
+            }
+
+            if (bytesTransferred == 0) {
+                if (completed && ctx->inUse && ctx->state == STATE_CONNECTED &&
+                    (g_channel.capabilities & MUX_CAP_HALF_CLOSE)) {
+                    // Client finished sending; data from the host still flows
+                    HandleClientEof(ctx);
+                } else {
+                    // Connection closed by client
+                    CloseConnection(ctx);
+                }
+                continue;
+            }
+
+            ctx->io->bytesTransferred = bytesTransferred;
+
+            switch (ctx->state) {
+                case STATE_INIT:
+                case STATE_AUTH:
+                    if (ProcessSocksHandshake(ctx)) {
+                        if (ctx->state == STATE_CONNECTED) {
+                            ArmConnectionTimer(ctx);
+                        }
+                        PostClientRead(ctx);
+                    } else {
+                        CloseConnection(ctx);
                     }
                     break;
-                case OP_WRITE:
-                    // Ready to read more data
-                    PostClientRead(ctx);
+                case STATE_CONNECTED:
+                    // Forward data to virtio
+                    ctx->lastActivity = g_timers.current;
+                    if (!SendToVirtio(ctx, ctx->io->buffer, (uint16_t)bytesTransferred)) {
+                        CloseConnection(ctx);
+                    } else if (g_egressPool.freeCount <= EGRESS_RESERVE_FRAMES) {
+                        // The channel is backed up; read again once writes complete
+                        ctx->readBlocked = true;
+                        g_readsBlocked = true;
+                    } else {
+                        PostClientRead(ctx);
+                    }
                     break;
                 default:
+                    CloseConnection(ctx);
                     break;
             }
         }
@@ -949,77 +1038,6 @@ HANDLE FindVirtIOSerialDevice(void) {
     return INVALID_HANDLE_VALUE;
 }
 
-void TestVirtioRead(void) {
-    printf("Testing direct read from virtio device...\n");
-    
-    uint8_t buffer[1024];
-    DWORD bytesRead = 0;
-    BOOL result;
-    OVERLAPPED overlap = {0};
-    
-    // Try to read synchronously first
-    result = ReadFile(
-        g_virtioHandle,
-        buffer,
-        sizeof(buffer),
-        &bytesRead,
-        NULL  // No overlapped
-    );
-    
-    if (result) {
-        printf("Direct sync read succeeded: %d bytes\n", bytesRead);
-        // Print the bytes if any were read
-        if (bytesRead > 0) {
-            printf("Read data: ");
-            for (DWORD i = 0; i < (bytesRead < 32 ? bytesRead : 32); i++) {
-                printf("%02X ", buffer[i]);
-            }
-            printf("\n");
-        }
-    } else {
-        printf("Direct sync read failed: %d\n", GetLastError());
-    }
-    
-    // Try an async read with manual wait
-    memset(&overlap, 0, sizeof(overlap));
-    result = ReadFile(
-        g_virtioHandle,
-        buffer,
-        sizeof(buffer),
-        &bytesRead,
-        &overlap
-    );
-    
-    if (!result) {
-        if (GetLastError() == ERROR_IO_PENDING) {
-            printf("Async read pending, waiting...\n");
-            if (GetOverlappedResult(g_virtioHandle, &overlap, &bytesRead, TRUE)) {
-                printf("Async read completed: %d bytes\n", bytesRead);
-                if (bytesRead > 0) {
-                    printf("Read data: ");
-                    for (DWORD i = 0; i < (bytesRead < 32 ? bytesRead : 32); i++) {
-                        printf("%02X ", buffer[i]);
-                    }
-                    printf("\n");
-                }
-            } else {
-                printf("GetOverlappedResult failed: %d\n", GetLastError());
-            }
-        } else {
-            printf("Async read failed immediately: %d\n", GetLastError());
-        }
-    } else {
-        printf("Async read completed immediately: %d bytes\n", bytesRead);
-        if (bytesRead > 0) {
-            printf("Read data: ");
-            for (DWORD i = 0; i < (bytesRead < 32 ? bytesRead : 32); i++) {
-                printf("%02X ", buffer[i]);
-            }
-            printf("\n");
-        }
-    }
-}
-
 bool InitializeVirtio(void) {
     // Try to find and open the virtio device
     g_virtioHandle = FindVirtIOSerialDevice();
@@ -1036,9 +1054,6 @@ bool InitializeVirtio(void) {
         return false;
     }
     
-    // Try a test read to verify the connection works
-    TestVirtioRead();
-    
     return true;
 }
 
@@ -1058,10 +1073,12 @@ void CleanupServer(void) {
         g_listenSocket = INVALID_SOCKET;
     }
 
-    // Close accept socket if open
-    if (g_acceptSocket != INVALID_SOCKET) {
-        closesocket(g_acceptSocket);
-        g_acceptSocket = INVALID_SOCKET;
+    // Close the sockets of posted accepts
+    for (i = 0; i < MAX_ACCEPTS; i++) {
+        if (g_accepts[i].socket != INVALID_SOCKET) {
+            closesocket(g_accepts[i].socket);
+            g_accepts[i].socket = INVALID_SOCKET;
+        }
     }
 
     // Close virtio handle
@@ -1077,49 +1094,274 @@ void CleanupServer(void) {
     }
 }
 
-void PostAccept(void) {
+void PostAccept(ACCEPT_OP* accept) {
     DWORD bytesReceived = 0;
 
     // Create a new socket for the next client
-    g_acceptSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (g_acceptSocket == INVALID_SOCKET) {
+    accept->socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (accept->socket == INVALID_SOCKET) {
         printf("Failed to create accept socket: %d\n", WSAGetLastError());
+        TimerSchedule(&g_timers, &g_acceptTimer, ACCEPT_RETRY_MS);
         return;
     }
 
     // Reset the overlapped structure
-    memset(&g_acceptOverlap, 0, sizeof(OVERLAPPED));
+    memset(&accept->overlap, 0, sizeof(OVERLAPPED));
 
-    // Post AcceptEx
-    if (!lpfnAcceptEx(g_listenSocket, g_acceptSocket, g_acceptBuffer, 0,
-                    sizeof(SOCKADDR_IN) + 16, sizeof(SOCKADDR_IN) + 16,
-                    &bytesReceived, &g_acceptOverlap)) {
+    // Post AcceptEx; with --accept-data it completes once the client has
+    // sent its greeting, which saves a read
+    if (!lpfnAcceptEx(g_listenSocket, accept->socket, accept->buffer, g_acceptData ? ACCEPT_DATA_SIZE : 0,
+                    ACCEPT_ADDRESS_SIZE, ACCEPT_ADDRESS_SIZE,
+                    &bytesReceived, &accept->overlap)) {
         if (WSAGetLastError() != ERROR_IO_PENDING) {
             printf("AcceptEx failed: %d\n", WSAGetLastError());
-            closesocket(g_acceptSocket);
-            g_acceptSocket = INVALID_SOCKET;
+            closesocket(accept->socket);
+            accept->socket = INVALID_SOCKET;
+            TimerSchedule(&g_timers, &g_acceptTimer, ACCEPT_RETRY_MS);
+            return;
         }
     }
+    accept->posted = true;
 }
 
-void PostVirtioRead(void) {
-    DWORD bytesRead;
-    BOOL result;
+ACCEPT_OP* FindAccept(OVERLAPPED* overlap) {
+    ACCEPT_OP* accept = CONTAINING_RECORD(overlap, ACCEPT_OP, overlap);
 
-    // Reset the overlapped structure
-    memset(&g_virtioReadOverlap, 0, sizeof(OVERLAPPED));
-
-    // Post ReadFile on virtio device
-    result = ReadFile(
-        g_virtioHandle,
-        g_virtioReadBuffer,
-        sizeof(g_virtioReadBuffer),
-        &bytesRead,
-        &g_virtioReadOverlap
-    );
+    if (accept < g_accepts || accept >= g_accepts + MAX_ACCEPTS) {
+        return NULL;
+    }
+    return accept;
+}
+
+void CompleteAccept(ACCEPT_OP* accept, BOOL completed, DWORD bytesReceived) {
+    SOCKET clientSocket = accept->socket;
 
-    if (!result && GetLastError() != ERROR_IO_PENDING) {
-        printf("Failed to post virtio read: %d\n", GetLastError());
+    accept->socket = INVALID_SOCKET;
+    accept->posted = false;
+    if (!completed) {
+        // Includes accepts of silent clients closed by CheckAccepts
+        if (clientSocket != INVALID_SOCKET) {
+            closesocket(clientSocket);
+        }
+    } else {
+        // The accepted socket takes on the listening socket's properties,
+        // which shutdown() relies on
+        setsockopt(clientSocket, SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT,
+                   (char*)&g_listenSocket, sizeof(g_listenSocket));
+        if (!HandleNewConnection(clientSocket, accept->buffer, bytesReceived)) {
+            closesocket(clientSocket);
+        }
+    }
+
+    // The first bytes have been taken out of the buffer; post it again
+    PostAccept(accept);
+}
+
+// Posts the accepts that failed to post earlier. With --accept-data a
+// client that connects without sending anything would also hold an accept
+// forever; those connected for longer than the handshake timeout are
+// closed, which completes their accept.
+void CheckAccepts(TIMER* timer, void* context) {
+    bool retry = false;
+    DWORD seconds;
+    int length;
+    int i;
+
+    (void)context;
+
+    for (i = 0; i < g_acceptCount; i++) {
+        if (!g_accepts[i].posted) {
+            PostAccept(&g_accepts[i]);
+            retry = retry || !g_accepts[i].posted;
+            continue;
+        }
+        if (!g_acceptData || g_accepts[i].socket == INVALID_SOCKET) {
+            continue;
+        }
+        length = sizeof(seconds);
+        if (getsockopt(g_accepts[i].socket, SOL_SOCKET, SO_CONNECT_TIME, (char*)&seconds, &length) == 0 &&
+            seconds != 0xFFFFFFFF && seconds * 1000ULL >= HANDSHAKE_TIMEOUT_MS) {
+            printf("Client sent nothing after connecting, dropping it\n");
+            closesocket(g_accepts[i].socket);
+            g_accepts[i].socket = INVALID_SOCKET;
+        }
+    }
+
+    if (retry) {
+        TimerSchedule(&g_timers, timer, ACCEPT_RETRY_MS);
+    } else if (g_acceptData) {
+        TimerSchedule(&g_timers, timer, ACCEPT_CHECK_MS);
+    }
+}
+
+// Keeps up to VIRTIO_READS reads posted on the channel while receive
+// buffers are free. Reads complete in the order they were posted.
+void PostVirtioReads(void) {
+    MUX_RX_BUFFER* buffer;
+    OVERLAPPED* overlap;
+
+    if (g_virtioFailed) {
+        return;
+    }
+
+    while (g_virtioReadsPosted < VIRTIO_READS && (buffer = MuxRxAlloc(&g_virtioRx)) != NULL) {
+        overlap = &g_virtioReadOverlaps[buffer->index];
+        memset(overlap, 0, sizeof(OVERLAPPED));
+
+        if (!ReadFile(g_virtioHandle, buffer->data + MUX_RX_HEADROOM, MUX_RX_READ_SIZE, NULL, overlap) &&
+            GetLastError() != ERROR_IO_PENDING) {
+            printf("Failed to post virtio read: %d\n", GetLastError());
+            MuxRxComplete(&g_virtioRx, buffer, 0);
+            VirtioFailed();
+            return;
+        }
+        g_virtioReadsPosted++;
+    }
+}
+
+MUX_RX_BUFFER* FindVirtioRead(OVERLAPPED* overlap) {
+    if (overlap < g_virtioReadOverlaps || overlap >= g_virtioReadOverlaps + VIRTIO_READ_BUFFERS) {
+        return NULL;
+    }
+    return &g_virtioReadBuffers[overlap - g_virtioReadOverlaps];
+}
+
+void CompleteVirtioRead(MUX_RX_BUFFER* buffer, BOOL completed, DWORD bytesRead) {
+    g_virtioReadsPosted--;
+
+    // Cancelled, or data from before the failure
+    if (g_virtioFailed) {
+        MuxRxComplete(&g_virtioRx, buffer, 0);
+        return;
+    }
+
+    // Posting the read again would fail the same way; reopen the device
+    if (!completed || bytesRead == 0) {
+        if (!completed) {
+            printf("Virtio read failed: %d\n", GetLastError());
+        } else {
+            printf("Virtio read returned no data\n");
+        }
+        MuxRxComplete(&g_virtioRx, buffer, 0);
+        VirtioFailed();
+        return;
+    }
+
+    MuxRxComplete(&g_virtioRx, buffer, bytesRead);
+    ProcessVirtioIngress();
+    PostVirtioReads();
+}
+
+// Hands the frames of completed reads, in order, to the control handler
+// and to the clients. A frame no client send is free for stops the rest;
+// it is retried when a send completes.
+void ProcessVirtioIngress(void) {
+    VIRTIO_MSG_HEADER header;
+    const uint8_t* payload;
+    MUX_RX_BUFFER* buffer;
+    int result;
+
+    g_ingressStalled = false;
+    while ((result = MuxRxNext(&g_virtioRx, BUFFER_SIZE, &header, &payload, &buffer)) == MUX_FRAME_COMPLETE) {
+        if (header.connId == MUX_CONTROL_CONNID) {
+            HandleControlFrame(payload, header.length);
+        } else if (!ForwardToClient(header.connId, buffer, payload, header.length)) {
+            g_ingressStalled = true;
+            return;
+        }
+        MuxRxConsume(&g_virtioRx, &header);
+    }
+
+    if (result == MUX_FRAME_INVALID) {
+        printf("Invalid frame length from virtio, dropping received data\n");
+        MuxRxDiscard(&g_virtioRx);
+    }
+}
+
+// Queues host data for the stream's client, by reference into the receive
+// buffer, and sends it unless a send is in flight already. Frames for
+// streams that are gone are dropped; false means the client is too far
+// behind to take more.
+bool ForwardToClient(uint16_t connId, MUX_RX_BUFFER* buffer, const uint8_t* data, uint16_t length) {
+    CONNECTION_CONTEXT* ctx;
+    MUX_RX_QUEUE* queue;
+
+    if (connId >= MAX_CONNECTIONS || !g_connections[connId].inUse ||
+        g_connections[connId].state != STATE_CONNECTED || length == 0) {
+        return true;
+    }
+
+    ctx = &g_connections[connId];
+    queue = &ctx->io->sendQueue;
+    if (queue->count > 0 && (queue->count == MUX_RX_QUEUE_SLICES || queue->bytes + length > CLIENT_QUEUE_BYTES)) {
+        return false;
+    }
+
+    ctx->lastActivity = g_timers.current;
+    MuxRxQueuePush(queue, buffer, data, length);
+    if (!ctx->sendPending) {
+        PostClientSend(ctx);
+    }
+    return true;
+}
+
+// Posts everything queued for the client as one gathered send. Frames that
+// arrive meanwhile queue up behind it.
+void PostClientSend(CONNECTION_CONTEXT* ctx) {
+    CONNECTION_IO* io = ctx->io;
+    MUX_RX_SLICE* slice;
+    int i;
+
+    for (i = 0; i < io->sendQueue.count; i++) {
+        slice = MuxRxQueueAt(&io->sendQueue, i);
+        io->sendBufs[i].buf = (char*)slice->data;
+        io->sendBufs[i].len = (ULONG)slice->length;
+    }
+    memset(&io->sendOp.overlap, 0, sizeof(OVERLAPPED));
+
+    if (WSASend(ctx->socket, io->sendBufs, (DWORD)io->sendQueue.count, NULL, 0, &io->sendOp.overlap, NULL) ==
+        SOCKET_ERROR && WSAGetLastError() != WSA_IO_PENDING) {
+        printf("WSASend failed: %d\n", WSAGetLastError());
+        MuxRxQueueClear(&g_virtioRx, &io->sendQueue);
+        CloseConnection(ctx);
+        return;
+    }
+    ctx->sendPending = true;
+}
+
+void CompleteClientSend(CONNECTION_CONTEXT* ctx, BOOL completed, DWORD bytesSent) {
+    CONNECTION_IO* io = ctx->io;
+
+    ctx->sendPending = false;
+    if (!completed || ctx->socket == INVALID_SOCKET) {
+        // The client is gone; so is everything queued for it
+        MuxRxQueueClear(&g_virtioRx, &io->sendQueue);
+        CloseConnection(ctx);
+    } else {
+        MuxRxQueueAdvance(&g_virtioRx, &io->sendQueue, bytesSent);
+        if (io->sendQueue.count > 0) {
+            PostClientSend(ctx);
+        } else {
+            FinishClientSends(ctx);
+        }
+    }
+
+    if (g_ingressStalled) {
+        ProcessVirtioIngress();
+    }
+    PostVirtioReads();
+}
+
+// Once the host has finished and the client has all of its data, shuts
+// down the client's write side; a stream done both ways is closed
+void FinishClientSends(CONNECTION_CONTEXT* ctx) {
+    if (!ctx->hostEof || ctx->sendPending || ctx->io->sendQueue.count > 0) {
+        return;
+    }
+
+    shutdown(ctx->socket, SD_SEND);
+    if (ctx->clientEof) {
+        CloseConnection(ctx);
     }
 }
 
@@ -1128,41 +1370,51 @@ void PostClientRead(CONNECTION_CONTEXT* ctx) {
     int result;
 
     // Setup the overlapped structure
-    memset(&ctx->overlap, 0, sizeof(OVERLAPPED));
+    memset(&ctx->io->recvOp.overlap, 0, sizeof(OVERLAPPED));
     
-    // Setup the buffer
-    ctx->wsaBuf.buf = (char*)ctx->buffer;
-    ctx->wsaBuf.len = BUFFER_SIZE;
-    ctx->pendingOp = OP_READ;
+    // Setup the buffer; stream data must fit in one frame, and handshake
+    // bytes go behind an unfinished greeting or request
+    if (ctx->state == STATE_CONNECTED) {
+        ctx->io->recvBuf.buf = (char*)ctx->io->buffer;
+        ctx->io->recvBuf.len = g_channel.maxPayload;
+    } else {
+        ctx->io->recvBuf.buf = (char*)ctx->io->buffer + ctx->io->handshakeLen;
+        ctx->io->recvBuf.len = BUFFER_SIZE - ctx->io->handshakeLen;
+    }
 
-    // Post WSARecv
+    // Post WSARecv; sends to the client go on independently
     result = WSARecv(
         ctx->socket,
-        &ctx->wsaBuf,
+        &ctx->io->recvBuf,
         1,
         NULL,
         &flags,
-        &ctx->overlap,
+        &ctx->io->recvOp.overlap,
         NULL
     );
 
     if (result == SOCKET_ERROR && WSAGetLastError() != WSA_IO_PENDING) {
         printf("WSARecv failed: %d\n", WSAGetLastError());
         CloseConnection(ctx);
+        return;
     }
+    ctx->recvPending = true;
 }
 
+// A slot whose last connection still has operations in flight is skipped;
+// their completions would land on the new one
 int GetFreeConnectionSlot(void) {
     int i;
     for (i = 0; i < MAX_CONNECTIONS; i++) {
-        if (!g_connections[i].inUse) {
+        if (!g_connections[i].inUse && !g_connections[i].recvPending && !g_connections[i].sendPending) {
             return i;
         }
     }
     return -1;
 }
 
-bool HandleNewConnection(SOCKET clientSocket) {
+// Takes on an accepted client; data holds what it sent with the accept
+bool HandleNewConnection(SOCKET clientSocket, const uint8_t* data, DWORD length) {
     int slot = GetFreeConnectionSlot();
     CONNECTION_CONTEXT* ctx;
 
@@ -1182,171 +1434,386 @@ bool HandleNewConnection(SOCKET clientSocket) {
     ctx->socket = clientSocket;
     ctx->inUse = true;
     ctx->state = STATE_INIT;
-    memset(&ctx->overlap, 0, sizeof(OVERLAPPED));
+    ctx->clientEof = false;
+    ctx->hostEof = false;
+    ctx->awaitingOpen = false;
+    ctx->readBlocked = false;
+    ctx->lastActivity = g_timers.current;
+    ctx->io->handshakeLen = 0;
+
+    // Clients that stall in the SOCKS handshake are dropped
+    ArmConnectionTimer(ctx);
+
+    // A greeting that came with the accept is handled right away
+    if (length > 0) {
+        memcpy(ctx->io->buffer, data, length);
+        ctx->io->bytesTransferred = length;
+        if (!ProcessSocksHandshake(ctx)) {
+            CloseConnection(ctx);
+            return true;
+        }
+        if (ctx->state == STATE_CONNECTED) {
+            ArmConnectionTimer(ctx);
+        }
+    }
 
-    // Post initial read to receive SOCKS handshake
+    // Post a read for the rest of the SOCKS handshake
     PostClientRead(ctx);
     
     return true;
 }
 
 void CloseConnection(CONNECTION_CONTEXT* ctx) {
-    if (!ctx->inUse) {
+    if (!ctx->inUse || ctx->state == STATE_CLOSING) {
         return;
     }
 
     closesocket(ctx->socket);
     ctx->socket = INVALID_SOCKET;
+
+    // Once the host knows about the stream, keep the slot until it
+    // confirms the close with its own CLOSE
+    if (ctx->state == STATE_CONNECTED) {
+        ctx->state = STATE_CLOSING;
+        ArmConnectionTimer(ctx);
+        SendControlToVirtio((uint16_t)ctx->connId, MUX_CTRL_CLOSE, (uint16_t)ctx->connId);
+        return;
+    }
+
+    TimerCancel(&g_timers, &ctx->io->timer);
     ctx->inUse = false;
 }
 
-bool ProcessSocksAuth(CONNECTION_CONTEXT* ctx) {
-    uint8_t ver, nmethods, i;
-    uint8_t response[2];
-    WSABUF wsaBuf;
-    DWORD bytesSent;
+// Schedules the timeout that applies to the stream's current state
+void ArmConnectionTimer(CONNECTION_CONTEXT* ctx) {
+    uint64_t delayMs;
 
-    if (ctx->bytesTransferred < 2) {
-        printf("Invalid SOCKS auth packet (too short)\n");
-        return false;
+    if (ctx->state == STATE_CLOSING || ctx->clientEof || ctx->hostEof) {
+        delayMs = LINGER_TIMEOUT_MS;
+    } else if (ctx->state != STATE_CONNECTED) {
+        delayMs = HANDSHAKE_TIMEOUT_MS;
+    } else if (g_idleTimeoutMs != 0) {
+        delayMs = g_idleTimeoutMs;
+    } else {
+        TimerCancel(&g_timers, &ctx->io->timer);
+        return;
     }
 
-    ver = ctx->buffer[0];
-    nmethods = ctx->buffer[1];
+    TimerSchedule(&g_timers, &ctx->io->timer, delayMs);
+}
 
-    if (ver != SOCKS_VERSION) {
-        printf("Unsupported SOCKS version: %d\n", ver);
+void ConnectionTimeout(TIMER* timer, void* context) {
+    CONNECTION_CONTEXT* ctx = (CONNECTION_CONTEXT*)context;
+
+    (void)timer;
+
+    if (ctx->state == STATE_CLOSING) {
+        // The host never confirmed the close; reclaim the slot anyway
+        printf("Connection %d: no CLOSE from host, releasing\n", ctx->connId);
+        MuxSchedDropFlow(&g_egressSched, (uint16_t)ctx->connId);
+        ctx->inUse = false;
+    } else if (ctx->state != STATE_CONNECTED) {
+        printf("Connection %d: SOCKS handshake timed out\n", ctx->connId);
+        CloseConnection(ctx);
+    } else if (ctx->clientEof || ctx->hostEof) {
+        printf("Connection %d: half-closed for too long\n", ctx->connId);
+        CloseConnection(ctx);
+    } else if (g_timers.current - ctx->lastActivity >= g_idleTimeoutMs) {
+        printf("Connection %d: idle timeout\n", ctx->connId);
+        CloseConnection(ctx);
+    } else {
+        // Traffic since the timer was armed; only wait out the remainder
+        TimerSchedule(&g_timers, &ctx->io->timer, ctx->lastActivity + g_idleTimeoutMs - g_timers.current);
+    }
+}
+
+bool SendHello(uint8_t type) {
+    MUX_HELLO msg;
+
+    msg.type = type;
+    msg.version = MUX_PROTOCOL_VERSION;
+    msg.maxPayload = BUFFER_SIZE;
+    msg.capabilities = MUX_CAPABILITIES;
+
+    if (!MuxSchedEnqueue(&g_egressSched, CONTROL_FLOW, MUX_CONTROL_CONNID, (const uint8_t*)&msg, sizeof(msg))) {
+        printf("Virtio egress queue full, dropping HELLO\n");
         return false;
     }
 
-    if (ctx->bytesTransferred < 2 + nmethods) {
-        printf("Invalid SOCKS auth packet (methods truncated)\n");
+    return FlushVirtio();
+}
+
+// Applies the host's HELLO parameters; the channel stays down on a mismatch
+bool NegotiateChannel(const MUX_HELLO* peer) {
+    g_channel.ready = false;
+
+    if (peer->version != MUX_PROTOCOL_VERSION) {
+        printf("Error: host speaks protocol version %u, this server speaks %d\n",
+               peer->version, MUX_PROTOCOL_VERSION);
+        return false;
+    }
+    if (peer->maxPayload < MUX_MIN_PAYLOAD) {
+        printf("Error: host frame payload limit %u is below the minimum of %d\n",
+               peer->maxPayload, MUX_MIN_PAYLOAD);
         return false;
     }
 
-    // Check if no-auth method is supported
-    for (i = 0; i < nmethods; i++) {
-        if (ctx->buffer[2 + i] == SOCKS_AUTH_NONE) {
-            // Send auth response
-            response[0] = SOCKS_VERSION;
-            response[1] = SOCKS_AUTH_NONE;
+    g_channel.version = peer->version;
+    g_channel.maxPayload = peer->maxPayload < BUFFER_SIZE ? peer->maxPayload : BUFFER_SIZE;
+    g_channel.capabilities = peer->capabilities & MUX_CAPABILITIES;
+    g_channel.ready = true;
+    printf("Channel ready: protocol %u, max payload %u, capabilities 0x%08X\n",
+           g_channel.version, g_channel.maxPayload, g_channel.capabilities);
+    return true;
+}
 
-            wsaBuf.buf = (char*)response;
-            wsaBuf.len = 2;
+// Drops every stream without CLOSE frames; the host has started over
+void ResetStreams(void) {
+    int i;
 
-            if (WSASend(ctx->socket, &wsaBuf, 1, &bytesSent, 0, NULL, NULL) == SOCKET_ERROR) {
-                printf("Failed to send auth response: %d\n", WSAGetLastError());
-                return false;
-            }
+    for (i = 0; i < MAX_CONNECTIONS; i++) {
+        CONNECTION_CONTEXT* ctx = &g_connections[i];
 
-            return true;
+        if (!ctx->inUse) {
+            continue;
         }
+        closesocket(ctx->socket);
+        ctx->socket = INVALID_SOCKET;
+        TimerCancel(&g_timers, &ctx->io->timer);
+        MuxSchedDropFlow(&g_egressSched, (uint16_t)i);
+        // Late completions for the old socket are ignored in this state
+        ctx->state = STATE_CLOSING;
+        ctx->inUse = false;
+    }
+}
+
+void HandleControlFrame(const uint8_t* data, uint16_t length) {
+    MUX_CTRL_STREAM msg;
+    MUX_HELLO hello;
+    MUX_HEARTBEAT heartbeat;
+    MUX_OPEN_RESULT result;
+
+    if (length < 1) {
+        return;
     }
 
-    printf("No supported auth methods\n");
-    return false;
+    switch (data[0]) {
+        case MUX_CTRL_HELLO:
+        case MUX_CTRL_HELLO_ACK:
+            if (length < sizeof(hello)) {
+                printf("Invalid HELLO control frame\n");
+                return;
+            }
+            memcpy(&hello, data, sizeof(hello));
+            if (data[0] == MUX_CTRL_HELLO) {
+                // The host (re)started: nothing it knew about survives
+                printf("HELLO from host\n");
+                ResetStreams();
+                SendHello(MUX_CTRL_HELLO_ACK);
+            }
+            NegotiateChannel(&hello);
+            break;
+        case MUX_CTRL_PING:
+            // Echo the heartbeat so the host can measure the round trip
+            if (length < sizeof(heartbeat)) {
+                printf("Invalid PING control frame\n");
+                return;
+            }
+            memcpy(&heartbeat, data, sizeof(heartbeat));
+            heartbeat.type = MUX_CTRL_PONG;
+            if (MuxSchedEnqueue(&g_egressSched, CONTROL_FLOW, MUX_CONTROL_CONNID,
+                                (const uint8_t*)&heartbeat, sizeof(heartbeat))) {
+                FlushVirtio();
+            }
+            break;
+        case MUX_CTRL_CLOSE:
+            if (length < sizeof(msg)) {
+                printf("Invalid CLOSE control frame\n");
+                return;
+            }
+            memcpy(&msg, data, sizeof(msg));
+            HandleHostClose(msg.connId);
+            break;
+        case MUX_CTRL_EOF:
+            if (length < sizeof(msg)) {
+                printf("Invalid EOF control frame\n");
+                return;
+            }
+            memcpy(&msg, data, sizeof(msg));
+            HandleHostEof(msg.connId);
+            break;
+        case MUX_CTRL_OPEN_ACK:
+        case MUX_CTRL_OPEN_FAIL:
+            if (length < sizeof(result)) {
+                printf("Invalid open result control frame\n");
+                return;
+            }
+            memcpy(&result, data, sizeof(result));
+            HandleOpenResult(&result);
+            break;
+        default:
+            printf("Ignoring unknown control frame type %u\n", data[0]);
+            break;
+    }
 }
 
-bool ProcessSocksRequest(CONNECTION_CONTEXT* ctx) {
-    uint8_t ver, cmd, rsv, atyp;
-    uint8_t response[10]; // We'll use IPv4 response format for simplicity
-    WSABUF wsaBuf;
-    DWORD bytesSent;
-    uint16_t port;
-    char addrBuf[256];
-    int addrLen = 0;
+void HandleHostClose(uint16_t connId) {
+    CONNECTION_CONTEXT* ctx;
 
-    if (ctx->bytesTransferred < 4) {
-        printf("Invalid SOCKS request (too short)\n");
-        return false;
+    if (connId >= MAX_CONNECTIONS || !g_connections[connId].inUse) {
+        return;
     }
 
-    ver = ctx->buffer[0];
-    cmd = ctx->buffer[1];
-    rsv = ctx->buffer[2];
-    atyp = ctx->buffer[3];
+    ctx = &g_connections[connId];
+    if (ctx->state == STATE_CLOSING) {
+        // Both sides have now closed; the slot can be reused
+        TimerCancel(&g_timers, &ctx->io->timer);
+        ctx->inUse = false;
+        return;
+    }
 
-    if (ver != SOCKS_VERSION) {
-        printf("Unsupported SOCKS version in request: %d\n", ver);
-        return false;
+    // The host no longer wants anything queued for this stream. A client
+    // still waiting for its SOCKS reply learns that the connect failed.
+    MuxSchedDropFlow(&g_egressSched, connId);
+    if (ctx->awaitingOpen) {
+        ctx->awaitingOpen = false;
+        SendSocksReply(ctx, SOCKS_REPLY_GENERAL_FAILURE, NULL);
     }
+    CloseConnection(ctx);
+    TimerCancel(&g_timers, &ctx->io->timer);
+    ctx->inUse = false;
+}
 
-    if (cmd != SOCKS_CMD_CONNECT) {
-        printf("Unsupported SOCKS command: %d\n", cmd);
-        return false;
+void HandleHostEof(uint16_t connId) {
+    CONNECTION_CONTEXT* ctx;
+
+    if (connId >= MAX_CONNECTIONS || !g_connections[connId].inUse ||
+        g_connections[connId].state != STATE_CONNECTED || g_connections[connId].hostEof) {
+        return;
     }
 
-    // Extract address based on address type
-    switch (atyp) {
-        case SOCKS_ATYP_IPV4:
-            if (ctx->bytesTransferred < 10) {
-                printf("Invalid IPv4 request (too short)\n");
-                return false;
-            }
-            sprintf(addrBuf, "%d.%d.%d.%d", 
-                ctx->buffer[4], ctx->buffer[5], ctx->buffer[6], ctx->buffer[7]);
-            port = (ctx->buffer[8] << 8) | ctx->buffer[9];
-            addrLen = 4;
-            break;
-        case SOCKS_ATYP_DOMAIN:
-            if (ctx->bytesTransferred < 5) {
-                printf("Invalid domain request (too short)\n");
-                return false;
-            }
-            addrLen = ctx->buffer[4];
-            if (ctx->bytesTransferred < 5 + addrLen + 2) {
-                printf("Invalid domain request (domain truncated)\n");
+    // Data from the host arrives before its EOF; the client's write side
+    // is shut down once its sends have completed
+    ctx = &g_connections[connId];
+    ctx->hostEof = true;
+    ArmConnectionTimer(ctx);
+    FinishClientSends(ctx);
+}
+
+// The host finished connecting the stream's upstream socket. The client's
+// SOCKS reply was held back for this, unless the server runs optimistic.
+void HandleOpenResult(const MUX_OPEN_RESULT* result) {
+    CONNECTION_CONTEXT* ctx;
+
+    if (result->connId >= MAX_CONNECTIONS || !g_connections[result->connId].inUse ||
+        g_connections[result->connId].state != STATE_CONNECTED) {
+        return;
+    }
+
+    ctx = &g_connections[result->connId];
+    if (ctx->awaitingOpen) {
+        ctx->awaitingOpen = false;
+        if (!SendSocksReply(ctx, result->reply, result) || result->type == MUX_CTRL_OPEN_FAIL) {
+            CloseConnection(ctx);
+        }
+    } else if (result->type == MUX_CTRL_OPEN_FAIL) {
+        // Optimistic: the client was told it is connected; all it sees is the close
+        CloseConnection(ctx);
+    }
+}
+
+void HandleClientEof(CONNECTION_CONTEXT* ctx) {
+    ctx->clientEof = true;
+    SendControlToVirtio((uint16_t)ctx->connId, MUX_CTRL_EOF, (uint16_t)ctx->connId);
+
+    if (ctx->hostEof && !ctx->sendPending) {
+        CloseConnection(ctx);
+    } else {
+        ArmConnectionTimer(ctx);
+    }
+}
+
+// Runs the SOCKS handshake over what the client has sent so far. Data a
+// client sent right behind its CONNECT request goes on to the host.
+bool ProcessSocksHandshake(CONNECTION_CONTEXT* ctx) {
+    CONNECTION_IO* io = ctx->io;
+    DWORD length = io->handshakeLen + io->bytesTransferred;
+    DWORD offset = 0;
+    SOCKS_STEP step;
+    int result;
+
+    while (ctx->state != STATE_CONNECTED) {
+        result = SocksHandshakeStep(&ctx->state, io->buffer + offset, length - offset, &step);
+        if (result == SOCKS_STEP_INVALID) {
+            return false;
+        }
+        if (result == SOCKS_STEP_PARTIAL) {
+            // Keep the unfinished message for the next read
+            memmove(io->buffer, io->buffer + offset, length - offset);
+            io->handshakeLen = length - offset;
+            return true;
+        }
+
+        offset += (DWORD)step.consumed;
+        if (result == SOCKS_STEP_REPLY) {
+            if (!SendToClient(ctx, step.reply, step.replyLength)) {
                 return false;
             }
-            memcpy(addrBuf, &ctx->buffer[5], addrLen);
-            addrBuf[addrLen] = '\0';
-            port = (ctx->buffer[5 + addrLen] << 8) | ctx->buffer[5 + addrLen + 1];
-            break;
-        case SOCKS_ATYP_IPV6:
-            printf("IPv6 not supported in this implementation\n");
+        } else if (!OpenHostStream(ctx, &step.request)) {
             return false;
-        default:
-            printf("Unsupported address type: %d\n", atyp);
+        }
+    }
+
+    io->handshakeLen = 0;
+    while (offset < length) {
+        uint16_t chunk = length - offset < g_channel.maxPayload ? (uint16_t)(length - offset) : g_channel.maxPayload;
+
+        ctx->lastActivity = g_timers.current;
+        if (!SendToVirtio(ctx, io->buffer + offset, chunk)) {
             return false;
+        }
+        offset += chunk;
     }
 
-    printf("SOCKS request: Connect to %s:%d\n", addrBuf, port);
+    return true;
+}
 
-    // Send connection request to virtio
-    // Format: [conn_id][atyp][addr_len][addr][port]
-    uint8_t reqBuf[4 + 256 + 2]; // 4 bytes header + max addr + port
-    uint16_t reqLen = 0;
-    
-    reqBuf[reqLen++] = atyp;
-    
-    if (atyp == SOCKS_ATYP_DOMAIN) {
-        reqBuf[reqLen++] = (uint8_t)addrLen;
-        memcpy(&reqBuf[reqLen], addrBuf, addrLen);
-        reqLen += addrLen;
-    } else { // IPv4
-        memcpy(&reqBuf[reqLen], &ctx->buffer[4], 4);
-        reqLen += 4;
+// Sends the client's CONNECT request to the host as the stream's first frame
+bool OpenHostStream(CONNECTION_CONTEXT* ctx, const SOCKS_REQUEST* request) {
+    printf("SOCKS request: Connect to %s:%d\n", request->host, request->port);
+
+    if (!g_channel.ready) {
+        printf("Virtio channel not ready, refusing request\n");
+        return false;
     }
-    
-    // Copy port
-    reqBuf[reqLen++] = (port >> 8) & 0xFF;
-    reqBuf[reqLen++] = port & 0xFF;
-    
-    if (!SendToVirtio(ctx, reqBuf, reqLen)) {
+
+    // Pick the egress priority class for this stream before its first frame
+    MuxSchedSetPriority(&g_egressSched, (uint16_t)ctx->connId, MuxSchedPortPriority(&g_egressSched, request->port));
+
+    if (!SendToVirtio(ctx, request->open, request->openLength)) {
         printf("Failed to send connection request to virtio\n");
         return false;
     }
 
-    // Send success response
-    response[0] = SOCKS_VERSION;
-    response[1] = SOCKS_REPLY_SUCCESS;
-    response[2] = 0; // RSV
-    response[3] = SOCKS_ATYP_IPV4;
-    // Use all zeros for the bound address and port for simplicity
-    memset(&response[4], 0, 6);
+    // The host now owns a stream for this ID; closing must go through CLOSE
+    ctx->state = STATE_CONNECTED;
+
+    // A host that reports connect results gets to answer the client;
+    // otherwise, or when running optimistic, report success right away
+    if ((g_channel.capabilities & MUX_CAP_OPEN_RESULT) && !g_optimisticOpen) {
+        ctx->awaitingOpen = true;
+        return true;
+    }
+
+    return SendSocksReply(ctx, SOCKS_REPLY_SUCCESS, NULL);
+}
+
+bool SendToClient(CONNECTION_CONTEXT* ctx, const uint8_t* data, size_t length) {
+    WSABUF wsaBuf;
+    DWORD bytesSent;
 
-    wsaBuf.buf = (char*)response;
-    wsaBuf.len = 10;
+    wsaBuf.buf = (char*)data;
+    wsaBuf.len = (ULONG)length;
 
     if (WSASend(ctx->socket, &wsaBuf, 1, &bytesSent, 0, NULL, NULL) == SOCKET_ERROR) {
         printf("Failed to send SOCKS response: %d\n", WSAGetLastError());
@@ -1356,46 +1823,190 @@ bool ProcessSocksRequest(CONNECTION_CONTEXT* ctx) {
     return true;
 }
 
-bool SendToVirtio(CONNECTION_CONTEXT* ctx, const uint8_t* data, uint16_t length) {
-    uint8_t buffer[BUFFER_SIZE + sizeof(VIRTIO_MSG_HEADER)];
-    VIRTIO_MSG_HEADER* header = (VIRTIO_MSG_HEADER*)buffer;
-    DWORD bytesWritten;
-    OVERLAPPED overlap = {0};
-    BOOL result;
+// Answers the client's CONNECT request
+bool SendSocksReply(CONNECTION_CONTEXT* ctx, uint8_t reply, const MUX_OPEN_RESULT* result) {
+    uint8_t response[SOCKS_REPLY_MAX];
 
-    if (length > BUFFER_SIZE) {
+    return SendToClient(ctx, response, SocksBuildReply(response, reply, result));
+}
+
+bool SendToVirtio(CONNECTION_CONTEXT* ctx, const uint8_t* data, uint16_t length) {
+    if (length > g_channel.maxPayload) {
         printf("Data too large for virtio buffer\n");
         return false;
     }
 
-    // Prepare message header
-    header->connId = (uint16_t)ctx->connId;
-    header->length = length;
+    // Queue the frame on the stream's flow; the scheduler decides the order
+    if (!MuxSchedEnqueue(&g_egressSched, (uint16_t)ctx->connId, (uint16_t)ctx->connId, data, length)) {
+        printf("Virtio egress queue full\n");
+        return false;
+    }
 
-    // Copy data after header
-    memcpy(buffer + sizeof(VIRTIO_MSG_HEADER), data, length);
+    return FlushVirtio();
+}
 
-    // Write to virtio synchronously for simplicity
-    result = WriteFile(
-        g_virtioHandle,
-        buffer,
-        sizeof(VIRTIO_MSG_HEADER) + length,
-        &bytesWritten,
-        &overlap
-    );
+bool SendControlToVirtio(uint16_t flowId, uint8_t type, uint16_t connId) {
+    MUX_CTRL_STREAM msg;
 
-    if (!result) {
-        if (GetLastError() == ERROR_IO_PENDING) {
-            // Wait for the write to complete
-            if (!GetOverlappedResult(g_virtioHandle, &overlap, &bytesWritten, TRUE)) {
-                printf("WriteFile to virtio failed: %d\n", GetLastError());
-                return false;
-            }
-        } else {
+    msg.type = type;
+    msg.connId = connId;
+
+    // Stream control frames share the stream's flow so they stay behind its data
+    if (!MuxSchedEnqueue(&g_egressSched, flowId, MUX_CONTROL_CONNID, (const uint8_t*)&msg, sizeof(msg))) {
+        printf("Virtio egress queue full, dropping control frame %u for connection %u\n", type, connId);
+        return false;
+    }
+
+    return FlushVirtio();
+}
+
+// Packs queued frames into free write buffers, in scheduler order, and
+// posts the writes. Frames that arrive while every buffer is in flight are
+// sent together once one completes. Writes on the handle reach the channel
+// in the order they were posted.
+bool FlushVirtio(void) {
+    VIRTIO_WRITE* write;
+    MUX_FRAME* frame;
+    int i;
+
+    if (g_virtioFailed) {
+        return false;
+    }
+
+    for (i = 0; i < VIRTIO_WRITES && g_egressSched.queuedFrames > 0; i++) {
+        write = &g_virtioWrites[i];
+        if (write->inUse) {
+            continue;
+        }
+
+        // Any frame fits as long as a full-size one does
+        write->length = 0;
+        while (write->length + sizeof(VIRTIO_MSG_HEADER) + MUX_MAX_PAYLOAD <= VIRTIO_WRITE_SIZE &&
+               (frame = MuxSchedDequeue(&g_egressSched)) != NULL) {
+            memcpy(write->data + write->length, frame->data, frame->size);
+            write->length += frame->size;
+            MuxPoolFree(&g_egressPool, frame);
+        }
+
+        memset(&write->overlap, 0, sizeof(OVERLAPPED));
+        write->inUse = true;
+        if (!WriteFile(g_virtioHandle, write->data, write->length, NULL, &write->overlap) &&
+            GetLastError() != ERROR_IO_PENDING) {
             printf("WriteFile to virtio failed: %d\n", GetLastError());
+            write->inUse = false;
+            VirtioFailed();
             return false;
         }
     }
 
-    return (bytesWritten == sizeof(VIRTIO_MSG_HEADER) + length);
-} 
\ No newline at end of file
+    return true;
+}
+
+VIRTIO_WRITE* FindVirtioWrite(OVERLAPPED* overlap) {
+    int i;
+
+    for (i = 0; i < VIRTIO_WRITES; i++) {
+        if (overlap == &g_virtioWrites[i].overlap) {
+            return &g_virtioWrites[i];
+        }
+    }
+    return NULL;
+}
+
+void CompleteVirtioWrite(VIRTIO_WRITE* write, BOOL completed, DWORD bytesWritten) {
+    write->inUse = false;
+
+    // Writes posted after this one may have gone out already, so the rest
+    // cannot be sent again without reordering the stream
+    if (!completed || bytesWritten != write->length) {
+        if (g_virtioFailed) {
+            return;
+        }
+        if (!completed) {
+            printf("WriteFile to virtio failed: %d\n", GetLastError());
+        } else {
+            printf("Short write to virtio: %lu of %lu bytes\n", bytesWritten, write->length);
+        }
+        VirtioFailed();
+        return;
+    }
+
+    FlushVirtio();
+    ResumeClientReads();
+}
+
+// The host lost part of what was written and can no longer find the frame
+// boundaries, or the device stopped reading. Every stream is dropped and
+// the operations in flight are cancelled; the channel is then opened again
+// and the handshake starts over.
+void VirtioFailed(void) {
+    if (g_virtioFailed) {
+        return;
+    }
+
+    printf("Virtio channel failed, reopening it\n");
+    g_virtioFailed = true;
+    g_channel.ready = false;
+    ResetStreams();
+    MuxSchedDropFlow(&g_egressSched, CONTROL_FLOW);
+    MuxRxDiscard(&g_virtioRx);
+    g_ingressStalled = false;
+    CancelIoEx(g_virtioHandle, NULL);
+    TimerSchedule(&g_timers, &g_reopenTimer, VIRTIO_REOPEN_MS);
+}
+
+void ReopenVirtio(TIMER* timer, void* context) {
+    int i;
+
+    (void)timer;
+    (void)context;
+
+    // The buffers of cancelled operations are not free until they complete
+    for (i = 0; i < VIRTIO_WRITES; i++) {
+        if (g_virtioWrites[i].inUse) {
+            TimerSchedule(&g_timers, &g_reopenTimer, VIRTIO_REOPEN_MS);
+            return;
+        }
+    }
+    if (g_virtioReadsPosted > 0) {
+        TimerSchedule(&g_timers, &g_reopenTimer, VIRTIO_REOPEN_MS);
+        return;
+    }
+
+    MuxRxDiscard(&g_virtioRx);
+    if (g_virtioHandle != INVALID_HANDLE_VALUE) {
+        CloseHandle(g_virtioHandle);
+        g_virtioHandle = INVALID_HANDLE_VALUE;
+    }
+    if (!InitializeVirtio()) {
+        TimerSchedule(&g_timers, &g_reopenTimer, VIRTIO_REOPEN_MS);
+        return;
+    }
+
+    g_virtioFailed = false;
+    MuxSchedDropFlow(&g_egressSched, CONTROL_FLOW);
+    PostVirtioReads();
+    SendHello(MUX_CTRL_HELLO);
+}
+
+// Posts reads again for clients that were held back while the egress
+// queue was full, once it has drained to half
+void ResumeClientReads(void) {
+    int i;
+
+    if (!g_readsBlocked || g_egressPool.freeCount < EGRESS_POOL_FRAMES / 2) {
+        return;
+    }
+
+    g_readsBlocked = false;
+    for (i = 0; i < MAX_CONNECTIONS; i++) {
+        CONNECTION_CONTEXT* ctx = &g_connections[i];
+
+        if (ctx->inUse && ctx->readBlocked) {
+            ctx->readBlocked = false;
+            if (ctx->state == STATE_CONNECTED && !ctx->clientEof) {
+                PostClientRead(ctx);
+            }
+        }
+    }
+}
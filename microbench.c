@@ -0,0 +1,486 @@
+// Microbenchmarks of the per-frame path: building and splitting frames,
+// reassembling frames from channel reads, finding a stream's connection
+// slot and walking all slots, the egress queue and open request parsing. End-to-end runs
+// (fake_guest, socks_load) are too noisy to show a small regression in
+// these; a benchmark here runs one piece in a tight loop for a fixed time,
+// several times, and reports the fastest run.
+//
+// The report is key=value lines in a fixed order: NAME_ns_per_op and
+// NAME_bytes_per_s for every benchmark, where an operation is one frame,
+// lookup or request. Compare runs on the same machine with the same
+// build flags only.
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+
+#include "mux_protocol.h"
+#include "mux_frame.h"
+#include "mux_sched.h"
+
+#define REPORT_VERSION 1
+
+#define DEFAULT_RUN_MS 200
+#define DEFAULT_RUNS 5
+
+// Shapes of the host proxy's tables (host_proxy.c)
+#define MICRO_MAX_VMS 64
+#define MICRO_MAX_STREAMS 64
+#define MICRO_MAX_CONNECTIONS 1024
+#define MICRO_BUFFER_SIZE 4096
+#define MICRO_INGRESS_SIZE (64 * 1024)
+
+// Bytes of channel traffic the codec benchmarks walk through
+#define MICRO_WIRE_SIZE (1024 * 1024)
+#define MICRO_LOOKUPS 4096
+
+#define MICRO_FLOWS 16
+#define MICRO_BATCH 64
+
+typedef struct {
+    const char* name;
+    // Runs the operation iterations times; adds the bytes it moved
+    uint64_t (*run)(uint64_t iterations, uint64_t* bytes);
+} MICRO_BENCHMARK;
+
+// Laid out like the host proxy's connection slots: a cache line of state
+// in g_connections, and the buffers in g_connectionData
+typedef struct MUX_CACHE_ALIGNED {
+    int socket;
+    bool inUse;
+    bool closing;
+    bool throttled;
+    bool connecting;
+    bool flags[4];
+    uint16_t connId;
+    uint16_t pendingLen;
+    void* vm;
+    void* data;
+    int fields[3];
+    uint64_t lastActivity;
+} MICRO_CONNECTION;
+
+typedef struct {
+    uint8_t pending[MICRO_BUFFER_SIZE];
+    uint8_t rest[256];
+} MICRO_CONNECTION_DATA;
+
+static uint8_t g_payload[MUX_MAX_PAYLOAD];
+static uint8_t g_frame[sizeof(VIRTIO_MSG_HEADER) + MUX_MAX_PAYLOAD];
+static uint8_t g_wire[MICRO_WIRE_SIZE + sizeof(VIRTIO_MSG_HEADER) + MUX_MAX_PAYLOAD];
+static size_t g_wireSize;
+static uint32_t g_readSizes[4096];
+static uint8_t g_ingress[MICRO_INGRESS_SIZE];
+
+static MICRO_CONNECTION g_connections[MICRO_MAX_CONNECTIONS];
+static MICRO_CONNECTION_DATA g_connectionData[MICRO_MAX_CONNECTIONS];
+static int16_t g_streams[MICRO_MAX_VMS][MICRO_MAX_STREAMS];
+static uint16_t g_lookupVm[MICRO_LOOKUPS];
+static uint16_t g_lookupConnId[MICRO_LOOKUPS];
+
+static MUX_FRAME g_frames[MICRO_BATCH];
+static MUX_FRAME_POOL g_pool;
+static MUX_FLOW g_flows[MICRO_FLOWS];
+static MUX_SCHEDULER g_sched;
+
+static uint8_t g_openIpv4[7] = {MUX_ATYP_IPV4, 192, 168, 122, 1, 0x01, 0xBB};
+static uint8_t g_openDomain[2 + 19 + 2];
+
+static uint32_t g_random = 0x2545F491;
+
+// Stops the compiler from dropping work whose result is unused
+static volatile uint64_t g_sink;
+
+static void PrintUsage(const char* prog) {
+    printf("Usage: %s [options]\n", prog);
+    printf("Times the per-frame path of the proxy piece by piece\n");
+    printf("  -t, --time MS           Length of one run (default: %d)\n", DEFAULT_RUN_MS);
+    printf("  -r, --runs N            Runs per benchmark, the fastest counts (default: %d)\n", DEFAULT_RUNS);
+    printf("  -f, --filter TEXT       Only run benchmarks whose name contains TEXT\n");
+    printf("  -l, --list              List the benchmarks\n");
+    printf("  -h, --help              Show this help\n");
+}
+
+static uint64_t NowNanos(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t NextRandom(void) {
+    g_random ^= g_random << 13;
+    g_random ^= g_random >> 17;
+    g_random ^= g_random << 5;
+    return g_random;
+}
+
+// Channel traffic as the host reads it: mostly small frames, some full
+// ones, cut into reads of random size
+static void BuildWire(void) {
+    size_t i;
+
+    g_wireSize = 0;
+    while (g_wireSize < MICRO_WIRE_SIZE) {
+        uint32_t pick = NextRandom() % 8;
+        uint16_t length = pick < 5 ? (uint16_t)(1 + NextRandom() % 128) :
+                          pick < 7 ? (uint16_t)(1 + NextRandom() % MUX_MAX_PAYLOAD) : MUX_MAX_PAYLOAD;
+
+        g_wireSize += MuxFrameEncode(g_wire + g_wireSize, (uint16_t)(NextRandom() % MICRO_MAX_STREAMS),
+                                     g_payload, length);
+    }
+    for (i = 0; i < sizeof(g_readSizes) / sizeof(g_readSizes[0]); i++) {
+        g_readSizes[i] = 1 + NextRandom() % (16 * 1024);
+    }
+}
+
+// Streams of every VM spread over the shared slots, as after a while of churn
+static void BuildTables(void) {
+    int order[MICRO_MAX_CONNECTIONS];
+    int vm;
+    int i;
+
+    for (i = 0; i < MICRO_MAX_CONNECTIONS; i++) {
+        order[i] = i;
+    }
+    for (i = MICRO_MAX_CONNECTIONS - 1; i > 0; i--) {
+        int j = (int)(NextRandom() % (uint32_t)(i + 1));
+        int swap = order[i];
+
+        order[i] = order[j];
+        order[j] = swap;
+    }
+
+    for (vm = 0; vm < MICRO_MAX_VMS; vm++) {
+        for (i = 0; i < MICRO_MAX_STREAMS; i++) {
+            g_streams[vm][i] = -1;
+        }
+    }
+    for (i = 0; i < MICRO_MAX_CONNECTIONS; i++) {
+        vm = i % MICRO_MAX_VMS;
+        g_streams[vm][i / MICRO_MAX_VMS] = (int16_t)order[i];
+        g_connections[order[i]].inUse = true;
+        g_connections[order[i]].data = &g_connectionData[order[i]];
+        g_connections[order[i]].socket = 100 + i;
+        g_connections[order[i]].connId = (uint16_t)(i / MICRO_MAX_VMS);
+    }
+    for (i = 0; i < MICRO_LOOKUPS; i++) {
+        g_lookupVm[i] = (uint16_t)(NextRandom() % MICRO_MAX_VMS);
+        g_lookupConnId[i] = (uint16_t)(NextRandom() % MICRO_MAX_STREAMS);
+    }
+}
+
+static uint64_t BenchFrameEncodeSmall(uint64_t iterations, uint64_t* bytes) {
+    uint64_t sum = 0;
+    uint64_t i;
+
+    for (i = 0; i < iterations; i++) {
+        sum += MuxFrameEncode(g_frame, (uint16_t)i, g_payload, 64);
+    }
+    *bytes += sum;
+    return g_frame[0];
+}
+
+static uint64_t BenchFrameEncodeFull(uint64_t iterations, uint64_t* bytes) {
+    uint64_t sum = 0;
+    uint64_t i;
+
+    for (i = 0; i < iterations; i++) {
+        sum += MuxFrameEncode(g_frame, (uint16_t)i, g_payload, MUX_MAX_PAYLOAD);
+    }
+    *bytes += sum;
+    return g_frame[0];
+}
+
+// Walks complete frames, as the ingress loop does for a full buffer
+static uint64_t BenchFrameDecode(uint64_t iterations, uint64_t* bytes) {
+    VIRTIO_MSG_HEADER header;
+    uint64_t sum = 0;
+    size_t offset = 0;
+    uint64_t i;
+
+    for (i = 0; i < iterations; i++) {
+        if (MuxFrameSplit(g_wire + offset, g_wireSize - offset, MUX_MAX_PAYLOAD, &header) != MUX_FRAME_COMPLETE) {
+            offset = 0;
+            continue;
+        }
+        sum += header.connId;
+        offset += sizeof(header) + header.length;
+        *bytes += sizeof(header) + header.length;
+    }
+    return sum;
+}
+
+// Appends channel reads to an ingress buffer, takes the complete frames and
+// moves the partial one to the front, like ProcessVirtioIngress
+static uint64_t BenchReassembly(uint64_t iterations, uint64_t* bytes) {
+    VIRTIO_MSG_HEADER header;
+    uint64_t frames = 0;
+    uint64_t sum = 0;
+    size_t used = 0;
+    size_t wireOffset = 0;
+    uint32_t read = 0;
+
+    while (frames < iterations) {
+        size_t chunk = g_readSizes[read++ % (sizeof(g_readSizes) / sizeof(g_readSizes[0]))];
+        size_t offset = 0;
+
+        if (chunk > sizeof(g_ingress) - used) {
+            chunk = sizeof(g_ingress) - used;
+        }
+        if (chunk > g_wireSize - wireOffset) {
+            chunk = g_wireSize - wireOffset;
+        }
+        memcpy(g_ingress + used, g_wire + wireOffset, chunk);
+        used += chunk;
+        wireOffset += chunk;
+        *bytes += chunk;
+
+        while (MuxFrameSplit(g_ingress + offset, used - offset, MUX_MAX_PAYLOAD, &header) == MUX_FRAME_COMPLETE) {
+            sum += g_ingress[offset + sizeof(header)] + header.connId;
+            offset += sizeof(header) + header.length;
+            frames++;
+        }
+        if (offset > 0) {
+            memmove(g_ingress, g_ingress + offset, used - offset);
+            used -= offset;
+        }
+
+        // Start over at a frame boundary once the traffic is used up
+        if (wireOffset == g_wireSize) {
+            wireOffset = 0;
+            used = 0;
+        }
+    }
+    return sum;
+}
+
+// vm->streams[connId] to the slot in g_connections, then the fields the
+// dispatch checks, like FindStream
+static uint64_t BenchStreamLookup(uint64_t iterations, uint64_t* bytes) {
+    uint64_t sum = 0;
+    uint64_t i;
+
+    (void)bytes;
+    for (i = 0; i < iterations; i++) {
+        uint32_t k = (uint32_t)(i % MICRO_LOOKUPS);
+        int16_t slot = g_streams[g_lookupVm[k]][g_lookupConnId[k]];
+
+        if (slot >= 0) {
+            MICRO_CONNECTION* conn = &g_connections[slot];
+
+            if (conn->inUse && !conn->closing) {
+                sum += (uint64_t)conn->socket + conn->pendingLen;
+            }
+        }
+    }
+    return sum;
+}
+
+// Walks every slot the way the host's poll setup does, choosing the events
+// of the streams in use
+static uint64_t BenchConnectionScan(uint64_t iterations, uint64_t* bytes) {
+    uint64_t sum = 0;
+    uint64_t i;
+
+    (void)bytes;
+    for (i = 0; i < iterations; i++) {
+        MICRO_CONNECTION* conn = &g_connections[i % MICRO_MAX_CONNECTIONS];
+
+        if (conn->inUse && !conn->closing && conn->socket != -1) {
+            bool canRead = !conn->throttled && !conn->connecting;
+
+            sum += (canRead ? 1 : 0) | (conn->pendingLen > 0 || conn->connecting ? 4 : 0);
+        }
+    }
+    return sum;
+}
+
+// Frames queued on several flows and taken out by the scheduler in batches
+static uint64_t BenchEgressQueue(uint64_t iterations, uint64_t* bytes) {
+    uint64_t sum = 0;
+    uint64_t done = 0;
+
+    while (done < iterations) {
+        MUX_FRAME* frame;
+        int i;
+
+        for (i = 0; i < MICRO_BATCH; i++) {
+            MuxSchedEnqueue(&g_sched, (uint16_t)(i % MICRO_FLOWS), (uint16_t)(i % MICRO_FLOWS), g_payload,
+                            (uint16_t)(64 + (i & 7) * 128));
+        }
+        while ((frame = MuxSchedDequeue(&g_sched)) != NULL) {
+            sum += frame->data[0];
+            *bytes += frame->size;
+            MuxPoolFree(&g_pool, frame);
+            done++;
+        }
+    }
+    return sum;
+}
+
+static uint64_t BenchOpenIpv4(uint64_t iterations, uint64_t* bytes) {
+    MUX_OPEN_REQUEST request;
+    uint64_t sum = 0;
+    uint64_t i;
+    int error;
+
+    for (i = 0; i < iterations; i++) {
+        g_openIpv4[4] = (uint8_t)i;
+        if (MuxParseOpenRequest(g_openIpv4, sizeof(g_openIpv4), &request, &error)) {
+            sum += request.port + (uint8_t)request.host[0];
+        }
+    }
+    *bytes += iterations * sizeof(g_openIpv4);
+    return sum;
+}
+
+static uint64_t BenchOpenDomain(uint64_t iterations, uint64_t* bytes) {
+    MUX_OPEN_REQUEST request;
+    uint64_t sum = 0;
+    uint64_t i;
+    int error;
+
+    for (i = 0; i < iterations; i++) {
+        g_openDomain[2] = (uint8_t)('a' + i % 26);
+        if (MuxParseOpenRequest(g_openDomain, sizeof(g_openDomain), &request, &error)) {
+            sum += request.port + (uint8_t)request.host[0];
+        }
+    }
+    *bytes += iterations * sizeof(g_openDomain);
+    return sum;
+}
+
+static const MICRO_BENCHMARK g_benchmarks[] = {
+    {"frame_encode_64", BenchFrameEncodeSmall},
+    {"frame_encode_4096", BenchFrameEncodeFull},
+    {"frame_decode", BenchFrameDecode},
+    {"reassembly", BenchReassembly},
+    {"stream_lookup", BenchStreamLookup},
+    {"connection_scan", BenchConnectionScan},
+    {"egress_queue", BenchEgressQueue},
+    {"open_request_ipv4", BenchOpenIpv4},
+    {"open_request_domain", BenchOpenDomain},
+};
+
+#define MICRO_BENCHMARKS (sizeof(g_benchmarks) / sizeof(g_benchmarks[0]))
+
+// Finds an iteration count that takes about runMs, then keeps the fastest
+// of the runs
+static void RunBenchmark(const MICRO_BENCHMARK* benchmark, uint64_t runMs, int runs) {
+    uint64_t targetNs = runMs * 1000000ULL;
+    uint64_t iterations = 1000;
+    double bestNsPerOp = 0;
+    double bestBytesPerOp = 0;
+    int run;
+
+    while (1) {
+        uint64_t bytes = 0;
+        uint64_t start = NowNanos();
+        uint64_t elapsed;
+
+        g_sink += benchmark->run(iterations, &bytes);
+        elapsed = NowNanos() - start;
+        if (elapsed >= targetNs / 4 || iterations >= (1ULL << 40)) {
+            iterations = (uint64_t)((double)iterations * targetNs / (elapsed > 0 ? elapsed : 1));
+            break;
+        }
+        iterations *= elapsed > 0 && targetNs / 4 / elapsed < 16 ? 4 : 16;
+    }
+    if (iterations == 0) {
+        iterations = 1;
+    }
+
+    for (run = 0; run < runs; run++) {
+        uint64_t bytes = 0;
+        uint64_t start = NowNanos();
+        double nsPerOp;
+
+        g_sink += benchmark->run(iterations, &bytes);
+        nsPerOp = (double)(NowNanos() - start) / (double)iterations;
+        if (run == 0 || nsPerOp < bestNsPerOp) {
+            bestNsPerOp = nsPerOp;
+            bestBytesPerOp = (double)bytes / (double)iterations;
+        }
+    }
+
+    printf("%s_ns_per_op=%.2f\n", benchmark->name, bestNsPerOp);
+    printf("%s_bytes_per_s=%.0f\n", benchmark->name, bestNsPerOp > 0 ? bestBytesPerOp * 1e9 / bestNsPerOp : 0);
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[]) {
+    static const struct option longOptions[] = {
+        {"time", required_argument, NULL, 't'},
+        {"runs", required_argument, NULL, 'r'},
+        {"filter", required_argument, NULL, 'f'},
+        {"list", no_argument, NULL, 'l'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    const char* filter = NULL;
+    uint64_t runMs = DEFAULT_RUN_MS;
+    int runs = DEFAULT_RUNS;
+    char* end;
+    size_t i;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "t:r:f:lh", longOptions, NULL)) != -1) {
+        switch (opt) {
+            case 't':
+                runMs = strtoull(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || runMs == 0) {
+                    printf("Invalid run time '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'r':
+                runs = (int)strtol(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || runs < 1) {
+                    printf("Invalid run count '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'f':
+                filter = optarg;
+                break;
+            case 'l':
+                for (i = 0; i < MICRO_BENCHMARKS; i++) {
+                    printf("%s\n", g_benchmarks[i].name);
+                }
+                return 0;
+            case 'h':
+                PrintUsage(argv[0]);
+                return 0;
+            default:
+                PrintUsage(argv[0]);
+                return 1;
+        }
+    }
+
+    for (i = 0; i < sizeof(g_payload); i++) {
+        g_payload[i] = (uint8_t)i;
+    }
+    g_openDomain[0] = MUX_ATYP_DOMAIN;
+    g_openDomain[1] = 19;
+    memcpy(g_openDomain + 2, "updates.example.com", 19);
+    g_openDomain[21] = 0x01;
+    g_openDomain[22] = 0xBB;
+    BuildWire();
+    BuildTables();
+    MuxPoolInit(&g_pool, g_frames, MICRO_BATCH);
+    MuxSchedInit(&g_sched, g_flows, MICRO_FLOWS, &g_pool);
+
+    printf("report_version=%d\n", REPORT_VERSION);
+    printf("run_ms=%llu\n", (unsigned long long)runMs);
+    printf("runs=%d\n", runs);
+    for (i = 0; i < MICRO_BENCHMARKS; i++) {
+        if (filter == NULL || strstr(g_benchmarks[i].name, filter) != NULL) {
+            RunBenchmark(&g_benchmarks[i], runMs, runs);
+        }
+    }
+    return 0;
+}
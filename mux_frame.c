@@ -0,0 +1,70 @@
+#include "mux_frame.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+size_t MuxFrameEncode(uint8_t* frame, uint16_t connId, const uint8_t* payload, uint16_t length) {
+    VIRTIO_MSG_HEADER header;
+
+    header.connId = connId;
+    header.length = length;
+    memcpy(frame, &header, sizeof(header));
+    memcpy(frame + sizeof(header), payload, length);
+    return sizeof(header) + length;
+}
+
+int MuxFrameSplit(const uint8_t* data, size_t available, uint16_t maxPayload, VIRTIO_MSG_HEADER* header) {
+    if (available < sizeof(*header)) {
+        return MUX_FRAME_PARTIAL;
+    }
+
+    memcpy(header, data, sizeof(*header));
+    if (header->length > maxPayload) {
+        return MUX_FRAME_INVALID;
+    }
+    if (available < sizeof(*header) + header->length) {
+        return MUX_FRAME_PARTIAL;
+    }
+    return MUX_FRAME_COMPLETE;
+}
+
+bool MuxParseOpenRequest(const uint8_t* data, uint16_t length, MUX_OPEN_REQUEST* request, int* error) {
+    int hostLen;
+
+    if (length < 1) {
+        *error = EINVAL;
+        return false;
+    }
+    request->atyp = data[0];
+
+    switch (request->atyp) {
+        case MUX_ATYP_IPV4:
+            if (length < 1 + 4 + 2) {
+                *error = EINVAL;
+                return false;
+            }
+            snprintf(request->host, sizeof(request->host), "%d.%d.%d.%d", data[1], data[2], data[3], data[4]);
+            request->port = (uint16_t)((data[5] << 8) | data[6]);
+            return true;
+
+        case MUX_ATYP_DOMAIN:
+            if (length < 2) {
+                *error = EINVAL;
+                return false;
+            }
+            hostLen = data[1];
+            if (length < 2 + hostLen + 2) {
+                *error = EINVAL;
+                return false;
+            }
+            memcpy(request->host, &data[2], hostLen);
+            request->host[hostLen] = '\0';
+            request->port = (uint16_t)((data[2 + hostLen] << 8) | data[2 + hostLen + 1]);
+            return true;
+
+        default:
+            *error = EAFNOSUPPORT;
+            return false;
+    }
+}
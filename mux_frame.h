@@ -0,0 +1,42 @@
+#ifndef MUX_FRAME_H
+#define MUX_FRAME_H
+
+// Frame codec: building frames, splitting a byte stream read from the
+// channel back into frames, and parsing the open request that starts a
+// stream. Portable C with no state of its own, so the per-frame path can be
+// measured on its own (see microbench.c).
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "mux_protocol.h"
+
+// Results of MuxFrameSplit
+#define MUX_FRAME_PARTIAL 0     // More bytes are needed
+#define MUX_FRAME_COMPLETE 1
+#define MUX_FRAME_INVALID (-1)  // The length exceeds maxPayload; the channel is out of sync
+
+// Open request address types (SOCKS5 ATYP)
+#define MUX_ATYP_IPV4 0x01
+#define MUX_ATYP_DOMAIN 0x03
+#define MUX_ATYP_IPV6 0x04
+
+#define MUX_HOST_MAX 256
+
+// Destination of a stream as requested by the guest
+typedef struct {
+    uint8_t atyp;
+    char host[MUX_HOST_MAX];    // Dotted IPv4 address or domain name
+    uint16_t port;
+} MUX_OPEN_REQUEST;
+
+// Writes header and payload to frame; returns the frame's size
+size_t MuxFrameEncode(uint8_t* frame, uint16_t connId, const uint8_t* payload, uint16_t length);
+
+// Looks at the bytes at data for a frame and reads its header
+int MuxFrameSplit(const uint8_t* data, size_t available, uint16_t maxPayload, VIRTIO_MSG_HEADER* header);
+
+// Parses [atyp][addr][port]; on failure sets error to an errno value
+bool MuxParseOpenRequest(const uint8_t* data, uint16_t length, MUX_OPEN_REQUEST* request, int* error);
+
+#endif // MUX_FRAME_H
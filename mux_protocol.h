@@ -0,0 +1,118 @@
+#ifndef MUX_PROTOCOL_H
+#define MUX_PROTOCOL_H
+
+// Wire format shared by the guest SOCKS server and the host proxy
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Largest payload carried by a single frame
+#define MUX_MAX_PAYLOAD 4096
+// Smallest payload limit a peer may offer in its HELLO
+#define MUX_MIN_PAYLOAD 512
+
+// Protocol revision announced in HELLO; peers must match
+#define MUX_PROTOCOL_VERSION 1
+
+// Capability bits announced in HELLO; only common bits are used
+#define MUX_CAP_HALF_CLOSE 0x00000001   // EOF control frames
+#define MUX_CAP_HEARTBEAT 0x00000002    // Answers PING with PONG
+#define MUX_CAP_OPEN_RESULT 0x00000004  // Host reports connect results with OPEN_ACK/OPEN_FAIL
+#define MUX_CAPABILITIES (MUX_CAP_HALF_CLOSE | MUX_CAP_HEARTBEAT | MUX_CAP_OPEN_RESULT)
+
+// Tables that the event loops walk on every pass keep each entry's hot
+// fields within one cache line
+#define MUX_CACHE_LINE 64
+#if defined(_MSC_VER)
+#define MUX_CACHE_ALIGNED __declspec(align(64))
+#else
+#define MUX_CACHE_ALIGNED __attribute__((aligned(MUX_CACHE_LINE)))
+#endif
+
+// Virtio message header for multiplexing
+#pragma pack(push, 1)
+typedef struct {
+    uint16_t connId;
+    uint16_t length;
+} VIRTIO_MSG_HEADER;
+#pragma pack(pop)
+
+// Frames sent on this connection ID carry a control message instead of
+// stream data. The first payload byte is the message type.
+#define MUX_CONTROL_CONNID 0xFFFF
+
+// Control message types
+#define MUX_CTRL_CLOSE 0x01   // Stream closed by the sender
+#define MUX_CTRL_EOF 0x02     // Sender has no more data for the stream
+#define MUX_CTRL_HELLO 0x03   // Channel opened, announces the sender's parameters
+#define MUX_CTRL_HELLO_ACK 0x04 // Answer to HELLO with the responder's parameters
+#define MUX_CTRL_PING 0x05    // Heartbeat request
+#define MUX_CTRL_PONG 0x06    // Heartbeat answer
+#define MUX_CTRL_OPEN_ACK 0x07  // Upstream connect of a stream succeeded
+#define MUX_CTRL_OPEN_FAIL 0x08 // Upstream connect of a stream failed
+
+// Stream close: [type][connId]. Each side sends exactly one CLOSE per
+// stream; a connection ID may be reused once both sides have sent theirs.
+// EOF uses the same layout and half-closes the stream: the receiver shuts
+// down its write side toward the endpoint but keeps delivering data the
+// other way. Both frames travel behind the stream's data.
+#pragma pack(push, 1)
+typedef struct {
+    uint8_t type;
+    uint16_t connId;
+} MUX_CTRL_STREAM;
+#pragma pack(pop)
+
+// Handshake: [type][version][maxPayload][capabilities]. Either side sends
+// HELLO when it opens the channel and the peer answers with HELLO_ACK. Both
+// then use the smaller payload limit and the common capabilities. A HELLO
+// means the sender starts from scratch, so streams from an earlier session
+// are dropped without CLOSE frames. No stream frames are sent before the
+// exchange completes.
+#pragma pack(push, 1)
+typedef struct {
+    uint8_t type;
+    uint8_t version;
+    uint16_t maxPayload;
+    uint32_t capabilities;
+} MUX_HELLO;
+#pragma pack(pop)
+
+// Heartbeat: [type][seq][timestamp]. The receiver of a PING sends the
+// payload back unchanged as a PONG; the timestamp only means something to
+// the side that sent the PING.
+#pragma pack(push, 1)
+typedef struct {
+    uint8_t type;
+    uint32_t seq;
+    uint64_t timestamp;
+} MUX_HEARTBEAT;
+#pragma pack(pop)
+
+// Open result: [type][connId][reply][atyp][addr][port]. With
+// MUX_CAP_OPEN_RESULT the host answers every connection request with one
+// OPEN_ACK once the upstream connect has succeeded, or one OPEN_FAIL ahead
+// of its CLOSE. reply is the SOCKS5 reply code (RFC 1928) for the client.
+// An OPEN_ACK carries the address the upstream socket is bound to: atyp is
+// 0x01 (IPv4, first 4 bytes of addr) or 0x04 (IPv6), and port is in
+// network byte order.
+#pragma pack(push, 1)
+typedef struct {
+    uint8_t type;
+    uint16_t connId;
+    uint8_t reply;
+    uint8_t atyp;
+    uint8_t addr[16];
+    uint16_t port;
+} MUX_OPEN_RESULT;
+#pragma pack(pop)
+
+// Channel parameters agreed in the HELLO exchange
+typedef struct {
+    bool ready;
+    uint8_t version;
+    uint16_t maxPayload;
+    uint32_t capabilities;
+} MUX_CHANNEL;
+
+#endif // MUX_PROTOCOL_H
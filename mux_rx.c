@@ -0,0 +1,170 @@
+#include "mux_rx.h"
+
+#include <string.h>
+
+void MuxRxInit(MUX_RX* rx, MUX_RX_BUFFER* buffers, size_t count) {
+    size_t i;
+
+    memset(rx, 0, sizeof(*rx));
+    rx->offset = MUX_RX_HEADROOM;
+    for (i = 0; i < count; i++) {
+        buffers[i].index = (uint16_t)i;
+        buffers[i].refs = 0;
+        buffers[i].next = rx->freeList;
+        rx->freeList = &buffers[i];
+    }
+    rx->freeCount = count;
+}
+
+MUX_RX_BUFFER* MuxRxAlloc(MUX_RX* rx) {
+    MUX_RX_BUFFER* buffer = rx->freeList;
+
+    if (buffer == NULL) {
+        return NULL;
+    }
+    rx->freeList = buffer->next;
+    rx->freeCount--;
+
+    buffer->next = NULL;
+    buffer->done = false;
+    buffer->refs = 1;
+    buffer->length = 0;
+    if (rx->tail != NULL) {
+        rx->tail->next = buffer;
+    } else {
+        rx->head = buffer;
+    }
+    rx->tail = buffer;
+    return buffer;
+}
+
+void MuxRxComplete(MUX_RX* rx, MUX_RX_BUFFER* buffer, size_t length) {
+    (void)rx;
+
+    buffer->length = length;
+    buffer->done = true;
+}
+
+// Done with the oldest read; the reader's reference goes
+static void PopHead(MUX_RX* rx) {
+    MUX_RX_BUFFER* head = rx->head;
+
+    rx->head = head->next;
+    if (rx->head == NULL) {
+        rx->tail = NULL;
+    }
+    rx->offset = MUX_RX_HEADROOM;
+    MuxRxRelease(rx, head);
+}
+
+int MuxRxNext(MUX_RX* rx, uint16_t maxPayload, VIRTIO_MSG_HEADER* header, const uint8_t** payload,
+              MUX_RX_BUFFER** buffer) {
+    MUX_RX_BUFFER* head;
+    size_t end;
+    int result;
+
+    while ((head = rx->head) != NULL && head->done) {
+        // The start of a frame from the previous read goes in front
+        if (rx->carryLength > 0) {
+            rx->offset -= rx->carryLength;
+            memcpy(head->data + rx->offset, rx->carry, rx->carryLength);
+            rx->carryLength = 0;
+        }
+
+        end = MUX_RX_HEADROOM + head->length;
+        result = MuxFrameSplit(head->data + rx->offset, end - rx->offset, maxPayload, header);
+        if (result == MUX_FRAME_COMPLETE) {
+            *payload = head->data + rx->offset + sizeof(*header);
+            *buffer = head;
+            return MUX_FRAME_COMPLETE;
+        }
+        if (result == MUX_FRAME_INVALID) {
+            return MUX_FRAME_INVALID;
+        }
+
+        // Shorter than a frame, so it fits the headroom of the next read
+        rx->carryLength = end - rx->offset;
+        memcpy(rx->carry, head->data + rx->offset, rx->carryLength);
+        PopHead(rx);
+    }
+
+    return MUX_FRAME_PARTIAL;
+}
+
+void MuxRxConsume(MUX_RX* rx, const VIRTIO_MSG_HEADER* header) {
+    rx->offset += sizeof(*header) + header->length;
+}
+
+void MuxRxRef(MUX_RX_BUFFER* buffer) {
+    buffer->refs++;
+}
+
+void MuxRxRelease(MUX_RX* rx, MUX_RX_BUFFER* buffer) {
+    if (--buffer->refs > 0) {
+        return;
+    }
+    buffer->next = rx->freeList;
+    rx->freeList = buffer;
+    rx->freeCount++;
+}
+
+void MuxRxDiscard(MUX_RX* rx) {
+    while (rx->head != NULL && rx->head->done) {
+        PopHead(rx);
+    }
+    rx->carryLength = 0;
+}
+
+void MuxRxQueueInit(MUX_RX_QUEUE* queue) {
+    queue->head = 0;
+    queue->count = 0;
+    queue->bytes = 0;
+}
+
+bool MuxRxQueuePush(MUX_RX_QUEUE* queue, MUX_RX_BUFFER* buffer, const uint8_t* data, size_t length) {
+    MUX_RX_SLICE* slice;
+
+    if (queue->count == MUX_RX_QUEUE_SLICES) {
+        return false;
+    }
+
+    slice = &queue->slices[(queue->head + queue->count) % MUX_RX_QUEUE_SLICES];
+    slice->buffer = buffer;
+    slice->data = data;
+    slice->length = length;
+    MuxRxRef(buffer);
+    queue->count++;
+    queue->bytes += length;
+    return true;
+}
+
+MUX_RX_SLICE* MuxRxQueueAt(MUX_RX_QUEUE* queue, int index) {
+    return &queue->slices[(queue->head + index) % MUX_RX_QUEUE_SLICES];
+}
+
+void MuxRxQueueAdvance(MUX_RX* rx, MUX_RX_QUEUE* queue, size_t length) {
+    MUX_RX_SLICE* slice;
+
+    queue->bytes -= length;
+    while (length > 0 && queue->count > 0) {
+        slice = &queue->slices[queue->head];
+        if (length < slice->length) {
+            slice->data += length;
+            slice->length -= length;
+            return;
+        }
+        length -= slice->length;
+        MuxRxRelease(rx, slice->buffer);
+        queue->head = (queue->head + 1) % MUX_RX_QUEUE_SLICES;
+        queue->count--;
+    }
+}
+
+void MuxRxQueueClear(MUX_RX* rx, MUX_RX_QUEUE* queue) {
+    while (queue->count > 0) {
+        MuxRxRelease(rx, queue->slices[queue->head].buffer);
+        queue->head = (queue->head + 1) % MUX_RX_QUEUE_SLICES;
+        queue->count--;
+    }
+    queue->bytes = 0;
+}
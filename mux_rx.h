@@ -0,0 +1,102 @@
+#ifndef MUX_RX_H
+#define MUX_RX_H
+
+// Channel receive buffers of the guest frontends. The channel is read into
+// a pool of buffers, several reads at a time, and frames are taken from
+// the buffers in the order the reads were issued. Data frames are not
+// copied on their way to a client: the send points into the buffer and
+// holds a reference to it, and the buffer is only read into again once
+// the last reference is gone. A frame split between two reads is joined
+// in the headroom in front of the later one. Portable C; all storage is
+// supplied by the caller.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "mux_frame.h"
+
+// Bytes one read may return
+#define MUX_RX_READ_SIZE (16 * 1024)
+// Room in front of the read for the start of a frame from the previous one
+#define MUX_RX_HEADROOM (sizeof(VIRTIO_MSG_HEADER) + MUX_MAX_PAYLOAD)
+
+typedef struct MUX_RX_BUFFER {
+    struct MUX_RX_BUFFER* next;   // Free list, or reads in the order issued
+    uint16_t index;               // Position in the caller's array
+    bool done;                    // The read has completed
+    uint32_t refs;                // One for the reader, one per send using the buffer
+    size_t length;                // Bytes read, starting at MUX_RX_HEADROOM
+    uint8_t data[MUX_RX_HEADROOM + MUX_RX_READ_SIZE];
+} MUX_RX_BUFFER;
+
+typedef struct {
+    MUX_RX_BUFFER* freeList;
+    size_t freeCount;
+    MUX_RX_BUFFER* head;          // Oldest read not fully processed
+    MUX_RX_BUFFER* tail;
+    size_t offset;                // Next frame in head, from head->data
+    uint8_t carry[MUX_RX_HEADROOM]; // Unfinished frame at the end of the last buffer
+    size_t carryLength;
+} MUX_RX;
+
+void MuxRxInit(MUX_RX* rx, MUX_RX_BUFFER* buffers, size_t count);
+
+// A free buffer to read MUX_RX_READ_SIZE bytes into at data +
+// MUX_RX_HEADROOM, queued behind the reads issued before; NULL if every
+// buffer is in use
+MUX_RX_BUFFER* MuxRxAlloc(MUX_RX* rx);
+
+// The read into buffer finished with length bytes; 0 for a failed read
+void MuxRxComplete(MUX_RX* rx, MUX_RX_BUFFER* buffer, size_t length);
+
+// Looks for the next frame in read order. MUX_FRAME_PARTIAL means it waits
+// for a read to complete. The frame stays the next one until
+// MuxRxConsume, so a caller that cannot take it yet asks again later.
+int MuxRxNext(MUX_RX* rx, uint16_t maxPayload, VIRTIO_MSG_HEADER* header, const uint8_t** payload,
+              MUX_RX_BUFFER** buffer);
+
+// Moves past the frame MuxRxNext returned
+void MuxRxConsume(MUX_RX* rx, const VIRTIO_MSG_HEADER* header);
+
+// References held by sends that point into a buffer
+void MuxRxRef(MUX_RX_BUFFER* buffer);
+void MuxRxRelease(MUX_RX* rx, MUX_RX_BUFFER* buffer);
+
+// Drops the data of completed reads that has not been processed, e.g.
+// when the channel is reopened. Reads still in flight stay queued.
+void MuxRxDiscard(MUX_RX* rx);
+
+// Received data on its way to a client, by reference into its buffer
+typedef struct {
+    MUX_RX_BUFFER* buffer;
+    const uint8_t* data;
+    size_t length;
+} MUX_RX_SLICE;
+
+// Slices waiting to be sent on one connection, oldest first
+#define MUX_RX_QUEUE_SLICES 16
+
+typedef struct {
+    MUX_RX_SLICE slices[MUX_RX_QUEUE_SLICES];
+    int head;
+    int count;
+    size_t bytes;                 // Total length of the queued slices
+} MUX_RX_QUEUE;
+
+void MuxRxQueueInit(MUX_RX_QUEUE* queue);
+
+// Appends data that lives in buffer and takes a reference to the buffer;
+// false if the queue is full
+bool MuxRxQueuePush(MUX_RX_QUEUE* queue, MUX_RX_BUFFER* buffer, const uint8_t* data, size_t length);
+
+// The index-th queued slice, 0 being the oldest
+MUX_RX_SLICE* MuxRxQueueAt(MUX_RX_QUEUE* queue, int index);
+
+// Takes length sent bytes off the front; slices sent in full release
+// their buffers
+void MuxRxQueueAdvance(MUX_RX* rx, MUX_RX_QUEUE* queue, size_t length);
+
+// Releases everything queued, e.g. when the client is gone
+void MuxRxQueueClear(MUX_RX* rx, MUX_RX_QUEUE* queue);
+
+#endif // MUX_RX_H
@@ -0,0 +1,315 @@
+#include "mux_sched.h"
+#include "mux_frame.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char* const g_priorityNames[MUX_PRIO_CLASSES] = {
+    "control", "interactive", "default", "bulk"
+};
+
+void MuxPoolInit(MUX_FRAME_POOL* pool, MUX_FRAME* frames, size_t count) {
+    size_t i;
+
+    pool->freeList = NULL;
+    for (i = count; i > 0; i--) {
+        frames[i - 1].next = pool->freeList;
+        pool->freeList = &frames[i - 1];
+    }
+    pool->freeCount = count;
+    pool->totalCount = count;
+}
+
+MUX_FRAME* MuxPoolAlloc(MUX_FRAME_POOL* pool) {
+    MUX_FRAME* frame = pool->freeList;
+
+    if (frame == NULL) {
+        return NULL;
+    }
+
+    pool->freeList = frame->next;
+    pool->freeCount--;
+    frame->next = NULL;
+    return frame;
+}
+
+void MuxPoolFree(MUX_FRAME_POOL* pool, MUX_FRAME* frame) {
+    frame->next = pool->freeList;
+    pool->freeList = frame;
+    pool->freeCount++;
+}
+
+void MuxSchedInit(MUX_SCHEDULER* sched, MUX_FLOW* flows, uint16_t flowCount, MUX_FRAME_POOL* pool) {
+    int cls;
+    uint16_t i;
+
+    memset(sched, 0, sizeof(*sched));
+    memset(flows, 0, sizeof(MUX_FLOW) * flowCount);
+
+    sched->pool = pool;
+    sched->flows = flows;
+    sched->flowCount = flowCount;
+
+    for (cls = 0; cls < MUX_PRIO_CLASSES; cls++) {
+        sched->activeHead[cls] = MUX_NO_FLOW;
+        sched->activeTail[cls] = MUX_NO_FLOW;
+        sched->quantum[cls] = MUX_DEFAULT_QUANTUM;
+    }
+
+    for (i = 0; i < flowCount; i++) {
+        flows[i].priority = MUX_PRIO_DEFAULT;
+        flows[i].nextActive = MUX_NO_FLOW;
+    }
+}
+
+bool MuxSchedEnqueue(MUX_SCHEDULER* sched, uint16_t flowId, uint16_t connId,
+                     const uint8_t* data, uint16_t length) {
+    MUX_FLOW* flow;
+    MUX_FRAME* frame;
+
+    if (flowId >= sched->flowCount || length > MUX_MAX_PAYLOAD) {
+        return false;
+    }
+
+    frame = MuxPoolAlloc(sched->pool);
+    if (frame == NULL) {
+        return false;
+    }
+
+    // Build the frame exactly as it goes on the wire
+    frame->size = (uint16_t)MuxFrameEncode(frame->data, connId, data, length);
+
+    flow = &sched->flows[flowId];
+    if (flow->tail != NULL) {
+        flow->tail->next = frame;
+    } else {
+        flow->head = frame;
+    }
+    flow->tail = frame;
+    flow->queuedBytes += frame->size;
+    sched->queuedBytes += frame->size;
+    sched->queuedFrames++;
+
+    // Join the back of the round for the flow's class
+    if (!flow->active) {
+        uint8_t cls = flow->priority;
+
+        flow->active = true;
+        flow->activeClass = cls;
+        flow->deficit = 0;
+        flow->nextActive = MUX_NO_FLOW;
+        if (sched->activeTail[cls] != MUX_NO_FLOW) {
+            sched->flows[sched->activeTail[cls]].nextActive = flowId;
+        } else {
+            sched->activeHead[cls] = flowId;
+        }
+        sched->activeTail[cls] = flowId;
+    }
+
+    return true;
+}
+
+MUX_FRAME* MuxSchedDequeue(MUX_SCHEDULER* sched) {
+    int cls;
+
+    for (cls = 0; cls < MUX_PRIO_CLASSES; cls++) {
+        while (sched->activeHead[cls] != MUX_NO_FLOW) {
+            uint16_t flowId = sched->activeHead[cls];
+            MUX_FLOW* flow = &sched->flows[flowId];
+
+            if (flow->deficit >= flow->head->size) {
+                MUX_FRAME* frame = flow->head;
+
+                flow->head = frame->next;
+                if (flow->head == NULL) {
+                    flow->tail = NULL;
+                }
+                flow->deficit -= frame->size;
+                flow->queuedBytes -= frame->size;
+                sched->queuedBytes -= frame->size;
+                sched->queuedFrames--;
+                frame->next = NULL;
+
+                if (flow->head == NULL) {
+                    // An idle flow does not keep its deficit
+                    sched->activeHead[cls] = flow->nextActive;
+                    if (sched->activeHead[cls] == MUX_NO_FLOW) {
+                        sched->activeTail[cls] = MUX_NO_FLOW;
+                    }
+                    flow->active = false;
+                    flow->deficit = 0;
+                    flow->nextActive = MUX_NO_FLOW;
+                }
+                return frame;
+            }
+
+            // Out of credit for this round: top up and go to the back
+            flow->deficit += sched->quantum[cls];
+            if (flow->nextActive != MUX_NO_FLOW) {
+                sched->activeHead[cls] = flow->nextActive;
+                sched->flows[sched->activeTail[cls]].nextActive = flowId;
+                sched->activeTail[cls] = flowId;
+                flow->nextActive = MUX_NO_FLOW;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// Takes a flow out of the round of its class
+static void UnlinkFlow(MUX_SCHEDULER* sched, uint16_t flowId) {
+    MUX_FLOW* flow = &sched->flows[flowId];
+    uint8_t cls = flow->activeClass;
+    uint16_t prev = MUX_NO_FLOW;
+    uint16_t id = sched->activeHead[cls];
+
+    while (id != MUX_NO_FLOW && id != flowId) {
+        prev = id;
+        id = sched->flows[id].nextActive;
+    }
+    if (id == flowId) {
+        if (prev == MUX_NO_FLOW) {
+            sched->activeHead[cls] = flow->nextActive;
+        } else {
+            sched->flows[prev].nextActive = flow->nextActive;
+        }
+        if (sched->activeTail[cls] == flowId) {
+            sched->activeTail[cls] = prev;
+        }
+    }
+
+    flow->active = false;
+    flow->deficit = 0;
+    flow->nextActive = MUX_NO_FLOW;
+}
+
+void MuxSchedDropFlow(MUX_SCHEDULER* sched, uint16_t flowId) {
+    MUX_FLOW* flow;
+
+    if (flowId >= sched->flowCount) {
+        return;
+    }
+
+    flow = &sched->flows[flowId];
+    while (flow->head != NULL) {
+        MUX_FRAME* frame = flow->head;
+
+        flow->head = frame->next;
+        sched->queuedBytes -= frame->size;
+        sched->queuedFrames--;
+        MuxPoolFree(sched->pool, frame);
+    }
+    flow->tail = NULL;
+    flow->queuedBytes = 0;
+
+    // The next stream on this ID joins the round of its own class
+    if (flow->active) {
+        UnlinkFlow(sched, flowId);
+    }
+}
+
+void MuxSchedSetPriority(MUX_SCHEDULER* sched, uint16_t flowId, uint8_t priority) {
+    if (flowId < sched->flowCount && priority < MUX_PRIO_CLASSES) {
+        sched->flows[flowId].priority = priority;
+    }
+}
+
+uint8_t MuxSchedPortPriority(const MUX_SCHEDULER* sched, uint16_t port) {
+    int i;
+
+    for (i = 0; i < sched->portRuleCount; i++) {
+        if (port >= sched->portRules[i].firstPort && port <= sched->portRules[i].lastPort) {
+            return sched->portRules[i].priority;
+        }
+    }
+    return MUX_PRIO_DEFAULT;
+}
+
+// Accepts a class name or its number
+static bool ParsePriority(const char* text, uint8_t* priority) {
+    char* end;
+    unsigned long value;
+    int cls;
+
+    for (cls = 0; cls < MUX_PRIO_CLASSES; cls++) {
+        if (strcmp(text, g_priorityNames[cls]) == 0) {
+            *priority = (uint8_t)cls;
+            return true;
+        }
+    }
+
+    value = strtoul(text, &end, 10);
+    if (end == text || *end != '\0' || value >= MUX_PRIO_CLASSES) {
+        return false;
+    }
+    *priority = (uint8_t)value;
+    return true;
+}
+
+// Spec format: PORT[-PORT]=CLASS, e.g. "22=interactive" or "8000-8999=bulk"
+bool MuxSchedAddPortRule(MUX_SCHEDULER* sched, const char* spec) {
+    MUX_PORT_RULE rule;
+    unsigned long first, last;
+    char* end;
+
+    if (sched->portRuleCount >= MUX_MAX_PORT_RULES) {
+        printf("Too many priority rules (max %d)\n", MUX_MAX_PORT_RULES);
+        return false;
+    }
+
+    first = strtoul(spec, &end, 10);
+    last = first;
+    if (end != spec && *end == '-') {
+        const char* lastText = end + 1;
+        last = strtoul(lastText, &end, 10);
+        if (end == lastText) {
+            end = (char*)spec;
+        }
+    }
+
+    if (end == spec || *end != '=' || first > 65535 || last > 65535 || first > last ||
+        !ParsePriority(end + 1, &rule.priority)) {
+        printf("Invalid priority rule '%s' (expected PORT[-PORT]=CLASS)\n", spec);
+        return false;
+    }
+
+    rule.firstPort = (uint16_t)first;
+    rule.lastPort = (uint16_t)last;
+    sched->portRules[sched->portRuleCount++] = rule;
+    return true;
+}
+
+// Spec format: CLASS=BYTES, e.g. "bulk=1024"
+bool MuxSchedSetQuantum(MUX_SCHEDULER* sched, const char* spec) {
+    const char* sep = strchr(spec, '=');
+    char className[32];
+    uint8_t cls;
+    unsigned long quantum;
+    char* end;
+
+    if (sep == NULL || (size_t)(sep - spec) >= sizeof(className)) {
+        printf("Invalid quantum '%s' (expected CLASS=BYTES)\n", spec);
+        return false;
+    }
+
+    memcpy(className, spec, sep - spec);
+    className[sep - spec] = '\0';
+    quantum = strtoul(sep + 1, &end, 10);
+
+    if (!ParsePriority(className, &cls) || end == sep + 1 || *end != '\0' ||
+        quantum < MUX_MIN_QUANTUM || quantum > 1024 * 1024) {
+        printf("Invalid quantum '%s' (expected CLASS=BYTES, at least %d bytes)\n", spec, MUX_MIN_QUANTUM);
+        return false;
+    }
+
+    sched->quantum[cls] = (uint32_t)quantum;
+    return true;
+}
+
+void MuxSchedCopyConfig(MUX_SCHEDULER* sched, const MUX_SCHEDULER* source) {
+    memcpy(sched->quantum, source->quantum, sizeof(sched->quantum));
+    memcpy(sched->portRules, source->portRules, sizeof(sched->portRules));
+    sched->portRuleCount = source->portRuleCount;
+}
@@ -0,0 +1,95 @@
+#ifndef MUX_SCHED_H
+#define MUX_SCHED_H
+
+// Deficit-round-robin egress scheduler over per-stream frame queues.
+// Portable C, shared by the guest SOCKS server and the host proxy. All
+// storage is supplied by the caller; nothing is allocated dynamically.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "mux_protocol.h"
+
+// Priority classes, served strictly in order (lowest value first).
+// Streams within a class share the channel by deficit round robin.
+#define MUX_PRIO_CONTROL 0
+#define MUX_PRIO_INTERACTIVE 1
+#define MUX_PRIO_DEFAULT 2
+#define MUX_PRIO_BULK 3
+#define MUX_PRIO_CLASSES 4
+
+// Default per-stream quantum: one full frame per round
+#define MUX_DEFAULT_QUANTUM (sizeof(VIRTIO_MSG_HEADER) + MUX_MAX_PAYLOAD)
+#define MUX_MIN_QUANTUM 512
+
+#define MUX_MAX_PORT_RULES 32
+#define MUX_NO_FLOW 0xFFFF
+
+// A queued frame, laid out exactly as it goes on the wire
+typedef struct MUX_FRAME {
+    struct MUX_FRAME* next;
+    uint16_t size;    // Header + payload bytes
+    uint8_t data[sizeof(VIRTIO_MSG_HEADER) + MUX_MAX_PAYLOAD];
+} MUX_FRAME;
+
+// Fixed pool of frames, may be shared by several schedulers
+typedef struct {
+    MUX_FRAME* freeList;
+    size_t freeCount;
+    size_t totalCount;
+} MUX_FRAME_POOL;
+
+// Per-stream egress queue
+typedef struct {
+    MUX_FRAME* head;
+    MUX_FRAME* tail;
+    size_t queuedBytes;
+    uint32_t deficit;
+    uint16_t nextActive;   // Next flow in the active list of its class
+    uint8_t priority;      // Class used the next time the flow becomes active
+    uint8_t activeClass;   // Class list the flow is currently linked into
+    bool active;
+} MUX_FLOW;
+
+// Destination ports mapped to a priority class
+typedef struct {
+    uint16_t firstPort;
+    uint16_t lastPort;
+    uint8_t priority;
+} MUX_PORT_RULE;
+
+typedef struct {
+    MUX_FRAME_POOL* pool;
+    MUX_FLOW* flows;
+    uint16_t flowCount;
+    uint16_t activeHead[MUX_PRIO_CLASSES];
+    uint16_t activeTail[MUX_PRIO_CLASSES];
+    uint32_t quantum[MUX_PRIO_CLASSES];
+    MUX_PORT_RULE portRules[MUX_MAX_PORT_RULES];
+    int portRuleCount;
+    size_t queuedBytes;
+    size_t queuedFrames;
+} MUX_SCHEDULER;
+
+// Frame pool
+void MuxPoolInit(MUX_FRAME_POOL* pool, MUX_FRAME* frames, size_t count);
+MUX_FRAME* MuxPoolAlloc(MUX_FRAME_POOL* pool);
+void MuxPoolFree(MUX_FRAME_POOL* pool, MUX_FRAME* frame);
+
+// Scheduler. Flow IDs are indexes into the caller's flow array.
+void MuxSchedInit(MUX_SCHEDULER* sched, MUX_FLOW* flows, uint16_t flowCount, MUX_FRAME_POOL* pool);
+bool MuxSchedEnqueue(MUX_SCHEDULER* sched, uint16_t flowId, uint16_t connId,
+                     const uint8_t* data, uint16_t length);
+MUX_FRAME* MuxSchedDequeue(MUX_SCHEDULER* sched);
+void MuxSchedDropFlow(MUX_SCHEDULER* sched, uint16_t flowId);
+void MuxSchedSetPriority(MUX_SCHEDULER* sched, uint16_t flowId, uint8_t priority);
+
+// Configuration
+uint8_t MuxSchedPortPriority(const MUX_SCHEDULER* sched, uint16_t port);
+bool MuxSchedAddPortRule(MUX_SCHEDULER* sched, const char* spec);
+bool MuxSchedSetQuantum(MUX_SCHEDULER* sched, const char* spec);
+
+// Copies quanta and port rules, e.g. from a template to each channel's scheduler
+void MuxSchedCopyConfig(MUX_SCHEDULER* sched, const MUX_SCHEDULER* source);
+
+#endif // MUX_SCHED_H
@@ -0,0 +1,224 @@
+// Shared-memory ring server. Creates the memfd rings for a host proxy started
+// with --channel shm:PATH and relays them to an ordinary channel, such as the
+// QEMU virtio-serial socket or a test guest. Running the two processes on one
+// machine exercises the shared-memory path end to end; in an ivshmem
+// deployment the guest side would map the region instead.
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "shm_ring.h"
+#include "transport.h"
+
+// Poll entries: ring doorbell and control socket, then the guest channel
+#define BRIDGE_POLL_FDS (TRANSPORT_POLL_FDS + TRANSPORT_POLL_FDS)
+
+static void PrintUsage(const char* prog) {
+    printf("Usage: %s [options] SOCKET CHANNEL\n", prog);
+    printf("Serves shared-memory rings on the Unix socket SOCKET and relays them to CHANNEL\n");
+    printf("  -s, --ring-size BYTES   Bytes per direction, a power of two (default: %u)\n", SHM_RING_DEFAULT_SIZE);
+    printf("  -h, --help              Show this help\n");
+    printf("Channels: unix:PATH, tcp:HOST:PORT, dev:PATH, dev:IN_FIFO,OUT_FIFO, or a bare path\n");
+}
+
+static int ListenUnix(const char* path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Socket path %s is too long\n", path);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Error creating socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, strlen(path) + 1);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        printf("Error listening on %s: %s (errno=%d)\n", path, strerror(errno), errno);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Moves bytes both ways until one side goes away
+static void Relay(SHM_CHANNEL* rings, TRANSPORT* guest) {
+    unsigned long long toGuest = 0;
+    unsigned long long fromGuest = 0;
+
+    while (1) {
+        struct pollfd fds[BRIDGE_POLL_FDS];
+        struct iovec iov[2];
+        bool ringsReady;
+        bool guestReady;
+        short guestEvents;
+        ssize_t moved;
+        int count;
+
+        // Ring to guest: hand the readable spans straight to writev
+        while ((count = ShmChannelPeek(rings, iov)) > 0) {
+            moved = TransportWritev(guest, iov, count);
+            if (moved < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                    break;
+                }
+                perror("Error writing to guest channel");
+                goto done;
+            }
+            ShmChannelConsume(rings, moved);
+            toGuest += moved;
+            if ((size_t)moved < iov[0].iov_len + (count > 1 ? iov[1].iov_len : 0)) {
+                break;
+            }
+        }
+
+        // Guest to ring: read straight into the free space
+        while ((count = ShmChannelReserve(rings, iov)) > 0) {
+            moved = TransportRead(guest, iov[0].iov_base, iov[0].iov_len);
+            if (moved == 0) {
+                printf("Guest channel closed\n");
+                goto done;
+            }
+            if (moved < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                    break;
+                }
+                perror("Error reading from guest channel");
+                goto done;
+            }
+            ShmChannelCommit(rings, moved);
+            fromGuest += moved;
+        }
+
+        // Sleep on whichever side is holding things up: guest writability
+        // while ring data is pending, ring space while the ring is full
+        ringsReady = ShmChannelPrepareWait(rings, ShmRingReadable(&rings->rx) == 0,
+                                           ShmRingWritable(&rings->tx) == 0);
+        fds[0].fd = rings->doorbell;
+        fds[0].events = POLLIN;
+        fds[0].revents = 0;
+        fds[1].fd = rings->control;
+        fds[1].events = 0;
+        fds[1].revents = 0;
+        guestReady = TransportPollSetup(guest, fds + TRANSPORT_POLL_FDS, ShmRingWritable(&rings->tx) > 0,
+                                        ShmRingReadable(&rings->rx) > 0);
+
+        if (poll(fds, BRIDGE_POLL_FDS, ringsReady || guestReady ? 0 : -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll error");
+            goto done;
+        }
+
+        ShmChannelFinishWait(rings);
+        if (fds[1].revents & (POLLERR | POLLHUP)) {
+            printf("Host proxy detached\n");
+            goto done;
+        }
+        guestEvents = TransportPollEvents(guest, fds + TRANSPORT_POLL_FDS);
+        if ((guestEvents & (POLLERR | POLLHUP)) && !(guestEvents & POLLIN)) {
+            printf("Guest channel hung up\n");
+            goto done;
+        }
+    }
+
+done:
+    printf("Relayed %llu bytes to the guest and %llu bytes from it\n", toGuest, fromGuest);
+}
+
+int main(int argc, char* argv[]) {
+    static const struct option longOptions[] = {
+        {"ring-size", required_argument, NULL, 's'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    unsigned long ringSize = SHM_RING_DEFAULT_SIZE;
+    TRANSPORT guest;
+    int listener;
+    int opt;
+
+    while ((opt = getopt_long(argc, argv, "s:h", longOptions, NULL)) != -1) {
+        switch (opt) {
+            case 's':
+                ringSize = strtoul(optarg, NULL, 0);
+                break;
+            case 'h':
+                PrintUsage(argv[0]);
+                return 0;
+            default:
+                PrintUsage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (argc - optind != 2) {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+    if (!TransportParse(&guest, argv[optind + 1])) {
+        return 1;
+    }
+    if (ringSize > SHM_RING_MAX_SIZE) {
+        printf("Ring size %lu is larger than %u\n", ringSize, SHM_RING_MAX_SIZE);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    listener = ListenUnix(argv[optind]);
+    if (listener < 0) {
+        return 1;
+    }
+    printf("Serving %lu-byte shared memory rings on %s\n", ringSize, argv[optind]);
+
+    // One host proxy at a time, each with fresh rings
+    while (1) {
+        SHM_CHANNEL rings;
+        int client = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+
+        if (client < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("accept error");
+            break;
+        }
+
+        printf("Host proxy attached\n");
+        if (!TransportOpen(&guest)) {
+            close(client);
+            continue;
+        }
+        if (!ShmChannelServe(&rings, client, (uint32_t)ringSize)) {
+            TransportClose(&guest);
+            continue;
+        }
+
+        Relay(&rings, &guest);
+        ShmChannelClose(&rings);
+        TransportClose(&guest);
+    }
+
+    close(listener);
+    unlink(argv[optind]);
+    return 1;
+}
@@ -0,0 +1,394 @@
+#define _GNU_SOURCE
+
+#include "shm_ring.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+#define SHM_SERVER_TO_CLIENT 0
+#define SHM_CLIENT_TO_SERVER 1
+
+// Descriptors sent by the server, in this order
+#define SHM_FD_MEMORY 0
+#define SHM_FD_CLIENT_DOORBELL 1
+#define SHM_FD_SERVER_DOORBELL 2
+#define SHM_FD_COUNT 3
+
+static size_t RegionLength(uint32_t ringSize) {
+    return sizeof(SHM_REGION_HEADER) + 2 * (size_t)ringSize;
+}
+
+static void SetupRing(SHM_CHANNEL* channel, SHM_RING* ring, int which) {
+    SHM_REGION_HEADER* header = (SHM_REGION_HEADER*)channel->base;
+
+    ring->index = &header->rings[which];
+    ring->size = header->ringSize;
+    ring->data = (uint8_t*)channel->base + sizeof(SHM_REGION_HEADER) + (size_t)which * header->ringSize;
+}
+
+static void RingDoorbell(int fd) {
+    uint64_t one = 1;
+
+    // A full counter (EAGAIN) still wakes the peer
+    if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        perror("Error ringing shared memory doorbell");
+    }
+}
+
+void ShmChannelInit(SHM_CHANNEL* channel) {
+    memset(channel, 0, sizeof(*channel));
+    channel->memFd = -1;
+    channel->doorbell = -1;
+    channel->peerDoorbell = -1;
+    channel->control = -1;
+}
+
+bool ShmChannelServe(SHM_CHANNEL* channel, int socket, uint32_t ringSize) {
+    SHM_REGION_HEADER* header;
+    int fds[SHM_FD_COUNT];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+    struct iovec iov;
+    uint32_t hello = SHM_RING_MAGIC;
+
+    ShmChannelInit(channel);
+    channel->control = socket;
+
+    if (ringSize < SHM_RING_MIN_SIZE || ringSize > SHM_RING_MAX_SIZE || (ringSize & (ringSize - 1)) != 0) {
+        printf("Invalid ring size %u (power of two between %u and %u)\n",
+               ringSize, SHM_RING_MIN_SIZE, SHM_RING_MAX_SIZE);
+        ShmChannelClose(channel);
+        return false;
+    }
+
+    channel->length = RegionLength(ringSize);
+    channel->memFd = memfd_create("mux-channel", MFD_CLOEXEC);
+    if (channel->memFd < 0 || ftruncate(channel->memFd, channel->length) < 0) {
+        perror("Error creating shared memory region");
+        ShmChannelClose(channel);
+        return false;
+    }
+
+    channel->base = mmap(NULL, channel->length, PROT_READ | PROT_WRITE, MAP_SHARED, channel->memFd, 0);
+    if (channel->base == MAP_FAILED) {
+        channel->base = NULL;
+        perror("Error mapping shared memory region");
+        ShmChannelClose(channel);
+        return false;
+    }
+
+    // Fresh memfd pages are zero, so the indices and flags start out clear
+    header = (SHM_REGION_HEADER*)channel->base;
+    header->magic = SHM_RING_MAGIC;
+    header->version = SHM_RING_VERSION;
+    header->ringSize = ringSize;
+    SetupRing(channel, &channel->tx, SHM_SERVER_TO_CLIENT);
+    SetupRing(channel, &channel->rx, SHM_CLIENT_TO_SERVER);
+
+    channel->doorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    channel->peerDoorbell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (channel->doorbell < 0 || channel->peerDoorbell < 0) {
+        perror("Error creating doorbell");
+        ShmChannelClose(channel);
+        return false;
+    }
+
+    fds[SHM_FD_MEMORY] = channel->memFd;
+    fds[SHM_FD_CLIENT_DOORBELL] = channel->peerDoorbell;
+    fds[SHM_FD_SERVER_DOORBELL] = channel->doorbell;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(control, 0, sizeof(control));
+    iov.iov_base = &hello;
+    iov.iov_len = sizeof(hello);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if (sendmsg(socket, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(hello)) {
+        perror("Error sending shared memory descriptors");
+        ShmChannelClose(channel);
+        return false;
+    }
+
+    return true;
+}
+
+bool ShmChannelAttach(SHM_CHANNEL* channel, int socket) {
+    int fds[SHM_FD_COUNT];
+    char control[CMSG_SPACE(sizeof(fds))];
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+    struct iovec iov;
+    uint32_t hello = 0;
+    ssize_t received;
+
+    ShmChannelInit(channel);
+    channel->control = socket;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = &hello;
+    iov.iov_len = sizeof(hello);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    received = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (received != (ssize_t)sizeof(hello) || hello != SHM_RING_MAGIC || cmsg == NULL ||
+        cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        if (received < 0) {
+            perror("Error receiving shared memory descriptors");
+        } else {
+            printf("Peer did not send a shared memory region\n");
+        }
+        ShmChannelClose(channel);
+        return false;
+    }
+
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    return ShmChannelAdopt(channel, fds[SHM_FD_MEMORY], fds[SHM_FD_CLIENT_DOORBELL],
+                           fds[SHM_FD_SERVER_DOORBELL], socket);
+}
+
+bool ShmChannelAdopt(SHM_CHANNEL* channel, int memFd, int doorbell, int peerDoorbell, int control) {
+    SHM_REGION_HEADER* header;
+    struct stat statbuf;
+
+    ShmChannelInit(channel);
+    channel->memFd = memFd;
+    channel->doorbell = doorbell;
+    channel->peerDoorbell = peerDoorbell;
+    channel->control = control;
+
+    if (fstat(channel->memFd, &statbuf) < 0 || (size_t)statbuf.st_size < sizeof(SHM_REGION_HEADER)) {
+        printf("Shared memory region is too small\n");
+        ShmChannelClose(channel);
+        return false;
+    }
+
+    channel->length = statbuf.st_size;
+    channel->base = mmap(NULL, channel->length, PROT_READ | PROT_WRITE, MAP_SHARED, channel->memFd, 0);
+    if (channel->base == MAP_FAILED) {
+        channel->base = NULL;
+        perror("Error mapping shared memory region");
+        ShmChannelClose(channel);
+        return false;
+    }
+
+    header = (SHM_REGION_HEADER*)channel->base;
+    if (header->magic != SHM_RING_MAGIC || header->version != SHM_RING_VERSION ||
+        header->ringSize < SHM_RING_MIN_SIZE || (header->ringSize & (header->ringSize - 1)) != 0 ||
+        RegionLength(header->ringSize) > channel->length) {
+        printf("Unsupported shared memory region (magic 0x%08X, version %u, ring size %u)\n",
+               header->magic, header->version, header->ringSize);
+        ShmChannelClose(channel);
+        return false;
+    }
+
+    SetupRing(channel, &channel->rx, SHM_SERVER_TO_CLIENT);
+    SetupRing(channel, &channel->tx, SHM_CLIENT_TO_SERVER);
+    return true;
+}
+
+void ShmChannelClose(SHM_CHANNEL* channel) {
+    if (channel->base != NULL) {
+        munmap(channel->base, channel->length);
+    }
+    if (channel->memFd != -1) {
+        close(channel->memFd);
+    }
+    if (channel->doorbell != -1) {
+        close(channel->doorbell);
+    }
+    if (channel->peerDoorbell != -1) {
+        close(channel->peerDoorbell);
+    }
+    if (channel->control != -1) {
+        close(channel->control);
+    }
+    ShmChannelInit(channel);
+}
+
+size_t ShmRingReadable(const SHM_RING* ring) {
+    uint64_t head = __atomic_load_n(&ring->index->head, __ATOMIC_ACQUIRE);
+
+    return (size_t)(head - ring->index->tail);
+}
+
+size_t ShmRingWritable(const SHM_RING* ring) {
+    uint64_t tail = __atomic_load_n(&ring->index->tail, __ATOMIC_ACQUIRE);
+
+    return ring->size - (size_t)(ring->index->head - tail);
+}
+
+// Splits length bytes starting at position into at most two spans of the
+// ring's storage
+static int RingSpans(const SHM_RING* ring, uint64_t position, size_t length, struct iovec iov[2]) {
+    size_t offset = (size_t)(position & (ring->size - 1));
+    size_t first = ring->size - offset;
+
+    if (length == 0) {
+        return 0;
+    }
+    iov[0].iov_base = ring->data + offset;
+    if (length <= first) {
+        iov[0].iov_len = length;
+        return 1;
+    }
+    iov[0].iov_len = first;
+    iov[1].iov_base = ring->data;
+    iov[1].iov_len = length - first;
+    return 2;
+}
+
+int ShmChannelPeek(SHM_CHANNEL* channel, struct iovec iov[2]) {
+    return RingSpans(&channel->rx, channel->rx.index->tail, ShmRingReadable(&channel->rx), iov);
+}
+
+void ShmChannelConsume(SHM_CHANNEL* channel, size_t bytes) {
+    SHM_RING_INDEX* index = channel->rx.index;
+
+    if (bytes == 0) {
+        return;
+    }
+
+    // Publish the free space, then check whether the producer went to sleep
+    // waiting for it. The fence pairs with the one in ShmChannelPrepareWait.
+    __atomic_store_n(&index->tail, index->tail + bytes, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&index->writerWaiting, __ATOMIC_RELAXED)) {
+        RingDoorbell(channel->peerDoorbell);
+    }
+}
+
+int ShmChannelReserve(SHM_CHANNEL* channel, struct iovec iov[2]) {
+    return RingSpans(&channel->tx, channel->tx.index->head, ShmRingWritable(&channel->tx), iov);
+}
+
+void ShmChannelCommit(SHM_CHANNEL* channel, size_t bytes) {
+    SHM_RING_INDEX* index = channel->tx.index;
+
+    if (bytes == 0) {
+        return;
+    }
+
+    __atomic_store_n(&index->head, index->head + bytes, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&index->readerWaiting, __ATOMIC_RELAXED)) {
+        RingDoorbell(channel->peerDoorbell);
+    }
+}
+
+ssize_t ShmChannelRead(SHM_CHANNEL* channel, void* buffer, size_t length) {
+    struct iovec iov[2];
+    int count = ShmChannelPeek(channel, iov);
+    size_t copied = 0;
+    int i;
+
+    if (count == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    for (i = 0; i < count && copied < length; i++) {
+        size_t chunk = iov[i].iov_len < length - copied ? iov[i].iov_len : length - copied;
+
+        memcpy((uint8_t*)buffer + copied, iov[i].iov_base, chunk);
+        copied += chunk;
+    }
+
+    ShmChannelConsume(channel, copied);
+    return (ssize_t)copied;
+}
+
+ssize_t ShmChannelWritev(SHM_CHANNEL* channel, const struct iovec* iov, int iovcnt) {
+    struct iovec space[2];
+    int count = ShmChannelReserve(channel, space);
+    int spaceIndex = 0;
+    size_t spaceUsed = 0;
+    size_t written = 0;
+    int i;
+
+    if (count == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    // Copy as much of the gather list as fits into the free spans
+    for (i = 0; i < iovcnt && spaceIndex < count; i++) {
+        const uint8_t* source = (const uint8_t*)iov[i].iov_base;
+        size_t remaining = iov[i].iov_len;
+
+        while (remaining > 0 && spaceIndex < count) {
+            size_t room = space[spaceIndex].iov_len - spaceUsed;
+            size_t chunk = remaining < room ? remaining : room;
+
+            memcpy((uint8_t*)space[spaceIndex].iov_base + spaceUsed, source, chunk);
+            source += chunk;
+            remaining -= chunk;
+            spaceUsed += chunk;
+            written += chunk;
+            if (spaceUsed == space[spaceIndex].iov_len) {
+                spaceIndex++;
+                spaceUsed = 0;
+            }
+        }
+    }
+
+    ShmChannelCommit(channel, written);
+    return (ssize_t)written;
+}
+
+bool ShmChannelPrepareWait(SHM_CHANNEL* channel, bool wantRead, bool wantWrite) {
+    bool ready = false;
+
+    // Announce the sleep first and look at the rings afterwards: a peer that
+    // updated them before seeing the flag is caught by the second check
+    if (wantRead) {
+        __atomic_store_n(&channel->rx.index->readerWaiting, 1, __ATOMIC_RELAXED);
+    }
+    if (wantWrite) {
+        __atomic_store_n(&channel->tx.index->writerWaiting, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (wantRead && ShmRingReadable(&channel->rx) > 0) {
+        ready = true;
+    }
+    if (wantWrite && ShmRingWritable(&channel->tx) > 0) {
+        ready = true;
+    }
+
+    if (ready) {
+        ShmChannelFinishWait(channel);
+    }
+    return ready;
+}
+
+void ShmChannelFinishWait(SHM_CHANNEL* channel) {
+    uint64_t count;
+
+    __atomic_store_n(&channel->rx.index->readerWaiting, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&channel->tx.index->writerWaiting, 0, __ATOMIC_RELAXED);
+
+    // Reading an eventfd resets it; EAGAIN just means nobody rang
+    if (read(channel->doorbell, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        perror("Error reading shared memory doorbell");
+    }
+}
@@ -0,0 +1,105 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+// Mux channel over shared memory: a memfd holding two single-producer,
+// single-consumer byte rings, one per direction, and an eventfd doorbell per
+// side. The side that creates the region (the server) hands the memfd and
+// both eventfds to the other side (the client) over a Unix socket with
+// SCM_RIGHTS, the same way an ivshmem server does. That socket stays open and
+// hangs up when either process goes away.
+//
+// The rings carry the same byte stream as the serial port, so the mux frame
+// format is unchanged. Doorbells are only rung when the other side has said
+// it is about to sleep, so a busy channel moves data without system calls.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#define SHM_CACHE_LINE 64
+#define SHM_RING_MAGIC 0x4D48534DU    // "MSHM"
+#define SHM_RING_VERSION 1
+#define SHM_RING_MIN_SIZE 4096
+#define SHM_RING_MAX_SIZE (64U << 20)
+#define SHM_RING_DEFAULT_SIZE (1U << 20)
+
+// Shared indices of one ring. Positions count bytes since the region was
+// created and only ever grow; the producer and consumer halves live on
+// separate cache lines so the two processes do not bounce a line between
+// them on every update.
+typedef struct {
+    volatile uint64_t head;             // Written by the producer
+    volatile uint32_t writerWaiting;    // Producer sleeps until space frees up
+    uint8_t producerPad[SHM_CACHE_LINE - sizeof(uint64_t) - sizeof(uint32_t)];
+    volatile uint64_t tail;             // Written by the consumer
+    volatile uint32_t readerWaiting;    // Consumer sleeps until data arrives
+    uint8_t consumerPad[SHM_CACHE_LINE - sizeof(uint64_t) - sizeof(uint32_t)];
+} SHM_RING_INDEX;
+
+// Start of the region; the ring data follows, ring 0 first
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ringSize;
+    uint8_t headerPad[SHM_CACHE_LINE - 3 * sizeof(uint32_t)];
+    SHM_RING_INDEX rings[2];            // 0: server to client, 1: client to server
+} SHM_REGION_HEADER;
+
+typedef struct {
+    SHM_RING_INDEX* index;
+    uint8_t* data;
+    uint32_t size;                      // Power of two
+} SHM_RING;
+
+typedef struct {
+    void* base;
+    size_t length;
+    SHM_RING rx;
+    SHM_RING tx;
+    int memFd;
+    int doorbell;                       // Rung by the peer, polled by us
+    int peerDoorbell;                   // Rung by us
+    int control;                        // Socket the descriptors came over
+} SHM_CHANNEL;
+
+void ShmChannelInit(SHM_CHANNEL* channel);
+
+// Server side: creates the region with rings of ringSize bytes (a power of
+// two) and sends its descriptors to the client on socket, which the channel
+// then owns
+bool ShmChannelServe(SHM_CHANNEL* channel, int socket, uint32_t ringSize);
+
+// Client side: receives and maps the region; the channel owns socket
+bool ShmChannelAttach(SHM_CHANNEL* channel, int socket);
+
+// Client side, for descriptors that arrived some other way (a hot restart
+// handing over a live channel): maps the region; the channel owns all four
+bool ShmChannelAdopt(SHM_CHANNEL* channel, int memFd, int doorbell, int peerDoorbell, int control);
+
+void ShmChannelClose(SHM_CHANNEL* channel);
+
+size_t ShmRingReadable(const SHM_RING* ring);
+size_t ShmRingWritable(const SHM_RING* ring);
+
+// Zero-copy access: the readable (or free) bytes as up to two spans, then
+// the number of bytes actually consumed (or filled)
+int ShmChannelPeek(SHM_CHANNEL* channel, struct iovec iov[2]);
+void ShmChannelConsume(SHM_CHANNEL* channel, size_t bytes);
+int ShmChannelReserve(SHM_CHANNEL* channel, struct iovec iov[2]);
+void ShmChannelCommit(SHM_CHANNEL* channel, size_t bytes);
+
+// Copying access with the contract of a non-blocking socket: partial
+// transfers, and -1 with EAGAIN when the ring is empty (or full)
+ssize_t ShmChannelRead(SHM_CHANNEL* channel, void* buffer, size_t length);
+ssize_t ShmChannelWritev(SHM_CHANNEL* channel, const struct iovec* iov, int iovcnt);
+
+// Call before sleeping on the doorbell. Returns true if the wait is already
+// satisfied, in which case the caller should not block.
+bool ShmChannelPrepareWait(SHM_CHANNEL* channel, bool wantRead, bool wantWrite);
+
+// Call after waking up: resets the doorbell and the waiting flags
+void ShmChannelFinishWait(SHM_CHANNEL* channel);
+
+#endif // SHM_RING_H
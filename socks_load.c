@@ -0,0 +1,575 @@
+// SOCKS5 load generator. Opens many client connections to a SOCKS server,
+// such as the guest frontend, has each one CONNECT to a responder server
+// run by this tool, and exchanges fixed-size requests and responses over
+// it. Reports handshake latency (greeting and CONNECT round trips), time
+// to first byte, request latency and throughput in the same key=value
+// format as fake_guest.
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "bench.h"
+
+#define REPORT_VERSION 1
+#define DEFAULT_PROXY "127.0.0.1:1080"
+#define DEFAULT_TARGET "127.0.0.1"
+
+#define MAX_CLIENTS 1024
+#define MAX_MESSAGE_SIZE (16 * 1024 * 1024)
+#define IO_SIZE (64 * 1024)
+
+#define SOCKS_VERSION 5
+#define SOCKS_AUTH_NONE 0x00
+#define SOCKS_CMD_CONNECT 0x01
+#define SOCKS_ATYP_IPV4 0x01
+#define SOCKS_ATYP_DOMAIN 0x03
+#define SOCKS_ATYP_IPV6 0x04
+#define SOCKS_REPLY_SUCCESS 0x00
+
+typedef enum {
+    CLIENT_IDLE,
+    CLIENT_CONNECTING,          // TCP connect to the SOCKS server in progress
+    CLIENT_GREETING,            // Waiting for the method selection
+    CLIENT_REQUEST,             // Waiting for the CONNECT reply
+    CLIENT_ACTIVE               // Exchanging requests with the responder
+} CLIENT_STATE;
+
+typedef struct {
+    int socket;
+    CLIENT_STATE state;
+    uint64_t startUs;           // connect() to the SOCKS server
+    uint64_t connectedUs;       // TCP handshake done
+    uint64_t requestUs;         // Current request started
+    uint32_t requests;          // Completed on this connection
+    uint32_t toSend;            // Request bytes not yet written
+    uint32_t toReceive;         // Response bytes still to come
+    bool gotFirstByte;
+    uint8_t reply[4 + 255 + 2]; // Method selection or CONNECT reply so far
+    uint32_t replyLen;
+} CLIENT;
+
+typedef struct {
+    struct sockaddr_storage proxy;
+    socklen_t proxyLen;
+    const char* target;
+    int connections;
+    uint32_t requestsPerConnection;     // 0: keep connections open
+    uint32_t requestSize;
+    uint32_t responseSize;
+    bool pipeline;
+    uint64_t durationUs;
+    uint64_t warmupUs;
+} LOAD_CONFIG;
+
+typedef struct {
+    uint64_t startUs;
+    uint64_t bytesUp;
+    uint64_t bytesDown;
+    uint64_t connections;       // SOCKS handshakes completed
+    uint64_t requests;
+    uint64_t errors;            // Failed connects, refused CONNECTs, dropped connections
+} LOAD_STATS;
+
+static LOAD_CONFIG g_config;
+static LOAD_STATS g_stats;
+static BENCH_LATENCY g_handshake;
+static BENCH_LATENCY g_ttfb;
+static BENCH_LATENCY g_request;
+static BENCH_SERVERS g_servers;
+static CLIENT g_clients[MAX_CLIENTS];
+static bool g_measuring = false;
+static uint8_t g_pattern[IO_SIZE];
+static uint8_t g_scratch[IO_SIZE];
+
+static void PrintUsage(const char* prog) {
+    printf("Usage: %s [options]\n", prog);
+    printf("Drives a SOCKS5 server with clients that CONNECT through it to a local responder\n");
+    printf("  -x, --proxy HOST:PORT       SOCKS5 server (default: %s)\n", DEFAULT_PROXY);
+    printf("  -t, --target ADDR           IPv4 address the responder listens on and is requested at (default: %s)\n",
+           DEFAULT_TARGET);
+    printf("  -c, --connections N         Concurrent client connections, at most %d (default: 16)\n", MAX_CLIENTS);
+    printf("  -r, --requests N            Requests per connection before it is replaced, 0 for no limit (default: 0)\n");
+    printf("  -s, --request-size BYTES    Bytes per request (default: 64)\n");
+    printf("  -S, --response-size BYTES   Bytes per response (default: 64)\n");
+    printf("  -p, --pipeline              Send greeting, CONNECT and the first request without waiting for replies\n");
+    printf("  -d, --duration SEC          Measured time (default: 10)\n");
+    printf("  -w, --warmup SEC            Unmeasured time before it (default: 1)\n");
+    printf("  -h, --help                  Show this help\n");
+}
+
+static bool ParseProxy(const char* text) {
+    struct addrinfo hints;
+    struct addrinfo* result;
+    char host[256];
+    const char* colon = strrchr(text, ':');
+
+    if (colon == NULL || colon == text || (size_t)(colon - text) >= sizeof(host)) {
+        printf("Invalid proxy address '%s' (HOST:PORT)\n", text);
+        return false;
+    }
+    memcpy(host, text, colon - text);
+    host[colon - text] = '\0';
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, colon + 1, &hints, &result) != 0) {
+        printf("Cannot resolve proxy address '%s'\n", text);
+        return false;
+    }
+    memcpy(&g_config.proxy, result->ai_addr, result->ai_addrlen);
+    g_config.proxyLen = result->ai_addrlen;
+    freeaddrinfo(result);
+    return true;
+}
+
+static bool SendAll(CLIENT* client, const void* data, size_t length) {
+    // Handshake messages are small enough to fit the empty socket buffer
+    ssize_t n = send(client->socket, data, length, MSG_NOSIGNAL);
+
+    return n == (ssize_t)length;
+}
+
+static bool SendConnect(CLIENT* client) {
+    struct in_addr addr;
+    uint16_t port = g_servers.ports[BENCH_RESPONDER];
+    uint8_t request[10];
+
+    inet_pton(AF_INET, g_config.target, &addr);
+    request[0] = SOCKS_VERSION;
+    request[1] = SOCKS_CMD_CONNECT;
+    request[2] = 0;
+    request[3] = SOCKS_ATYP_IPV4;
+    memcpy(&request[4], &addr, 4);
+    request[8] = (uint8_t)(port >> 8);
+    request[9] = (uint8_t)port;
+    return SendAll(client, request, sizeof(request));
+}
+
+static void StartRequest(CLIENT* client, uint64_t now) {
+    client->requestUs = now;
+    client->toSend = g_config.requestSize;
+    client->toReceive = g_config.responseSize;
+}
+
+static void StartClient(CLIENT* client) {
+    client->socket = socket(g_config.proxy.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (client->socket < 0) {
+        perror("Error creating client socket");
+        client->state = CLIENT_IDLE;
+        return;
+    }
+
+    client->state = CLIENT_CONNECTING;
+    client->startUs = BenchNowMicros();
+    client->requests = 0;
+    client->toSend = 0;
+    client->toReceive = 0;
+    client->gotFirstByte = false;
+    client->replyLen = 0;
+    if (connect(client->socket, (struct sockaddr*)&g_config.proxy, g_config.proxyLen) < 0 && errno != EINPROGRESS) {
+        client->state = CLIENT_IDLE;
+        close(client->socket);
+        client->socket = -1;
+        if (g_measuring) {
+            g_stats.errors++;
+        }
+    }
+}
+
+// Replaces the connection; failed ones count as errors
+static void RestartClient(CLIENT* client, bool failed) {
+    if (failed && g_measuring) {
+        g_stats.errors++;
+    }
+    if (client->socket >= 0) {
+        close(client->socket);
+        client->socket = -1;
+    }
+    StartClient(client);
+}
+
+static void ConnectDone(CLIENT* client, uint64_t now) {
+    static const uint8_t greeting[3] = {SOCKS_VERSION, 1, SOCKS_AUTH_NONE};
+    int error = 0;
+    socklen_t errorLen = sizeof(error);
+
+    if (getsockopt(client->socket, SOL_SOCKET, SO_ERROR, &error, &errorLen) < 0 || error != 0) {
+        RestartClient(client, true);
+        return;
+    }
+
+    client->connectedUs = now;
+    client->state = CLIENT_GREETING;
+    if (!SendAll(client, greeting, sizeof(greeting)) || (g_config.pipeline && !SendConnect(client))) {
+        RestartClient(client, true);
+        return;
+    }
+    if (g_config.pipeline) {
+        StartRequest(client, now);
+    }
+}
+
+// Bytes needed for the complete reply: 2 for the method selection, and
+// for the CONNECT reply 4 plus the address its ATYP announces plus 2
+static uint32_t ReplyNeeded(const CLIENT* client) {
+    if (client->state == CLIENT_GREETING) {
+        return 2;
+    }
+    if (client->replyLen < 5) {
+        return 5;
+    }
+    switch (client->reply[3]) {
+        case SOCKS_ATYP_IPV6:
+            return 4 + 16 + 2;
+        case SOCKS_ATYP_DOMAIN:
+            return 4 + 1 + client->reply[4] + 2;
+        default:
+            return 4 + 4 + 2;
+    }
+}
+
+// Consumes handshake bytes from data; returns how many were used, -1 on failure
+static int HandleReply(CLIENT* client, const uint8_t* data, int length, uint64_t now) {
+    int used = 0;
+
+    while (used < length && client->state != CLIENT_ACTIVE) {
+        uint32_t needed = ReplyNeeded(client);
+
+        while (client->replyLen < needed && used < length) {
+            client->reply[client->replyLen++] = data[used++];
+        }
+        if (client->replyLen < needed || ReplyNeeded(client) > needed) {
+            continue;
+        }
+
+        if (client->state == CLIENT_GREETING) {
+            if (client->reply[0] != SOCKS_VERSION || client->reply[1] != SOCKS_AUTH_NONE) {
+                return -1;
+            }
+            client->state = CLIENT_REQUEST;
+            client->replyLen = 0;
+            if (!g_config.pipeline && !SendConnect(client)) {
+                return -1;
+            }
+        } else {
+            if (client->reply[1] != SOCKS_REPLY_SUCCESS) {
+                return -1;
+            }
+            client->state = CLIENT_ACTIVE;
+            if (g_measuring) {
+                g_stats.connections++;
+                BenchLatencyAdd(&g_handshake, now - client->connectedUs);
+            }
+            if (!g_config.pipeline) {
+                StartRequest(client, now);
+            }
+        }
+    }
+    return used;
+}
+
+static void ReadClient(CLIENT* client, uint64_t now) {
+    ssize_t n = recv(client->socket, g_scratch, sizeof(g_scratch), 0);
+    int offset = 0;
+
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+        RestartClient(client, true);
+        return;
+    }
+    if (n < 0) {
+        return;
+    }
+
+    if (client->state != CLIENT_ACTIVE) {
+        offset = HandleReply(client, g_scratch, (int)n, now);
+        if (offset < 0) {
+            RestartClient(client, true);
+            return;
+        }
+    }
+    if (offset == n) {
+        return;
+    }
+
+    // Response bytes
+    n -= offset;
+    if ((uint32_t)n > client->toReceive) {
+        RestartClient(client, true);
+        return;
+    }
+    if (!client->gotFirstByte) {
+        client->gotFirstByte = true;
+        if (g_measuring) {
+            BenchLatencyAdd(&g_ttfb, now - client->startUs);
+        }
+    }
+    client->toReceive -= (uint32_t)n;
+    if (g_measuring) {
+        g_stats.bytesDown += (uint64_t)n;
+    }
+    if (client->toReceive > 0 || client->toSend > 0) {
+        return;
+    }
+
+    if (g_measuring) {
+        g_stats.requests++;
+        BenchLatencyAdd(&g_request, now - client->requestUs);
+    }
+    client->requests++;
+    if (g_config.requestsPerConnection != 0 && client->requests >= g_config.requestsPerConnection) {
+        RestartClient(client, false);
+    } else {
+        StartRequest(client, now);
+    }
+}
+
+static void WriteClient(CLIENT* client) {
+    while (client->toSend > 0) {
+        size_t chunk = client->toSend < sizeof(g_pattern) ? client->toSend : sizeof(g_pattern);
+        ssize_t n = send(client->socket, g_pattern, chunk, MSG_NOSIGNAL);
+
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                RestartClient(client, true);
+            }
+            return;
+        }
+        client->toSend -= (uint32_t)n;
+        if (g_measuring) {
+            g_stats.bytesUp += (uint64_t)n;
+        }
+    }
+}
+
+static void PrintReport(uint64_t endUs) {
+    double seconds = (double)(endUs - g_stats.startUs) / 1e6;
+
+    printf("report_version=%d\n", REPORT_VERSION);
+    printf("connections=%d\n", g_config.connections);
+    printf("requests_per_connection=%u\n", g_config.requestsPerConnection);
+    printf("request_size=%u\n", g_config.requestSize);
+    printf("response_size=%u\n", g_config.responseSize);
+    printf("pipeline=%d\n", g_config.pipeline ? 1 : 0);
+    printf("duration_s=%.3f\n", seconds);
+    printf("bytes_up=%llu\n", (unsigned long long)g_stats.bytesUp);
+    printf("bytes_down=%llu\n", (unsigned long long)g_stats.bytesDown);
+    printf("mbit_up=%.2f\n", g_stats.bytesUp * 8 / seconds / 1e6);
+    printf("mbit_down=%.2f\n", g_stats.bytesDown * 8 / seconds / 1e6);
+    printf("handshakes=%llu\n", (unsigned long long)g_stats.connections);
+    printf("handshakes_per_s=%.1f\n", g_stats.connections / seconds);
+    printf("requests=%llu\n", (unsigned long long)g_stats.requests);
+    printf("requests_per_s=%.1f\n", g_stats.requests / seconds);
+    printf("errors=%llu\n", (unsigned long long)g_stats.errors);
+    BenchLatencyReport(&g_handshake, "handshake");
+    BenchLatencyReport(&g_ttfb, "ttfb");
+    BenchLatencyReport(&g_request, "request");
+}
+
+static void Run(void) {
+    static struct pollfd fds[MAX_CLIENTS + BENCH_SERVER_POLL_FDS];
+    static int pollClient[MAX_CLIENTS];
+    uint64_t startUs = BenchNowMicros();
+    uint64_t endUs = 0;
+    int nfds;
+    int serverFds;
+    int i;
+
+    for (i = 0; i < g_config.connections; i++) {
+        StartClient(&g_clients[i]);
+    }
+
+    while (1) {
+        uint64_t now = BenchNowMicros();
+        uint64_t due;
+
+        if (!g_measuring && now - startUs >= g_config.warmupUs) {
+            memset(&g_stats, 0, sizeof(g_stats));
+            g_handshake.count = 0;
+            g_ttfb.count = 0;
+            g_request.count = 0;
+            g_stats.startUs = now;
+            g_measuring = true;
+            endUs = now + g_config.durationUs;
+        }
+        if (g_measuring && now >= endUs) {
+            PrintReport(now);
+            return;
+        }
+        due = g_measuring ? endUs : startUs + g_config.warmupUs;
+
+        nfds = 0;
+        for (i = 0; i < g_config.connections; i++) {
+            CLIENT* client = &g_clients[i];
+
+            if (client->state == CLIENT_IDLE) {
+                // Could not even start a connect; try again on the next pass
+                StartClient(client);
+                continue;
+            }
+            pollClient[nfds] = i;
+            fds[nfds].fd = client->socket;
+            fds[nfds].events = client->state == CLIENT_CONNECTING ? POLLOUT :
+                               POLLIN | (client->toSend > 0 && (client->state == CLIENT_ACTIVE || g_config.pipeline) ?
+                                         POLLOUT : 0);
+            fds[nfds].revents = 0;
+            nfds++;
+        }
+        serverFds = BenchServersPollSetup(&g_servers, fds + nfds);
+
+        if (poll(fds, nfds + serverFds, (int)((due - now + 999) / 1000)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll error");
+            return;
+        }
+
+        now = BenchNowMicros();
+        BenchServersPollEvents(&g_servers, fds + nfds, serverFds);
+        for (i = 0; i < nfds; i++) {
+            CLIENT* client = &g_clients[pollClient[i]];
+            int fd = client->socket;
+
+            if (fds[i].revents == 0) {
+                continue;
+            }
+            if (client->state == CLIENT_CONNECTING) {
+                ConnectDone(client, now);
+                continue;
+            }
+            if (fds[i].revents & POLLOUT) {
+                WriteClient(client);
+            }
+            if (client->socket == fd && (fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                ReadClient(client, now);
+            }
+        }
+    }
+}
+
+static bool ParseCount(const char* text, unsigned long max, unsigned long* value) {
+    char* end;
+
+    *value = strtoul(text, &end, 10);
+    return end != text && *end == '\0' && *value <= max;
+}
+
+int main(int argc, char* argv[]) {
+    static const struct option longOptions[] = {
+        {"proxy", required_argument, NULL, 'x'},
+        {"target", required_argument, NULL, 't'},
+        {"connections", required_argument, NULL, 'c'},
+        {"requests", required_argument, NULL, 'r'},
+        {"request-size", required_argument, NULL, 's'},
+        {"response-size", required_argument, NULL, 'S'},
+        {"pipeline", no_argument, NULL, 'p'},
+        {"duration", required_argument, NULL, 'd'},
+        {"warmup", required_argument, NULL, 'w'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    const char* proxy = DEFAULT_PROXY;
+    struct in_addr target;
+    unsigned long value;
+    int opt;
+    int i;
+
+    g_config.target = DEFAULT_TARGET;
+    g_config.connections = 16;
+    g_config.requestSize = 64;
+    g_config.responseSize = 64;
+    g_config.durationUs = 10000000ULL;
+    g_config.warmupUs = 1000000ULL;
+
+    while ((opt = getopt_long(argc, argv, "x:t:c:r:s:S:pd:w:h", longOptions, NULL)) != -1) {
+        switch (opt) {
+            case 'x':
+                proxy = optarg;
+                break;
+            case 't':
+                g_config.target = optarg;
+                break;
+            case 'c':
+                if (!ParseCount(optarg, MAX_CLIENTS, &value) || value == 0) {
+                    printf("Invalid connection count '%s' (1 to %d)\n", optarg, MAX_CLIENTS);
+                    return 1;
+                }
+                g_config.connections = (int)value;
+                break;
+            case 'r':
+                if (!ParseCount(optarg, UINT32_MAX, &value)) {
+                    printf("Invalid request count '%s'\n", optarg);
+                    return 1;
+                }
+                g_config.requestsPerConnection = (uint32_t)value;
+                break;
+            case 's':
+            case 'S':
+                if (!ParseCount(optarg, MAX_MESSAGE_SIZE, &value) || value == 0) {
+                    printf("Invalid size '%s' (1 to %d)\n", optarg, MAX_MESSAGE_SIZE);
+                    return 1;
+                }
+                *(opt == 's' ? &g_config.requestSize : &g_config.responseSize) = (uint32_t)value;
+                break;
+            case 'p':
+                g_config.pipeline = true;
+                break;
+            case 'd':
+            case 'w':
+                if (!ParseCount(optarg, 86400, &value) || (opt == 'd' && value == 0)) {
+                    printf("Invalid time '%s'\n", optarg);
+                    return 1;
+                }
+                *(opt == 'd' ? &g_config.durationUs : &g_config.warmupUs) = value * 1000000ULL;
+                break;
+            case 'h':
+                PrintUsage(argv[0]);
+                return 0;
+            default:
+                PrintUsage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind < argc) {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+    if (!ParseProxy(proxy)) {
+        return 1;
+    }
+    if (inet_pton(AF_INET, g_config.target, &target) != 1) {
+        printf("Invalid target address '%s'\n", g_config.target);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    for (i = 0; i < IO_SIZE; i++) {
+        g_pattern[i] = (uint8_t)i;
+    }
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        g_clients[i].socket = -1;
+    }
+
+    g_servers.requestSize = g_config.requestSize;
+    g_servers.responseSize = g_config.responseSize;
+    if (!BenchServersStart(&g_servers, g_config.target)) {
+        return 1;
+    }
+    printf("Driving %s with %d connections, responder at %s:%u\n", proxy, g_config.connections,
+           g_config.target, g_servers.ports[BENCH_RESPONDER]);
+
+    Run();
+    return 0;
+}
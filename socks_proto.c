@@ -0,0 +1,140 @@
+#include "socks_proto.h"
+
+#include <stdio.h>
+#include <string.h>
+
+static int ParseGreeting(const uint8_t* data, size_t length, SOCKS_STEP* step) {
+    uint8_t nmethods;
+    uint8_t i;
+
+    if (length < 2) {
+        return SOCKS_STEP_PARTIAL;
+    }
+    if (data[0] != SOCKS_VERSION) {
+        printf("Unsupported SOCKS version: %d\n", data[0]);
+        return SOCKS_STEP_INVALID;
+    }
+
+    nmethods = data[1];
+    if (length < 2 + (size_t)nmethods) {
+        return SOCKS_STEP_PARTIAL;
+    }
+
+    for (i = 0; i < nmethods; i++) {
+        if (data[2 + i] == SOCKS_AUTH_NONE) {
+            step->consumed = 2 + (size_t)nmethods;
+            step->reply[0] = SOCKS_VERSION;
+            step->reply[1] = SOCKS_AUTH_NONE;
+            step->replyLength = 2;
+            return SOCKS_STEP_REPLY;
+        }
+    }
+
+    printf("No supported auth methods\n");
+    return SOCKS_STEP_INVALID;
+}
+
+static int ParseRequest(const uint8_t* data, size_t length, SOCKS_STEP* step) {
+    SOCKS_REQUEST* request = &step->request;
+    size_t addrLen;
+
+    if (length < 5) {
+        return SOCKS_STEP_PARTIAL;
+    }
+    if (data[0] != SOCKS_VERSION) {
+        printf("Unsupported SOCKS version in request: %d\n", data[0]);
+        return SOCKS_STEP_INVALID;
+    }
+    if (data[1] != SOCKS_CMD_CONNECT) {
+        printf("Unsupported SOCKS command: %d\n", data[1]);
+        return SOCKS_STEP_INVALID;
+    }
+
+    // The open request for the host is the request from ATYP on, with the
+    // domain length kept in front of a domain
+    request->atyp = data[3];
+    switch (request->atyp) {
+        case SOCKS_ATYP_IPV4:
+            addrLen = 4;
+            if (length < 4 + addrLen + 2) {
+                return SOCKS_STEP_PARTIAL;
+            }
+            snprintf(request->host, sizeof(request->host), "%d.%d.%d.%d", data[4], data[5], data[6], data[7]);
+            memcpy(request->open, &data[3], 1 + addrLen + 2);
+            request->openLength = (uint16_t)(1 + addrLen + 2);
+            break;
+        case SOCKS_ATYP_DOMAIN:
+            addrLen = 1 + (size_t)data[4];
+            if (length < 4 + addrLen + 2) {
+                return SOCKS_STEP_PARTIAL;
+            }
+            memcpy(request->host, &data[5], addrLen - 1);
+            request->host[addrLen - 1] = '\0';
+            memcpy(request->open, &data[3], 1 + addrLen + 2);
+            request->openLength = (uint16_t)(1 + addrLen + 2);
+            break;
+        case SOCKS_ATYP_IPV6:
+            printf("IPv6 not supported in this implementation\n");
+            return SOCKS_STEP_INVALID;
+        default:
+            printf("Unsupported address type: %d\n", request->atyp);
+            return SOCKS_STEP_INVALID;
+    }
+
+    request->port = (uint16_t)((data[4 + addrLen] << 8) | data[4 + addrLen + 1]);
+    step->consumed = 4 + addrLen + 2;
+    step->replyLength = 0;
+    return SOCKS_STEP_OPEN;
+}
+
+int SocksHandshakeStep(CONN_STATE* state, const uint8_t* data, size_t length, SOCKS_STEP* step) {
+    int result;
+
+    step->consumed = 0;
+    step->replyLength = 0;
+
+    switch (*state) {
+        case STATE_INIT:
+            result = ParseGreeting(data, length, step);
+            if (result == SOCKS_STEP_REPLY) {
+                *state = STATE_AUTH;
+            }
+            break;
+        case STATE_AUTH:
+            result = ParseRequest(data, length, step);
+            if (result == SOCKS_STEP_OPEN) {
+                *state = STATE_REQUEST;
+            }
+            break;
+        default:
+            return SOCKS_STEP_INVALID;
+    }
+
+    // A message that cannot fit the frontend's buffer will never complete
+    if (result == SOCKS_STEP_PARTIAL && length >= SOCKS_HANDSHAKE_MAX) {
+        printf("Invalid SOCKS handshake (message too long)\n");
+        return SOCKS_STEP_INVALID;
+    }
+    return result;
+}
+
+size_t SocksBuildReply(uint8_t* reply, uint8_t code, const MUX_OPEN_RESULT* result) {
+    size_t addrLen = 4;
+
+    reply[0] = SOCKS_VERSION;
+    reply[1] = code;
+    reply[2] = 0; // RSV
+    reply[3] = SOCKS_ATYP_IPV4;
+    memset(&reply[4], 0, SOCKS_REPLY_MAX - 4);
+
+    if (result != NULL && result->type == MUX_CTRL_OPEN_ACK) {
+        if (result->atyp == SOCKS_ATYP_IPV6) {
+            reply[3] = SOCKS_ATYP_IPV6;
+            addrLen = 16;
+        }
+        memcpy(&reply[4], result->addr, addrLen);
+        memcpy(&reply[4 + addrLen], &result->port, 2);
+    }
+
+    return 4 + addrLen + 2;
+}
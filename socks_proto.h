@@ -0,0 +1,72 @@
+#ifndef SOCKS_PROTO_H
+#define SOCKS_PROTO_H
+
+// SOCKS5 handshake of the guest frontends (RFC 1928: no authentication,
+// CONNECT only). Portable C shared by the Windows and the Linux SOCKS
+// server: it parses what a client sent, moves the connection through its
+// handshake states and builds the replies, while the frontends do the I/O.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "mux_frame.h"
+
+// SOCKS protocol constants
+#define SOCKS_VERSION 5
+#define SOCKS_AUTH_NONE 0x00
+#define SOCKS_AUTH_NO_ACCEPTABLE 0xFF
+#define SOCKS_CMD_CONNECT 0x01
+#define SOCKS_ATYP_IPV4 MUX_ATYP_IPV4
+#define SOCKS_ATYP_DOMAIN MUX_ATYP_DOMAIN
+#define SOCKS_ATYP_IPV6 MUX_ATYP_IPV6
+#define SOCKS_REPLY_SUCCESS 0x00
+#define SOCKS_REPLY_GENERAL_FAILURE 0x01
+
+// Longest greeting or CONNECT request a client can send
+#define SOCKS_HANDSHAKE_MAX (4 + 1 + 255 + 2)
+// Longest reply: IPv6 bound address
+#define SOCKS_REPLY_MAX (4 + 16 + 2)
+// Longest open request for the host: [atyp][len][domain][port]
+#define SOCKS_OPEN_MAX (1 + 1 + 255 + 2)
+
+// Results of SocksHandshakeStep
+#define SOCKS_STEP_PARTIAL 0    // More bytes are needed
+#define SOCKS_STEP_REPLY 1      // Send step->reply to the client and go on reading
+#define SOCKS_STEP_OPEN 2       // step->request is complete; open it on the host
+#define SOCKS_STEP_INVALID (-1) // Drop the client
+
+// Connection state
+typedef enum {
+    STATE_INIT,               // Waiting for the greeting
+    STATE_AUTH,               // Method chosen, waiting for the CONNECT request
+    STATE_REQUEST,            // Request parsed, not yet sent to the host
+    STATE_CONNECTED,          // The host owns a stream for the connection
+    STATE_CLOSING             // Our CLOSE is sent, waiting for the host's
+} CONN_STATE;
+
+// A client's CONNECT request
+typedef struct {
+    uint8_t atyp;
+    uint16_t port;
+    char host[MUX_HOST_MAX];            // Dotted IPv4 address or domain name
+    uint8_t open[SOCKS_OPEN_MAX];       // Open request payload for the host
+    uint16_t openLength;
+} SOCKS_REQUEST;
+
+typedef struct {
+    size_t consumed;                    // Client bytes the step used up
+    uint8_t reply[SOCKS_REPLY_MAX];     // For SOCKS_STEP_REPLY
+    size_t replyLength;
+    SOCKS_REQUEST request;              // For SOCKS_STEP_OPEN
+} SOCKS_STEP;
+
+// Parses the greeting (STATE_INIT) or the CONNECT request (STATE_AUTH) at
+// the front of data and advances state to STATE_AUTH or STATE_REQUEST.
+// Bytes past step->consumed belong to the next message or are stream data.
+int SocksHandshakeStep(CONN_STATE* state, const uint8_t* data, size_t length, SOCKS_STEP* step);
+
+// Builds the answer to a CONNECT request; returns its length. The bound
+// address comes from the host's OPEN_ACK; without one it is all zeros.
+size_t SocksBuildReply(uint8_t* reply, uint8_t code, const MUX_OPEN_RESULT* result);
+
+#endif // SOCKS_PROTO_H
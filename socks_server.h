@@ -18,6 +18,11 @@
 #include <initguid.h>  // For GUID definition
 #include <devguid.h>   // For device GUIDs
 
+#include "mux_sched.h" // Frame format and egress scheduler shared with the host
+#include "mux_rx.h"    // Receive buffers shared with the Linux frontend
+#include "socks_proto.h" // SOCKS handshake shared with the Linux frontend
+#include "timer_wheel.h"
+
 // Link against required libraries
 #pragma comment(lib, "ws2_32.lib")
 #pragma comment(lib, "mswsock.lib")  // Required for AcceptEx
@@ -30,6 +35,45 @@
 #define BUFFER_SIZE 4096
 #define SOCKS_PORT 1080
 
+// Egress frame pool for the virtio channel. Client reads stop while no
+// more than EGRESS_RESERVE_FRAMES are free, so control frames always find
+// one, and resume once half the pool is free again.
+#define EGRESS_POOL_FRAMES 128
+#define EGRESS_RESERVE_FRAMES 16
+// Overlapped writes to the virtio channel in flight at once. Each packs
+// queued frames of any streams, in scheduler order, up to VIRTIO_WRITE_SIZE.
+#define VIRTIO_WRITES 4
+#define VIRTIO_WRITE_SIZE (16 * (sizeof(VIRTIO_MSG_HEADER) + MUX_MAX_PAYLOAD))
+// A write that fails or comes up short leaves the host mid-frame, so the
+// channel is closed and opened again, retrying every VIRTIO_REOPEN_MS
+#define VIRTIO_REOPEN_MS 1000
+// Virtio receive buffers, and reads posted on the channel at once. Host
+// data is sent to clients straight from these buffers.
+#define VIRTIO_READ_BUFFERS 16
+#define VIRTIO_READS 4
+// Host data queued for one client. A frame past this or
+// MUX_RX_QUEUE_SLICES holds up the channel until a send completes.
+#define CLIENT_QUEUE_BYTES (64 * 1024)
+// Flow used for channel-level control frames (stream flows are 0..MAX_CONNECTIONS-1)
+#define CONTROL_FLOW MAX_CONNECTIONS
+
+// AcceptEx calls kept posted on the listening socket (--accepts)
+#define DEFAULT_ACCEPTS 16
+#define MAX_ACCEPTS 64
+#define ACCEPT_ADDRESS_SIZE (sizeof(SOCKADDR_IN) + 16)
+// With --accept-data an accept completes with the client's first bytes,
+// normally the whole SOCKS greeting. Clients that connect and stay silent
+// are checked for every ACCEPT_CHECK_MS.
+#define ACCEPT_DATA_SIZE SOCKS_HANDSHAKE_MAX
+#define ACCEPT_CHECK_MS 5000
+// An accept that could not be posted is tried again after this long
+#define ACCEPT_RETRY_MS 1000
+
+// Stream timeouts (milliseconds)
+#define HANDSHAKE_TIMEOUT_MS 30000       // Client must finish the SOCKS handshake
+#define DEFAULT_IDLE_TIMEOUT_MS 300000   // No data in either direction
+#define LINGER_TIMEOUT_MS 30000          // Half-closed, or waiting for the host's CLOSE
+
 // Define the VirtIO Serial device interface GUID
 // {6FDE7547-1B65-48AE-B628-80BE62016026}
 DEFINE_GUID(GUID_DEVINTERFACE_VSERIAL, 
@@ -53,15 +97,6 @@ static const char* VIRTIO_PATHS[VIRTIO_PATHS_COUNT] = {
 // Function to find VirtIO serial device (declaration)
 HANDLE FindVirtIOSerialDevice(void);
 
-// SOCKS protocol constants
-#define SOCKS_VERSION 5
-#define SOCKS_AUTH_NONE 0x00
-#define SOCKS_CMD_CONNECT 0x01
-#define SOCKS_ATYP_IPV4 0x01
-#define SOCKS_ATYP_DOMAIN 0x03
-#define SOCKS_ATYP_IPV6 0x04
-#define SOCKS_REPLY_SUCCESS 0x00
-
 // Operation types
 typedef enum {
     OP_ACCEPT,
@@ -71,40 +106,74 @@ typedef enum {
     OP_VIRTIO_WRITE
 } OP_TYPE;
 
-// Connection state
-typedef enum {
-    STATE_INIT,
-    STATE_AUTH,
-    STATE_REQUEST,
-    STATE_CONNECTED,
-    STATE_CLOSING
-} CONN_STATE;
-
-// Per-connection context
-typedef struct {
+struct CONNECTION_IO;
+
+// Per-connection state that slot scans and completion dispatch read, one
+// cache line per slot. The buffers and the overlapped operations live in
+// the slot's CONNECTION_IO.
+typedef struct MUX_CACHE_ALIGNED {
     SOCKET socket;
     CONN_STATE state;
-    uint8_t buffer[BUFFER_SIZE];
-    WSABUF wsaBuf;
-    DWORD bytesTransferred;
     int connId;
     bool inUse;
-    OP_TYPE pendingOp;
-    OVERLAPPED overlap;
+    bool recvPending;         // WSARecv in flight; the slot is not reused until it completes
+    bool sendPending;         // WSASend in flight, likewise
+    bool clientEof;           // Client finished sending; EOF forwarded to the host
+    bool hostEof;             // Host finished sending; client write side shut down
+    bool awaitingOpen;        // SOCKS reply waits for the host's OPEN_ACK or OPEN_FAIL
+    bool readBlocked;         // No read posted while the egress pool is low
+    uint64_t lastActivity;    // Wheel time of the last data in either direction
+    struct CONNECTION_IO* io;
 } CONNECTION_CONTEXT;
 
-// Virtio message header for multiplexing
+// An overlapped operation on a client socket. Each connection has one
+// for receiving and one for sending, so both directions are in flight at
+// the same time.
 typedef struct {
-    uint16_t connId;
-    uint16_t length;
-} VIRTIO_MSG_HEADER;
+    OVERLAPPED overlap;
+    OP_TYPE type;             // OP_READ or OP_WRITE
+    CONNECTION_CONTEXT* ctx;  // Slot the completion belongs to
+} CLIENT_OP;
+
+// The rest of a connection slot
+typedef struct CONNECTION_IO {
+    CLIENT_OP recvOp;
+    WSABUF recvBuf;
+    CLIENT_OP sendOp;
+    WSABUF sendBufs[MUX_RX_QUEUE_SLICES];
+    MUX_RX_QUEUE sendQueue;   // Host data for the client; the front of it is in flight
+    DWORD bytesTransferred;
+    DWORD handshakeLen;       // Unfinished greeting or request at the front of buffer
+    TIMER timer;              // Handshake, idle or linger timeout
+    uint8_t buffer[BUFFER_SIZE];
+} CONNECTION_IO;
+
+// A write to the virtio channel; completes through the IOCP like the rest
+typedef struct {
+    OVERLAPPED overlap;
+    bool inUse;
+    DWORD length;
+    uint8_t data[VIRTIO_WRITE_SIZE];
+} VIRTIO_WRITE;
+
+// A posted AcceptEx and the socket it accepts into
+typedef struct {
+    OVERLAPPED overlap;
+    SOCKET socket;
+    bool posted;              // AcceptEx is in flight
+    uint8_t buffer[ACCEPT_DATA_SIZE + 2 * ACCEPT_ADDRESS_SIZE];
+} ACCEPT_OP;
 
 // Global data
 extern HANDLE g_iocp;
 extern HANDLE g_virtioHandle;
 extern CONNECTION_CONTEXT g_connections[MAX_CONNECTIONS];
+extern CONNECTION_IO g_connectionIo[MAX_CONNECTIONS];
 extern SOCKET g_listenSocket;
 extern LPFN_ACCEPTEX lpfnAcceptEx;  // Add explicit declaration for AcceptEx function pointer
+extern MUX_SCHEDULER g_egressSched;
+extern TIMER_WHEEL g_timers;
+extern MUX_CHANNEL g_channel;
 
 // Function prototypes
 bool InitializeServer(void);
@@ -112,13 +181,41 @@ void CleanupServer(void);
 bool InitializeVirtio(void);
 int GetFreeConnectionSlot(void);
 void CloseConnection(CONNECTION_CONTEXT* ctx);
-bool HandleNewConnection(SOCKET clientSocket);
-bool ProcessSocksAuth(CONNECTION_CONTEXT* ctx);
-bool ProcessSocksRequest(CONNECTION_CONTEXT* ctx);
+bool HandleNewConnection(SOCKET clientSocket, const uint8_t* data, DWORD length);
+bool ProcessSocksHandshake(CONNECTION_CONTEXT* ctx);
+bool OpenHostStream(CONNECTION_CONTEXT* ctx, const SOCKS_REQUEST* request);
+bool SendToClient(CONNECTION_CONTEXT* ctx, const uint8_t* data, size_t length);
+bool SendSocksReply(CONNECTION_CONTEXT* ctx, uint8_t reply, const MUX_OPEN_RESULT* result);
 bool SendToVirtio(CONNECTION_CONTEXT* ctx, const uint8_t* data, uint16_t length);
-bool ReceiveFromVirtio(void);
-void PostAccept(void);
+bool SendControlToVirtio(uint16_t flowId, uint8_t type, uint16_t connId);
+bool FlushVirtio(void);
+VIRTIO_WRITE* FindVirtioWrite(OVERLAPPED* overlap);
+void CompleteVirtioWrite(VIRTIO_WRITE* write, BOOL completed, DWORD bytesWritten);
+void VirtioFailed(void);
+void ReopenVirtio(TIMER* timer, void* context);
+void ResumeClientReads(void);
+bool SendHello(uint8_t type);
+bool NegotiateChannel(const MUX_HELLO* peer);
+void ResetStreams(void);
+void HandleControlFrame(const uint8_t* data, uint16_t length);
+void HandleHostClose(uint16_t connId);
+void HandleHostEof(uint16_t connId);
+void HandleOpenResult(const MUX_OPEN_RESULT* result);
+void HandleClientEof(CONNECTION_CONTEXT* ctx);
+void ArmConnectionTimer(CONNECTION_CONTEXT* ctx);
+void ConnectionTimeout(TIMER* timer, void* context);
+void PostVirtioReads(void);
+MUX_RX_BUFFER* FindVirtioRead(OVERLAPPED* overlap);
+void CompleteVirtioRead(MUX_RX_BUFFER* buffer, BOOL completed, DWORD bytesRead);
+void ProcessVirtioIngress(void);
+bool ForwardToClient(uint16_t connId, MUX_RX_BUFFER* buffer, const uint8_t* data, uint16_t length);
+void PostClientSend(CONNECTION_CONTEXT* ctx);
+void CompleteClientSend(CONNECTION_CONTEXT* ctx, BOOL completed, DWORD bytesSent);
+void FinishClientSends(CONNECTION_CONTEXT* ctx);
+void PostAccept(ACCEPT_OP* accept);
+ACCEPT_OP* FindAccept(OVERLAPPED* overlap);
+void CompleteAccept(ACCEPT_OP* accept, BOOL completed, DWORD bytesReceived);
+void CheckAccepts(TIMER* timer, void* context);
 void PostClientRead(CONNECTION_CONTEXT* ctx);
-void PostVirtioRead(void);
 
 #endif // SOCKS_SERVER_H 
\ No newline at end of file
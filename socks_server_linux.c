@@ -0,0 +1,1403 @@
+// Linux build of the guest SOCKS server. Runs the same SOCKS handshake
+// (socks_proto.c), egress scheduler and stream state machine as the Windows
+// server in main.c, on an epoll loop instead of IOCP. The channel is either
+// a virtio-serial port in a Linux guest, or a Unix socket it listens on in
+// place of QEMU, so that SOCKS clients, this frontend, the host proxy and
+// upstream servers can all run and be benchmarked on one machine.
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "mux_sched.h"
+#include "mux_rx.h"
+#include "socks_proto.h"
+#include "timer_wheel.h"
+#include "transport.h"
+
+// Constants, as in socks_server.h
+#define MAX_CONNECTIONS 64
+#define BUFFER_SIZE 4096
+#define SOCKS_PORT 1080
+#define DEFAULT_CHANNEL "/tmp/vserial"
+
+// Egress frame pool for the channel. Client reads stop while no more than
+// EGRESS_RESERVE_FRAMES are free, so control frames always find one, and
+// resume once half the pool is free again.
+#define EGRESS_POOL_FRAMES 128
+#define EGRESS_RESERVE_FRAMES 16
+// Flow used for channel-level control frames (stream flows are 0..MAX_CONNECTIONS-1)
+#define CONTROL_FLOW MAX_CONNECTIONS
+
+// Stream timeouts (milliseconds)
+#define HANDSHAKE_TIMEOUT_MS 30000
+#define DEFAULT_IDLE_TIMEOUT_MS 300000
+#define LINGER_TIMEOUT_MS 30000
+// Delay before opening a channel device again after it failed
+#define REOPEN_DELAY_MS 1000
+
+// Frames handed to the channel in one writev. Frames queued while a batch
+// of events is handled go out together before the loop waits again.
+#define WRITE_BATCH_FRAMES 16
+
+// Channel receive buffers, and reads issued back to back while the channel
+// has more. Host data waits for its client inside these buffers.
+#define READ_BUFFERS 16
+#define CHANNEL_READS 4
+// Host data a client has not taken yet, as slices of receive buffers. A
+// data frame past this or MUX_RX_QUEUE_SLICES holds up the channel until
+// the client has drained.
+#define CLIENT_QUEUE_BYTES (64 * 1024)
+
+#define MAX_EVENTS 64
+
+// Clients accepted per wakeup of the listening socket (--accepts); more
+// wait for the next pass of the loop so a burst does not hold up the rest
+#define DEFAULT_ACCEPTS 16
+#define MAX_ACCEPTS 64
+
+// epoll tags; client sockets are tagged with their slot index, and the
+// slot's generation above TAG_SLOT_MASK so that events returned for a
+// socket closed earlier in the same batch skip the slot's next client
+#define TAG_SLOT_MASK 0xFFFF
+#define TAG_LISTEN MAX_CONNECTIONS
+#define TAG_CHANNEL_LISTEN (MAX_CONNECTIONS + 1)
+#define TAG_CHANNEL_READ (MAX_CONNECTIONS + 2)
+#define TAG_CHANNEL_WRITE (MAX_CONNECTIONS + 3)
+
+struct CONNECTION_IO;
+
+// Per-connection state that slot scans and event dispatch read, one cache
+// line per slot. The buffers live in the slot's CONNECTION_IO.
+typedef struct MUX_CACHE_ALIGNED {
+    int socket;
+    CONN_STATE state;
+    int connId;
+    uint32_t events;          // epoll events registered for the socket
+    bool inUse;
+    bool clientEof;           // Client finished sending; EOF forwarded to the host
+    bool hostEof;             // Host finished sending; shut down toward the client once drained
+    bool awaitingOpen;        // SOCKS reply waits for the host's OPEN_ACK or OPEN_FAIL
+    bool readBlocked;         // Not read while the egress pool is low
+    bool draining;            // Host closed; the client gets the rest of its data first
+    uint16_t generation;      // Bumped for each client the slot takes
+    uint64_t lastActivity;    // Wheel time of the last data in either direction
+    struct CONNECTION_IO* io;
+} CONNECTION_CONTEXT;
+
+// The rest of a connection slot
+typedef struct CONNECTION_IO {
+    TIMER timer;              // Handshake, idle or linger timeout
+    size_t handshakeLen;      // Unfinished greeting or request at the front of buffer
+    MUX_RX_QUEUE sendQueue;   // Host data not yet written to the client
+    uint8_t buffer[BUFFER_SIZE];
+} CONNECTION_IO;
+
+static CONNECTION_CONTEXT g_connections[MAX_CONNECTIONS];
+static CONNECTION_IO g_connectionIo[MAX_CONNECTIONS];
+static int g_epoll = -1;
+static int g_listenSocket = -1;
+
+// Egress scheduler: per-stream queues toward the channel
+static MUX_FRAME g_egressFrames[EGRESS_POOL_FRAMES];
+static MUX_FRAME_POOL g_egressPool;
+static MUX_FLOW g_egressFlows[MAX_CONNECTIONS + 1];
+static MUX_SCHEDULER g_egressSched;
+static MUX_FRAME* g_writeBatch[WRITE_BATCH_FRAMES]; // Dequeued, in scheduler order
+static int g_writeCount = 0;
+static size_t g_writeOffset = 0;        // Bytes of the first frame already written
+static bool g_readsBlocked = false;     // Some client has readBlocked set
+
+// Channel to the host: a device opened from a spec, or a host proxy that
+// connected to the Unix socket at g_channelPath
+static TRANSPORT g_transport;
+static bool g_useDevice = false;
+static const char* g_channelPath = DEFAULT_CHANNEL;
+static int g_channelListener = -1;
+static uint32_t g_channelEvents[2];     // Registered for readFd and writeFd
+static bool g_channelFailed = false;
+static TIMER g_reopenTimer;
+static MUX_RX_BUFFER g_readBuffers[READ_BUFFERS];
+static MUX_RX g_rx;
+static int g_stalledConn = -1;          // Ingress waits for this client to drain
+
+// Channel parameters agreed with the host
+static MUX_CHANNEL g_channel;
+
+// Handshake, idle and linger timeouts for client streams
+static TIMER_WHEEL g_timers;
+static uint64_t g_idleTimeoutMs = DEFAULT_IDLE_TIMEOUT_MS;
+
+// Answer SOCKS requests before the host has connected (--optimistic)
+static bool g_optimisticOpen = false;
+
+// Accepting clients: how many per wakeup, and whether the kernel holds a
+// connection back until its greeting has arrived (--accept-data)
+static int g_acceptBatch = DEFAULT_ACCEPTS;
+static bool g_acceptData = false;
+
+static bool SendToVirtio(CONNECTION_CONTEXT* ctx, const uint8_t* data, uint16_t length);
+static bool SendControlToVirtio(uint16_t flowId, uint8_t type, uint16_t connId);
+static void CloseConnection(CONNECTION_CONTEXT* ctx);
+static void FlushClient(CONNECTION_CONTEXT* ctx);
+static void HandleClientRead(CONNECTION_CONTEXT* ctx);
+
+static uint64_t NowMillis(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000ULL + (uint64_t)ts.tv_nsec / 1000000ULL;
+}
+
+static void PrintUsage(const char* prog) {
+    printf("Usage: %s [options] [SOCKET]\n", prog);
+    printf("SOCKS5 server that multiplexes its clients over the channel to a host proxy.\n");
+    printf("Without --channel it waits for the host proxy on the Unix socket SOCKET\n");
+    printf("(default: %s), in place of QEMU's chardev.\n", DEFAULT_CHANNEL);
+    printf("  -p, --port PORT              SOCKS port (default: %d)\n", SOCKS_PORT);
+    printf("  -b, --bind ADDR              SOCKS address (default: 0.0.0.0)\n");
+    printf("  -c, --channel SPEC           Open the channel instead, e.g. dev:/dev/virtio-ports/NAME\n");
+    printf("      --priority PORT[-PORT]=CLASS\n");
+    printf("      --quantum CLASS=BYTES\n");
+    printf("      --idle-timeout SECONDS   0 disables (default: %d)\n", DEFAULT_IDLE_TIMEOUT_MS / 1000);
+    printf("      --optimistic             Reply to CONNECT before the host has connected\n");
+    printf("      --accepts N              Clients accepted per wakeup (default: %d)\n", DEFAULT_ACCEPTS);
+    printf("      --accept-data            Accept a client once its greeting has arrived\n");
+    printf("  -h, --help                   Show this help\n");
+    printf("Classes: control (0), interactive (1), default (2), bulk (3)\n");
+}
+
+// Changes the events epoll reports for fd, if they differ from current
+static void SetEvents(int fd, uint32_t tag, uint32_t* current, uint32_t events) {
+    struct epoll_event ev;
+
+    if (*current == events) {
+        return;
+    }
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u32 = tag;
+    if (epoll_ctl(g_epoll, EPOLL_CTL_MOD, fd, &ev) < 0) {
+        perror("epoll_ctl error");
+        return;
+    }
+    *current = events;
+}
+
+static bool AddEvents(int fd, uint32_t tag, uint32_t events) {
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.u32 = tag;
+    if (epoll_ctl(g_epoll, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl error");
+        return false;
+    }
+    return true;
+}
+
+// Reads the channel while a receive buffer is free; writes while a frame is left
+static void UpdateChannelEvents(void) {
+    uint32_t readEvents = g_rx.freeCount > 0 ? EPOLLIN : 0;
+    uint32_t writeEvents = g_writeCount > 0 ? EPOLLOUT : 0;
+
+    if (!TransportIsOpen(&g_transport)) {
+        return;
+    }
+    if (g_transport.readFd == g_transport.writeFd) {
+        SetEvents(g_transport.readFd, TAG_CHANNEL_READ, &g_channelEvents[0], readEvents | writeEvents);
+    } else {
+        SetEvents(g_transport.readFd, TAG_CHANNEL_READ, &g_channelEvents[0], readEvents);
+        SetEvents(g_transport.writeFd, TAG_CHANNEL_WRITE, &g_channelEvents[1], writeEvents);
+    }
+}
+
+static uint32_t ClientTag(const CONNECTION_CONTEXT* ctx) {
+    return (uint32_t)ctx->connId | ((uint32_t)ctx->generation << 16);
+}
+
+static void UpdateClientEvents(CONNECTION_CONTEXT* ctx) {
+    uint32_t events = 0;
+
+    if (ctx->socket < 0) {
+        return;
+    }
+    if (!ctx->clientEof && !ctx->readBlocked && !ctx->draining) {
+        events |= EPOLLIN;
+    }
+    if (ctx->io->sendQueue.count > 0) {
+        events |= EPOLLOUT;
+    }
+    SetEvents(ctx->socket, ClientTag(ctx), &ctx->events, events);
+}
+
+static int GetFreeConnectionSlot(void) {
+    int i;
+
+    for (i = 0; i < MAX_CONNECTIONS; i++) {
+        if (!g_connections[i].inUse) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Schedules the timeout that applies to the stream's current state
+static void ArmConnectionTimer(CONNECTION_CONTEXT* ctx) {
+    uint64_t delayMs;
+
+    if (ctx->state == STATE_CLOSING || ctx->clientEof || ctx->hostEof || ctx->draining) {
+        delayMs = LINGER_TIMEOUT_MS;
+    } else if (ctx->state != STATE_CONNECTED) {
+        delayMs = HANDSHAKE_TIMEOUT_MS;
+    } else if (g_idleTimeoutMs != 0) {
+        delayMs = g_idleTimeoutMs;
+    } else {
+        TimerCancel(&g_timers, &ctx->io->timer);
+        return;
+    }
+
+    TimerSchedule(&g_timers, &ctx->io->timer, delayMs);
+}
+
+static bool HandleNewConnection(int clientSocket) {
+    int slot = GetFreeConnectionSlot();
+    CONNECTION_CONTEXT* ctx;
+
+    if (slot == -1) {
+        printf("Max connections reached\n");
+        return false;
+    }
+
+    ctx = &g_connections[slot];
+    ctx->generation++;
+    if (!AddEvents(clientSocket, ClientTag(ctx), EPOLLIN)) {
+        return false;
+    }
+
+    ctx->socket = clientSocket;
+    ctx->inUse = true;
+    ctx->state = STATE_INIT;
+    ctx->events = EPOLLIN;
+    ctx->clientEof = false;
+    ctx->hostEof = false;
+    ctx->awaitingOpen = false;
+    ctx->readBlocked = false;
+    ctx->draining = false;
+    ctx->lastActivity = g_timers.current;
+    ctx->io->handshakeLen = 0;
+    MuxRxQueueInit(&ctx->io->sendQueue);
+
+    // Clients that stall in the SOCKS handshake are dropped
+    ArmConnectionTimer(ctx);
+
+    // With deferred accepts the greeting is there already
+    if (g_acceptData) {
+        HandleClientRead(ctx);
+    }
+    return true;
+}
+
+// Frees the slot without telling the host
+static void ReleaseConnection(CONNECTION_CONTEXT* ctx) {
+    if (ctx->socket >= 0) {
+        close(ctx->socket);
+        ctx->socket = -1;
+    }
+    MuxRxQueueClear(&g_rx, &ctx->io->sendQueue);
+    TimerCancel(&g_timers, &ctx->io->timer);
+    ctx->draining = false;
+    ctx->inUse = false;
+}
+
+static void CloseConnection(CONNECTION_CONTEXT* ctx) {
+    if (!ctx->inUse || ctx->state == STATE_CLOSING) {
+        return;
+    }
+    if (ctx->draining) {
+        // The CLOSE frames have been exchanged already
+        ReleaseConnection(ctx);
+        return;
+    }
+
+    close(ctx->socket);
+    ctx->socket = -1;
+    MuxRxQueueClear(&g_rx, &ctx->io->sendQueue);
+
+    // Once the host knows about the stream, keep the slot until it
+    // confirms the close with its own CLOSE
+    if (ctx->state == STATE_CONNECTED) {
+        ctx->state = STATE_CLOSING;
+        ArmConnectionTimer(ctx);
+        SendControlToVirtio((uint16_t)ctx->connId, MUX_CTRL_CLOSE, (uint16_t)ctx->connId);
+        return;
+    }
+
+    TimerCancel(&g_timers, &ctx->io->timer);
+    ctx->inUse = false;
+}
+
+static void ConnectionTimeout(TIMER* timer, void* context) {
+    CONNECTION_CONTEXT* ctx = (CONNECTION_CONTEXT*)context;
+
+    (void)timer;
+
+    if (ctx->draining) {
+        printf("Connection %d: client did not take the host's data, releasing\n", ctx->connId);
+        ReleaseConnection(ctx);
+    } else if (ctx->state == STATE_CLOSING) {
+        // The host never confirmed the close; reclaim the slot anyway
+        printf("Connection %d: no CLOSE from host, releasing\n", ctx->connId);
+        MuxSchedDropFlow(&g_egressSched, (uint16_t)ctx->connId);
+        ctx->inUse = false;
+    } else if (ctx->state != STATE_CONNECTED) {
+        printf("Connection %d: SOCKS handshake timed out\n", ctx->connId);
+        CloseConnection(ctx);
+    } else if (ctx->clientEof || ctx->hostEof) {
+        printf("Connection %d: half-closed for too long\n", ctx->connId);
+        CloseConnection(ctx);
+    } else if (g_timers.current - ctx->lastActivity >= g_idleTimeoutMs) {
+        printf("Connection %d: idle timeout\n", ctx->connId);
+        CloseConnection(ctx);
+    } else {
+        // Traffic since the timer was armed; only wait out the remainder
+        TimerSchedule(&g_timers, &ctx->io->timer, ctx->lastActivity + g_idleTimeoutMs - g_timers.current);
+    }
+}
+
+// Writes a SOCKS reply. No host data is queued ahead of it, and a socket
+// takes a few bytes at once; fails if the client is gone.
+static bool SendToClient(CONNECTION_CONTEXT* ctx, const uint8_t* data, size_t length) {
+    if (send(ctx->socket, data, length, MSG_NOSIGNAL) != (ssize_t)length) {
+        printf("Failed to send SOCKS response: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// Answers the client's CONNECT request
+static bool SendSocksReply(CONNECTION_CONTEXT* ctx, uint8_t reply, const MUX_OPEN_RESULT* result) {
+    uint8_t response[SOCKS_REPLY_MAX];
+
+    return SendToClient(ctx, response, SocksBuildReply(response, reply, result));
+}
+
+// Writes out host data the client's socket did not take at once, all
+// queued slices per sendmsg; written slices release their buffers
+static void FlushClient(CONNECTION_CONTEXT* ctx) {
+    MUX_RX_QUEUE* queue = &ctx->io->sendQueue;
+    struct iovec iov[MUX_RX_QUEUE_SLICES];
+    struct msghdr msg;
+    MUX_RX_SLICE* slice;
+    ssize_t n;
+    int i;
+
+    while (queue->count > 0) {
+        for (i = 0; i < queue->count; i++) {
+            slice = MuxRxQueueAt(queue, i);
+            iov[i].iov_base = (void*)slice->data;
+            iov[i].iov_len = slice->length;
+        }
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = (size_t)queue->count;
+
+        n = sendmsg(ctx->socket, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                UpdateClientEvents(ctx);
+                return;
+            }
+            CloseConnection(ctx);
+            return;
+        }
+        MuxRxQueueAdvance(&g_rx, queue, (size_t)n);
+    }
+
+    // Everything the host sent is with the client now
+    if (ctx->draining) {
+        ReleaseConnection(ctx);
+        return;
+    }
+    if (ctx->hostEof) {
+        shutdown(ctx->socket, SHUT_WR);
+        if (ctx->clientEof) {
+            CloseConnection(ctx);
+            return;
+        }
+    }
+    UpdateClientEvents(ctx);
+}
+
+// Passes a data frame from the host to its client. What the socket does
+// not take at once is queued without a copy, referencing the receive
+// buffer. Returns false, keeping the frame, if the client is too far behind.
+static bool DeliverToClient(uint16_t connId, MUX_RX_BUFFER* buffer, const uint8_t* data, uint16_t length) {
+    CONNECTION_CONTEXT* ctx;
+    MUX_RX_QUEUE* queue;
+    ssize_t n;
+
+    if (connId >= MAX_CONNECTIONS || !g_connections[connId].inUse ||
+        g_connections[connId].state != STATE_CONNECTED || g_connections[connId].draining) {
+        return true;
+    }
+
+    ctx = &g_connections[connId];
+    queue = &ctx->io->sendQueue;
+    if (queue->count > 0 && (queue->count == MUX_RX_QUEUE_SLICES || queue->bytes + length > CLIENT_QUEUE_BYTES)) {
+        return false;
+    }
+
+    ctx->lastActivity = g_timers.current;
+    if (queue->count == 0) {
+        n = send(ctx->socket, data, length, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                CloseConnection(ctx);
+                return true;
+            }
+            n = 0;
+        }
+        if ((size_t)n == length) {
+            return true;
+        }
+        data += n;
+        length -= (uint16_t)n;
+    }
+
+    MuxRxQueuePush(queue, buffer, data, length);
+    UpdateClientEvents(ctx);
+    return true;
+}
+
+// Writes queued frames in scheduler order, as many as the channel takes,
+// several frames (often of different streams) per writev
+static bool FlushVirtio(void) {
+    struct iovec iov[WRITE_BATCH_FRAMES];
+    MUX_FRAME* frame;
+    size_t written;
+    ssize_t n;
+    int done;
+    int i;
+
+    if (!TransportIsOpen(&g_transport) || g_channelFailed) {
+        return false;
+    }
+
+    while (1) {
+        while (g_writeCount < WRITE_BATCH_FRAMES && (frame = MuxSchedDequeue(&g_egressSched)) != NULL) {
+            g_writeBatch[g_writeCount++] = frame;
+        }
+        if (g_writeCount == 0) {
+            break;
+        }
+
+        for (i = 0; i < g_writeCount; i++) {
+            iov[i].iov_base = g_writeBatch[i]->data;
+            iov[i].iov_len = g_writeBatch[i]->size;
+        }
+        iov[0].iov_base = g_writeBatch[0]->data + g_writeOffset;
+        iov[0].iov_len -= g_writeOffset;
+
+        n = TransportWritev(&g_transport, iov, g_writeCount);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                break;
+            }
+            perror("Error writing to the channel");
+            g_channelFailed = true;
+            return false;
+        }
+
+        // Release the frames that are out
+        written = g_writeOffset + (size_t)n;
+        for (done = 0; done < g_writeCount && written >= g_writeBatch[done]->size; done++) {
+            written -= g_writeBatch[done]->size;
+            MuxPoolFree(&g_egressPool, g_writeBatch[done]);
+        }
+        memmove(g_writeBatch, g_writeBatch + done, (size_t)(g_writeCount - done) * sizeof(g_writeBatch[0]));
+        g_writeCount -= done;
+        g_writeOffset = written;
+        if (g_writeCount > 0) {
+            // The channel took part of the batch; wait until it takes more
+            break;
+        }
+    }
+
+    UpdateChannelEvents();
+    return true;
+}
+
+static bool SendToVirtio(CONNECTION_CONTEXT* ctx, const uint8_t* data, uint16_t length) {
+    if (length > g_channel.maxPayload) {
+        printf("Data too large for virtio buffer\n");
+        return false;
+    }
+
+    // Queue the frame on the stream's flow; the scheduler decides the order,
+    // and the loop writes the queue out before it waits again
+    if (!MuxSchedEnqueue(&g_egressSched, (uint16_t)ctx->connId, (uint16_t)ctx->connId, data, length)) {
+        printf("Virtio egress queue full\n");
+        return false;
+    }
+
+    return true;
+}
+
+static bool SendControlToVirtio(uint16_t flowId, uint8_t type, uint16_t connId) {
+    MUX_CTRL_STREAM msg;
+
+    msg.type = type;
+    msg.connId = connId;
+
+    // Stream control frames share the stream's flow so they stay behind its data
+    if (!MuxSchedEnqueue(&g_egressSched, flowId, MUX_CONTROL_CONNID, (const uint8_t*)&msg, sizeof(msg))) {
+        printf("Virtio egress queue full, dropping control frame %u for connection %u\n", type, connId);
+        return false;
+    }
+
+    return true;
+}
+
+static bool SendHello(uint8_t type) {
+    MUX_HELLO msg;
+
+    msg.type = type;
+    msg.version = MUX_PROTOCOL_VERSION;
+    msg.maxPayload = BUFFER_SIZE;
+    msg.capabilities = MUX_CAPABILITIES;
+
+    if (!MuxSchedEnqueue(&g_egressSched, CONTROL_FLOW, MUX_CONTROL_CONNID, (const uint8_t*)&msg, sizeof(msg))) {
+        printf("Virtio egress queue full, dropping HELLO\n");
+        return false;
+    }
+
+    return true;
+}
+
+// Applies the host's HELLO parameters; the channel stays down on a mismatch
+static bool NegotiateChannel(const MUX_HELLO* peer) {
+    g_channel.ready = false;
+
+    if (peer->version != MUX_PROTOCOL_VERSION) {
+        printf("Error: host speaks protocol version %u, this server speaks %d\n",
+               peer->version, MUX_PROTOCOL_VERSION);
+        return false;
+    }
+    if (peer->maxPayload < MUX_MIN_PAYLOAD) {
+        printf("Error: host frame payload limit %u is below the minimum of %d\n",
+               peer->maxPayload, MUX_MIN_PAYLOAD);
+        return false;
+    }
+
+    g_channel.version = peer->version;
+    g_channel.maxPayload = peer->maxPayload < BUFFER_SIZE ? peer->maxPayload : BUFFER_SIZE;
+    g_channel.capabilities = peer->capabilities & MUX_CAPABILITIES;
+    g_channel.ready = true;
+    printf("Channel ready: protocol %u, max payload %u, capabilities 0x%08X\n",
+           g_channel.version, g_channel.maxPayload, g_channel.capabilities);
+    return true;
+}
+
+// Drops every stream without CLOSE frames; the host has started over
+static void ResetStreams(void) {
+    int i;
+
+    for (i = 0; i < MAX_CONNECTIONS; i++) {
+        CONNECTION_CONTEXT* ctx = &g_connections[i];
+
+        if (!ctx->inUse) {
+            continue;
+        }
+        MuxSchedDropFlow(&g_egressSched, (uint16_t)i);
+        ReleaseConnection(ctx);
+    }
+    g_stalledConn = -1;
+}
+
+static void HandleHostClose(uint16_t connId) {
+    CONNECTION_CONTEXT* ctx;
+
+    if (connId >= MAX_CONNECTIONS || !g_connections[connId].inUse || g_connections[connId].draining) {
+        return;
+    }
+
+    ctx = &g_connections[connId];
+    if (ctx->state == STATE_CLOSING) {
+        // Both sides have now closed; the slot can be reused
+        TimerCancel(&g_timers, &ctx->io->timer);
+        ctx->inUse = false;
+        return;
+    }
+
+    // The host no longer wants anything queued for this stream. A client
+    // still waiting for its SOCKS reply learns that the connect failed.
+    MuxSchedDropFlow(&g_egressSched, connId);
+    if (ctx->awaitingOpen) {
+        ctx->awaitingOpen = false;
+        SendSocksReply(ctx, SOCKS_REPLY_GENERAL_FAILURE, NULL);
+    }
+
+    if (ctx->state == STATE_CONNECTED && ctx->io->sendQueue.count > 0) {
+        // Confirm the close now, but hand the client what the host sent first
+        ctx->draining = true;
+        SendControlToVirtio(connId, MUX_CTRL_CLOSE, connId);
+        ArmConnectionTimer(ctx);
+        UpdateClientEvents(ctx);
+        return;
+    }
+
+    CloseConnection(ctx);
+    TimerCancel(&g_timers, &ctx->io->timer);
+    ctx->inUse = false;
+}
+
+static void HandleHostEof(uint16_t connId) {
+    CONNECTION_CONTEXT* ctx;
+
+    if (connId >= MAX_CONNECTIONS || !g_connections[connId].inUse ||
+        g_connections[connId].state != STATE_CONNECTED || g_connections[connId].hostEof ||
+        g_connections[connId].draining) {
+        return;
+    }
+
+    // Data from the host arrives before its EOF; the client's write side is
+    // shut down once it has all of it
+    ctx = &g_connections[connId];
+    ctx->hostEof = true;
+    ArmConnectionTimer(ctx);
+    if (ctx->io->sendQueue.count == 0) {
+        FlushClient(ctx);
+    }
+}
+
+// The host finished connecting the stream's upstream socket. The client's
+// SOCKS reply was held back for this, unless the server runs optimistic.
+static void HandleOpenResult(const MUX_OPEN_RESULT* result) {
+    CONNECTION_CONTEXT* ctx;
+
+    if (result->connId >= MAX_CONNECTIONS || !g_connections[result->connId].inUse ||
+        g_connections[result->connId].state != STATE_CONNECTED || g_connections[result->connId].draining) {
+        return;
+    }
+
+    ctx = &g_connections[result->connId];
+    if (ctx->awaitingOpen) {
+        ctx->awaitingOpen = false;
+        if (!SendSocksReply(ctx, result->reply, result) || result->type == MUX_CTRL_OPEN_FAIL) {
+            CloseConnection(ctx);
+        }
+    } else if (result->type == MUX_CTRL_OPEN_FAIL) {
+        // Optimistic: the client was told it is connected; all it sees is the close
+        CloseConnection(ctx);
+    }
+}
+
+static void HandleClientEof(CONNECTION_CONTEXT* ctx) {
+    ctx->clientEof = true;
+    SendControlToVirtio((uint16_t)ctx->connId, MUX_CTRL_EOF, (uint16_t)ctx->connId);
+
+    if (ctx->hostEof && ctx->io->sendQueue.count == 0) {
+        CloseConnection(ctx);
+    } else {
+        ArmConnectionTimer(ctx);
+        UpdateClientEvents(ctx);
+    }
+}
+
+static void HandleControlFrame(const uint8_t* data, uint16_t length) {
+    MUX_CTRL_STREAM msg;
+    MUX_HELLO hello;
+    MUX_HEARTBEAT heartbeat;
+    MUX_OPEN_RESULT result;
+
+    if (length < 1) {
+        return;
+    }
+
+    switch (data[0]) {
+        case MUX_CTRL_HELLO:
+        case MUX_CTRL_HELLO_ACK:
+            if (length < sizeof(hello)) {
+                printf("Invalid HELLO control frame\n");
+                return;
+            }
+            memcpy(&hello, data, sizeof(hello));
+            if (data[0] == MUX_CTRL_HELLO) {
+                // The host (re)started: nothing it knew about survives
+                printf("HELLO from host\n");
+                ResetStreams();
+                SendHello(MUX_CTRL_HELLO_ACK);
+            }
+            NegotiateChannel(&hello);
+            break;
+        case MUX_CTRL_PING:
+            // Echo the heartbeat so the host can measure the round trip
+            if (length < sizeof(heartbeat)) {
+                printf("Invalid PING control frame\n");
+                return;
+            }
+            memcpy(&heartbeat, data, sizeof(heartbeat));
+            heartbeat.type = MUX_CTRL_PONG;
+            MuxSchedEnqueue(&g_egressSched, CONTROL_FLOW, MUX_CONTROL_CONNID,
+                            (const uint8_t*)&heartbeat, sizeof(heartbeat));
+            break;
+        case MUX_CTRL_CLOSE:
+            if (length < sizeof(msg)) {
+                printf("Invalid CLOSE control frame\n");
+                return;
+            }
+            memcpy(&msg, data, sizeof(msg));
+            HandleHostClose(msg.connId);
+            break;
+        case MUX_CTRL_EOF:
+            if (length < sizeof(msg)) {
+                printf("Invalid EOF control frame\n");
+                return;
+            }
+            memcpy(&msg, data, sizeof(msg));
+            HandleHostEof(msg.connId);
+            break;
+        case MUX_CTRL_OPEN_ACK:
+        case MUX_CTRL_OPEN_FAIL:
+            if (length < sizeof(result)) {
+                printf("Invalid open result control frame\n");
+                return;
+            }
+            memcpy(&result, data, sizeof(result));
+            HandleOpenResult(&result);
+            break;
+        default:
+            printf("Ignoring unknown control frame type %u\n", data[0]);
+            break;
+    }
+}
+
+// Hands the frames read so far to their streams, in order. Stops at a data
+// frame whose client is too far behind; the rest waits until it has drained.
+static bool ProcessIngress(void) {
+    VIRTIO_MSG_HEADER header;
+    const uint8_t* payload;
+    MUX_RX_BUFFER* buffer;
+    int result;
+
+    while ((result = MuxRxNext(&g_rx, BUFFER_SIZE, &header, &payload, &buffer)) == MUX_FRAME_COMPLETE) {
+        if (header.connId == MUX_CONTROL_CONNID) {
+            HandleControlFrame(payload, header.length);
+        } else if (!DeliverToClient(header.connId, buffer, payload, header.length)) {
+            g_stalledConn = header.connId;
+            return true;
+        }
+        MuxRxConsume(&g_rx, &header);
+    }
+
+    if (result == MUX_FRAME_INVALID) {
+        printf("Invalid frame length %u from host, channel out of sync\n", header.length);
+        return false;
+    }
+    return true;
+}
+
+// Picks up ingress again once the client it waited for has drained or is gone
+static void ResumeIngress(void) {
+    CONNECTION_CONTEXT* ctx;
+
+    if (g_stalledConn < 0) {
+        return;
+    }
+
+    ctx = &g_connections[g_stalledConn];
+    if (ctx->inUse && ctx->state == STATE_CONNECTED && !ctx->draining && ctx->io->sendQueue.count > 0) {
+        return;
+    }
+
+    g_stalledConn = -1;
+    if (!ProcessIngress()) {
+        g_channelFailed = true;
+    }
+    UpdateChannelEvents();
+}
+
+// Lets clients read again once the egress queue has drained to half
+static void ResumeClientReads(void) {
+    int i;
+
+    if (!g_readsBlocked || g_egressPool.freeCount < EGRESS_POOL_FRAMES / 2) {
+        return;
+    }
+
+    g_readsBlocked = false;
+    for (i = 0; i < MAX_CONNECTIONS; i++) {
+        if (g_connections[i].inUse && g_connections[i].readBlocked) {
+            g_connections[i].readBlocked = false;
+            UpdateClientEvents(&g_connections[i]);
+        }
+    }
+}
+
+// Reads what the channel has into free receive buffers, a few reads back
+// to back, and hands the frames on. Reading goes on while ingress waits
+// for a slow client, until every buffer is taken.
+static bool ReadChannel(void) {
+    MUX_RX_BUFFER* buffer;
+    ssize_t n;
+    int i;
+
+    for (i = 0; i < CHANNEL_READS && (buffer = MuxRxAlloc(&g_rx)) != NULL; i++) {
+        n = TransportRead(&g_transport, buffer->data + MUX_RX_HEADROOM, MUX_RX_READ_SIZE);
+        MuxRxComplete(&g_rx, buffer, n > 0 ? (size_t)n : 0);
+        if (n == 0) {
+            printf("Host closed the channel\n");
+            return false;
+        }
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                break;
+            }
+            perror("Error reading from the channel");
+            return false;
+        }
+        if ((size_t)n < MUX_RX_READ_SIZE) {
+            break;
+        }
+    }
+
+    if (g_stalledConn < 0 && !ProcessIngress()) {
+        return false;
+    }
+    UpdateChannelEvents();
+    return true;
+}
+
+// Sends the client's CONNECT request to the host as the stream's first frame
+static bool OpenHostStream(CONNECTION_CONTEXT* ctx, const SOCKS_REQUEST* request) {
+    printf("SOCKS request: Connect to %s:%d\n", request->host, request->port);
+
+    if (!g_channel.ready) {
+        printf("Virtio channel not ready, refusing request\n");
+        return false;
+    }
+
+    // Pick the egress priority class for this stream before its first frame
+    MuxSchedSetPriority(&g_egressSched, (uint16_t)ctx->connId, MuxSchedPortPriority(&g_egressSched, request->port));
+
+    if (!SendToVirtio(ctx, request->open, request->openLength)) {
+        printf("Failed to send connection request to virtio\n");
+        return false;
+    }
+
+    // The host now owns a stream for this ID; closing must go through CLOSE
+    ctx->state = STATE_CONNECTED;
+
+    // A host that reports connect results gets to answer the client;
+    // otherwise, or when running optimistic, report success right away
+    if ((g_channel.capabilities & MUX_CAP_OPEN_RESULT) && !g_optimisticOpen) {
+        ctx->awaitingOpen = true;
+        return true;
+    }
+
+    return SendSocksReply(ctx, SOCKS_REPLY_SUCCESS, NULL);
+}
+
+// Runs the SOCKS handshake over what the client has sent so far. Data a
+// client sent right behind its CONNECT request goes on to the host.
+static bool ProcessSocksHandshake(CONNECTION_CONTEXT* ctx, size_t received) {
+    CONNECTION_IO* io = ctx->io;
+    size_t length = io->handshakeLen + received;
+    size_t offset = 0;
+    SOCKS_STEP step;
+    int result;
+
+    while (ctx->state != STATE_CONNECTED) {
+        result = SocksHandshakeStep(&ctx->state, io->buffer + offset, length - offset, &step);
+        if (result == SOCKS_STEP_INVALID) {
+            return false;
+        }
+        if (result == SOCKS_STEP_PARTIAL) {
+            // Keep the unfinished message for the next read
+            memmove(io->buffer, io->buffer + offset, length - offset);
+            io->handshakeLen = length - offset;
+            return true;
+        }
+
+        offset += step.consumed;
+        if (result == SOCKS_STEP_REPLY) {
+            if (!SendToClient(ctx, step.reply, step.replyLength)) {
+                return false;
+            }
+        } else if (!OpenHostStream(ctx, &step.request)) {
+            return false;
+        }
+    }
+
+    io->handshakeLen = 0;
+    while (offset < length) {
+        uint16_t chunk = length - offset < g_channel.maxPayload ? (uint16_t)(length - offset) : g_channel.maxPayload;
+
+        ctx->lastActivity = g_timers.current;
+        if (!SendToVirtio(ctx, io->buffer + offset, chunk)) {
+            return false;
+        }
+        offset += chunk;
+    }
+
+    return true;
+}
+
+static void HandleClientRead(CONNECTION_CONTEXT* ctx) {
+    CONNECTION_IO* io = ctx->io;
+    ssize_t n;
+
+    if (ctx->state == STATE_CONNECTED) {
+        if (g_egressPool.freeCount <= EGRESS_RESERVE_FRAMES) {
+            // The channel is backed up; read again once frames are free
+            ctx->readBlocked = true;
+            g_readsBlocked = true;
+            UpdateClientEvents(ctx);
+            return;
+        }
+        // Stream data must fit in one frame
+        n = recv(ctx->socket, io->buffer, g_channel.maxPayload, 0);
+    } else {
+        n = recv(ctx->socket, io->buffer + io->handshakeLen, BUFFER_SIZE - io->handshakeLen, 0);
+    }
+
+    if (n < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            CloseConnection(ctx);
+        }
+        return;
+    }
+    if (n == 0) {
+        if (ctx->state == STATE_CONNECTED && (g_channel.capabilities & MUX_CAP_HALF_CLOSE)) {
+            // Client finished sending; data from the host still flows
+            HandleClientEof(ctx);
+        } else {
+            // Connection closed by client
+            CloseConnection(ctx);
+        }
+        return;
+    }
+
+    if (ctx->state == STATE_CONNECTED) {
+        // Forward data to virtio
+        ctx->lastActivity = g_timers.current;
+        if (!SendToVirtio(ctx, io->buffer, (uint16_t)n)) {
+            CloseConnection(ctx);
+        }
+        return;
+    }
+
+    if (!ProcessSocksHandshake(ctx, (size_t)n)) {
+        CloseConnection(ctx);
+    } else if (ctx->state == STATE_CONNECTED) {
+        ArmConnectionTimer(ctx);
+    }
+}
+
+static void HandleClientEvent(CONNECTION_CONTEXT* ctx, uint32_t events) {
+    if (!ctx->inUse || ctx->socket < 0) {
+        return;
+    }
+
+    if (events & EPOLLOUT) {
+        FlushClient(ctx);
+        if (!ctx->inUse || ctx->socket < 0) {
+            return;
+        }
+    }
+    if (events & EPOLLIN) {
+        HandleClientRead(ctx);
+    } else if (events & (EPOLLERR | EPOLLHUP)) {
+        // Reset while we were not reading
+        CloseConnection(ctx);
+    }
+}
+
+// Takes up to g_acceptBatch waiting clients off the listen queue; the
+// socket stays readable if more are left
+static void AcceptClient(void) {
+    int fd;
+    int i;
+
+    for (i = 0; i < g_acceptBatch; i++) {
+        fd = accept4(g_listenSocket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept error");
+            }
+            return;
+        }
+
+        if (!HandleNewConnection(fd)) {
+            close(fd);
+        }
+    }
+}
+
+// The channel is open: register it and announce ourselves. Streams are
+// refused until the host answers; a host that starts later sends its own
+// HELLO instead.
+static bool ChannelUp(void) {
+    g_channelFailed = false;
+    g_channelEvents[0] = EPOLLIN;
+    g_channelEvents[1] = 0;
+    if (!AddEvents(g_transport.readFd, TAG_CHANNEL_READ, EPOLLIN)) {
+        TransportClose(&g_transport);
+        return false;
+    }
+    if (g_transport.writeFd != g_transport.readFd && !AddEvents(g_transport.writeFd, TAG_CHANNEL_WRITE, 0)) {
+        TransportClose(&g_transport);
+        return false;
+    }
+
+    printf("Channel open (%s)\n", TransportName(&g_transport));
+    return SendHello(MUX_CTRL_HELLO);
+}
+
+// The channel broke or the host went away. Everything the host knew about
+// is dropped; a device is opened again after a delay, while a Unix socket
+// waits for the next host proxy to connect.
+static void ChannelDown(void) {
+    ResetStreams();
+    MuxSchedDropFlow(&g_egressSched, CONTROL_FLOW);
+    while (g_writeCount > 0) {
+        MuxPoolFree(&g_egressPool, g_writeBatch[--g_writeCount]);
+    }
+    g_writeOffset = 0;
+    MuxRxDiscard(&g_rx);
+    g_channel.ready = false;
+    g_channelFailed = false;
+
+    // Closing the descriptors takes them out of the epoll set
+    TransportClose(&g_transport);
+    if (g_useDevice) {
+        TimerSchedule(&g_timers, &g_reopenTimer, REOPEN_DELAY_MS);
+    } else {
+        printf("Waiting for a host proxy on %s\n", g_channelPath);
+    }
+}
+
+static void ReopenChannel(TIMER* timer, void* context) {
+    (void)timer;
+    (void)context;
+
+    if (!TransportOpen(&g_transport) || !ChannelUp()) {
+        TimerSchedule(&g_timers, &g_reopenTimer, REOPEN_DELAY_MS);
+    }
+}
+
+static void AcceptChannel(void) {
+    char spec[TRANSPORT_SPEC_MAX];
+    int fd = accept4(g_channelListener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("accept error");
+        }
+        return;
+    }
+    if (TransportIsOpen(&g_transport)) {
+        printf("A host proxy is already connected, refusing another\n");
+        close(fd);
+        return;
+    }
+
+    // The accepted socket becomes the transport, as in fake_guest
+    snprintf(spec, sizeof(spec), "unix:%s", g_channelPath);
+    if (!TransportParse(&g_transport, spec) || !TransportAdopt(&g_transport, "unix", &fd, 1)) {
+        return;
+    }
+    if (!ChannelUp()) {
+        ChannelDown();
+    }
+}
+
+static void HandleChannelEvent(uint32_t tag, uint32_t events) {
+    if (!TransportIsOpen(&g_transport) || g_channelFailed) {
+        return;
+    }
+
+    if ((events & EPOLLOUT) || (tag == TAG_CHANNEL_WRITE && (events & EPOLLERR))) {
+        if (!FlushVirtio() || (events & EPOLLERR)) {
+            g_channelFailed = true;
+            return;
+        }
+    }
+    if (tag != TAG_CHANNEL_READ || !(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        return;
+    }
+    if (!(g_channelEvents[0] & EPOLLIN)) {
+        // Not reading, so only a hangup gets here; the streams go with it
+        printf("Host closed the channel\n");
+        g_channelFailed = true;
+    } else if (!ReadChannel()) {
+        g_channelFailed = true;
+    }
+}
+
+static int ListenChannel(const char* path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Socket path %s is too long\n", path);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        perror("Error creating socket");
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, strlen(path) + 1);
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+        printf("Error listening on %s: %s (errno=%d)\n", path, strerror(errno), errno);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static bool InitializeServer(const char* address, uint16_t port) {
+    struct sockaddr_in addr;
+    int one = 1;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, address, &addr.sin_addr) != 1) {
+        printf("Invalid address '%s'\n", address);
+        return false;
+    }
+
+    g_listenSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (g_listenSocket < 0) {
+        perror("Error creating socket");
+        return false;
+    }
+    setsockopt(g_listenSocket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (g_acceptData) {
+        // Wake up for a client only once it has sent something, as long as
+        // the handshake timeout
+        int deferSeconds = HANDSHAKE_TIMEOUT_MS / 1000;
+
+        setsockopt(g_listenSocket, IPPROTO_TCP, TCP_DEFER_ACCEPT, &deferSeconds, sizeof(deferSeconds));
+    }
+
+    if (bind(g_listenSocket, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(g_listenSocket, SOMAXCONN) < 0) {
+        printf("Error listening on %s:%u: %s (errno=%d)\n", address, port, strerror(errno), errno);
+        close(g_listenSocket);
+        return false;
+    }
+
+    return AddEvents(g_listenSocket, TAG_LISTEN, EPOLLIN);
+}
+
+int main(int argc, char* argv[]) {
+    static const struct option longOptions[] = {
+        {"port", required_argument, NULL, 'p'},
+        {"bind", required_argument, NULL, 'b'},
+        {"channel", required_argument, NULL, 'c'},
+        {"priority", required_argument, NULL, 'P'},
+        {"quantum", required_argument, NULL, 'Q'},
+        {"idle-timeout", required_argument, NULL, 'I'},
+        {"optimistic", no_argument, NULL, 'O'},
+        {"accepts", required_argument, NULL, 'N'},
+        {"accept-data", no_argument, NULL, 'D'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    struct epoll_event events[MAX_EVENTS];
+    const char* address = "0.0.0.0";
+    unsigned long port = SOCKS_PORT;
+    unsigned long seconds;
+    char* end;
+    int opt;
+    int n;
+    int i;
+
+    // Set up the egress scheduler. Control frames go first, and latency
+    // sensitive ports (SSH, DNS) are served ahead of ordinary streams.
+    MuxPoolInit(&g_egressPool, g_egressFrames, EGRESS_POOL_FRAMES);
+    MuxRxInit(&g_rx, g_readBuffers, READ_BUFFERS);
+    MuxSchedInit(&g_egressSched, g_egressFlows, MAX_CONNECTIONS + 1, &g_egressPool);
+    MuxSchedSetPriority(&g_egressSched, CONTROL_FLOW, MUX_PRIO_CONTROL);
+
+    while ((opt = getopt_long(argc, argv, "p:b:c:h", longOptions, NULL)) != -1) {
+        switch (opt) {
+            case 'p':
+                port = strtoul(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || port == 0 || port > 65535) {
+                    printf("Invalid port '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'b':
+                address = optarg;
+                break;
+            case 'c':
+                if (!TransportParse(&g_transport, optarg)) {
+                    return 1;
+                }
+                if (strcmp(TransportName(&g_transport), "shm") == 0) {
+                    printf("The shm backend is not supported here\n");
+                    return 1;
+                }
+                g_useDevice = true;
+                break;
+            case 'P':
+                if (!MuxSchedAddPortRule(&g_egressSched, optarg)) {
+                    return 1;
+                }
+                break;
+            case 'Q':
+                if (!MuxSchedSetQuantum(&g_egressSched, optarg)) {
+                    return 1;
+                }
+                break;
+            case 'I':
+                seconds = strtoul(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || seconds > TIMER_WHEEL_MAX_DELAY / 1000) {
+                    printf("Invalid timeout '%s'\n", optarg);
+                    return 1;
+                }
+                g_idleTimeoutMs = (uint64_t)seconds * 1000;
+                break;
+            case 'O':
+                g_optimisticOpen = true;
+                break;
+            case 'N':
+                g_acceptBatch = (int)strtol(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || g_acceptBatch < 1 || g_acceptBatch > MAX_ACCEPTS) {
+                    printf("Invalid accept count '%s' (1-%d)\n", optarg, MAX_ACCEPTS);
+                    return 1;
+                }
+                break;
+            case 'D':
+                g_acceptData = true;
+                break;
+            case 'h':
+                PrintUsage(argv[0]);
+                return 0;
+            default:
+                PrintUsage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind > 1 || (g_useDevice && optind < argc)) {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+    if (optind < argc) {
+        g_channelPath = argv[optind];
+    }
+    MuxSchedAddPortRule(&g_egressSched, "22=interactive");
+    MuxSchedAddPortRule(&g_egressSched, "53=interactive");
+
+    signal(SIGPIPE, SIG_IGN);
+
+    // Initialize connection contexts
+    TimerWheelInit(&g_timers, NowMillis());
+    TimerInit(&g_reopenTimer, ReopenChannel, NULL);
+    for (i = 0; i < MAX_CONNECTIONS; i++) {
+        g_connections[i].socket = -1;
+        g_connections[i].inUse = false;
+        g_connections[i].connId = i;
+        g_connections[i].io = &g_connectionIo[i];
+        TimerInit(&g_connectionIo[i].timer, ConnectionTimeout, &g_connections[i]);
+    }
+
+    g_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (g_epoll < 0) {
+        perror("epoll_create1 error");
+        return 1;
+    }
+    if (!InitializeServer(address, (uint16_t)port)) {
+        return 1;
+    }
+
+    if (g_useDevice) {
+        // The host end may not be there yet; keep trying as after a failure
+        if (!TransportOpen(&g_transport) || !ChannelUp()) {
+            TimerSchedule(&g_timers, &g_reopenTimer, REOPEN_DELAY_MS);
+        }
+    } else {
+        g_channelListener = ListenChannel(g_channelPath);
+        if (g_channelListener < 0 || !AddEvents(g_channelListener, TAG_CHANNEL_LISTEN, EPOLLIN)) {
+            return 1;
+        }
+        printf("Waiting for a host proxy on %s\n", g_channelPath);
+    }
+
+    printf("SOCKS server started. Listening on %s:%lu\n", address, port);
+
+    // Main event loop
+    while (1) {
+        uint64_t now = NowMillis();
+        int64_t timeout;
+
+        // Run due timers and write out what was queued since the last
+        // wait, then wait no longer than the next timer
+        TimerWheelAdvance(&g_timers, now);
+        if (TransportIsOpen(&g_transport)) {
+            FlushVirtio();
+        }
+        if (g_channelFailed) {
+            ChannelDown();
+        }
+        timeout = TimerWheelTimeout(&g_timers, now);
+
+        n = epoll_wait(g_epoll, events, MAX_EVENTS, timeout < 0 ? -1 : (int)timeout);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait error");
+            break;
+        }
+
+        for (i = 0; i < n; i++) {
+            uint32_t tag = events[i].data.u32;
+
+            if ((tag & TAG_SLOT_MASK) < MAX_CONNECTIONS) {
+                CONNECTION_CONTEXT* ctx = &g_connections[tag & TAG_SLOT_MASK];
+
+                if (ClientTag(ctx) == tag) {
+                    HandleClientEvent(ctx, events[i].events);
+                }
+            } else if (tag == TAG_LISTEN) {
+                AcceptClient();
+            } else if (tag == TAG_CHANNEL_LISTEN) {
+                AcceptChannel();
+            } else {
+                HandleChannelEvent(tag, events[i].events);
+            }
+        }
+
+        ResumeIngress();
+        ResumeClientReads();
+    }
+
+    return 1;
+}
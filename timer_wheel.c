@@ -0,0 +1,193 @@
+#include "timer_wheel.h"
+
+#include <string.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+static int LowestBit(uint64_t value) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, value);
+    return (int)index;
+#else
+    return __builtin_ctzll(value);
+#endif
+}
+
+static void LinkTimer(TIMER_WHEEL* wheel, TIMER* timer) {
+    uint64_t delta = timer->expires - wheel->current;
+    int level = 0;
+    int slot;
+
+    // The level is picked by how far away the timer is; the slot by the
+    // bits of its expiry at that level's resolution
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ULL << (TIMER_WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    slot = (int)((timer->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+
+    timer->level = (uint8_t)level;
+    timer->slot = (uint8_t)slot;
+    timer->prev = NULL;
+    timer->next = wheel->slots[level][slot];
+    if (timer->next != NULL) {
+        timer->next->prev = timer;
+    }
+    wheel->slots[level][slot] = timer;
+    wheel->occupied[level] |= 1ULL << slot;
+    wheel->count++;
+    timer->pending = true;
+}
+
+static void UnlinkTimer(TIMER_WHEEL* wheel, TIMER* timer) {
+    if (timer->prev != NULL) {
+        timer->prev->next = timer->next;
+    } else {
+        wheel->slots[timer->level][timer->slot] = timer->next;
+        if (timer->next == NULL) {
+            wheel->occupied[timer->level] &= ~(1ULL << timer->slot);
+        }
+    }
+    if (timer->next != NULL) {
+        timer->next->prev = timer->prev;
+    }
+
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->pending = false;
+    wheel->count--;
+}
+
+// Earliest tick after the current one at which a slot has to be run or
+// cascaded. Only the occupancy bitmaps are consulted.
+static uint64_t NextEventTick(const TIMER_WHEEL* wheel) {
+    uint64_t best = UINT64_MAX;
+    int level;
+
+    for (level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        int shift = TIMER_WHEEL_BITS * level;
+        uint64_t index = (wheel->current >> shift) & TIMER_WHEEL_MASK;
+        uint64_t ahead;
+        uint64_t tick;
+
+        if (wheel->occupied[level] == 0) {
+            continue;
+        }
+
+        ahead = index == TIMER_WHEEL_MASK ? 0 : wheel->occupied[level] & (~0ULL << (index + 1));
+        if (ahead != 0) {
+            tick = ((wheel->current >> shift) - index + (uint64_t)LowestBit(ahead)) << shift;
+        } else {
+            // Occupied slots are behind us; look again when this level wraps
+            tick = ((wheel->current >> (shift + TIMER_WHEEL_BITS)) + 1) << (shift + TIMER_WHEEL_BITS);
+        }
+
+        if (tick < best) {
+            best = tick;
+        }
+    }
+
+    return best;
+}
+
+static void Cascade(TIMER_WHEEL* wheel, int level) {
+    int slot = (int)((wheel->current >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK);
+    TIMER* timer = wheel->slots[level][slot];
+
+    wheel->slots[level][slot] = NULL;
+    wheel->occupied[level] &= ~(1ULL << slot);
+
+    // Redistribute onto finer levels relative to the new current tick
+    while (timer != NULL) {
+        TIMER* next = timer->next;
+
+        wheel->count--;
+        LinkTimer(wheel, timer);
+        timer = next;
+    }
+}
+
+void TimerWheelInit(TIMER_WHEEL* wheel, uint64_t nowMs) {
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->current = nowMs;
+}
+
+void TimerInit(TIMER* timer, TIMER_CALLBACK callback, void* context) {
+    memset(timer, 0, sizeof(*timer));
+    timer->callback = callback;
+    timer->context = context;
+}
+
+void TimerSchedule(TIMER_WHEEL* wheel, TIMER* timer, uint64_t delayMs) {
+    if (timer->pending) {
+        UnlinkTimer(wheel, timer);
+    }
+
+    // The current tick has already run, so the earliest expiry is the next one
+    if (delayMs == 0) {
+        delayMs = 1;
+    }
+    if (delayMs > TIMER_WHEEL_MAX_DELAY) {
+        delayMs = TIMER_WHEEL_MAX_DELAY;
+    }
+
+    timer->expires = wheel->current + delayMs;
+    LinkTimer(wheel, timer);
+}
+
+void TimerCancel(TIMER_WHEEL* wheel, TIMER* timer) {
+    if (timer->pending) {
+        UnlinkTimer(wheel, timer);
+    }
+}
+
+bool TimerPending(const TIMER* timer) {
+    return timer->pending;
+}
+
+void TimerWheelAdvance(TIMER_WHEEL* wheel, uint64_t nowMs) {
+    while (wheel->current < nowMs) {
+        uint64_t next;
+        int level;
+        TIMER* timer;
+
+        // Jump straight over ticks where nothing happens
+        next = wheel->count == 0 ? UINT64_MAX : NextEventTick(wheel);
+        if (next > nowMs) {
+            wheel->current = nowMs;
+            break;
+        }
+        wheel->current = next;
+
+        // On a level boundary, pull the matching coarser slots down first
+        for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+            uint64_t lowBits = (1ULL << (TIMER_WHEEL_BITS * level)) - 1;
+            if ((wheel->current & lowBits) != 0) {
+                break;
+            }
+            Cascade(wheel, level);
+        }
+
+        // Everything left in the current level-0 slot is due. Callbacks may
+        // schedule or cancel timers, so take one entry at a time.
+        while ((timer = wheel->slots[0][wheel->current & TIMER_WHEEL_MASK]) != NULL) {
+            UnlinkTimer(wheel, timer);
+            timer->callback(timer, timer->context);
+        }
+    }
+}
+
+int64_t TimerWheelTimeout(const TIMER_WHEEL* wheel, uint64_t nowMs) {
+    uint64_t next;
+
+    if (wheel->count == 0) {
+        return -1;
+    }
+
+    next = NextEventTick(wheel);
+    return next <= nowMs ? 0 : (int64_t)(next - nowMs);
+}
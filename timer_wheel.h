@@ -0,0 +1,51 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+// Hierarchical timer wheel. Scheduling, cancelling and expiring a timer are
+// O(1); finding the next wakeup only looks at one occupancy bitmap per
+// level. Timers are embedded in the caller's structures, nothing is
+// allocated. Time is in milliseconds and supplied by the caller.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4
+// Longest delay the wheel can represent (about 4.6 hours at 1ms per tick)
+#define TIMER_WHEEL_MAX_DELAY ((1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+struct TIMER;
+typedef void (*TIMER_CALLBACK)(struct TIMER* timer, void* context);
+
+typedef struct TIMER {
+    struct TIMER* next;
+    struct TIMER* prev;
+    uint64_t expires;       // Absolute tick
+    TIMER_CALLBACK callback;
+    void* context;
+    uint8_t level;
+    uint8_t slot;
+    bool pending;
+} TIMER;
+
+typedef struct {
+    uint64_t current;       // Last tick processed
+    uint64_t occupied[TIMER_WHEEL_LEVELS];
+    TIMER* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    uint32_t count;
+} TIMER_WHEEL;
+
+void TimerWheelInit(TIMER_WHEEL* wheel, uint64_t nowMs);
+void TimerInit(TIMER* timer, TIMER_CALLBACK callback, void* context);
+void TimerSchedule(TIMER_WHEEL* wheel, TIMER* timer, uint64_t delayMs);
+void TimerCancel(TIMER_WHEEL* wheel, TIMER* timer);
+bool TimerPending(const TIMER* timer);
+
+// Runs the callbacks of every timer due at or before nowMs
+void TimerWheelAdvance(TIMER_WHEEL* wheel, uint64_t nowMs);
+
+// Milliseconds until the wheel needs to be advanced again, -1 if idle
+int64_t TimerWheelTimeout(const TIMER_WHEEL* wheel, uint64_t nowMs);
+
+#endif // TIMER_WHEEL_H
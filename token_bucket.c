@@ -0,0 +1,61 @@
+#include "token_bucket.h"
+
+#define MICROS_PER_SECOND 1000000ULL
+
+void TokenBucketInit(TOKEN_BUCKET* bucket, uint64_t rate, uint64_t burst, uint64_t now) {
+    bucket->rate = rate;
+    bucket->burst = burst;
+    bucket->lastRefill = now;
+
+    // Start full so a new stream is not delayed
+    bucket->credit = burst * MICROS_PER_SECOND;
+}
+
+bool TokenBucketEnabled(const TOKEN_BUCKET* bucket) {
+    return bucket->rate != 0;
+}
+
+uint64_t TokenBucketAvailable(TOKEN_BUCKET* bucket, uint64_t now) {
+    uint64_t limit;
+
+    if (bucket->rate == 0) {
+        return TOKEN_BUCKET_UNLIMITED;
+    }
+
+    // Credit is kept in byte-microseconds so partial tokens are not lost
+    limit = bucket->burst * MICROS_PER_SECOND;
+    if (now > bucket->lastRefill) {
+        uint64_t elapsed = now - bucket->lastRefill;
+
+        if (elapsed >= limit / bucket->rate) {
+            bucket->credit = limit;
+        } else {
+            bucket->credit += elapsed * bucket->rate;
+            if (bucket->credit > limit) {
+                bucket->credit = limit;
+            }
+        }
+        bucket->lastRefill = now;
+    }
+
+    return bucket->credit / MICROS_PER_SECOND;
+}
+
+void TokenBucketConsume(TOKEN_BUCKET* bucket, uint64_t bytes) {
+    uint64_t cost = bytes * MICROS_PER_SECOND;
+
+    if (bucket->rate == 0) {
+        return;
+    }
+    bucket->credit = cost < bucket->credit ? bucket->credit - cost : 0;
+}
+
+// Microseconds until `bytes` tokens are available (as of the last refill)
+uint64_t TokenBucketDelay(const TOKEN_BUCKET* bucket, uint64_t bytes) {
+    uint64_t needed = bytes * MICROS_PER_SECOND;
+
+    if (bucket->rate == 0 || bucket->credit >= needed) {
+        return 0;
+    }
+    return (needed - bucket->credit + bucket->rate - 1) / bucket->rate;
+}
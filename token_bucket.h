@@ -0,0 +1,24 @@
+#ifndef TOKEN_BUCKET_H
+#define TOKEN_BUCKET_H
+
+// Token bucket rate limiter. Time is passed in by the caller in microseconds.
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TOKEN_BUCKET_UNLIMITED UINT64_MAX
+
+typedef struct {
+    uint64_t rate;          // Bytes per second, 0 = unlimited
+    uint64_t burst;         // Bucket depth in bytes
+    uint64_t credit;        // Available tokens, in byte-microseconds per second
+    uint64_t lastRefill;    // Time of the last refill (microseconds)
+} TOKEN_BUCKET;
+
+void TokenBucketInit(TOKEN_BUCKET* bucket, uint64_t rate, uint64_t burst, uint64_t now);
+bool TokenBucketEnabled(const TOKEN_BUCKET* bucket);
+uint64_t TokenBucketAvailable(TOKEN_BUCKET* bucket, uint64_t now);
+void TokenBucketConsume(TOKEN_BUCKET* bucket, uint64_t bytes);
+uint64_t TokenBucketDelay(const TOKEN_BUCKET* bucket, uint64_t bytes);
+
+#endif // TOKEN_BUCKET_H
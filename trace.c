@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+
+#include "trace.h"
+
+#include <string.h>
+#include <errno.h>
+#include <sys/time.h>
+
+bool TraceWriterOpen(TRACE_WRITER* trace, const char* path, bool payload, uint64_t nowUs) {
+    TRACE_FILE_HEADER header;
+    struct timeval tv;
+
+    trace->file = fopen(path, "wb");
+    if (trace->file == NULL) {
+        printf("Error creating trace file %s: %s (errno=%d)\n", path, strerror(errno), errno);
+        return false;
+    }
+
+    gettimeofday(&tv, NULL);
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    header.flags = payload ? TRACE_FLAG_PAYLOAD : 0;
+    header.startUnixUs = (uint64_t)tv.tv_sec * 1000000ULL + (uint64_t)tv.tv_usec;
+    if (fwrite(&header, sizeof(header), 1, trace->file) != 1) {
+        printf("Error writing trace file %s\n", path);
+        fclose(trace->file);
+        trace->file = NULL;
+        return false;
+    }
+
+    trace->payload = payload;
+    trace->lastUs = nowUs;
+    trace->frames = 0;
+    return true;
+}
+
+void TraceWriteFrame(TRACE_WRITER* trace, uint8_t direction, uint8_t vm, const VIRTIO_MSG_HEADER* header,
+                     const uint8_t* payload, uint64_t nowUs) {
+    TRACE_RECORD record;
+    uint64_t delta = nowUs > trace->lastUs ? nowUs - trace->lastUs : 0;
+    bool withPayload = trace->payload || header->connId == MUX_CONTROL_CONNID;
+
+    if (trace->file == NULL) {
+        return;
+    }
+
+    record.deltaUs = delta > UINT32_MAX ? UINT32_MAX : (uint32_t)delta;
+    record.direction = direction;
+    record.vm = vm;
+    record.connId = header->connId;
+    record.length = header->length;
+    if (fwrite(&record, sizeof(record), 1, trace->file) != 1 ||
+        (withPayload && header->length > 0 && fwrite(payload, header->length, 1, trace->file) != 1)) {
+        printf("Error writing trace file, capture stopped after %llu frames\n", (unsigned long long)trace->frames);
+        fclose(trace->file);
+        trace->file = NULL;
+        return;
+    }
+
+    trace->lastUs = nowUs;
+    trace->frames++;
+}
+
+void TraceWriterFlush(TRACE_WRITER* trace) {
+    if (trace->file != NULL) {
+        fflush(trace->file);
+    }
+}
+
+void TraceWriterClose(TRACE_WRITER* trace) {
+    if (trace->file != NULL) {
+        fclose(trace->file);
+        trace->file = NULL;
+    }
+}
+
+bool TraceReaderOpen(TRACE_READER* trace, const char* path) {
+    TRACE_FILE_HEADER header;
+
+    trace->file = fopen(path, "rb");
+    if (trace->file == NULL) {
+        printf("Error opening trace file %s: %s (errno=%d)\n", path, strerror(errno), errno);
+        return false;
+    }
+    if (fread(&header, sizeof(header), 1, trace->file) != 1 || header.magic != TRACE_MAGIC) {
+        printf("%s is not a channel trace\n", path);
+        TraceReaderClose(trace);
+        return false;
+    }
+    if (header.version != TRACE_VERSION) {
+        printf("Trace %s has format version %u, this tool reads %d\n", path, header.version, TRACE_VERSION);
+        TraceReaderClose(trace);
+        return false;
+    }
+
+    trace->flags = header.flags;
+    trace->timeUs = 0;
+    return true;
+}
+
+int TraceReadEvent(TRACE_READER* trace, TRACE_EVENT* event) {
+    TRACE_RECORD record;
+    size_t got = fread(&record, 1, sizeof(record), trace->file);
+
+    // A capture that was cut short may end in the middle of a record
+    if (got == 0 && feof(trace->file)) {
+        return 0;
+    }
+    if (got != sizeof(record)) {
+        return -1;
+    }
+    if (record.length > MUX_MAX_PAYLOAD || record.direction > TRACE_TO_GUEST) {
+        return -1;
+    }
+
+    trace->timeUs += record.deltaUs;
+    event->timeUs = trace->timeUs;
+    event->direction = record.direction;
+    event->vm = record.vm;
+    event->connId = record.connId;
+    event->length = record.length;
+    event->hasPayload = (trace->flags & TRACE_FLAG_PAYLOAD) || record.connId == MUX_CONTROL_CONNID;
+    if (event->hasPayload && record.length > 0 && fread(event->payload, record.length, 1, trace->file) != 1) {
+        return -1;
+    }
+    return 1;
+}
+
+void TraceReaderClose(TRACE_READER* trace) {
+    if (trace->file != NULL) {
+        fclose(trace->file);
+        trace->file = NULL;
+    }
+}
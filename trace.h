@@ -0,0 +1,85 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Channel traces: every mux frame that crossed a channel, in the order it
+// was handled, for replaying recorded traffic patterns offline (see
+// trace_replay.c). The file starts with a TRACE_FILE_HEADER, followed by one
+// TRACE_RECORD per frame. Each record is followed by the frame's payload if
+// the trace was taken with payloads, and for control frames always (they
+// carry no user data and say what happened to the streams). Fields are in
+// host byte order.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "mux_protocol.h"
+
+#define TRACE_MAGIC 0x43525456U       // "VTRC"
+#define TRACE_VERSION 1
+#define TRACE_FLAG_PAYLOAD 0x0001
+
+// Record directions
+#define TRACE_TO_HOST 0
+#define TRACE_TO_GUEST 1
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t flags;
+    uint64_t startUnixUs;       // Wall clock time of the first record
+} TRACE_FILE_HEADER;
+
+typedef struct {
+    uint32_t deltaUs;           // Since the previous record; longer gaps are cut
+    uint8_t direction;
+    uint8_t vm;                 // Channel index in the capturing process
+    uint16_t connId;
+    uint16_t length;
+} TRACE_RECORD;
+#pragma pack(pop)
+
+typedef struct {
+    FILE* file;                 // NULL while not capturing
+    bool payload;
+    uint64_t lastUs;
+    uint64_t frames;
+} TRACE_WRITER;
+
+typedef struct {
+    uint64_t timeUs;            // Since the start of the trace
+    uint8_t direction;
+    uint8_t vm;
+    uint16_t connId;
+    uint16_t length;
+    bool hasPayload;
+    uint8_t payload[MUX_MAX_PAYLOAD];
+} TRACE_EVENT;
+
+typedef struct {
+    FILE* file;
+    uint16_t flags;
+    uint64_t timeUs;
+} TRACE_READER;
+
+// Creates or truncates the trace file
+bool TraceWriterOpen(TRACE_WRITER* trace, const char* path, bool payload, uint64_t nowUs);
+
+// Appends a frame given as its header and payload. A write error ends the
+// capture instead of failing the caller.
+void TraceWriteFrame(TRACE_WRITER* trace, uint8_t direction, uint8_t vm, const VIRTIO_MSG_HEADER* header,
+                     const uint8_t* payload, uint64_t nowUs);
+
+void TraceWriterFlush(TRACE_WRITER* trace);
+void TraceWriterClose(TRACE_WRITER* trace);
+
+bool TraceReaderOpen(TRACE_READER* trace, const char* path);
+
+// 1 with the next frame in event, 0 at the end of the trace, -1 if the
+// file is damaged or truncated
+int TraceReadEvent(TRACE_READER* trace, TRACE_EVENT* event);
+
+void TraceReaderClose(TRACE_READER* trace);
+
+#endif // TRACE_H
@@ -0,0 +1,835 @@
+// Trace replay. Plays the guest's side of a channel trace taken with
+// host_proxy --capture against a host proxy, and runs the upstream servers
+// the streams connect to. Frames the guest sent are sent again at their
+// recorded times, scaled by --speed. Data the host delivered to the guest
+// is produced by the upstream server at its recorded time, and
+// upstream EOFs and closes are replayed the same way. Handshake and
+// heartbeats are answered live rather than replayed.
+//
+// Replay is paced, but keeps each stream's causality: a frame the guest sent
+// after having received N bytes on a stream waits until the stream has
+// received N bytes again, so a request does not overtake the response to
+// the previous one and a close does not overtake a slow connect.
+//
+// Every stream connects to 127.0.1.N, with N one more than the live stream
+// ID, so the server can tell which stream an accepted connection belongs to.
+// Trace stream IDs are mapped to free live IDs, because at a faster pace an
+// ID can be reused in the trace before the host has released it here.
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "mux_protocol.h"
+#include "transport.h"
+#include "trace.h"
+#include "bench.h"
+
+#define REPORT_VERSION 1
+#define DEFAULT_CHANNEL "/tmp/vserial"
+
+// The host proxy accepts stream IDs 0..MAX_STREAMS-1 per guest
+#define REPLAY_MAX_STREAMS 64
+#define REPLAY_TRACE_IDS 65536
+
+// Channel buffers; trace frames are only sent while the outgoing one has room
+#define IN_BUFFER_SIZE (256 * 1024)
+#define OUT_BUFFER_SIZE (1024 * 1024)
+#define OUT_HIGH_WATER (256 * 1024)
+
+// A guest frame waits at most this long for the data it depends on
+#define REPLAY_DEPENDENCY_US 1000000ULL
+
+// After the last frame, wait until nothing moved for this long
+#define REPLAY_QUIET_US 500000ULL
+#define REPLAY_DRAIN_MAX_US 30000000ULL
+
+#define SOCKS_ATYP_IPV4 0x01
+
+typedef struct {
+    bool inUse;                 // Opened, and not yet released by both sides and the trace
+    bool guestClosed;           // Our CLOSE sent
+    bool hostClosed;            // The host's CLOSE received
+    bool traceGuestClosed;      // The trace's CLOSEs seen so far
+    bool traceHostClosed;
+    bool awaitingOpen;          // Waiting for OPEN_ACK or OPEN_FAIL
+    int traceId;                // Trace stream this one plays, -1 once the trace closed it
+    int server;                 // Accepted upstream connection, -1 if none
+    uint64_t openedUs;
+    uint64_t downExpected;      // Stream bytes to the guest in the trace so far
+    uint64_t downSeen;          // Stream bytes the guest received
+    uint64_t upExpected;        // Stream bytes to the host in the trace so far
+    uint64_t upSeen;            // Stream bytes the server received
+    uint64_t upBeforeEnd;       // Bytes the server reads before its EOF or close
+    bool upEof;                 // The host ended the upstream side
+    uint64_t owed;              // Bytes the server still has to send
+    bool eofOwed;               // Shut down the server's side once owed is sent
+    bool closeOwed;             // Close the server connection once owed is sent
+} REPLAY_STREAM;
+
+typedef struct {
+    double speed;               // 0: as fast as possible
+    int vm;
+} REPLAY_CONFIG;
+
+typedef struct {
+    uint64_t startUs;
+    uint64_t traceUs;           // Time of the last frame in the trace
+    uint64_t frames;            // Trace frames of the replayed VM
+    uint64_t opens;
+    uint64_t openFailures;
+    uint64_t hostCloses;        // Streams the host closed before the trace did
+    uint64_t skipped;           // Frames for streams that were already gone
+    uint64_t dependencyTimeouts; // Frames sent without the data they waited for
+    uint64_t expectedUp;        // Stream bytes in the trace
+    uint64_t expectedDown;
+    uint64_t bytesUp;           // Received by the servers
+    uint64_t bytesDown;         // Received from the host
+} REPLAY_STATS;
+
+static REPLAY_CONFIG g_config = {1.0, 0};
+static REPLAY_STATS g_stats;
+static BENCH_LATENCY g_openLatency;
+static BENCH_LATENCY g_lag;
+static REPLAY_STREAM g_streams[REPLAY_MAX_STREAMS];
+static int16_t g_liveId[REPLAY_TRACE_IDS];
+static MUX_CHANNEL g_channel;
+static TRACE_READER g_reader;
+static TRACE_EVENT g_event;
+static bool g_eventPending = false;
+static bool g_traceDone = false;
+static uint64_t g_blockedSinceUs = 0;
+static int g_listener = -1;
+static uint16_t g_serverPort;
+
+static TRANSPORT g_transport;
+static uint8_t g_in[IN_BUFFER_SIZE];
+static size_t g_inLen = 0;
+static uint8_t g_out[OUT_BUFFER_SIZE];
+static size_t g_outStart = 0;
+static size_t g_outEnd = 0;
+static uint8_t g_pattern[64 * 1024];
+static uint8_t g_scratch[64 * 1024];
+
+static void PrintUsage(const char* prog) {
+    printf("Usage: %s [options] TRACE [SOCKET]\n", prog);
+    printf("Acts as the guest on the channel socket SOCKET (default: %s) and replays the\n", DEFAULT_CHANNEL);
+    printf("traffic in TRACE, recorded with host_proxy --capture, through the host proxy\n");
+    printf("  -x, --speed X           Pace relative to the recording, 0 for no delays (default: 1)\n");
+    printf("  -v, --vm N              Replay the Nth channel of the capturing proxy (default: 0)\n");
+    printf("  -h, --help              Show this help\n");
+}
+
+static size_t OutRoom(void) {
+    if (g_outStart > 0 && g_outEnd + MUX_MAX_PAYLOAD + sizeof(VIRTIO_MSG_HEADER) > sizeof(g_out)) {
+        memmove(g_out, g_out + g_outStart, g_outEnd - g_outStart);
+        g_outEnd -= g_outStart;
+        g_outStart = 0;
+    }
+    return sizeof(g_out) - g_outEnd;
+}
+
+static bool QueueFrame(uint16_t connId, const void* payload, uint16_t length) {
+    VIRTIO_MSG_HEADER header;
+
+    if (OutRoom() < sizeof(header) + length) {
+        return false;
+    }
+
+    header.connId = connId;
+    header.length = length;
+    memcpy(g_out + g_outEnd, &header, sizeof(header));
+    memcpy(g_out + g_outEnd + sizeof(header), payload, length);
+    g_outEnd += sizeof(header) + length;
+    return true;
+}
+
+static bool QueueControl(uint8_t type, uint16_t connId) {
+    MUX_CTRL_STREAM msg;
+
+    msg.type = type;
+    msg.connId = connId;
+    return QueueFrame(MUX_CONTROL_CONNID, &msg, sizeof(msg));
+}
+
+static bool FlushChannel(void) {
+    while (g_outStart < g_outEnd) {
+        struct iovec iov = {g_out + g_outStart, g_outEnd - g_outStart};
+        ssize_t n = TransportWritev(&g_transport, &iov, 1);
+
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                return true;
+            }
+            perror("Error writing to host proxy");
+            return false;
+        }
+        g_outStart += (size_t)n;
+    }
+    g_outStart = 0;
+    g_outEnd = 0;
+    return true;
+}
+
+static void CloseServer(REPLAY_STREAM* stream) {
+    if (stream->server != -1) {
+        close(stream->server);
+        stream->server = -1;
+    }
+}
+
+// Both sides and the trace are done with the stream; the live ID may be used again
+static void ReleaseStream(int id) {
+    REPLAY_STREAM* stream = &g_streams[id];
+
+    CloseServer(stream);
+    memset(stream, 0, sizeof(*stream));
+    stream->traceId = -1;
+    stream->server = -1;
+}
+
+static void ReleaseIfDone(int id) {
+    REPLAY_STREAM* stream = &g_streams[id];
+
+    if (stream->traceId != -1 && stream->traceGuestClosed && stream->traceHostClosed) {
+        g_liveId[stream->traceId] = -1;
+        stream->traceId = -1;
+    }
+    if (stream->traceId == -1 && stream->guestClosed && stream->hostClosed) {
+        ReleaseStream(id);
+    }
+}
+
+static void OpenStream(uint16_t traceId) {
+    uint8_t request[7] = {SOCKS_ATYP_IPV4, 127, 0, 1, 0, (uint8_t)(g_serverPort >> 8), (uint8_t)g_serverPort};
+    REPLAY_STREAM* stream;
+    int id;
+
+    for (id = 0; id < REPLAY_MAX_STREAMS && g_streams[id].inUse; id++) {
+    }
+    if (id == REPLAY_MAX_STREAMS) {
+        g_stats.skipped++;
+        return;
+    }
+
+    request[4] = (uint8_t)(id + 1);
+    QueueFrame((uint16_t)id, request, sizeof(request));
+
+    stream = &g_streams[id];
+    stream->inUse = true;
+    stream->awaitingOpen = (g_channel.capabilities & MUX_CAP_OPEN_RESULT) != 0;
+    stream->traceId = traceId;
+    stream->openedUs = BenchNowMicros();
+    g_liveId[traceId] = (int16_t)id;
+    g_stats.opens++;
+}
+
+// Sends what the server owes, then carries out a pending EOF or close
+static void ServeStream(REPLAY_STREAM* stream) {
+    while (stream->owed > 0) {
+        size_t chunk = stream->owed < sizeof(g_pattern) ? (size_t)stream->owed : sizeof(g_pattern);
+        ssize_t n = send(stream->server, g_pattern, chunk, MSG_NOSIGNAL);
+
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EINTR) {
+                CloseServer(stream);
+            }
+            return;
+        }
+        stream->owed -= (uint64_t)n;
+    }
+    if (stream->upSeen < stream->upBeforeEnd && !stream->upEof) {
+        return;
+    }
+    if (stream->closeOwed) {
+        CloseServer(stream);
+    } else if (stream->eofOwed) {
+        shutdown(stream->server, SHUT_WR);
+        stream->eofOwed = false;
+    }
+}
+
+// Only stream data, CLOSE and EOF are replayed; the rest is answered live
+static bool IsReplayed(const TRACE_EVENT* event) {
+    return event->connId != MUX_CONTROL_CONNID ||
+           (event->length >= sizeof(MUX_CTRL_STREAM) &&
+            (event->payload[0] == MUX_CTRL_CLOSE || event->payload[0] == MUX_CTRL_EOF));
+}
+
+// Live stream a replayed trace frame belongs to, -1 if none
+static int EventStream(const TRACE_EVENT* event) {
+    MUX_CTRL_STREAM msg;
+
+    if (event->connId != MUX_CONTROL_CONNID) {
+        return g_liveId[event->connId];
+    }
+    memcpy(&msg, event->payload, sizeof(msg));
+    return g_liveId[msg.connId];
+}
+
+// Plays one trace frame of the replayed VM
+static void PlayEvent(const TRACE_EVENT* event) {
+    REPLAY_STREAM* stream;
+    int id;
+
+    if (!IsReplayed(event)) {
+        return;
+    }
+    id = EventStream(event);
+    if (id == -1) {
+        // The first frame of a stream is its open request
+        if (event->connId != MUX_CONTROL_CONNID && event->direction == TRACE_TO_HOST) {
+            OpenStream(event->connId);
+        } else {
+            g_stats.skipped++;
+        }
+        return;
+    }
+    stream = &g_streams[id];
+
+    if (event->direction == TRACE_TO_HOST) {
+        if (stream->guestClosed || stream->hostClosed) {
+            // Closed early by the host; the guest's last frames have nowhere to go
+            if (event->connId == MUX_CONTROL_CONNID && event->payload[0] == MUX_CTRL_CLOSE) {
+                if (!stream->guestClosed) {
+                    QueueControl(MUX_CTRL_CLOSE, (uint16_t)id);
+                    stream->guestClosed = true;
+                }
+                stream->traceGuestClosed = true;
+                ReleaseIfDone(id);
+            } else {
+                g_stats.skipped++;
+            }
+        } else if (event->connId != MUX_CONTROL_CONNID) {
+            g_stats.expectedUp += event->length;
+            stream->upExpected += event->length;
+            QueueFrame((uint16_t)id, event->hasPayload ? event->payload : g_pattern, event->length);
+        } else if (event->payload[0] == MUX_CTRL_EOF) {
+            QueueControl(MUX_CTRL_EOF, (uint16_t)id);
+        } else {
+            QueueControl(MUX_CTRL_CLOSE, (uint16_t)id);
+            stream->guestClosed = true;
+            stream->traceGuestClosed = true;
+            ReleaseIfDone(id);
+        }
+        return;
+    }
+
+    // To the guest: the upstream server sends the data, or ends its side
+    if (event->connId != MUX_CONTROL_CONNID) {
+        g_stats.expectedDown += event->length;
+        stream->downExpected += event->length;
+        stream->owed += event->length;
+    } else if (event->payload[0] == MUX_CTRL_EOF) {
+        stream->eofOwed = true;
+        stream->upBeforeEnd = stream->upExpected;
+    } else {
+        stream->closeOwed = true;
+        stream->upBeforeEnd = stream->upExpected;
+        stream->traceHostClosed = true;
+    }
+    if (stream->server != -1) {
+        ServeStream(stream);
+    }
+    ReleaseIfDone(id);
+}
+
+// Whether the guest had, at this point of the trace, received every byte
+// that the stream has been sent in the trace so far
+static bool EventReady(const TRACE_EVENT* event, uint64_t now) {
+    int id;
+
+    if (event->direction != TRACE_TO_HOST || !IsReplayed(event)) {
+        return true;
+    }
+    id = EventStream(event);
+    if (id == -1 || g_streams[id].downSeen >= g_streams[id].downExpected || g_streams[id].hostClosed) {
+        return true;
+    }
+
+    if (g_blockedSinceUs == 0) {
+        g_blockedSinceUs = now;
+    }
+    if (now - g_blockedSinceUs < REPLAY_DEPENDENCY_US) {
+        return false;
+    }
+    g_stats.dependencyTimeouts++;
+    return true;
+}
+
+// Plays every frame that is due; returns microseconds until the next one
+static uint64_t PlayDueEvents(uint64_t now) {
+    while (!g_traceDone) {
+        uint64_t dueUs;
+        int result;
+
+        if (!g_eventPending) {
+            do {
+                result = TraceReadEvent(&g_reader, &g_event);
+            } while (result == 1 && g_event.vm != g_config.vm);
+            if (result != 1) {
+                if (result < 0) {
+                    printf("Trace is damaged or truncated, replayed what came before\n");
+                }
+                g_traceDone = true;
+                break;
+            }
+            g_eventPending = true;
+            g_stats.frames++;
+            g_stats.traceUs = g_event.timeUs;
+        }
+
+        dueUs = g_config.speed > 0 ? g_stats.startUs + (uint64_t)(g_event.timeUs / g_config.speed) : now;
+        if (dueUs > now) {
+            return dueUs - now;
+        }
+
+        // Keep the guest's own backlog bounded; the host is the one to measure
+        if (g_outEnd - g_outStart >= OUT_HIGH_WATER) {
+            return 0;
+        }
+        // Frames are played in trace order, so a waiting frame holds up the rest
+        if (!EventReady(&g_event, now)) {
+            return g_blockedSinceUs + REPLAY_DEPENDENCY_US - now;
+        }
+        g_blockedSinceUs = 0;
+        BenchLatencyAdd(&g_lag, now - dueUs);
+        PlayEvent(&g_event);
+        g_eventPending = false;
+    }
+    return UINT64_MAX;
+}
+
+static void HandleHello(const MUX_HELLO* hello) {
+    MUX_HELLO ack;
+
+    if (hello->version != MUX_PROTOCOL_VERSION) {
+        printf("Host speaks protocol version %u, this tool speaks %d\n", hello->version, MUX_PROTOCOL_VERSION);
+        return;
+    }
+    if (g_channel.ready) {
+        printf("Host proxy restarted the channel; streams of the replay are lost\n");
+    }
+
+    g_channel.version = hello->version;
+    g_channel.maxPayload = hello->maxPayload < MUX_MAX_PAYLOAD ? hello->maxPayload : MUX_MAX_PAYLOAD;
+    g_channel.capabilities = hello->capabilities & MUX_CAPABILITIES;
+
+    ack.type = MUX_CTRL_HELLO_ACK;
+    ack.version = MUX_PROTOCOL_VERSION;
+    ack.maxPayload = MUX_MAX_PAYLOAD;
+    ack.capabilities = MUX_CAPABILITIES;
+    QueueFrame(MUX_CONTROL_CONNID, &ack, sizeof(ack));
+    g_channel.ready = true;
+}
+
+static void HandleControl(const uint8_t* data, uint16_t length) {
+    MUX_CTRL_STREAM msg;
+    MUX_HELLO hello;
+    MUX_HEARTBEAT heartbeat;
+    REPLAY_STREAM* stream;
+
+    if (length < 1) {
+        return;
+    }
+
+    switch (data[0]) {
+        case MUX_CTRL_HELLO:
+            if (length >= sizeof(hello)) {
+                memcpy(&hello, data, sizeof(hello));
+                HandleHello(&hello);
+            }
+            return;
+        case MUX_CTRL_PING:
+            if (length >= sizeof(heartbeat)) {
+                memcpy(&heartbeat, data, sizeof(heartbeat));
+                heartbeat.type = MUX_CTRL_PONG;
+                QueueFrame(MUX_CONTROL_CONNID, &heartbeat, sizeof(heartbeat));
+            }
+            return;
+        case MUX_CTRL_CLOSE:
+        case MUX_CTRL_OPEN_ACK:
+        case MUX_CTRL_OPEN_FAIL:
+            break;
+        default:
+            // HELLO_ACK, PONG and EOF need no answer
+            return;
+    }
+
+    // OPEN_ACK and OPEN_FAIL are longer, but start the same way
+    if (length < sizeof(msg)) {
+        return;
+    }
+    memcpy(&msg, data, sizeof(msg));
+    if (msg.connId >= REPLAY_MAX_STREAMS || !g_streams[msg.connId].inUse) {
+        return;
+    }
+    stream = &g_streams[msg.connId];
+
+    if (msg.type != MUX_CTRL_CLOSE) {
+        if (stream->awaitingOpen) {
+            stream->awaitingOpen = false;
+            BenchLatencyAdd(&g_openLatency, BenchNowMicros() - stream->openedUs);
+            if (msg.type == MUX_CTRL_OPEN_FAIL) {
+                g_stats.openFailures++;
+            }
+        }
+        return;
+    }
+
+    stream->hostClosed = true;
+    if (!stream->guestClosed && !stream->traceHostClosed) {
+        // Gone before the trace says it should be; the rest of its frames are skipped
+        g_stats.hostCloses++;
+    }
+    ReleaseIfDone(msg.connId);
+}
+
+static bool ReadChannel(void) {
+    size_t offset = 0;
+    ssize_t n = TransportRead(&g_transport, g_in + g_inLen, sizeof(g_in) - g_inLen);
+
+    if (n == 0) {
+        printf("Host proxy disconnected\n");
+        return false;
+    }
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return true;
+        }
+        perror("Error reading from host proxy");
+        return false;
+    }
+    g_inLen += (size_t)n;
+
+    while (g_inLen - offset >= sizeof(VIRTIO_MSG_HEADER)) {
+        VIRTIO_MSG_HEADER header;
+
+        memcpy(&header, g_in + offset, sizeof(header));
+        if (g_inLen - offset < sizeof(header) + header.length) {
+            break;
+        }
+        if (header.connId == MUX_CONTROL_CONNID) {
+            HandleControl(g_in + offset + sizeof(header), header.length);
+        } else {
+            g_stats.bytesDown += header.length;
+            if (header.connId < REPLAY_MAX_STREAMS) {
+                g_streams[header.connId].downSeen += header.length;
+            }
+        }
+        offset += sizeof(header) + header.length;
+    }
+
+    memmove(g_in, g_in + offset, g_inLen - offset);
+    g_inLen -= offset;
+    return true;
+}
+
+static bool StartServer(void) {
+    struct sockaddr_in addr;
+    socklen_t addrLen = sizeof(addr);
+
+    g_listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (g_listener < 0) {
+        perror("Error creating server socket");
+        return false;
+    }
+
+    // Any address, so that every 127.0.1.N reaches it
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bind(g_listener, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(g_listener, SOMAXCONN) < 0 ||
+        getsockname(g_listener, (struct sockaddr*)&addr, &addrLen) < 0) {
+        perror("Error starting server");
+        return false;
+    }
+    g_serverPort = ntohs(addr.sin_port);
+    return true;
+}
+
+static void AcceptServers(void) {
+    struct sockaddr_in addr;
+    socklen_t addrLen;
+    uint32_t local;
+    int fd;
+
+    while ((fd = accept4(g_listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        REPLAY_STREAM* stream;
+        int id;
+
+        addrLen = sizeof(addr);
+        getsockname(fd, (struct sockaddr*)&addr, &addrLen);
+        local = ntohl(addr.sin_addr.s_addr);
+        id = (int)(local & 0xFF) - 1;
+        if ((local & 0xFFFFFF00U) != 0x7F000100U || id < 0 || id >= REPLAY_MAX_STREAMS ||
+            !g_streams[id].inUse) {
+            close(fd);
+            continue;
+        }
+
+        stream = &g_streams[id];
+        CloseServer(stream);
+        stream->server = fd;
+        ServeStream(stream);
+    }
+}
+
+static void ServeUpstream(REPLAY_STREAM* stream, short revents) {
+    if (revents & POLLIN) {
+        ssize_t n = recv(stream->server, g_scratch, sizeof(g_scratch), 0);
+
+        if (n > 0) {
+            g_stats.bytesUp += (uint64_t)n;
+            stream->upSeen += (uint64_t)n;
+        } else if (n == 0) {
+            // The host ended the upstream side; ours follows when the trace says
+            stream->upEof = true;
+        } else if (errno != EAGAIN && errno != EINTR) {
+            CloseServer(stream);
+            return;
+        }
+    }
+    if (stream->server != -1) {
+        ServeStream(stream);
+    }
+}
+
+static bool Busy(void) {
+    int id;
+
+    if (g_outStart < g_outEnd) {
+        return true;
+    }
+    for (id = 0; id < REPLAY_MAX_STREAMS; id++) {
+        if (g_streams[id].server != -1 && g_streams[id].owed > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void PrintReport(uint64_t endUs) {
+    double seconds = (double)(endUs - g_stats.startUs) / 1e6;
+
+    printf("report_version=%d\n", REPORT_VERSION);
+    printf("speed=%.2f\n", g_config.speed);
+    printf("frames=%llu\n", (unsigned long long)g_stats.frames);
+    printf("trace_duration_s=%.3f\n", (double)g_stats.traceUs / 1e6);
+    printf("duration_s=%.3f\n", seconds);
+    printf("streams=%llu\n", (unsigned long long)g_stats.opens);
+    printf("open_failures=%llu\n", (unsigned long long)g_stats.openFailures);
+    printf("host_closes=%llu\n", (unsigned long long)g_stats.hostCloses);
+    printf("skipped_frames=%llu\n", (unsigned long long)g_stats.skipped);
+    printf("dependency_timeouts=%llu\n", (unsigned long long)g_stats.dependencyTimeouts);
+    printf("expected_up=%llu\n", (unsigned long long)g_stats.expectedUp);
+    printf("expected_down=%llu\n", (unsigned long long)g_stats.expectedDown);
+    printf("bytes_up=%llu\n", (unsigned long long)g_stats.bytesUp);
+    printf("bytes_down=%llu\n", (unsigned long long)g_stats.bytesDown);
+    printf("mbit_up=%.2f\n", g_stats.bytesUp * 8 / seconds / 1e6);
+    printf("mbit_down=%.2f\n", g_stats.bytesDown * 8 / seconds / 1e6);
+    BenchLatencyReport(&g_openLatency, "open");
+    BenchLatencyReport(&g_lag, "lag");
+}
+
+static bool Run(void) {
+    static struct pollfd fds[TRANSPORT_POLL_FDS + 1 + REPLAY_MAX_STREAMS];
+    int pollStream[REPLAY_MAX_STREAMS];
+    uint64_t quietSinceUs = 0;
+    uint64_t drainStartUs = 0;
+    int nfds;
+    int i;
+
+    while (1) {
+        uint64_t now = BenchNowMicros();
+        uint64_t nextUs = UINT64_MAX;
+        int timeoutMs;
+        int channelTimeoutMs;
+        short events;
+
+        if (g_channel.ready && g_stats.startUs == 0) {
+            g_stats.startUs = now;
+            printf("Replaying at %s\n", g_config.speed > 0 ? "the recorded pace (scaled)" : "full speed");
+        }
+        if (g_stats.startUs != 0) {
+            nextUs = PlayDueEvents(now);
+        }
+
+        // Done once the trace is through and nothing moved for a while
+        if (g_traceDone) {
+            if (drainStartUs == 0) {
+                drainStartUs = now;
+            }
+            if (Busy()) {
+                quietSinceUs = 0;
+            } else if (quietSinceUs == 0) {
+                quietSinceUs = now;
+            }
+            if ((quietSinceUs != 0 && now - quietSinceUs >= REPLAY_QUIET_US) ||
+                now - drainStartUs >= REPLAY_DRAIN_MAX_US) {
+                PrintReport(quietSinceUs != 0 ? quietSinceUs : now);
+                return true;
+            }
+            nextUs = 100000;
+        }
+
+        if (!FlushChannel()) {
+            return false;
+        }
+
+        timeoutMs = nextUs == UINT64_MAX ? -1 : (int)((nextUs + 999) / 1000);
+        if (TransportPollSetup(&g_transport, fds, true, g_outStart < g_outEnd)) {
+            timeoutMs = 0;
+        }
+        channelTimeoutMs = TransportPollTimeout(&g_transport);
+        if (channelTimeoutMs >= 0 && (timeoutMs < 0 || channelTimeoutMs < timeoutMs)) {
+            timeoutMs = channelTimeoutMs;
+        }
+
+        nfds = TRANSPORT_POLL_FDS;
+        fds[nfds].fd = g_listener;
+        fds[nfds].events = POLLIN;
+        fds[nfds].revents = 0;
+        nfds++;
+        for (i = 0; i < REPLAY_MAX_STREAMS; i++) {
+            short wanted = (g_streams[i].upEof ? 0 : POLLIN) | (g_streams[i].owed > 0 ? POLLOUT : 0);
+
+            // A server that has only to wait for the trace is left out, as it may be hung up
+            if (g_streams[i].server == -1 || wanted == 0) {
+                continue;
+            }
+            pollStream[nfds - TRANSPORT_POLL_FDS - 1] = i;
+            fds[nfds].fd = g_streams[i].server;
+            fds[nfds].events = wanted;
+            fds[nfds].revents = 0;
+            nfds++;
+        }
+
+        if (poll(fds, nfds, timeoutMs) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll error");
+            return false;
+        }
+
+        for (i = TRANSPORT_POLL_FDS + 1; i < nfds; i++) {
+            REPLAY_STREAM* stream = &g_streams[pollStream[i - TRANSPORT_POLL_FDS - 1]];
+
+            if (fds[i].revents != 0 && stream->server == fds[i].fd) {
+                ServeUpstream(stream, fds[i].revents);
+            }
+        }
+        if (fds[TRANSPORT_POLL_FDS].revents & POLLIN) {
+            AcceptServers();
+        }
+
+        events = TransportPollEvents(&g_transport, fds);
+        if ((events & POLLOUT) && !FlushChannel()) {
+            return false;
+        }
+        if ((events & (POLLIN | POLLHUP | POLLERR)) && !ReadChannel()) {
+            return false;
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    static const struct option longOptions[] = {
+        {"speed", required_argument, NULL, 'x'},
+        {"vm", required_argument, NULL, 'v'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+    const char* path = DEFAULT_CHANNEL;
+    char spec[TRANSPORT_SPEC_MAX];
+    char* end;
+    int listener;
+    int opt;
+    int fd;
+    int i;
+
+    while ((opt = getopt_long(argc, argv, "x:v:h", longOptions, NULL)) != -1) {
+        switch (opt) {
+            case 'x':
+                g_config.speed = strtod(optarg, &end);
+                if (end == optarg || *end != '\0' || g_config.speed < 0) {
+                    printf("Invalid speed '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'v':
+                g_config.vm = (int)strtol(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || g_config.vm < 0 || g_config.vm > UINT8_MAX) {
+                    printf("Invalid VM index '%s'\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'h':
+                PrintUsage(argv[0]);
+                return 0;
+            default:
+                PrintUsage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind < 1 || argc - optind > 2) {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+    if (optind + 1 < argc) {
+        path = argv[optind + 1];
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    for (i = 0; i < (int)sizeof(g_pattern); i++) {
+        g_pattern[i] = (uint8_t)i;
+    }
+    for (i = 0; i < REPLAY_TRACE_IDS; i++) {
+        g_liveId[i] = -1;
+    }
+    for (i = 0; i < REPLAY_MAX_STREAMS; i++) {
+        g_streams[i].traceId = -1;
+        g_streams[i].server = -1;
+    }
+
+    if (!TraceReaderOpen(&g_reader, argv[optind]) || !StartServer()) {
+        return 1;
+    }
+
+    listener = BenchListenUnix(path);
+    if (listener < 0) {
+        return 1;
+    }
+    printf("Waiting for a host proxy on %s to replay %s\n", path, argv[optind]);
+
+    fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+        perror("accept error");
+        close(listener);
+        return 1;
+    }
+    close(listener);
+    unlink(path);
+
+    snprintf(spec, sizeof(spec), "unix:%s", path);
+    if (!TransportParse(&g_transport, spec) || !TransportAdopt(&g_transport, "unix", &fd, 1)) {
+        return 1;
+    }
+
+    if (!Run()) {
+        return 1;
+    }
+    TransportClose(&g_transport);
+    TraceReaderClose(&g_reader);
+    return 0;
+}
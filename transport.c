@@ -0,0 +1,719 @@
+#define _GNU_SOURCE
+
+#include "transport.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <termios.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+static bool SetNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+
+    return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+// Sockets: recv/sendmsg, with MSG_NOSIGNAL so a vanished peer is an error
+// rather than SIGPIPE
+
+static ssize_t SocketRead(TRANSPORT* transport, void* buffer, size_t length) {
+    return recv(transport->readFd, buffer, length, 0);
+}
+
+static ssize_t SocketWritev(TRANSPORT* transport, const struct iovec* iov, int iovcnt) {
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = (struct iovec*)iov;
+    msg.msg_iovlen = iovcnt;
+    return sendmsg(transport->writeFd, &msg, MSG_NOSIGNAL);
+}
+
+static void FdClose(TRANSPORT* transport) {
+    if (transport->writeFd != -1 && transport->writeFd != transport->readFd) {
+        close(transport->writeFd);
+    }
+    if (transport->readFd != -1) {
+        close(transport->readFd);
+    }
+    transport->readFd = -1;
+    transport->writeFd = -1;
+}
+
+static int ConnectUnix(const char* path, int flags) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        printf("Socket path %s is too long\n", path);
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | flags, 0);
+    if (fd < 0) {
+        printf("Error creating socket: %s (errno=%d)\n", strerror(errno), errno);
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path, strlen(path) + 1);
+
+    // Local stream connects complete (or fail) immediately
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        printf("Error connecting to %s: %s (errno=%d)\n", path, strerror(errno), errno);
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// Poll the read side, and the write side when it is a separate descriptor
+static bool FdPollSetup(TRANSPORT* transport, struct pollfd* fds, bool wantRead, bool wantWrite) {
+    fds[0].fd = transport->readFd;
+    fds[0].events = wantRead ? POLLIN : 0;
+    fds[1].fd = -1;
+    fds[1].events = 0;
+
+    if (wantWrite) {
+        if (transport->writeFd == transport->readFd) {
+            fds[0].events |= POLLOUT;
+        } else {
+            fds[1].fd = transport->writeFd;
+            fds[1].events = POLLOUT;
+        }
+    }
+
+    // A negative fd is ignored by poll, so hangups on a paused descriptor
+    // do not spin the loop
+    if (fds[0].events == 0) {
+        fds[0].fd = -1;
+    }
+    return false;
+}
+
+static short FdPollEvents(TRANSPORT* transport, const struct pollfd* fds) {
+    (void)transport;
+    return fds[0].revents | fds[1].revents;
+}
+
+static bool UnixOpen(TRANSPORT* transport) {
+    int fd;
+
+    printf("Connecting to unix socket %s\n", transport->address);
+    fd = ConnectUnix(transport->address, SOCK_NONBLOCK);
+    if (fd < 0) {
+        return false;
+    }
+
+    transport->readFd = fd;
+    transport->writeFd = fd;
+    return true;
+}
+
+static bool TcpOpen(TRANSPORT* transport) {
+    char host[TRANSPORT_ADDRESS_MAX];
+    const char* port;
+    const char* sep = strrchr(transport->address, ':');
+    struct addrinfo hints, *res, *ai;
+    int fd = -1;
+    int one = 1;
+    size_t hostLen;
+
+    if (sep == NULL || sep == transport->address || sep[1] == '\0') {
+        printf("Invalid TCP address '%s' (expected HOST:PORT)\n", transport->address);
+        return false;
+    }
+
+    // Accept [v6-address]:port as well
+    hostLen = sep - transport->address;
+    if (transport->address[0] == '[' && sep[-1] == ']') {
+        memcpy(host, transport->address + 1, hostLen - 2);
+        host[hostLen - 2] = '\0';
+    } else {
+        memcpy(host, transport->address, hostLen);
+        host[hostLen] = '\0';
+    }
+    port = sep + 1;
+
+    printf("Connecting to TCP %s port %s\n", host, port);
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        printf("Cannot resolve %s\n", transport->address);
+        return false;
+    }
+
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd < 0) {
+        printf("Error connecting to %s: %s (errno=%d)\n", transport->address, strerror(errno), errno);
+        return false;
+    }
+
+    // Frames are already batched into one writev; do not hold them back
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (!SetNonBlocking(fd)) {
+        perror("Failed to set non-blocking mode for TCP channel");
+        close(fd);
+        return false;
+    }
+
+    transport->readFd = fd;
+    transport->writeFd = fd;
+    return true;
+}
+
+// Character devices and FIFOs: plain read/writev
+
+static ssize_t DeviceRead(TRANSPORT* transport, void* buffer, size_t length) {
+    return read(transport->readFd, buffer, length);
+}
+
+static ssize_t DeviceWritev(TRANSPORT* transport, const struct iovec* iov, int iovcnt) {
+    return writev(transport->writeFd, iov, iovcnt);
+}
+
+static bool DeviceOpen(TRANSPORT* transport) {
+    int fd;
+
+    if (transport->outPath[0] != '\0') {
+        int outFd;
+
+        // Open the reading end first: opening a FIFO for writing fails
+        // with ENXIO until somebody reads it
+        printf("Opening FIFOs %s (in) and %s (out)\n", transport->address, transport->outPath);
+        fd = open(transport->address, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd < 0) {
+            printf("Error opening %s: %s (errno=%d)\n", transport->address, strerror(errno), errno);
+            return false;
+        }
+        outFd = open(transport->outPath, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+        if (outFd < 0) {
+            printf("Error opening %s: %s (errno=%d)\n", transport->outPath, strerror(errno), errno);
+            close(fd);
+            return false;
+        }
+
+        transport->readFd = fd;
+        transport->writeFd = outFd;
+        return true;
+    }
+
+    printf("Opening character device %s\n", transport->address);
+    fd = open(transport->address, O_RDWR | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0) {
+        printf("Error opening %s: %s (errno=%d)\n", transport->address, strerror(errno), errno);
+        return false;
+    }
+
+    // Console-style ports would otherwise echo and translate bytes
+    if (isatty(fd)) {
+        struct termios tio;
+
+        if (tcgetattr(fd, &tio) == 0) {
+            cfmakeraw(&tio);
+            tcsetattr(fd, TCSANOW, &tio);
+        }
+    }
+
+    transport->readFd = fd;
+    transport->writeFd = fd;
+    return true;
+}
+
+// Shared memory: the doorbell eventfd stands in for both POLLIN and POLLOUT,
+// and the control socket reports the peer going away
+
+static bool ShmOpen(TRANSPORT* transport) {
+    struct timeval timeout = { 2, 0 };
+    int fd;
+
+    printf("Attaching to shared memory rings from %s\n", transport->address);
+    fd = ConnectUnix(transport->address, 0);
+    if (fd < 0) {
+        return false;
+    }
+
+    // The server sends the region right after accepting
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (!ShmChannelAttach(&transport->shm, fd)) {
+        return false;
+    }
+
+    printf("Shared memory rings: %u bytes per direction\n", transport->shm.rx.size);
+    transport->readFd = transport->shm.doorbell;
+    transport->writeFd = transport->shm.control;
+    return true;
+}
+
+static ssize_t ShmRead(TRANSPORT* transport, void* buffer, size_t length) {
+    ssize_t result = ShmChannelRead(&transport->shm, buffer, length);
+    char byte;
+
+    // Report EOF once the rings are drained and the server is gone
+    if (result < 0 && errno == EAGAIN && recv(transport->shm.control, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == 0) {
+        return 0;
+    }
+    return result;
+}
+
+static ssize_t ShmWritev(TRANSPORT* transport, const struct iovec* iov, int iovcnt) {
+    return ShmChannelWritev(&transport->shm, iov, iovcnt);
+}
+
+static void ShmClose(TRANSPORT* transport) {
+    ShmChannelClose(&transport->shm);
+    transport->readFd = -1;
+    transport->writeFd = -1;
+}
+
+static bool ShmPollSetup(TRANSPORT* transport, struct pollfd* fds, bool wantRead, bool wantWrite) {
+    fds[0].fd = wantRead || wantWrite ? transport->shm.doorbell : -1;
+    fds[0].events = POLLIN;
+    fds[1].fd = transport->shm.control;
+    fds[1].events = 0;
+    return ShmChannelPrepareWait(&transport->shm, wantRead, wantWrite);
+}
+
+static short ShmPollEvents(TRANSPORT* transport, const struct pollfd* fds) {
+    short events = 0;
+
+    ShmChannelFinishWait(&transport->shm);
+    if (ShmRingReadable(&transport->shm.rx) > 0) {
+        events |= POLLIN;
+    }
+    if (ShmRingWritable(&transport->shm.tx) > 0) {
+        events |= POLLOUT;
+    }
+    return events | (fds[1].revents & (POLLERR | POLLHUP));
+}
+
+// Channel emulation: reads and writes go through the emulator's pipes, and
+// the backend fills and drains them as fast as the emulated link allows
+
+static uint64_t NowMicros(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000ULL + (uint64_t)ts.tv_nsec / 1000;
+}
+
+// Hands bytes that have crossed the link to the backend
+static void EmuFlush(TRANSPORT* transport, uint64_t now) {
+    CHANNEL_EMU* emu = transport->emu;
+    struct iovec iov[2];
+    int iovcnt;
+
+    while (emu->outError == 0 && ChannelEmuArrived(&emu->out, now, iov, &iovcnt) > 0) {
+        ssize_t n = transport->active->writev(transport, iov, iovcnt);
+
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                emu->outError = errno;
+            }
+            return;
+        }
+        ChannelEmuPop(&emu->out, (size_t)n);
+    }
+}
+
+static bool EmuOutBacklog(TRANSPORT* transport, uint64_t now) {
+    struct iovec iov[2];
+    int iovcnt;
+
+    return ChannelEmuArrived(&transport->emu->out, now, iov, &iovcnt) > 0;
+}
+
+// The peer's end of the channel is gone and everything it sent was read
+static bool EmuInFinished(const CHANNEL_EMU* emu) {
+    return emu->in.used == 0 && (emu->inEof || emu->inError != 0);
+}
+
+static ssize_t EmuRead(TRANSPORT* transport, void* buffer, size_t length) {
+    static uint8_t scratch[CHANNEL_EMU_BUFFER];
+    CHANNEL_EMU* emu = transport->emu;
+    uint64_t now = NowMicros();
+    size_t room = ChannelEmuRoom(emu, &emu->in, now);
+    struct iovec iov[2];
+    size_t arrived;
+    size_t copied = 0;
+    int iovcnt;
+    int i;
+
+    // Let in what the peer sent, as far as the link has room for it
+    if (room > 0 && !emu->inEof && emu->inError == 0) {
+        ssize_t n = transport->active->read(transport, scratch, room);
+
+        if (n > 0) {
+            iov[0].iov_base = scratch;
+            iov[0].iov_len = (size_t)n;
+            ChannelEmuPush(emu, &emu->in, iov, 1, (size_t)n, now);
+        } else if (n == 0) {
+            emu->inEof = true;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            emu->inError = errno;
+        }
+    }
+
+    arrived = ChannelEmuArrived(&emu->in, now, iov, &iovcnt);
+    if (arrived == 0) {
+        if (EmuInFinished(emu)) {
+            if (emu->inEof) {
+                return 0;
+            }
+            errno = emu->inError;
+            return -1;
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+
+    length = ChannelEmuChunk(emu, length < arrived ? length : arrived);
+    for (i = 0; i < iovcnt && copied < length; i++) {
+        size_t n = iov[i].iov_len < length - copied ? iov[i].iov_len : length - copied;
+
+        memcpy((uint8_t*)buffer + copied, iov[i].iov_base, n);
+        copied += n;
+    }
+    ChannelEmuPop(&emu->in, copied);
+    return (ssize_t)copied;
+}
+
+static ssize_t EmuWritev(TRANSPORT* transport, const struct iovec* iov, int iovcnt) {
+    CHANNEL_EMU* emu = transport->emu;
+    uint64_t now = NowMicros();
+    size_t total = 0;
+    size_t length;
+    int i;
+
+    EmuFlush(transport, now);
+    if (emu->outError != 0) {
+        errno = emu->outError;
+        return -1;
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+    if (total == 0) {
+        return 0;
+    }
+    length = ChannelEmuRoom(emu, &emu->out, now);
+    length = ChannelEmuChunk(emu, total < length ? total : length);
+    if (length == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    // Without latency the bytes go straight on
+    ChannelEmuPush(emu, &emu->out, iov, iovcnt, length, now);
+    EmuFlush(transport, now);
+    return (ssize_t)length;
+}
+
+// The backend is polled for reading while the link has room for more input,
+// and for writing while bytes that crossed the link wait for it
+static bool EmuPollSetup(TRANSPORT* transport, struct pollfd* fds, bool wantRead, bool wantWrite) {
+    CHANNEL_EMU* emu = transport->emu;
+    uint64_t now = NowMicros();
+    struct iovec iov[2];
+    int iovcnt;
+    bool backendRead;
+    bool ready;
+
+    EmuFlush(transport, now);
+    backendRead = wantRead && !emu->inEof && emu->inError == 0 && ChannelEmuRoom(emu, &emu->in, now) > 0;
+    ready = transport->active->pollSetup(transport, fds, backendRead, EmuOutBacklog(transport, now));
+
+    if (wantRead && (ChannelEmuArrived(&emu->in, now, iov, &iovcnt) > 0 || EmuInFinished(emu))) {
+        ready = true;
+    }
+    if (wantWrite && (emu->outError != 0 || ChannelEmuRoom(emu, &emu->out, now) > 0)) {
+        ready = true;
+    }
+
+    // Measured from the same moment as the checks above, so nothing that
+    // arrives in between is missed
+    emu->wakeUs = ChannelEmuNextEvent(emu, now);
+    if (emu->wakeUs != CHANNEL_EMU_NEVER) {
+        emu->wakeUs += now;
+    }
+    return ready;
+}
+
+static short EmuPollEvents(TRANSPORT* transport, const struct pollfd* fds) {
+    CHANNEL_EMU* emu = transport->emu;
+    short backend = transport->active->pollEvents(transport, fds);
+    short events = backend & (POLLERR | POLLHUP);
+    uint64_t now = NowMicros();
+    struct iovec iov[2];
+    int iovcnt;
+
+    if (backend & POLLOUT) {
+        EmuFlush(transport, now);
+    }
+    if ((backend & POLLIN) || ChannelEmuArrived(&emu->in, now, iov, &iovcnt) > 0 || EmuInFinished(emu)) {
+        events |= POLLIN;
+    }
+    if (emu->outError != 0 || ChannelEmuRoom(emu, &emu->out, now) > 0) {
+        events |= POLLOUT;
+    }
+    return events;
+}
+
+static const TRANSPORT_OPS g_unixOps = { "unix", UnixOpen, SocketRead, SocketWritev, FdClose, FdPollSetup, FdPollEvents };
+static const TRANSPORT_OPS g_tcpOps = { "tcp", TcpOpen, SocketRead, SocketWritev, FdClose, FdPollSetup, FdPollEvents };
+static const TRANSPORT_OPS g_deviceOps = { "dev", DeviceOpen, DeviceRead, DeviceWritev, FdClose, FdPollSetup, FdPollEvents };
+static const TRANSPORT_OPS g_shmOps = { "shm", ShmOpen, ShmRead, ShmWritev, ShmClose, ShmPollSetup, ShmPollEvents };
+
+bool TransportParse(TRANSPORT* transport, const char* spec) {
+    const char* address = spec;
+    const char* comma;
+
+    memset(transport, 0, sizeof(*transport));
+    transport->readFd = -1;
+    transport->writeFd = -1;
+    ShmChannelInit(&transport->shm);
+
+    if (strncmp(spec, "unix:", 5) == 0) {
+        transport->ops = &g_unixOps;
+        address = spec + 5;
+    } else if (strncmp(spec, "tcp:", 4) == 0) {
+        transport->ops = &g_tcpOps;
+        address = spec + 4;
+    } else if (strncmp(spec, "shm:", 4) == 0) {
+        transport->ops = &g_shmOps;
+        address = spec + 4;
+    } else if (strncmp(spec, "dev:", 4) == 0) {
+        transport->ops = &g_deviceOps;
+        address = spec + 4;
+
+        comma = strchr(address, ',');
+        if (comma != NULL) {
+            if (strlen(comma + 1) >= sizeof(transport->outPath) || comma[1] == '\0') {
+                printf("Invalid channel '%s'\n", spec);
+                return false;
+            }
+            strcpy(transport->outPath, comma + 1);
+            if ((size_t)(comma - address) >= sizeof(transport->address)) {
+                printf("Invalid channel '%s'\n", spec);
+                return false;
+            }
+            memcpy(transport->address, address, comma - address);
+            transport->address[comma - address] = '\0';
+            return transport->address[0] != '\0';
+        }
+    }
+
+    if (address[0] == '\0' || strlen(address) >= sizeof(transport->address)) {
+        printf("Invalid channel '%s'\n", spec);
+        return false;
+    }
+    strcpy(transport->address, address);
+    return true;
+}
+
+void TransportSpec(const TRANSPORT* transport, char* spec, size_t size) {
+    if (transport->ops == NULL) {
+        snprintf(spec, size, "%s", transport->address);
+    } else if (transport->outPath[0] != '\0') {
+        snprintf(spec, size, "%s:%s,%s", transport->ops->name, transport->address, transport->outPath);
+    } else {
+        snprintf(spec, size, "%s:%s", transport->ops->name, transport->address);
+    }
+}
+
+bool TransportOpen(TRANSPORT* transport) {
+    const TRANSPORT_OPS* ops = transport->ops;
+
+    // A bare path may be a socket one day and a device the next
+    if (ops == NULL) {
+        struct stat statbuf;
+
+        if (stat(transport->address, &statbuf) == -1) {
+            printf("Error: Cannot stat channel %s: %s (errno=%d)\n", transport->address, strerror(errno), errno);
+            printf("Make sure the QEMU VM is running with the virtio-serial device properly configured.\n");
+            return false;
+        }
+        if (S_ISSOCK(statbuf.st_mode)) {
+            ops = &g_unixOps;
+        } else if (S_ISCHR(statbuf.st_mode) || S_ISFIFO(statbuf.st_mode)) {
+            ops = &g_deviceOps;
+        } else {
+            printf("Error: %s is neither a socket nor a device\n", transport->address);
+            return false;
+        }
+    }
+
+    if (!ops->open(transport)) {
+        return false;
+    }
+
+    transport->active = ops;
+    if (transport->emu != NULL) {
+        ChannelEmuInit(transport->emu, &transport->emu->config, NowMicros());
+    }
+    return true;
+}
+
+void TransportClose(TRANSPORT* transport) {
+    if (transport->active != NULL) {
+        transport->active->close(transport);
+        transport->active = NULL;
+    }
+}
+
+bool TransportIsOpen(const TRANSPORT* transport) {
+    return transport->active != NULL;
+}
+
+ssize_t TransportRead(TRANSPORT* transport, void* buffer, size_t length) {
+    if (transport->emu != NULL) {
+        return EmuRead(transport, buffer, length);
+    }
+    return transport->active->read(transport, buffer, length);
+}
+
+ssize_t TransportWritev(TRANSPORT* transport, const struct iovec* iov, int iovcnt) {
+    if (transport->emu != NULL) {
+        return EmuWritev(transport, iov, iovcnt);
+    }
+    return transport->active->writev(transport, iov, iovcnt);
+}
+
+bool TransportPollSetup(TRANSPORT* transport, struct pollfd* fds, bool wantRead, bool wantWrite) {
+    fds[0].revents = 0;
+    fds[1].revents = 0;
+    if (transport->active == NULL) {
+        fds[0].fd = -1;
+        fds[1].fd = -1;
+        return false;
+    }
+    if (transport->emu != NULL) {
+        return EmuPollSetup(transport, fds, wantRead, wantWrite);
+    }
+    return transport->active->pollSetup(transport, fds, wantRead, wantWrite);
+}
+
+short TransportPollEvents(TRANSPORT* transport, const struct pollfd* fds) {
+    if (transport->active == NULL) {
+        return 0;
+    }
+    if (transport->emu != NULL) {
+        return EmuPollEvents(transport, fds);
+    }
+    return transport->active->pollEvents(transport, fds);
+}
+
+int TransportExport(const TRANSPORT* transport, int* fds) {
+    if (transport->active == NULL) {
+        return 0;
+    }
+    if (transport->active == &g_shmOps) {
+        fds[0] = transport->shm.memFd;
+        fds[1] = transport->shm.doorbell;
+        fds[2] = transport->shm.peerDoorbell;
+        fds[3] = transport->shm.control;
+        return 4;
+    }
+    fds[0] = transport->readFd;
+    if (transport->writeFd != transport->readFd) {
+        fds[1] = transport->writeFd;
+        return 2;
+    }
+    return 1;
+}
+
+bool TransportAdopt(TRANSPORT* transport, const char* backend, const int* fds, int count) {
+    static const TRANSPORT_OPS* const backends[] = { &g_unixOps, &g_tcpOps, &g_deviceOps, &g_shmOps };
+    const TRANSPORT_OPS* ops = NULL;
+    size_t i;
+    int j;
+
+    for (i = 0; i < sizeof(backends) / sizeof(backends[0]); i++) {
+        if (strcmp(backends[i]->name, backend) == 0) {
+            ops = backends[i];
+        }
+    }
+
+    TransportClose(transport);
+    if (ops == &g_shmOps && count == 4) {
+        if (!ShmChannelAdopt(&transport->shm, fds[0], fds[1], fds[2], fds[3])) {
+            return false;
+        }
+        transport->readFd = transport->shm.doorbell;
+        transport->writeFd = transport->shm.control;
+    } else if (ops != NULL && ops != &g_shmOps && (count == 1 || count == 2)) {
+        transport->readFd = fds[0];
+        transport->writeFd = fds[count - 1];
+    } else {
+        printf("Cannot adopt a %s channel from %d descriptors\n", backend, count);
+        for (j = 0; j < count; j++) {
+            close(fds[j]);
+        }
+        return false;
+    }
+
+    transport->active = ops;
+    if (transport->emu != NULL) {
+        ChannelEmuInit(transport->emu, &transport->emu->config, NowMicros());
+    }
+    return true;
+}
+
+void TransportEmulate(TRANSPORT* transport, CHANNEL_EMU* emu, const CHANNEL_EMU_CONFIG* config) {
+    ChannelEmuInit(emu, config, NowMicros());
+    transport->emu = emu;
+}
+
+int TransportPollTimeout(TRANSPORT* transport) {
+    uint64_t now;
+    uint64_t wake;
+
+    if (transport->emu == NULL || transport->active == NULL || transport->emu->wakeUs == CHANNEL_EMU_NEVER) {
+        return -1;
+    }
+
+    // Rounded down: the last fraction of a millisecond is polled without
+    // blocking rather than overshot
+    now = NowMicros();
+    wake = transport->emu->wakeUs;
+    if (wake <= now) {
+        return 0;
+    }
+    return (wake - now) / 1000 > INT_MAX ? INT_MAX : (int)((wake - now) / 1000);
+}
+
+const char* TransportName(const TRANSPORT* transport) {
+    if (transport->active != NULL) {
+        return transport->active->name;
+    }
+    return transport->ops != NULL ? transport->ops->name : "auto";
+}
@@ -0,0 +1,100 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+// Byte-stream transports carrying the mux channel on the host side. Every
+// backend leaves its descriptors non-blocking and reads and writes them the
+// way that suits the descriptor type. The backend is picked at runtime from
+// a channel spec:
+//
+//   unix:PATH              AF_UNIX stream socket (QEMU chardev socket)
+//   tcp:HOST:PORT          TCP connection, e.g. to a benchmark peer
+//   dev:PATH               Character device such as /dev/virtio-ports/NAME
+//   dev:IN_PATH,OUT_PATH   FIFO pair: read from the first, write to the second
+//   shm:PATH               Shared-memory rings handed out by a server on the
+//                          Unix socket PATH (see shm_ring.h)
+//   PATH                   Socket or device, detected from the file type on
+//                          every open
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <poll.h>
+
+#include "shm_ring.h"
+#include "channel_emu.h"
+
+#define TRANSPORT_ADDRESS_MAX 256
+// Poll entries a transport needs in the caller's pollfd array
+#define TRANSPORT_POLL_FDS 2
+// Descriptors an open transport is made of, for handing it to another process
+#define TRANSPORT_MAX_FDS 4
+// Longest channel spec: backend prefix and two FIFO paths
+#define TRANSPORT_SPEC_MAX (2 * TRANSPORT_ADDRESS_MAX + 8)
+
+struct TRANSPORT;
+
+typedef struct {
+    const char* name;
+    bool (*open)(struct TRANSPORT* transport);
+    ssize_t (*read)(struct TRANSPORT* transport, void* buffer, size_t length);
+    ssize_t (*writev)(struct TRANSPORT* transport, const struct iovec* iov, int iovcnt);
+    void (*close)(struct TRANSPORT* transport);
+    bool (*pollSetup)(struct TRANSPORT* transport, struct pollfd* fds, bool wantRead, bool wantWrite);
+    short (*pollEvents)(struct TRANSPORT* transport, const struct pollfd* fds);
+} TRANSPORT_OPS;
+
+typedef struct TRANSPORT {
+    const TRANSPORT_OPS* ops;               // NULL: detect from the file type
+    const TRANSPORT_OPS* active;            // Backend of the open descriptors
+    char address[TRANSPORT_ADDRESS_MAX];    // Path, HOST:PORT or input FIFO
+    char outPath[TRANSPORT_ADDRESS_MAX];    // Output FIFO, empty if not split
+    int readFd;                             // -1 while closed
+    int writeFd;                            // Same as readFd unless split
+    SHM_CHANNEL shm;                        // Rings of the shm backend
+    CHANNEL_EMU* emu;                       // Link emulation, NULL if none
+} TRANSPORT;
+
+// Fills in the transport from a channel spec; nothing is opened yet
+bool TransportParse(TRANSPORT* transport, const char* spec);
+
+// The spec a transport was parsed from, in its canonical form
+void TransportSpec(const TRANSPORT* transport, char* spec, size_t size);
+
+bool TransportOpen(TRANSPORT* transport);
+void TransportClose(TRANSPORT* transport);
+bool TransportIsOpen(const TRANSPORT* transport);
+
+// Same contract as read() and writev() on a non-blocking descriptor
+ssize_t TransportRead(TRANSPORT* transport, void* buffer, size_t length);
+ssize_t TransportWritev(TRANSPORT* transport, const struct iovec* iov, int iovcnt);
+
+// Fills fds[0..TRANSPORT_POLL_FDS-1] for poll(). Returns true when the
+// transport can already make progress, in which case poll() must not block.
+bool TransportPollSetup(TRANSPORT* transport, struct pollfd* fds, bool wantRead, bool wantWrite);
+
+// Readiness after poll() as POLLIN, POLLOUT, POLLERR and POLLHUP bits
+short TransportPollEvents(TRANSPORT* transport, const struct pollfd* fds);
+
+// Hot restart: the descriptors of an open transport, and the reverse. Export
+// fills fds with up to TRANSPORT_MAX_FDS descriptors that stay owned by the
+// transport and returns how many. Adopt opens a parsed transport on
+// descriptors received from a process that exported one with the backend
+// named backend, and takes ownership of them even on failure.
+int TransportExport(const TRANSPORT* transport, int* fds);
+bool TransportAdopt(TRANSPORT* transport, const char* backend, const int* fds, int count);
+
+// Passes all traffic through an emulated slow link from the next open on
+// (see channel_emu.h). The emulator must live as long as the transport;
+// bytes in flight are dropped when the channel closes or is handed over.
+void TransportEmulate(TRANSPORT* transport, CHANNEL_EMU* emu, const CHANNEL_EMU_CONFIG* config);
+
+// Milliseconds until an emulated link has bytes to deliver or can take more,
+// to cap the poll() timeout with; -1 if it waits for nothing. Valid after
+// TransportPollSetup.
+int TransportPollTimeout(TRANSPORT* transport);
+
+// Backend name for log messages
+const char* TransportName(const TRANSPORT* transport);
+
+#endif // TRANSPORT_H